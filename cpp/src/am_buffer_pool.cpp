@@ -0,0 +1,172 @@
+#include "am_buffer_pool.h"
+#include "common_utils.h"
+#include "logger.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+AmBufferPool::AmBufferPool(ucp_context_h ucp_context, ucp_worker_h ucp_worker,
+                           unsigned nbuffers, size_t buffer_size)
+    : ucp_context_(ucp_context), ucp_worker_(ucp_worker), nbuffers_(nbuffers),
+      buffer_size_(buffer_size), buffers_(NULL), buffers_len_(0), memh_(NULL),
+      stats_() {}
+
+AmBufferPool::~AmBufferPool() {
+  if (memh_ != NULL) {
+    ucp_mem_unmap(ucp_context_, memh_);
+  }
+  if (buffers_ != NULL) {
+    munmap(buffers_, buffers_len_);
+  }
+}
+
+int AmBufferPool::init(const char *name) {
+  ucp_mem_map_params_t params;
+  ucs_status_t status;
+  unsigned i;
+
+  if ((nbuffers_ == 0) || (buffer_size_ == 0)) {
+    LOG_ERROR("%s: the pool needs buffers of a non-zero size\n", name);
+    return -1;
+  }
+
+  buffers_len_ = nbuffers_ * buffer_size_;
+  buffers_ = static_cast<char *>(mmap(NULL, buffers_len_,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  CHKERR_ACTION(buffers_ == MAP_FAILED, "allocate pool buffers\n",
+                buffers_ = NULL; return -1);
+
+  params.field_mask =
+      UCP_MEM_MAP_PARAM_FIELD_ADDRESS | UCP_MEM_MAP_PARAM_FIELD_LENGTH;
+  params.address = buffers_;
+  params.length = buffers_len_;
+  status = ucp_mem_map(ucp_context_, &params, &memh_);
+  CHKERR_ACTION(status != UCS_OK, "register pool buffers\n",
+                memh_ = NULL; return -1);
+
+  for (i = nbuffers_; i > 0; --i) {
+    free_buffers_.push_back(i - 1);
+  }
+  return 0;
+}
+
+int AmBufferPool::take_buffer(struct am_payload *payload) {
+  uint64_t in_use;
+
+  if (free_buffers_.empty()) {
+    return -1;
+  }
+
+  payload->kind = AM_PAYLOAD_BUFFER;
+  payload->buffer = free_buffers_.back();
+  payload->data = buffers_ + payload->buffer * buffer_size_;
+  free_buffers_.pop_back();
+
+  in_use = nbuffers_ - free_buffers_.size();
+  if (in_use > stats_.peak_buffers) {
+    stats_.peak_buffers = in_use;
+  }
+  return 0;
+}
+
+void AmBufferPool::rndv_done(void *request, ucs_status_t status,
+                             size_t length, void *user_data) {
+  struct am_payload *payload = static_cast<struct am_payload *>(user_data);
+
+  if (request != NULL) {
+    ucp_request_free(request);
+  }
+  payload->cb(payload, status);
+}
+
+void AmBufferPool::start_rndv(struct am_payload *payload, void *desc) {
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+
+  take_buffer(payload);
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_USER_DATA |
+                       UCP_OP_ATTR_FIELD_DATATYPE | UCP_OP_ATTR_FIELD_MEMH;
+  param.cb.recv_am = rndv_done;
+  param.user_data = payload;
+  param.datatype = ucp_dt_make_contig(1);
+  param.memh = memh_;
+  request = ucp_am_recv_data_nbx(ucp_worker_, desc, payload->data,
+                                 payload->length, &param);
+  if (!UCS_PTR_IS_PTR(request)) {
+    rndv_done(NULL, UCS_PTR_STATUS(request), payload->length, payload);
+  }
+}
+
+ucs_status_t AmBufferPool::take_in(struct am_payload *payload, void *data,
+                                   size_t length,
+                                   const ucp_am_recv_param_t *param) {
+  payload->length = length;
+
+  if (param->recv_attr & UCP_AM_RECV_ATTR_FLAG_RNDV) {
+    ++stats_.rndv;
+    if (free_buffers_.empty()) {
+      ++stats_.rndv_waits;
+      payload->kind = AM_PAYLOAD_WAITING;
+      payload->data = NULL;
+      waiting_.emplace_back(payload, data);
+    } else {
+      start_rndv(payload, data);
+    }
+    return UCS_INPROGRESS;
+  }
+
+  if (param->recv_attr & UCP_AM_RECV_ATTR_FLAG_DATA) {
+    ++stats_.held;
+    payload->kind = AM_PAYLOAD_HELD;
+    payload->data = data;
+    payload->cb(payload, UCS_OK);
+    return UCS_INPROGRESS;
+  }
+
+  if (take_buffer(payload) == 0) {
+    ++stats_.copied;
+    memcpy(payload->data, data, length);
+  } else {
+    /* Copying it anywhere else would take memory beyond the pool */
+    ++stats_.in_place;
+    payload->kind = AM_PAYLOAD_VOLATILE;
+    payload->data = data;
+  }
+  payload->cb(payload, UCS_OK);
+  return UCS_OK;
+}
+
+void AmBufferPool::release(struct am_payload *payload) {
+  switch (payload->kind) {
+  case AM_PAYLOAD_HELD:
+    ucp_am_data_release(ucp_worker_, payload->data);
+    break;
+  case AM_PAYLOAD_BUFFER:
+    free_buffers_.push_back(payload->buffer);
+    break;
+  case AM_PAYLOAD_VOLATILE:
+  case AM_PAYLOAD_WAITING:
+    break;
+  }
+  payload->data = NULL;
+
+  /* A buffer given back goes to the oldest waiting rendezvous */
+  while (!waiting_.empty() && !free_buffers_.empty()) {
+    std::pair<struct am_payload *, void *> next = waiting_.front();
+
+    waiting_.pop_front();
+    start_rndv(next.first, next.second);
+  }
+}
+
+void AmBufferPool::drop_waiting() {
+  while (!waiting_.empty()) {
+    std::pair<struct am_payload *, void *> next = waiting_.front();
+
+    waiting_.pop_front();
+    ucp_am_data_release(ucp_worker_, next.second);
+    next.first->cb(next.first, UCS_ERR_CANCELED);
+  }
+}
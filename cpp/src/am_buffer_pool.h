@@ -0,0 +1,146 @@
+#ifndef MYUCXPLAYGROUND_AM_BUFFER_POOL_H
+#define MYUCXPLAYGROUND_AM_BUFFER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ucp/api/ucp.h>
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+class AmBufferPool;
+
+typedef enum {
+  AM_PAYLOAD_HELD,     /* `data` is UCX's, kept until release() */
+  AM_PAYLOAD_BUFFER,   /* `data` is pool buffer `buffer` */
+  AM_PAYLOAD_VOLATILE, /* `data` is UCX's, valid only inside the callback */
+  AM_PAYLOAD_WAITING   /* rendezvous waiting for a buffer, no `data` yet */
+} am_payload_kind_t;
+
+struct am_payload;
+
+/**
+ * @brief Called once the payload can be used: from take_in() itself, or
+ * when a rendezvous transfer completes. On an error status there is no
+ * data; the payload must still be given back with release().
+ */
+typedef void (*am_payload_cb_t)(struct am_payload *payload,
+                                ucs_status_t status);
+
+/**
+ * Where the data of one active message lies. Embedded in the consumer's
+ * per-message state; `cb` and `arg` are the consumer's, the rest is filled
+ * by the pool.
+ */
+struct am_payload {
+  am_payload_kind_t kind;
+  int buffer;
+  void *data;
+  size_t length;
+  am_payload_cb_t cb;
+  void *arg;
+};
+
+/**
+ * Takes in the data of active messages without copying it where UCX lets
+ * it be kept, and otherwise into a fixed pool of buffers registered once
+ * with ucp_mem_map().
+ *
+ * - Eager data UCX allows to be held (UCP_AM_RECV_ATTR_FLAG_DATA) is kept
+ *   where it lies and given back with ucp_am_data_release().
+ * - Rendezvous data is received with ucp_am_recv_data_nbx() into a pool
+ *   buffer. When every buffer is busy the message waits, and so does its
+ *   sender, until one is released.
+ * - Other eager data is only valid inside the AM callback and is copied
+ *   into a pool buffer. When the pool is empty it is handed over as
+ *   AM_PAYLOAD_VOLATILE for the consumer to finish with before the callback
+ *   returns.
+ *
+ * So the pool never holds more than `nbuffers` x `buffer_size` bytes.
+ *
+ * Not thread safe: use it from the thread that progresses `ucp_worker`.
+ */
+class AmBufferPool {
+
+public:
+  struct stats {
+    uint64_t held;         /* eager payloads kept in UCX's buffer */
+    uint64_t copied;       /* eager payloads copied into a pool buffer */
+    uint64_t in_place;     /* eager payloads handed over as volatile */
+    uint64_t rndv;         /* payloads received into a pool buffer */
+    uint64_t rndv_waits;   /* rendezvous payloads that waited for a buffer */
+    uint64_t peak_buffers; /* buffers in use at once */
+  };
+
+  /**
+   * @param ucp_context Context created with UCP_FEATURE_AM.
+   * @param ucp_worker Worker of `ucp_context`.
+   * @param nbuffers Buffers in the pool.
+   * @param buffer_size Largest payload.
+   */
+  AmBufferPool(ucp_context_h ucp_context, ucp_worker_h ucp_worker,
+               unsigned nbuffers, size_t buffer_size);
+
+  /**
+   * @brief Frees the buffers. Every payload must have been released.
+   */
+  ~AmBufferPool();
+
+  AmBufferPool(const AmBufferPool &) = delete;
+  AmBufferPool &operator=(const AmBufferPool &) = delete;
+
+  /**
+   * @brief Allocates and registers the buffers.
+   *
+   * @param name Used in error messages.
+   * @return 0 on success, -1 on failure.
+   */
+  int init(const char *name);
+
+  /**
+   * @brief Takes in the data of a message from an AM callback, which must
+   * return what this returns. `payload->cb` is called once the data can be
+   * used, possibly before this returns.
+   */
+  ucs_status_t take_in(struct am_payload *payload, void *data, size_t length,
+                       const ucp_am_recv_param_t *param);
+
+  /**
+   * @brief Gives back the memory of a payload, and a freed buffer to the
+   * oldest rendezvous waiting for one.
+   */
+  void release(struct am_payload *payload);
+
+  /**
+   * @brief Gives back the data of every rendezvous still waiting for a
+   * buffer and calls their callbacks with UCS_ERR_CANCELED.
+   */
+  void drop_waiting();
+
+  size_t buffer_size() const { return buffer_size_; }
+
+  ucp_mem_h memh() const { return memh_; }
+
+  const struct stats &get_stats() const { return stats_; }
+
+private:
+  static void rndv_done(void *request, ucs_status_t status, size_t length,
+                        void *user_data);
+
+  int take_buffer(struct am_payload *payload);
+  void start_rndv(struct am_payload *payload, void *desc);
+
+  ucp_context_h ucp_context_;
+  ucp_worker_h ucp_worker_;
+  unsigned nbuffers_;
+  size_t buffer_size_;
+  char *buffers_;
+  size_t buffers_len_;
+  ucp_mem_h memh_;
+  std::vector<int> free_buffers_;
+  std::deque<std::pair<struct am_payload *, void *>> waiting_; /* descs */
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_AM_BUFFER_POOL_H
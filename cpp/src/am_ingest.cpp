@@ -0,0 +1,207 @@
+#include "am_ingest.h"
+#include "common_utils.h"
+#include "logger.h"
+
+#include <string.h>
+
+AmIngest::AmIngest(ucp_context_h ucp_context, ucp_worker_h ucp_worker,
+                   unsigned am_id, unsigned nthreads, unsigned nbuffers,
+                   size_t buffer_size, am_ingest_cb_t cb, void *arg)
+    : ucp_worker_(ucp_worker), am_id_(am_id), nthreads_(nthreads), cb_(cb),
+      arg_(arg), handler_set_(false),
+      pool_(ucp_context, ucp_worker, nbuffers, buffer_size), inflight_(0),
+      stop_(false), stats_() {}
+
+AmIngest::~AmIngest() {
+  const struct AmBufferPool::stats &pool = pool_.get_stats();
+  ucp_am_handler_param_t param;
+
+  if (handler_set_) {
+    param.field_mask =
+        UCP_AM_HANDLER_PARAM_FIELD_ID | UCP_AM_HANDLER_PARAM_FIELD_CB;
+    param.id = am_id_;
+    param.cb = NULL;
+    ucp_worker_set_am_recv_handler(ucp_worker_, &param);
+  }
+
+  /* Rendezvous messages still waiting for a buffer are dropped */
+  pool_.drop_waiting();
+  while (inflight_ > 0) {
+    progress();
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  for (pthread_t thread : threads_) {
+    pthread_join(thread, NULL);
+  }
+
+  for (struct item *item : free_items_) {
+    delete item;
+  }
+  LOG_INFO("am ingest: %lu messages (%lu bytes): %lu held, %lu copied, "
+           "%lu in place, %lu rendezvous (%lu waited), %lu dropped, "
+           "%lu errors\n",
+           stats_.messages, stats_.bytes, pool.held, pool.copied,
+           pool.in_place, pool.rndv, pool.rndv_waits, stats_.dropped,
+           stats_.errors);
+}
+
+int AmIngest::init() {
+  ucp_am_handler_param_t param;
+  ucs_status_t status;
+  unsigned i;
+  int ret;
+
+  CHKERR_ACTION(nthreads_ == 0, "size the ingest pool\n", return -1);
+  if (pool_.init("am ingest") != 0) {
+    return -1;
+  }
+
+  for (i = 0; i < nthreads_; ++i) {
+    threads_.emplace_back();
+    ret = pthread_create(&threads_.back(), NULL, thread_main, this);
+    CHKERR_ACTION(ret != 0, "create an ingest thread\n",
+                  threads_.pop_back(); return -1);
+  }
+
+  /* Without PERSISTENT_DATA UCX never offers to let us keep eager data */
+  param.field_mask = UCP_AM_HANDLER_PARAM_FIELD_ID |
+                     UCP_AM_HANDLER_PARAM_FIELD_FLAGS |
+                     UCP_AM_HANDLER_PARAM_FIELD_CB |
+                     UCP_AM_HANDLER_PARAM_FIELD_ARG;
+  param.id = am_id_;
+  param.flags = UCP_AM_FLAG_WHOLE_MSG | UCP_AM_FLAG_PERSISTENT_DATA;
+  param.cb = recv_cb;
+  param.arg = this;
+  status = ucp_worker_set_am_recv_handler(ucp_worker_, &param);
+  CHKERR_ACTION(status != UCS_OK, "set the ingest handler\n", return -1);
+  handler_set_ = true;
+
+  return 0;
+}
+
+struct AmIngest::item *AmIngest::get_item(const void *header,
+                                          size_t header_length) {
+  struct item *item;
+
+  if (free_items_.empty()) {
+    item = new struct item;
+    item->ingest = this;
+    item->payload.cb = payload_ready;
+    item->payload.arg = item;
+  } else {
+    item = free_items_.back();
+    free_items_.pop_back();
+  }
+  item->header_length = header_length;
+  memcpy(item->header, header, header_length);
+  return item;
+}
+
+void AmIngest::put_item(struct item *item) { free_items_.push_back(item); }
+
+void AmIngest::submit(struct item *item) {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    work_.push_back(item);
+  }
+  cond_.notify_one();
+}
+
+void *AmIngest::thread_main(void *arg) {
+  AmIngest *ingest = static_cast<AmIngest *>(arg);
+  std::unique_lock<std::mutex> guard(ingest->lock_);
+  struct item *item;
+
+  for (;;) {
+    ingest->cond_.wait(guard, [ingest] {
+      return ingest->stop_ || !ingest->work_.empty();
+    });
+    if (ingest->work_.empty()) {
+      return NULL;
+    }
+    item = ingest->work_.front();
+    ingest->work_.pop_front();
+
+    guard.unlock();
+    ingest->cb_(ingest->arg_, item->header, item->header_length,
+                item->payload.data, item->payload.length);
+    guard.lock();
+    ingest->done_.push_back(item);
+  }
+}
+
+void AmIngest::payload_ready(struct am_payload *payload,
+                             ucs_status_t status) {
+  struct item *item = static_cast<struct item *>(payload->arg);
+  AmIngest *ingest = item->ingest;
+
+  if (status != UCS_OK) {
+    if (status == UCS_ERR_CANCELED) {
+      ++ingest->stats_.dropped; /* waited for a buffer until shutdown */
+    } else {
+      LOG_WARN("am ingest: receiving a message failed (%s)\n",
+               ucs_status_string(status));
+      ++ingest->stats_.errors;
+    }
+    ingest->release(item);
+    return;
+  }
+
+  if (payload->kind == AM_PAYLOAD_VOLATILE) {
+    /* No buffer to keep it in: handle it before UCX reuses the data */
+    ingest->cb_(ingest->arg_, item->header, item->header_length,
+                payload->data, payload->length);
+    ingest->release(item);
+    return;
+  }
+  ingest->submit(item);
+}
+
+void AmIngest::release(struct item *item) {
+  pool_.release(&item->payload);
+  put_item(item);
+  --inflight_;
+}
+
+unsigned AmIngest::progress() {
+  unsigned count = ucp_worker_progress(ucp_worker_);
+
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    reaped_.swap(done_);
+  }
+  for (struct item *item : reaped_) {
+    release(item);
+  }
+  count += reaped_.size();
+  reaped_.clear();
+  return count;
+}
+
+ucs_status_t AmIngest::recv_cb(void *arg, const void *header,
+                               size_t header_length, void *data,
+                               size_t length,
+                               const ucp_am_recv_param_t *param) {
+  AmIngest *ingest = static_cast<AmIngest *>(arg);
+  struct item *item;
+
+  if ((header_length > AM_INGEST_MAX_HEADER) ||
+      (length > ingest->pool_.buffer_size())) {
+    LOG_WARN("am ingest: dropping a message of %zu header and %zu data "
+             "bytes\n",
+             header_length, length);
+    ++ingest->stats_.dropped;
+    return UCS_OK;
+  }
+
+  item = ingest->get_item(header, header_length);
+  ++ingest->inflight_;
+  ++ingest->stats_.messages;
+  ingest->stats_.bytes += length;
+  return ingest->pool_.take_in(&item->payload, data, length, param);
+}
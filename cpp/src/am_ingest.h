@@ -0,0 +1,145 @@
+#ifndef MYUCXPLAYGROUND_AM_INGEST_H
+#define MYUCXPLAYGROUND_AM_INGEST_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <ucp/api/ucp.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "am_buffer_pool.h"
+
+#define AM_INGEST_MAX_HEADER 64 /* bytes of AM header kept per message */
+
+/**
+ * @brief Handles one message on a pool thread, or on the thread that calls
+ * progress() when the pool is empty. `data` stays valid until the callback
+ * returns; `header` is a copy of the AM header.
+ */
+typedef void (*am_ingest_cb_t)(void *arg, const void *header,
+                               size_t header_length, const void *data,
+                               size_t length);
+
+/**
+ * Receives active messages on one AM id and hands them to a pool of
+ * threads without copying the payload where UCX lets it be kept.
+ *
+ * Payloads are taken in by an AmBufferPool: eager data UCX lets us keep is
+ * handed to the threads where it lies, rendezvous data is received into a
+ * pool buffer (waiting, with its sender, while all are busy), and other
+ * eager data is copied into a pool buffer. When the pool is empty such a
+ * message is handled right away on the thread that calls progress(), as
+ * its data is gone once the AM callback returns. So the ingest never holds
+ * more than `nbuffers` buffers of payload.
+ *
+ * UCX objects are only touched from the thread that calls progress(): the
+ * pool threads queue what they are done with, and progress() releases it.
+ * So the worker does not need to be thread safe. With more than one pool
+ * thread, messages may be handled out of order.
+ */
+class AmIngest {
+
+public:
+  struct stats {
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t dropped; /* larger than a buffer, or the header was */
+    uint64_t errors;
+  };
+
+  /**
+   * @param ucp_context Context created with UCP_FEATURE_AM.
+   * @param ucp_worker Worker of `ucp_context`.
+   * @param am_id Active message id to receive.
+   * @param nthreads Pool threads.
+   * @param nbuffers Buffers in the pool.
+   * @param buffer_size Largest payload received into or copied to a buffer.
+   * @param cb Handler, see am_ingest_cb_t.
+   */
+  AmIngest(ucp_context_h ucp_context, ucp_worker_h ucp_worker,
+           unsigned am_id, unsigned nthreads, unsigned nbuffers,
+           size_t buffer_size, am_ingest_cb_t cb, void *arg);
+
+  /**
+   * @brief Removes the handler, waits for every message taken in to be
+   * handled, and releases the buffers and the pool.
+   */
+  ~AmIngest();
+
+  AmIngest(const AmIngest &) = delete;
+  AmIngest &operator=(const AmIngest &) = delete;
+
+  /**
+   * @brief Registers the buffers, starts the pool threads and installs the
+   * handler.
+   *
+   * @return 0 on success, -1 on failure.
+   */
+  int init();
+
+  /**
+   * @brief Progresses the worker and gives back to UCX and the pool what the
+   * threads are done with.
+   */
+  unsigned progress();
+
+  /**
+   * @return Messages taken in and not released yet.
+   */
+  size_t inflight() const { return inflight_; }
+
+  const struct stats &get_stats() const { return stats_; }
+
+  const struct AmBufferPool::stats &pool_stats() const {
+    return pool_.get_stats();
+  }
+
+private:
+  struct item {
+    AmIngest *ingest;
+    struct am_payload payload;
+    size_t header_length;
+    char header[AM_INGEST_MAX_HEADER];
+  };
+
+  static ucs_status_t recv_cb(void *arg, const void *header,
+                              size_t header_length, void *data,
+                              size_t length,
+                              const ucp_am_recv_param_t *param);
+  static void payload_ready(struct am_payload *payload, ucs_status_t status);
+  static void *thread_main(void *arg);
+
+  struct item *get_item(const void *header, size_t header_length);
+  void put_item(struct item *item);
+  void submit(struct item *item);
+  void release(struct item *item);
+
+  ucp_worker_h ucp_worker_;
+  unsigned am_id_;
+  unsigned nthreads_;
+  am_ingest_cb_t cb_;
+  void *arg_;
+  bool handler_set_;
+
+  /* Only the progress thread touches these */
+  AmBufferPool pool_;
+  std::vector<struct item *> free_items_;
+  std::vector<struct item *> reaped_; /* done_, swapped out by progress() */
+  size_t inflight_;
+
+  /* Shared with the pool threads */
+  std::mutex lock_;
+  std::condition_variable cond_;
+  std::deque<struct item *> work_;
+  std::vector<struct item *> done_;
+  bool stop_;
+  std::vector<pthread_t> threads_;
+
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_AM_INGEST_H
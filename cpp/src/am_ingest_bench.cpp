@@ -0,0 +1,301 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucp/api/ucp.h>
+#include <unistd.h> /* getopt */
+
+#include <atomic>
+#include <vector>
+
+#include "am_ingest.h"
+#include "common_utils.h"
+#include "crc32c.h"
+#include "logger.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+/**
+ * Streams active messages from a sender thread into an AmIngest on a
+ * receiver thread and measures rate and one-way latency, from send until a
+ * pool thread has checksummed the payload.
+ *
+ * The sender keeps -w messages in flight. Whether a message arrives eager
+ * or by rendezvous is up to UCX (UCX_RNDV_THRESH) unless -r forces
+ * rendezvous; the receiver's statistics show how each was taken in.
+ */
+
+#define AI_AM_ID 20
+#define AI_DEFAULT_COUNT 200000
+#define AI_DEFAULT_SIZE 4096
+#define AI_DEFAULT_WINDOW 32
+#define AI_DEFAULT_THREADS 2
+#define AI_DEFAULT_BUFFERS 64
+
+struct ai_hdr {
+  uint64_t seq;
+  uint64_t send_ns;
+  uint32_t crc; /* of the payload */
+  uint32_t reserved;
+};
+
+struct ai_bench;
+
+struct ai_send_slot {
+  struct ai_bench *bench;
+  struct ai_hdr hdr;
+  std::vector<char> buffer;
+};
+
+struct ai_bench {
+  struct bench_side sender;
+  struct bench_side receiver;
+  long count;
+  size_t size;
+  unsigned window;
+  unsigned nthreads;
+  unsigned nbuffers;
+  bool force_rndv;
+  std::atomic<int> barrier_count;
+  std::vector<struct ai_send_slot *> free_slots;
+  /* written by the pool threads, each seq by one */
+  std::atomic<long> handled;
+  std::atomic<long> corrupt;
+  std::vector<uint64_t> latency_ns;
+  /* results */
+  uint64_t elapsed_ns;
+  struct AmBufferPool::stats stats;
+  int ret[2];
+};
+
+static void print_ai_usage() {
+  fprintf(stderr, "Usage: run_am_ingest [parameters]\n");
+  fprintf(stderr, "\nParameters are:\n");
+  fprintf(stderr, "  -n <count>    Messages (default:%d)\n",
+          AI_DEFAULT_COUNT);
+  fprintf(stderr, "  -s <size>     Payload size (default:%d)\n",
+          AI_DEFAULT_SIZE);
+  fprintf(stderr, "  -w <count>    Messages in flight (default:%d)\n",
+          AI_DEFAULT_WINDOW);
+  fprintf(stderr, "  -t <count>    Pool threads (default:%d)\n",
+          AI_DEFAULT_THREADS);
+  fprintf(stderr, "  -b <count>    Pool buffers (default:%d)\n",
+          AI_DEFAULT_BUFFERS);
+  fprintf(stderr, "  -r            Force rendezvous\n");
+}
+
+/* Runs on a pool thread */
+static void ai_handle(void *arg, const void *header, size_t header_length,
+                      const void *data, size_t length) {
+  struct ai_bench *bench = (struct ai_bench *)arg;
+  const struct ai_hdr *hdr = (const struct ai_hdr *)header;
+
+  if ((header_length != sizeof(*hdr)) ||
+      (hdr->seq >= (uint64_t)bench->count) ||
+      (crc32c(0, data, length) != hdr->crc)) {
+    bench->corrupt.fetch_add(1);
+  } else {
+    bench->latency_ns[hdr->seq] = get_time_ns() - hdr->send_ns;
+  }
+  bench->handled.fetch_add(1);
+}
+
+static void ai_send_done(void *request, ucs_status_t status,
+                         void *user_data) {
+  struct ai_send_slot *slot = (struct ai_send_slot *)user_data;
+
+  if (status != UCS_OK) {
+    LOG_ERROR("am ingest bench: send failed (%s)\n",
+              ucs_status_string(status));
+  }
+  slot->bench->free_slots.push_back(slot);
+  ucp_request_free(request);
+}
+
+static void *ai_sender_thread(void *arg) {
+  struct ai_bench *bench = (struct ai_bench *)arg;
+  ucp_worker_h ucp_worker = bench->sender.ucp_worker;
+  std::vector<struct ai_send_slot> slots(bench->window);
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+  struct ai_send_slot *slot;
+  ucs_status_t status = UCS_OK;
+  size_t i;
+  long seq;
+
+  for (struct ai_send_slot &s : slots) {
+    s.bench = bench;
+    s.buffer.resize(bench->size);
+    for (i = 0; i < bench->size; ++i) {
+      s.buffer[i] = (char)(i + (&s - slots.data()));
+    }
+    s.hdr.crc = crc32c(0, s.buffer.data(), bench->size);
+    s.hdr.reserved = 0;
+    bench->free_slots.push_back(&s);
+  }
+
+  bench_barrier(&bench->barrier_count, 2, 1, ucp_worker);
+
+  for (seq = 0; (seq < bench->count) && (status == UCS_OK); ++seq) {
+    while (bench->free_slots.empty()) {
+      ucp_worker_progress(ucp_worker);
+    }
+    slot = bench->free_slots.back();
+    bench->free_slots.pop_back();
+    slot->hdr.seq = seq;
+    slot->hdr.send_ns = get_time_ns();
+
+    param.op_attr_mask = UCP_OP_ATTR_FIELD_FLAGS |
+                         UCP_OP_ATTR_FIELD_CALLBACK |
+                         UCP_OP_ATTR_FIELD_USER_DATA;
+    param.flags = bench->force_rndv ? UCP_AM_SEND_FLAG_RNDV : 0;
+    param.cb.send = ai_send_done;
+    param.user_data = slot;
+    request = ucp_am_send_nbx(bench->sender.ep, AI_AM_ID, &slot->hdr,
+                              sizeof(slot->hdr), slot->buffer.data(),
+                              bench->size, &param);
+    if (UCS_PTR_IS_PTR(request)) {
+      continue;
+    }
+    status = UCS_PTR_STATUS(request);
+    bench->free_slots.push_back(slot);
+  }
+
+  while (bench->free_slots.size() < slots.size()) {
+    ucp_worker_progress(ucp_worker);
+  }
+
+  bench_barrier(&bench->barrier_count, 2, 2, ucp_worker);
+  bench->ret[0] = (status == UCS_OK) ? 0 : -1;
+  return NULL;
+}
+
+static void *ai_receiver_thread(void *arg) {
+  struct ai_bench *bench = (struct ai_bench *)arg;
+  ucp_worker_h ucp_worker = bench->receiver.ucp_worker;
+  AmIngest *ingest;
+  uint64_t start_ns;
+  int ret;
+
+  ingest = new AmIngest(bench->receiver.ucp_context, ucp_worker, AI_AM_ID,
+                        bench->nthreads, bench->nbuffers, bench->size,
+                        ai_handle, bench);
+  ret = ingest->init();
+
+  bench_barrier(&bench->barrier_count, 2, 1, ucp_worker);
+
+  start_ns = get_time_ns();
+  while ((ret == 0) && (bench->handled.load() < bench->count)) {
+    ingest->progress();
+  }
+  bench->elapsed_ns = get_time_ns() - start_ns;
+
+  bench_barrier(&bench->barrier_count, 2, 2, ucp_worker);
+  bench->stats = ingest->pool_stats();
+  delete ingest;
+  bench->ret[1] = ((ret == 0) && (bench->corrupt.load() == 0)) ? 0 : -1;
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  struct ai_bench bench;
+  pthread_t sender_thread, receiver_thread;
+  ucs_status_t status;
+  int ret = -1;
+  int c;
+
+  bench.count = AI_DEFAULT_COUNT;
+  bench.size = AI_DEFAULT_SIZE;
+  bench.window = AI_DEFAULT_WINDOW;
+  bench.nthreads = AI_DEFAULT_THREADS;
+  bench.nbuffers = AI_DEFAULT_BUFFERS;
+  bench.force_rndv = false;
+
+  while ((c = getopt(argc, argv, "n:s:w:t:b:rh")) != -1) {
+    switch (c) {
+    case 'n':
+      bench.count = atol(optarg);
+      break;
+    case 's':
+      bench.size = strtoul(optarg, NULL, 0);
+      break;
+    case 'w':
+      bench.window = atoi(optarg);
+      break;
+    case 't':
+      bench.nthreads = atoi(optarg);
+      break;
+    case 'b':
+      bench.nbuffers = atoi(optarg);
+      break;
+    case 'r':
+      bench.force_rndv = true;
+      break;
+    case 'h':
+    default:
+      print_ai_usage();
+      return -1;
+    }
+  }
+
+  if ((bench.count <= 0) || (bench.size == 0) || (bench.window == 0) ||
+      (bench.nthreads == 0) || (bench.nbuffers == 0)) {
+    print_ai_usage();
+    return -1;
+  }
+
+  bench.barrier_count.store(0);
+  bench.handled.store(0);
+  bench.corrupt.store(0);
+  bench.latency_ns.resize(bench.count);
+  bench.ret[0] = bench.ret[1] = -1;
+
+  ret = bench_init_side(&bench.sender, "am ingest sender",
+                        UCP_FEATURE_AM);
+  CHKERR_JUMP(ret != 0, "initialize sender\n", err);
+
+  ret = bench_init_side(&bench.receiver, "am ingest receiver",
+                        UCP_FEATURE_AM);
+  CHKERR_JUMP(ret != 0, "initialize receiver\n", err_sender);
+
+  ret = -1;
+  status = bench_connect(&bench.sender, &bench.receiver, &bench.sender.ep);
+  CHKERR_JUMP(status != UCS_OK, "connect sender\n", err_receiver);
+
+  CHKERR_JUMP(pthread_create(&receiver_thread, NULL, ai_receiver_thread,
+                             &bench) != 0,
+              "create receiver thread\n", err_ep);
+  /* Without a sender the receiver never returns; leave it to exit */
+  CHKERR_JUMP(pthread_create(&sender_thread, NULL, ai_sender_thread,
+                             &bench) != 0,
+              "create sender thread\n", err_ep);
+  pthread_join(sender_thread, NULL);
+  pthread_join(receiver_thread, NULL);
+
+  if ((bench.ret[0] == 0) && (bench.ret[1] == 0)) {
+    log_flush();
+    printf("\n%ld messages of %lu bytes, %u in flight, %u pool threads, "
+           "%u buffers; latencies in us\n",
+           bench.count, bench.size, bench.window, bench.nthreads,
+           bench.nbuffers);
+    printf("%12s %10s %10s %10s %10s %10s %10s %10s %10s\n", "msg/s", "GB/s",
+           "p50", "p99", "p99.9", "held", "copied", "in place", "rndv");
+    printf("%12.0f %10.2f %10.2f %10.2f %10.2f %10lu %10lu %10lu %10lu\n",
+           bench.count / (bench.elapsed_ns / 1e9),
+           bench.count * bench.size / (double)bench.elapsed_ns,
+           percentile_us(bench.latency_ns, 0.5),
+           percentile_us(bench.latency_ns, 0.99),
+           percentile_us(bench.latency_ns, 0.999), bench.stats.held,
+           bench.stats.copied, bench.stats.in_place, bench.stats.rndv);
+    ret = 0;
+  }
+
+err_ep:
+  ep_close(bench.sender.ucp_worker, bench.sender.ep, UCP_EP_CLOSE_FLAG_FORCE);
+err_receiver:
+  bench_cleanup_side(&bench.receiver);
+err_sender:
+  bench_cleanup_side(&bench.sender);
+err:
+  return ret;
+}
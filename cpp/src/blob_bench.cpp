@@ -0,0 +1,399 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucp/api/ucp.h>
+#include <unistd.h> /* getopt */
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "blob_catalog.h"
+#include "common_utils.h"
+#include "logger.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+/**
+ * Reads random ranges of blobs served by a BlobCatalog.
+ *
+ * A server thread registers -b blobs of -S bytes each and answers lookups.
+ * Each reader thread has its own context, looks every blob up once and then
+ * keeps -w reads of -s bytes in flight, each a random range of a random
+ * blob, pulled with gets of at most -c bytes into a registered buffer. The
+ * first and last byte of every read are checked against the blob's
+ * pattern.
+ *
+ * With -i the server stops progressing its worker once every reader has
+ * its keys, which works when the transport does the gets (shared memory,
+ * RDMA) and hangs when it emulates them (TCP).
+ */
+
+#define BB_DEFAULT_THREADS 4
+#define BB_DEFAULT_BLOBS 16
+#define BB_DEFAULT_BLOB_SIZE (16ul << 20)
+#define BB_DEFAULT_COUNT 100000
+#define BB_DEFAULT_SIZE (64ul << 10)
+#define BB_DEFAULT_CHUNK (16ul << 10)
+#define BB_DEFAULT_WINDOW 8
+
+struct bb_reader;
+
+/* A read in flight */
+struct bb_read {
+  struct bb_reader *reader;
+  char *buffer;
+  unsigned blob;
+  uint64_t offset;
+  uint64_t start_ns;
+};
+
+struct bb_bench;
+
+struct bb_reader {
+  struct bb_bench *bench;
+  unsigned id;
+  struct bench_side side; /* the BlobReader makes its own endpoint */
+  uint64_t rng;
+  std::vector<unsigned> blobs; /* handles, by blob index */
+  unsigned looked_up;
+  std::vector<struct bb_read> reads;
+  std::vector<struct bb_read *> free_reads;
+  long done;
+  int failed;
+  std::vector<uint64_t> latency_ns;
+  uint64_t elapsed_ns;
+  int ret;
+};
+
+struct bb_bench {
+  unsigned nreaders;
+  unsigned nblobs;
+  size_t blob_size;
+  long count; /* reads per reader */
+  size_t size;
+  size_t chunk;
+  unsigned window;
+  bool idle_server;
+  struct bench_side server;
+  BlobCatalog *catalog;
+  std::vector<std::vector<char>> blobs;
+  std::atomic<unsigned> ready; /* readers holding every key */
+  std::atomic<bool> stop;
+  std::vector<struct bb_reader> readers;
+};
+
+static void print_bb_usage() {
+  fprintf(stderr, "Usage: run_blob_catalog [parameters]\n");
+  fprintf(stderr, "\nParameters are:\n");
+  fprintf(stderr, "  -t <count>    Reader threads (default:%d)\n",
+          BB_DEFAULT_THREADS);
+  fprintf(stderr, "  -b <count>    Blobs (default:%d)\n", BB_DEFAULT_BLOBS);
+  fprintf(stderr, "  -S <size>     Blob size (default:%lu)\n",
+          BB_DEFAULT_BLOB_SIZE);
+  fprintf(stderr, "  -n <count>    Reads per reader (default:%d)\n",
+          BB_DEFAULT_COUNT);
+  fprintf(stderr, "  -s <size>     Read size (default:%lu)\n",
+          BB_DEFAULT_SIZE);
+  fprintf(stderr, "  -c <size>     Largest get a read is split into "
+                  "(default:%lu)\n",
+          BB_DEFAULT_CHUNK);
+  fprintf(stderr, "  -w <count>    Reads in flight per reader (default:%d)\n",
+          BB_DEFAULT_WINDOW);
+  fprintf(stderr, "  -i            Stop progressing the server after the "
+                  "lookups\n");
+}
+
+/* Byte `offset` of blob `blob` */
+static inline char bb_pattern(unsigned blob, uint64_t offset) {
+  return (char)(offset * 31 + blob);
+}
+
+static void *bb_server_thread(void *arg) {
+  struct bb_bench *bench = (struct bb_bench *)arg;
+
+  while (!bench->stop.load()) {
+    if (bench->idle_server &&
+        (bench->ready.load() == bench->nreaders)) {
+      continue;
+    }
+    ucp_worker_progress(bench->server.ucp_worker);
+  }
+  return NULL;
+}
+
+static void bb_looked_up(void *arg, ucs_status_t status, size_t length) {
+  struct bb_reader *reader = (struct bb_reader *)arg;
+
+  if ((status != UCS_OK) || (length != reader->bench->blob_size)) {
+    LOG_ERROR("blob bench: lookup failed (%s)\n", ucs_status_string(status));
+    reader->failed = 1;
+  }
+  ++reader->looked_up;
+}
+
+static void bb_read_done(void *arg, ucs_status_t status, size_t length) {
+  struct bb_read *read = (struct bb_read *)arg;
+  struct bb_reader *reader = read->reader;
+
+  if ((status != UCS_OK) ||
+      (read->buffer[0] != bb_pattern(read->blob, read->offset)) ||
+      (read->buffer[length - 1] !=
+       bb_pattern(read->blob, read->offset + length - 1))) {
+    LOG_ERROR("blob bench: read of blob %u at %lu failed (%s)\n", read->blob,
+              read->offset, ucs_status_string(status));
+    reader->failed = 1;
+  }
+  reader->latency_ns.push_back(get_time_ns() - read->start_ns);
+  ++reader->done;
+  reader->free_reads.push_back(read);
+}
+
+static void *bb_reader_thread(void *arg) {
+  struct bb_reader *reader = (struct bb_reader *)arg;
+  struct bb_bench *bench = reader->bench;
+  BlobReader blobs(reader->side.ucp_worker, bench->chunk);
+  std::vector<char> buffers(bench->window * bench->size);
+  ucp_mem_map_params_t params;
+  ucp_mem_h memh = NULL;
+  ucs_status_t status;
+  struct bb_read *read;
+  uint64_t start_ns;
+  long issued = 0;
+  char name[32];
+  unsigned i;
+
+  params.field_mask =
+      UCP_MEM_MAP_PARAM_FIELD_ADDRESS | UCP_MEM_MAP_PARAM_FIELD_LENGTH;
+  params.address = buffers.data();
+  params.length = buffers.size();
+  status = ucp_mem_map(reader->side.ucp_context, &params, &memh);
+  CHKERR_ACTION(status != UCS_OK, "register read buffers\n", return NULL);
+  for (i = 0; i < bench->window; ++i) {
+    reader->reads[i].reader = reader;
+    reader->reads[i].buffer = buffers.data() + i * bench->size;
+    reader->free_reads.push_back(&reader->reads[i]);
+  }
+
+  status = blobs.connect(bench->server.worker_attr.address);
+  CHKERR_JUMP(status != UCS_OK, "connect to the catalog\n", out);
+
+  for (i = 0; i < bench->nblobs; ++i) {
+    snprintf(name, sizeof(name), "blob%u", i);
+    status = blobs.lookup(name, &reader->blobs[i], bb_looked_up, reader);
+    CHKERR_JUMP(status != UCS_OK, "look a blob up\n", out);
+  }
+  while (reader->looked_up < bench->nblobs) {
+    blobs.progress();
+  }
+  bench->ready.fetch_add(1);
+  CHKERR_JUMP(reader->failed, "look the blobs up\n", out);
+
+  start_ns = get_time_ns();
+  while ((reader->done < bench->count) && !reader->failed) {
+    while ((issued < bench->count) && !reader->free_reads.empty()) {
+      read = reader->free_reads.back();
+      reader->free_reads.pop_back();
+      read->blob = bench_rand(&reader->rng) % bench->nblobs;
+      read->offset =
+          bench_rand(&reader->rng) % (bench->blob_size - bench->size + 1);
+      read->start_ns = get_time_ns();
+      status = blobs.read(reader->blobs[read->blob], read->offset,
+                          bench->size, read->buffer, memh, bb_read_done,
+                          read);
+      if (status != UCS_OK) {
+        reader->free_reads.push_back(read);
+        reader->failed = 1;
+        break;
+      }
+      ++issued;
+    }
+    blobs.progress();
+  }
+  reader->elapsed_ns = get_time_ns() - start_ns;
+
+out:
+  status = blobs.close();
+  ucp_mem_unmap(reader->side.ucp_context, memh);
+  reader->ret = (!reader->failed && (reader->done == bench->count) &&
+                 (status == UCS_OK))
+                    ? 0
+                    : -1;
+  return NULL;
+}
+
+static int bb_run(struct bb_bench *bench) {
+  std::vector<pthread_t> threads(bench->nreaders);
+  std::vector<uint64_t> latency_ns;
+  pthread_t server_thread;
+  uint64_t elapsed_ns = 0;
+  unsigned i;
+  int ret = 0;
+
+  bench->ready.store(0);
+  bench->stop.store(false);
+  CHKERR_ACTION(pthread_create(&server_thread, NULL, bb_server_thread,
+                               bench) != 0,
+                "create server thread\n", return -1);
+  for (i = 0; i < bench->nreaders; ++i) {
+    /* Started threads never return; leave them to process exit */
+    CHKERR_ACTION(pthread_create(&threads[i], NULL, bb_reader_thread,
+                                 &bench->readers[i]) != 0,
+                  "create reader thread\n", return -1);
+  }
+  for (i = 0; i < bench->nreaders; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  bench->stop.store(true);
+  pthread_join(server_thread, NULL);
+
+  for (struct bb_reader &reader : bench->readers) {
+    if (reader.ret != 0) {
+      ret = -1;
+    }
+    elapsed_ns = std::max(elapsed_ns, reader.elapsed_ns);
+    latency_ns.insert(latency_ns.end(), reader.latency_ns.begin(),
+                      reader.latency_ns.end());
+  }
+  if (ret != 0) {
+    return -1;
+  }
+
+  log_flush();
+  printf("%12.0f %10.2f %10.2f %10.2f %10.2f %10lu\n",
+         bench->count * bench->nreaders / (elapsed_ns / 1e9),
+         bench->count * bench->nreaders * bench->size / (double)elapsed_ns,
+         percentile_us(latency_ns, 0.5), percentile_us(latency_ns, 0.99),
+         percentile_us(latency_ns, 0.999),
+         bench->catalog->get_stats().lookups);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  struct bb_bench bench;
+  ucs_status_t status;
+  char name[32];
+  unsigned i;
+  size_t j;
+  int ret = -1;
+  int c;
+
+  bench.nreaders = BB_DEFAULT_THREADS;
+  bench.nblobs = BB_DEFAULT_BLOBS;
+  bench.blob_size = BB_DEFAULT_BLOB_SIZE;
+  bench.count = BB_DEFAULT_COUNT;
+  bench.size = BB_DEFAULT_SIZE;
+  bench.chunk = BB_DEFAULT_CHUNK;
+  bench.window = BB_DEFAULT_WINDOW;
+  bench.idle_server = false;
+
+  while ((c = getopt(argc, argv, "t:b:S:n:s:c:w:ih")) != -1) {
+    switch (c) {
+    case 't':
+      bench.nreaders = atoi(optarg);
+      break;
+    case 'b':
+      bench.nblobs = atoi(optarg);
+      break;
+    case 'S':
+      bench.blob_size = strtoull(optarg, NULL, 0);
+      break;
+    case 'n':
+      bench.count = atol(optarg);
+      break;
+    case 's':
+      bench.size = strtoull(optarg, NULL, 0);
+      break;
+    case 'c':
+      bench.chunk = strtoull(optarg, NULL, 0);
+      break;
+    case 'w':
+      bench.window = atoi(optarg);
+      break;
+    case 'i':
+      bench.idle_server = true;
+      break;
+    case 'h':
+    default:
+      print_bb_usage();
+      return -1;
+    }
+  }
+
+  if ((bench.nreaders == 0) || (bench.nblobs == 0) || (bench.count <= 0) ||
+      (bench.size == 0) || (bench.size > bench.blob_size) ||
+      (bench.chunk == 0) ||
+      ((bench.size + bench.chunk - 1) / bench.chunk >
+       BLOB_READER_MAX_CHUNKS) ||
+      (bench.window == 0) || (bench.window > BLOB_READER_MAX_OPS)) {
+    print_bb_usage();
+    return -1;
+  }
+
+  bench.catalog = NULL;
+  bench.readers.resize(bench.nreaders);
+  for (i = 0; i < bench.nreaders; ++i) {
+    bench.readers[i].bench = &bench;
+    bench.readers[i].id = i;
+    bench.readers[i].side.ucp_worker = NULL;
+    bench.readers[i].rng = 0x9e3779b97f4a7c15ull * (i + 1);
+    bench.readers[i].blobs.resize(bench.nblobs);
+    bench.readers[i].looked_up = 0;
+    bench.readers[i].reads.resize(bench.window);
+    bench.readers[i].done = 0;
+    bench.readers[i].failed = 0;
+    bench.readers[i].elapsed_ns = 0;
+    bench.readers[i].ret = -1;
+  }
+
+  ret = bench_init_side(&bench.server, "blob catalog",
+                        UCP_FEATURE_AM | UCP_FEATURE_RMA);
+  CHKERR_JUMP(ret != 0, "initialize server\n", err);
+
+  ret = -1;
+  bench.catalog = new BlobCatalog(bench.server.ucp_context,
+                                  bench.server.ucp_worker);
+  status = bench.catalog->start();
+  CHKERR_JUMP(status != UCS_OK, "start the catalog\n", err_cleanup);
+
+  bench.blobs.resize(bench.nblobs);
+  for (i = 0; i < bench.nblobs; ++i) {
+    bench.blobs[i].resize(bench.blob_size);
+    for (j = 0; j < bench.blob_size; ++j) {
+      bench.blobs[i][j] = bb_pattern(i, j);
+    }
+    snprintf(name, sizeof(name), "blob%u", i);
+    status = bench.catalog->add(name, bench.blobs[i].data(),
+                                bench.blob_size);
+    CHKERR_JUMP(status != UCS_OK, "add a blob\n", err_cleanup);
+  }
+
+  for (struct bb_reader &reader : bench.readers) {
+    ret = bench_init_side(&reader.side, "blob reader",
+                          UCP_FEATURE_AM | UCP_FEATURE_RMA);
+    CHKERR_ACTION(ret != 0, "initialize reader\n",
+                  reader.side.ucp_worker = NULL;
+                  goto err_cleanup);
+  }
+
+  log_flush();
+  printf("\n%u readers, %u blobs of %lu bytes, %ld reads of %lu bytes each "
+         "in gets of %lu bytes, %u in flight; latencies in us\n",
+         bench.nreaders, bench.nblobs, bench.blob_size, bench.count,
+         bench.size, bench.chunk, bench.window);
+  printf("%12s %10s %10s %10s %10s %10s\n", "reads/s", "GB/s", "p50", "p99",
+         "p99.9", "lookups");
+  ret = bb_run(&bench);
+
+err_cleanup:
+  for (struct bb_reader &reader : bench.readers) {
+    if (reader.side.ucp_worker != NULL) {
+      bench_cleanup_side(&reader.side);
+    }
+  }
+  delete bench.catalog;
+  bench_cleanup_side(&bench.server);
+err:
+  return ret;
+}
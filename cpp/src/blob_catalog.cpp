@@ -0,0 +1,437 @@
+#include "blob_catalog.h"
+#include "common_utils.h"
+#include "logger.h"
+#include "ucx_utils.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+BlobCatalog::BlobCatalog(ucp_context_h ucp_context, ucp_worker_h ucp_worker)
+    : ucp_context_(ucp_context), ucp_worker_(ucp_worker), stats_() {}
+
+BlobCatalog::~BlobCatalog() {
+  for (auto &entry : blobs_) {
+    ucp_mem_unmap(ucp_context_, entry.second.memh);
+  }
+  LOG_INFO("blob catalog: %lu blobs (%lu bytes), %lu lookups, %lu misses, "
+           "%lu errors\n",
+           stats_.blobs, stats_.bytes, stats_.lookups, stats_.misses,
+           stats_.errors);
+}
+
+ucs_status_t BlobCatalog::start() {
+  ucp_am_handler_param_t param;
+
+  param.field_mask = UCP_AM_HANDLER_PARAM_FIELD_ID |
+                     UCP_AM_HANDLER_PARAM_FIELD_CB |
+                     UCP_AM_HANDLER_PARAM_FIELD_ARG;
+  param.id = CATALOG_AM_LOOKUP;
+  param.cb = lookup_cb;
+  param.arg = this;
+  return ucp_worker_set_am_recv_handler(ucp_worker_, &param);
+}
+
+ucs_status_t BlobCatalog::add(const char *name, const void *data,
+                              size_t length) {
+  size_t name_len = strlen(name);
+  ucp_mem_map_params_t params;
+  struct blob blob;
+  void *rkey_buffer;
+  size_t rkey_len;
+  ucs_status_t status;
+
+  if ((name_len > CATALOG_MAX_NAME) || (length == 0)) {
+    return UCS_ERR_INVALID_PARAM;
+  }
+  if (blobs_.count(name) > 0) {
+    return UCS_ERR_ALREADY_EXISTS;
+  }
+
+  params.field_mask =
+      UCP_MEM_MAP_PARAM_FIELD_ADDRESS | UCP_MEM_MAP_PARAM_FIELD_LENGTH;
+  params.address = const_cast<void *>(data);
+  params.length = length;
+  status = ucp_mem_map(ucp_context_, &params, &blob.memh);
+  CHKERR_ACTION(status != UCS_OK, "register a blob\n", return status);
+
+  status = ucp_rkey_pack(ucp_context_, blob.memh, &rkey_buffer, &rkey_len);
+  CHKERR_ACTION(status != UCS_OK, "pack a blob's rkey\n",
+                ucp_mem_unmap(ucp_context_, blob.memh);
+                return status);
+
+  blob.address = data;
+  blob.length = length;
+  blob.rkey.assign(static_cast<char *>(rkey_buffer),
+                   static_cast<char *>(rkey_buffer) + rkey_len);
+  ucp_rkey_buffer_release(rkey_buffer);
+
+  blobs_.emplace(name, std::move(blob));
+  ++stats_.blobs;
+  stats_.bytes += length;
+  return UCS_OK;
+}
+
+void BlobCatalog::reply(ucp_ep_h ep, uint64_t req_id, ucs_status_t status,
+                        const struct blob *blob) {
+  struct catalog_reply_hdr hdr;
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+
+  hdr.req_id = req_id;
+  hdr.address = (blob != NULL) ? (uint64_t)blob->address : 0;
+  hdr.length = (blob != NULL) ? blob->length : 0;
+  hdr.status = status;
+  hdr.rkey_len = (blob != NULL) ? blob->rkey.size() : 0;
+
+  /* The header is on the stack, the key stays in the catalog */
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_FLAGS;
+  param.flags = UCP_AM_SEND_FLAG_COPY_HEADER;
+  request = ucp_am_send_nbx(ep, CATALOG_AM_REPLY, &hdr, sizeof(hdr),
+                            (blob != NULL) ? blob->rkey.data() : NULL,
+                            hdr.rkey_len, &param);
+  if (UCS_PTR_IS_PTR(request)) {
+    ucp_request_free(request);
+  } else if (UCS_PTR_IS_ERR(request)) {
+    LOG_WARN("blob catalog: reply failed (%s)\n",
+             ucs_status_string(UCS_PTR_STATUS(request)));
+    ++stats_.errors;
+  }
+}
+
+ucs_status_t BlobCatalog::lookup_cb(void *arg, const void *header,
+                                    size_t header_length, void *data,
+                                    size_t length,
+                                    const ucp_am_recv_param_t *param) {
+  BlobCatalog *catalog = static_cast<BlobCatalog *>(arg);
+  const struct catalog_lookup_hdr *hdr =
+      static_cast<const struct catalog_lookup_hdr *>(header);
+  const char *name = reinterpret_cast<const char *>(hdr + 1);
+
+  if (!(param->recv_attr & UCP_AM_RECV_ATTR_FIELD_REPLY_EP) ||
+      (header_length < sizeof(*hdr))) {
+    LOG_WARN("blob catalog: dropping a lookup without reply endpoint or "
+             "header\n");
+    ++catalog->stats_.errors;
+    return UCS_OK;
+  }
+
+  ++catalog->stats_.lookups;
+  if ((hdr->name_len > CATALOG_MAX_NAME) ||
+      (header_length != sizeof(*hdr) + hdr->name_len)) {
+    ++catalog->stats_.errors;
+    catalog->reply(param->reply_ep, hdr->req_id, UCS_ERR_INVALID_PARAM,
+                   NULL);
+    return UCS_OK;
+  }
+
+  auto it = catalog->blobs_.find(std::string(name, hdr->name_len));
+  if (it == catalog->blobs_.end()) {
+    ++catalog->stats_.misses;
+    catalog->reply(param->reply_ep, hdr->req_id, UCS_ERR_NO_ELEM, NULL);
+    return UCS_OK;
+  }
+
+  catalog->reply(param->reply_ep, hdr->req_id, UCS_OK, &it->second);
+  return UCS_OK;
+}
+
+BlobReader::BlobReader(ucp_worker_h ucp_worker, size_t chunk_size)
+    : ucp_worker_(ucp_worker), chunk_size_(chunk_size), ep_(NULL),
+      ops_(BLOB_READER_MAX_OPS), pending_(0), stats_() {
+  size_t i;
+
+  free_ops_.reserve(ops_.size());
+  for (i = ops_.size(); i > 0; --i) {
+    ops_[i - 1].reader = this;
+    ops_[i - 1].waits = 0;
+    free_ops_.push_back(&ops_[i - 1]);
+  }
+}
+
+BlobReader::~BlobReader() {
+  for (struct blob &blob : blobs_) {
+    ucp_rkey_destroy(blob.rkey);
+  }
+  if (ep_ != NULL) {
+    ep_close(ucp_worker_, ep_, UCP_EP_CLOSE_FLAG_FORCE);
+  }
+  LOG_INFO("blob reader: %lu lookups, %lu reads in %lu gets (%lu bytes), "
+           "%lu errors\n",
+           stats_.lookups, stats_.reads, stats_.gets, stats_.bytes,
+           stats_.errors);
+}
+
+ucs_status_t BlobReader::connect(const ucp_address_t *address) {
+  ucp_am_handler_param_t handler_param;
+  ucp_ep_params_t ep_params;
+  ucs_status_t status;
+
+  CHKERR_ACTION(chunk_size_ == 0, "use a non-zero chunk size\n",
+                return UCS_ERR_INVALID_PARAM);
+
+  handler_param.field_mask = UCP_AM_HANDLER_PARAM_FIELD_ID |
+                             UCP_AM_HANDLER_PARAM_FIELD_CB |
+                             UCP_AM_HANDLER_PARAM_FIELD_ARG;
+  handler_param.id = CATALOG_AM_REPLY;
+  handler_param.cb = reply_cb;
+  handler_param.arg = this;
+  status = ucp_worker_set_am_recv_handler(ucp_worker_, &handler_param);
+  CHKERR_ACTION(status != UCS_OK, "set the catalog reply handler\n",
+                return status);
+
+  ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS;
+  ep_params.address = address;
+  status = ucp_ep_create(ucp_worker_, &ep_params, &ep_);
+  CHKERR_ACTION(status != UCS_OK, "ucp_ep_create\n",
+                ep_ = NULL; return status);
+
+  return UCS_OK;
+}
+
+ucs_status_t BlobReader::close() {
+  ucs_status_t status;
+
+  while (pending_ > 0) {
+    ucp_worker_progress(ucp_worker_);
+  }
+
+  for (struct blob &blob : blobs_) {
+    ucp_rkey_destroy(blob.rkey);
+  }
+  blobs_.clear();
+  if (ep_ == NULL) {
+    return UCS_OK;
+  }
+  status = worker_drain(ucp_worker_, &ep_, 1);
+  ep_ = NULL;
+  return status;
+}
+
+struct BlobReader::op *BlobReader::get_op(blob_done_cb_t cb, void *arg) {
+  struct op *op;
+
+  if (free_ops_.empty()) {
+    return NULL;
+  }
+
+  op = free_ops_.back();
+  free_ops_.pop_back();
+  op->cb = cb;
+  op->arg = arg;
+  op->waits = 1;
+  op->status = UCS_OK;
+  op->length = 0;
+  op->blob = NULL;
+  ++pending_;
+  return op;
+}
+
+void BlobReader::op_done(struct op *op, ucs_status_t status) {
+  blob_done_cb_t cb;
+  void *arg;
+  size_t length;
+
+  if ((status != UCS_OK) && (op->status == UCS_OK)) {
+    op->status = status;
+  }
+  if (--op->waits > 0) {
+    return;
+  }
+
+  /* A lookup of an unknown name is an answer, not an error */
+  if ((op->status != UCS_OK) && (op->status != UCS_ERR_NO_ELEM)) {
+    ++stats_.errors;
+  }
+
+  /* The callback may start a new operation in this slot */
+  cb = op->cb;
+  arg = op->arg;
+  status = op->status;
+  length = op->length;
+  free_ops_.push_back(op);
+  --pending_;
+  cb(arg, status, length);
+}
+
+void BlobReader::send_done(void *request, ucs_status_t status,
+                           void *user_data) {
+  struct op *op = static_cast<struct op *>(user_data);
+
+  if (status != UCS_OK) {
+    LOG_WARN("blob reader: lookup failed (%s)\n", ucs_status_string(status));
+  }
+  op->reader->op_done(op, status);
+  ucp_request_free(request);
+}
+
+void BlobReader::get_done(void *request, ucs_status_t status,
+                          void *user_data) {
+  struct op *op = static_cast<struct op *>(user_data);
+
+  if (status != UCS_OK) {
+    LOG_WARN("blob reader: get failed (%s)\n", ucs_status_string(status));
+  }
+  op->reader->op_done(op, status);
+  ucp_request_free(request);
+}
+
+ucs_status_t BlobReader::reply_cb(void *arg, const void *header,
+                                  size_t header_length, void *data,
+                                  size_t length,
+                                  const ucp_am_recv_param_t *param) {
+  BlobReader *reader = static_cast<BlobReader *>(arg);
+  const struct catalog_reply_hdr *hdr =
+      static_cast<const struct catalog_reply_hdr *>(header);
+  struct blob blob;
+  ucs_status_t status;
+  struct op *op;
+
+  if ((header_length < sizeof(*hdr)) ||
+      (hdr->req_id >= reader->ops_.size()) ||
+      (reader->ops_[hdr->req_id].waits == 0) ||
+      (reader->ops_[hdr->req_id].blob == NULL)) {
+    LOG_WARN("blob reader: dropping an unexpected reply\n");
+    ++reader->stats_.errors;
+    return UCS_OK;
+  }
+
+  op = &reader->ops_[hdr->req_id];
+  status = (ucs_status_t)hdr->status;
+  if (status != UCS_OK) {
+    reader->op_done(op, status);
+    return UCS_OK;
+  }
+
+  /* A key is far below the rendezvous threshold, so it arrives here */
+  if ((param->recv_attr & UCP_AM_RECV_ATTR_FLAG_RNDV) ||
+      (length != hdr->rkey_len)) {
+    reader->op_done(op, UCS_ERR_INVALID_PARAM);
+    return UCS_OK;
+  }
+
+  status = ucp_ep_rkey_unpack(reader->ep_, data, &blob.rkey);
+  if (status == UCS_OK) {
+    blob.address = hdr->address;
+    blob.length = hdr->length;
+    *op->blob = reader->blobs_.size();
+    reader->blobs_.push_back(blob);
+    op->length = blob.length;
+  }
+  reader->op_done(op, status);
+  return UCS_OK;
+}
+
+ucs_status_t BlobReader::lookup(const char *name, unsigned *blob,
+                                blob_done_cb_t cb, void *arg) {
+  char header[sizeof(struct catalog_lookup_hdr) + CATALOG_MAX_NAME];
+  struct catalog_lookup_hdr *hdr =
+      reinterpret_cast<struct catalog_lookup_hdr *>(header);
+  size_t name_len = strlen(name);
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+  struct op *op;
+
+  if ((ep_ == NULL) || (name_len > CATALOG_MAX_NAME)) {
+    return UCS_ERR_INVALID_PARAM;
+  }
+
+  op = get_op(cb, arg);
+  if (op == NULL) {
+    return UCS_ERR_NO_RESOURCE;
+  }
+  op->blob = blob;
+  ++stats_.lookups;
+
+  hdr->req_id = op - ops_.data();
+  hdr->name_len = name_len;
+  hdr->reserved = 0;
+  hdr->reserved2 = 0;
+  memcpy(hdr + 1, name, name_len);
+
+  /* The header is on the stack */
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_FLAGS | UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_USER_DATA;
+  param.flags = UCP_AM_SEND_FLAG_REPLY | UCP_AM_SEND_FLAG_COPY_HEADER;
+  param.cb.send = send_done;
+  param.user_data = op;
+  request = ucp_am_send_nbx(ep_, CATALOG_AM_LOOKUP, header,
+                            sizeof(*hdr) + name_len, NULL, 0, &param);
+  if (UCS_PTR_IS_PTR(request)) {
+    ++op->waits;
+  } else if (UCS_PTR_IS_ERR(request)) {
+    LOG_WARN("blob reader: sending a lookup failed (%s)\n",
+             ucs_status_string(UCS_PTR_STATUS(request)));
+    /* No reply is coming */
+    op_done(op, UCS_PTR_STATUS(request));
+  }
+  return UCS_OK;
+}
+
+ucs_status_t BlobReader::read(unsigned blob, uint64_t offset, size_t length,
+                              void *buffer, ucp_mem_h memh,
+                              blob_done_cb_t cb, void *arg) {
+  char *dest = static_cast<char *>(buffer);
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+  ucs_status_t status = UCS_OK;
+  size_t nchunks, chunk, done;
+  struct op *op;
+
+  if ((blob >= blobs_.size()) || (offset > blobs_[blob].length) ||
+      (length > blobs_[blob].length - offset)) {
+    return UCS_ERR_INVALID_PARAM;
+  }
+  nchunks = (length + chunk_size_ - 1) / chunk_size_;
+  if (nchunks > BLOB_READER_MAX_CHUNKS) {
+    return UCS_ERR_INVALID_PARAM;
+  }
+
+  op = get_op(cb, arg);
+  if (op == NULL) {
+    return UCS_ERR_NO_RESOURCE;
+  }
+  op->length = length;
+  ++stats_.reads;
+  if (nchunks == 0) {
+    op_done(op, UCS_OK);
+    return UCS_OK;
+  }
+
+  /* The extra wait holds the operation until every chunk is issued */
+  op->waits = nchunks + 1;
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_USER_DATA;
+  param.cb.send = get_done;
+  param.user_data = op;
+  if (memh != NULL) {
+    param.op_attr_mask |= UCP_OP_ATTR_FIELD_MEMH;
+    param.memh = memh;
+  }
+
+  for (done = 0; done < length; done += chunk) {
+    chunk = std::min(chunk_size_, length - done);
+    if (status != UCS_OK) {
+      /* A get failed; the rest are not issued */
+      op_done(op, status);
+      continue;
+    }
+
+    ++stats_.gets;
+    request = ucp_get_nbx(ep_, dest + done, chunk,
+                          blobs_[blob].address + offset + done,
+                          blobs_[blob].rkey, &param);
+    if (UCS_PTR_IS_PTR(request)) {
+      continue;
+    }
+    status = UCS_PTR_STATUS(request);
+    if (status != UCS_OK) {
+      LOG_WARN("blob reader: get failed (%s)\n", ucs_status_string(status));
+    }
+    op_done(op, status);
+  }
+
+  stats_.bytes += length;
+  op_done(op, UCS_OK);
+  return UCS_OK;
+}
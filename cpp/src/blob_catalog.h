@@ -0,0 +1,259 @@
+#ifndef MYUCXPLAYGROUND_BLOB_CATALOG_H
+#define MYUCXPLAYGROUND_BLOB_CATALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ucp/api/ucp.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Wire format of the blob catalog (BlobCatalog / BlobReader).
+ *
+ * A lookup is an active message on CATALOG_AM_LOOKUP, sent with
+ * UCP_AM_SEND_FLAG_REPLY, whose header is struct catalog_lookup_hdr and the
+ * blob's name. The answer is an active message on CATALOG_AM_REPLY whose
+ * header is struct catalog_reply_hdr and whose data is the blob's packed
+ * remote key. Everything after that is RMA: the reader gets the bytes it
+ * wants straight from the blob.
+ */
+
+#define CATALOG_AM_LOOKUP 12
+#define CATALOG_AM_REPLY 13
+
+#define CATALOG_MAX_NAME 250      /* bytes per blob name */
+#define BLOB_READER_MAX_OPS 256   /* outstanding lookups and reads */
+#define BLOB_READER_MAX_CHUNKS 64 /* gets a read is split into */
+
+struct catalog_lookup_hdr {
+  uint64_t req_id;
+  uint16_t name_len; /* bytes of name that follow */
+  uint16_t reserved;
+  uint32_t reserved2;
+};
+
+struct catalog_reply_hdr {
+  uint64_t req_id;
+  uint64_t address;
+  uint64_t length;
+  int32_t status; /* ucs_status_t; UCS_ERR_NO_ELEM for an unknown name */
+  uint32_t rkey_len;
+};
+
+/**
+ * Named blobs served for receiver-driven reads.
+ *
+ * Each blob is registered with ucp_mem_map() where it lies, and its remote
+ * key is packed once. Readers look a name up with one active message and
+ * then fetch whatever ranges they want with ucp_get_nbx(); over shared
+ * memory and RDMA transports this side's CPU takes no part in those reads.
+ * Transports without RMA (TCP) emulate it in software, and then the
+ * catalog's worker has to be progressed.
+ *
+ * Lookups are answered inside the AM callback. Blobs cannot be removed: a
+ * reader may hold a blob's key for as long as it is connected.
+ *
+ * Not thread safe: use it from the thread that progresses `ucp_worker`.
+ */
+class BlobCatalog {
+
+public:
+  struct stats {
+    uint64_t blobs;
+    uint64_t bytes; /* registered */
+    uint64_t lookups;
+    uint64_t misses; /* lookups of unknown names */
+    uint64_t errors; /* malformed lookups and failed replies */
+  };
+
+  /**
+   * @param ucp_context Context created with UCP_FEATURE_AM and
+   * UCP_FEATURE_RMA.
+   * @param ucp_worker Worker of `ucp_context`.
+   */
+  BlobCatalog(ucp_context_h ucp_context, ucp_worker_h ucp_worker);
+
+  /**
+   * @brief Unregisters every blob; the caller frees their memory.
+   */
+  ~BlobCatalog();
+
+  BlobCatalog(const BlobCatalog &) = delete;
+  BlobCatalog &operator=(const BlobCatalog &) = delete;
+
+  /**
+   * @brief Installs the lookup handler on the worker.
+   *
+   * @return UCS_OK on success.
+   */
+  ucs_status_t start();
+
+  /**
+   * @brief Registers `length` bytes at `data` under `name`. The memory must
+   * stay valid and unchanged for the catalog's lifetime.
+   *
+   * @return UCS_OK, UCS_ERR_ALREADY_EXISTS if the name is taken,
+   * UCS_ERR_INVALID_PARAM for a name longer than CATALOG_MAX_NAME, or the
+   * error of registering.
+   */
+  ucs_status_t add(const char *name, const void *data, size_t length);
+
+  const struct stats &get_stats() const { return stats_; }
+
+private:
+  struct blob {
+    const void *address;
+    size_t length;
+    ucp_mem_h memh;
+    std::vector<char> rkey;
+  };
+
+  static ucs_status_t lookup_cb(void *arg, const void *header,
+                                size_t header_length, void *data,
+                                size_t length,
+                                const ucp_am_recv_param_t *param);
+
+  void reply(ucp_ep_h ep, uint64_t req_id, ucs_status_t status,
+             const struct blob *blob);
+
+  ucp_context_h ucp_context_;
+  ucp_worker_h ucp_worker_;
+  std::unordered_map<std::string, struct blob> blobs_;
+  struct stats stats_;
+};
+
+/**
+ * @brief Called once per operation. `length` is the blob's length for a
+ * lookup and the bytes read for a read.
+ */
+typedef void (*blob_done_cb_t)(void *arg, ucs_status_t status,
+                               size_t length);
+
+/**
+ * Client of a BlobCatalog: looks blobs up by name and reads byte ranges of
+ * them with RMA gets, straight into the caller's buffer.
+ *
+ * A read is split into chunks of at most `chunk_size` bytes that are all
+ * issued at once, so a large read keeps several gets in flight and UCX can
+ * spread them over its lanes. Operations complete through their callback
+ * while the worker is progressed; once an operation is accepted its
+ * callback is always called, possibly before the call returns.
+ *
+ * Not thread safe: use it from the thread that progresses `ucp_worker`.
+ */
+class BlobReader {
+
+public:
+  struct stats {
+    uint64_t lookups;
+    uint64_t reads;
+    uint64_t gets;
+    uint64_t bytes;
+    uint64_t errors;
+  };
+
+  /**
+   * @param ucp_worker Worker of a context created with UCP_FEATURE_AM and
+   * UCP_FEATURE_RMA.
+   * @param chunk_size Largest get a read is split into, non-zero.
+   */
+  BlobReader(ucp_worker_h ucp_worker, size_t chunk_size);
+  ~BlobReader();
+
+  BlobReader(const BlobReader &) = delete;
+  BlobReader &operator=(const BlobReader &) = delete;
+
+  /**
+   * @brief Connects to the catalog's worker and installs the reply handler.
+   *
+   * @return UCS_OK on success, UCS_ERR_INVALID_PARAM if the reader was made
+   * with a zero chunk size.
+   */
+  ucs_status_t connect(const ucp_address_t *address);
+
+  /**
+   * @brief Looks `name` up. On success `*blob`, which must stay valid until
+   * the callback, is set to a handle for read(); the callback gets
+   * UCS_ERR_NO_ELEM if the catalog has no such blob.
+   *
+   * @return UCS_OK if the lookup was accepted, UCS_ERR_NO_RESOURCE if
+   * BLOB_READER_MAX_OPS are outstanding, UCS_ERR_INVALID_PARAM for a bad
+   * name.
+   */
+  ucs_status_t lookup(const char *name, unsigned *blob, blob_done_cb_t cb,
+                      void *arg);
+
+  /**
+   * @brief Reads `length` bytes at `offset` of `blob` into `buffer`.
+   *
+   * @param memh Registration of `buffer`, or NULL to let UCX register it.
+   *
+   * @return As lookup(); UCS_ERR_INVALID_PARAM also for an unknown blob, a
+   * range outside it, or one that needs more than BLOB_READER_MAX_CHUNKS
+   * chunks.
+   */
+  ucs_status_t read(unsigned blob, uint64_t offset, size_t length,
+                    void *buffer, ucp_mem_h memh, blob_done_cb_t cb,
+                    void *arg);
+
+  /**
+   * @return Length of a blob looked up before.
+   */
+  size_t length(unsigned blob) const { return blobs_[blob].length; }
+
+  unsigned progress() { return ucp_worker_progress(ucp_worker_); }
+
+  /**
+   * @return Operations not completed yet.
+   */
+  unsigned pending() const { return pending_; }
+
+  /**
+   * @brief Waits for outstanding operations, then releases the remote keys
+   * and closes the endpoint; see worker_drain().
+   */
+  ucs_status_t close();
+
+  const struct stats &get_stats() const { return stats_; }
+
+private:
+  struct blob {
+    uint64_t address;
+    size_t length;
+    ucp_rkey_h rkey;
+  };
+
+  struct op {
+    BlobReader *reader;
+    blob_done_cb_t cb;
+    void *arg;
+    unsigned waits; /* reply or gets still due */
+    ucs_status_t status;
+    size_t length;
+    unsigned *blob; /* lookup: where the handle goes */
+  };
+
+  static ucs_status_t reply_cb(void *arg, const void *header,
+                               size_t header_length, void *data,
+                               size_t length,
+                               const ucp_am_recv_param_t *param);
+  static void send_done(void *request, ucs_status_t status,
+                        void *user_data);
+  static void get_done(void *request, ucs_status_t status, void *user_data);
+
+  struct op *get_op(blob_done_cb_t cb, void *arg);
+  void op_done(struct op *op, ucs_status_t status);
+
+  ucp_worker_h ucp_worker_;
+  size_t chunk_size_;
+  ucp_ep_h ep_;
+  std::vector<struct blob> blobs_;
+  std::vector<struct op> ops_;
+  std::vector<struct op *> free_ops_;
+  unsigned pending_;
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_BLOB_CATALOG_H
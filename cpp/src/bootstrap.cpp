@@ -0,0 +1,352 @@
+#include "bootstrap.h"
+#include "common_utils.h"
+#include "logger.h"
+#include "ucx_utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define BOOTSTRAP_MAX_EVENTS 64
+#define BOOTSTRAP_MAX_ADDR_LEN (64 * 1024)
+
+/* Registration state of one rank connection */
+struct bootstrap_conn {
+  int fd;
+  int rank;
+  struct bootstrap_register_hdr hdr;
+  size_t hdr_received;
+  std::vector<char> addr;
+  size_t addr_received;
+};
+
+static int bootstrap_send_all(int fd, const void *buf, size_t len) {
+  const char *p = static_cast<const char *>(buf);
+  ssize_t n;
+
+  while (len > 0) {
+    n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int bootstrap_recv_all(int fd, void *buf, size_t len) {
+  char *p = static_cast<char *>(buf);
+  ssize_t n;
+
+  while (len > 0) {
+    n = recv(fd, p, len, MSG_WAITALL);
+    if (n <= 0) {
+      if ((n < 0) && (errno == EINTR)) {
+        continue;
+      }
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int bootstrap_listen(uint16_t port, const char *unix_path) {
+  struct sockaddr_un un_addr;
+  int fd;
+  int ret;
+
+  if (unix_path == NULL) {
+    return listen_nonblock(port);
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  CHKERR_ACTION(fd < 0, "create bootstrap socket", return -1);
+
+  memset(&un_addr, 0, sizeof(un_addr));
+  un_addr.sun_family = AF_UNIX;
+  snprintf(un_addr.sun_path, sizeof(un_addr.sun_path), "%s", unix_path);
+  unlink(unix_path);
+  ret = bind(fd, (struct sockaddr *)&un_addr, sizeof(un_addr));
+  CHKERR_JUMP(ret < 0, "bind bootstrap socket", err_close);
+
+  ret = listen(fd, SOMAXCONN);
+  CHKERR_JUMP(ret < 0, "listen on bootstrap socket", err_close);
+
+  ret = set_nonblock(fd);
+  CHKERR_JUMP(ret < 0, "make bootstrap socket non-blocking", err_close);
+
+  return fd;
+
+err_close:
+  close(fd);
+  return -1;
+}
+
+/* Reads whatever is available for `conn`.
+ * Returns 1 once the registration is complete, 0 if more data is needed and
+ * -1 on error or disconnect */
+static int bootstrap_conn_read(struct bootstrap_conn *conn, int nranks) {
+  char *dst;
+  size_t want;
+  ssize_t n;
+
+  for (;;) {
+    if (conn->hdr_received < sizeof(conn->hdr)) {
+      dst = reinterpret_cast<char *>(&conn->hdr) + conn->hdr_received;
+      want = sizeof(conn->hdr) - conn->hdr_received;
+    } else {
+      dst = conn->addr.data() + conn->addr_received;
+      want = conn->addr.size() - conn->addr_received;
+    }
+
+    if (want == 0) {
+      return 1;
+    }
+
+    n = recv(conn->fd, dst, want, 0);
+    if (n == 0) {
+      return -1;
+    } else if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+    }
+
+    if (conn->hdr_received < sizeof(conn->hdr)) {
+      conn->hdr_received += n;
+      if (conn->hdr_received < sizeof(conn->hdr)) {
+        continue;
+      }
+
+      if ((conn->hdr.magic != BOOTSTRAP_MAGIC) ||
+          (conn->hdr.nranks != (uint32_t)nranks) ||
+          (conn->hdr.rank >= (uint32_t)nranks) || (conn->hdr.addr_len == 0) ||
+          (conn->hdr.addr_len > BOOTSTRAP_MAX_ADDR_LEN)) {
+        LOG_ERROR("bootstrap: invalid registration (rank %u of %u)\n",
+                  conn->hdr.rank, conn->hdr.nranks);
+        return -1;
+      }
+      conn->addr.resize(conn->hdr.addr_len);
+    } else {
+      conn->addr_received += n;
+    }
+  }
+}
+
+int bootstrap_server_run(uint16_t port, const char *unix_path, int nranks) {
+  struct epoll_event events[BOOTSTRAP_MAX_EVENTS];
+  struct epoll_event ev;
+  std::vector<struct bootstrap_conn *> by_rank(nranks, NULL);
+  std::vector<struct bootstrap_conn *> conns;
+  struct bootstrap_table_hdr table_hdr;
+  std::vector<char> table;
+  int registered = 0;
+  int listen_fd, epoll_fd;
+  int ret = -1;
+  int n, fd;
+
+  listen_fd = bootstrap_listen(port, unix_path);
+  if (listen_fd < 0) {
+    return -1;
+  }
+
+  epoll_fd = epoll_create1(0);
+  CHKERR_JUMP(epoll_fd < 0, "create bootstrap epoll", out_close_listen);
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL; /* NULL marks the listening socket */
+  ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+  CHKERR_JUMP(ret < 0, "add bootstrap socket to epoll", out_close_epoll);
+
+  if (unix_path != NULL) {
+    LOG_INFO("bootstrap: waiting for %d ranks on unix:%s\n", nranks,
+             unix_path);
+  } else {
+    LOG_INFO("bootstrap: waiting for %d ranks on TCP port %u\n", nranks,
+             (unsigned)port);
+  }
+  ret = -1;
+
+  while (registered < nranks) {
+    n = epoll_wait(epoll_fd, events, BOOTSTRAP_MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR("bootstrap: epoll_wait failed (%s)\n", strerror(errno));
+      goto out_close_conns;
+    }
+
+    for (int i = 0; i < n; ++i) {
+      struct bootstrap_conn *conn =
+          static_cast<struct bootstrap_conn *>(events[i].data.ptr);
+
+      if (conn == NULL) {
+        /* Drain the accept queue */
+        while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+          set_nonblock(fd);
+          conn = new bootstrap_conn();
+          conn->fd = fd;
+          conn->rank = -1;
+          conns.push_back(conn);
+
+          ev.events = EPOLLIN;
+          ev.data.ptr = conn;
+          epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        }
+        continue;
+      }
+
+      switch (bootstrap_conn_read(conn, nranks)) {
+      case 1:
+        if (by_rank[conn->hdr.rank] != NULL) {
+          LOG_ERROR("bootstrap: rank %u registered twice\n", conn->hdr.rank);
+          goto out_close_conns;
+        }
+        conn->rank = conn->hdr.rank;
+        by_rank[conn->rank] = conn;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        ++registered;
+        LOG_DEBUG("bootstrap: rank %d registered (%d/%d)\n", conn->rank,
+                  registered, nranks);
+        break;
+      case 0:
+        break;
+      default:
+        LOG_ERROR("bootstrap: rank connection lost before registering\n");
+        goto out_close_conns;
+      }
+    }
+  }
+
+  /* Everyone is in: build the table once and send it to every rank */
+  for (int rank = 0; rank < nranks; ++rank) {
+    uint32_t len = by_rank[rank]->addr.size();
+    table.insert(table.end(), reinterpret_cast<char *>(&len),
+                 reinterpret_cast<char *>(&len) + sizeof(len));
+    table.insert(table.end(), by_rank[rank]->addr.begin(),
+                 by_rank[rank]->addr.end());
+  }
+
+  table_hdr.magic = BOOTSTRAP_MAGIC;
+  table_hdr.nranks = nranks;
+  table_hdr.table_len = table.size();
+
+  for (int rank = 0; rank < nranks; ++rank) {
+    fd = by_rank[rank]->fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    if ((bootstrap_send_all(fd, &table_hdr, sizeof(table_hdr)) != 0) ||
+        (bootstrap_send_all(fd, table.data(), table.size()) != 0)) {
+      LOG_ERROR("bootstrap: failed to send address table to rank %d\n", rank);
+      goto out_close_conns;
+    }
+  }
+
+  LOG_INFO("bootstrap: all-gather of %d ranks done (%lu bytes)\n", nranks,
+           table.size());
+  ret = 0;
+
+out_close_conns:
+  for (struct bootstrap_conn *conn : conns) {
+    close(conn->fd);
+    delete conn;
+  }
+out_close_epoll:
+  close(epoll_fd);
+out_close_listen:
+  close(listen_fd);
+  if (unix_path != NULL) {
+    unlink(unix_path);
+  }
+  return ret;
+}
+
+static int bootstrap_connect(const char *server, uint16_t port,
+                             const char *unix_path) {
+  struct sockaddr_un un_addr;
+  int fd;
+
+  if (unix_path == NULL) {
+    return connect_client(server, port, AF_INET);
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  CHKERR_ACTION(fd < 0, "create bootstrap socket", return -1);
+
+  memset(&un_addr, 0, sizeof(un_addr));
+  un_addr.sun_family = AF_UNIX;
+  snprintf(un_addr.sun_path, sizeof(un_addr.sun_path), "%s", unix_path);
+  if (connect(fd, (struct sockaddr *)&un_addr, sizeof(un_addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int bootstrap_allgather(const char *server, uint16_t port,
+                        const char *unix_path, int rank, int nranks,
+                        const ucp_address_t *addr, size_t addr_len,
+                        struct bootstrap_table *table) {
+  struct bootstrap_register_hdr hdr;
+  struct bootstrap_table_hdr table_hdr;
+  size_t pos = 0;
+  uint32_t len;
+  int ret = -1;
+  int fd;
+
+  fd = bootstrap_connect(server, port, unix_path);
+  CHKERR_ACTION(fd < 0, "connect to bootstrap server", return -1);
+
+  hdr.magic = BOOTSTRAP_MAGIC;
+  hdr.rank = rank;
+  hdr.nranks = nranks;
+  hdr.addr_len = addr_len;
+  CHKERR_JUMP((bootstrap_send_all(fd, &hdr, sizeof(hdr)) != 0) ||
+                  (bootstrap_send_all(fd, addr, addr_len) != 0),
+              "register with bootstrap server", out);
+
+  CHKERR_JUMP(bootstrap_recv_all(fd, &table_hdr, sizeof(table_hdr)) != 0,
+              "receive address table header", out);
+  CHKERR_JUMP((table_hdr.magic != BOOTSTRAP_MAGIC) ||
+                  ((int)table_hdr.nranks != nranks),
+              "validate address table header", out);
+
+  table->nranks = nranks;
+  table->blob.resize(table_hdr.table_len);
+  table->offsets.resize(nranks);
+  table->lengths.resize(nranks);
+  CHKERR_JUMP(bootstrap_recv_all(fd, table->blob.data(),
+                                 table_hdr.table_len) != 0,
+              "receive address table", out);
+
+  /* Index the table in place: addresses stay where they landed */
+  for (int i = 0; i < nranks; ++i) {
+    CHKERR_JUMP(pos + sizeof(len) > table->blob.size(), "parse address table",
+                out);
+    memcpy(&len, table->blob.data() + pos, sizeof(len));
+    pos += sizeof(len);
+    CHKERR_JUMP(pos + len > table->blob.size(), "parse address table", out);
+    table->offsets[i] = pos;
+    table->lengths[i] = len;
+    pos += len;
+  }
+
+  ret = 0;
+
+out:
+  close(fd);
+  return ret;
+}
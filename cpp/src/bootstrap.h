@@ -0,0 +1,90 @@
+#ifndef MYUCXPLAYGROUND_BOOTSTRAP_H
+#define MYUCXPLAYGROUND_BOOTSTRAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ucp/api/ucp.h>
+
+#include <vector>
+
+/**
+ * Rendezvous service for exchanging worker addresses between N ranks.
+ *
+ * Every rank opens one connection to the bootstrap server and registers its
+ * worker address; once all N ranks have registered the server replies to each
+ * of them with the full address table. Startup therefore needs N connections
+ * and one round trip instead of N^2 pairwise exchanges.
+ *
+ * The server listens on a TCP port, or on a Unix-domain socket when a path is
+ * given (cheaper for ranks on the same host).
+ */
+
+#define BOOTSTRAP_MAGIC 0x55435842u /* "UCXB" */
+#define BOOTSTRAP_DEFAULT_PORT 13338
+
+/* Sent by each rank, followed by `addr_len` bytes of worker address */
+struct bootstrap_register_hdr {
+  uint32_t magic;
+  uint32_t rank;
+  uint32_t nranks;
+  uint32_t addr_len;
+};
+
+/* Sent back to each rank, followed by `table_len` bytes: for every rank in
+ * order a uint32_t length and that many address bytes */
+struct bootstrap_table_hdr {
+  uint32_t magic;
+  uint32_t nranks;
+  uint64_t table_len;
+};
+
+/**
+ * Worker addresses of all ranks, stored back to back in one buffer.
+ */
+struct bootstrap_table {
+  int nranks;
+  std::vector<char> blob;
+  std::vector<size_t> offsets;
+  std::vector<size_t> lengths;
+
+  const ucp_address_t *address(int rank) const {
+    return reinterpret_cast<const ucp_address_t *>(blob.data() +
+                                                   offsets[rank]);
+  }
+  size_t address_length(int rank) const { return lengths[rank]; }
+};
+
+/**
+ * @brief Serves one all-gather for `nranks` ranks, then returns.
+ *
+ * A single epoll loop accepts connections and reads registrations without
+ * blocking, so slow ranks do not hold up the others.
+ *
+ * @param port TCP port to listen on, ignored when `unix_path` is set.
+ * @param unix_path Unix-domain socket path, or NULL for TCP.
+ * @param nranks Number of ranks expected.
+ * @return 0 on success, -1 on error.
+ */
+int bootstrap_server_run(uint16_t port, const char *unix_path, int nranks);
+
+/**
+ * @brief Registers this rank's address and receives the full table.
+ *
+ * Blocks until all ranks have registered.
+ *
+ * @param server Host name of the bootstrap server (TCP only).
+ * @param port TCP port of the bootstrap server.
+ * @param unix_path Unix-domain socket path, or NULL for TCP.
+ * @param rank This rank, in [0, nranks).
+ * @param nranks Total number of ranks.
+ * @param addr This rank's worker address.
+ * @param addr_len Length of `addr`.
+ * @param table Filled with every rank's address.
+ * @return 0 on success, -1 on error.
+ */
+int bootstrap_allgather(const char *server, uint16_t port,
+                        const char *unix_path, int rank, int nranks,
+                        const ucp_address_t *addr, size_t addr_len,
+                        struct bootstrap_table *table);
+
+#endif // MYUCXPLAYGROUND_BOOTSTRAP_H
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucp/api/ucp.h>
+#include <unistd.h> /* getopt */
+
+#include "bootstrap.h"
+#include "common_utils.h"
+#include "logger.h"
+#include "rank_endpoints.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+/**
+ * One rank of an N-rank job: registers its worker address with the bootstrap
+ * server and reports how long the all-gather took.
+ *
+ * With -k, each rank then sends one message to each of its next k ranks,
+ * creating endpoints on first use (or up front with -e), and reports the
+ * endpoint creation cost.
+ */
+
+#define RANK_TAG 0x1337a881u
+
+/* Sends to ranks rank+1..rank+k and receives from rank-1..rank-k */
+static int rank_neighbor_exchange(ucp_worker_h ucp_worker, int rank,
+                                  const struct bootstrap_table *table, int k,
+                                  int eager, const char *server, uint16_t port,
+                                  const char *unix_path,
+                                  const ucp_worker_attr_t *worker_attr) {
+  struct err_handling err_handling_opt = {UCP_ERR_HANDLING_MODE_NONE,
+                                          FAILURE_MODE_NONE};
+  RankEndpoints eps(ucp_worker, rank, table, err_handling_opt);
+  std::vector<struct ucx_context *> recv_reqs;
+  std::vector<int> neighbors;
+  std::vector<int> recv_buf(k);
+  struct bootstrap_table barrier_table;
+  ucp_request_param_t param;
+  ucs_status_t status;
+  int nranks = table->nranks;
+  int ret = 0;
+
+  for (int i = 1; i <= k; ++i) {
+    neighbors.push_back((rank + i) % nranks);
+  }
+
+  if (eager) {
+    status = eps.preconnect(neighbors);
+    CHKERR_JUMP(status != UCS_OK, "preconnect neighbors\n", err);
+  }
+
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_DATATYPE;
+  param.cb.recv = recv_handler;
+  param.datatype = ucp_dt_make_contig(1);
+  for (int i = 0; i < k; ++i) {
+    recv_reqs.push_back((struct ucx_context *)ucp_tag_recv_nbx(
+        ucp_worker, &recv_buf[i], sizeof(recv_buf[i]), RANK_TAG, UINT64_MAX,
+        &param));
+  }
+
+  for (int peer : neighbors) {
+    status = eps.send(peer, &rank, sizeof(rank), RANK_TAG);
+    CHKERR_ACTION(status != UCS_OK, "send to neighbor\n", ret = -1);
+  }
+
+  for (struct ucx_context *request : recv_reqs) {
+    status = ucx_wait(ucp_worker, request, "receive", "neighbor message");
+    CHKERR_ACTION(status != UCS_OK, "receive from neighbor\n", ret = -1);
+  }
+
+  eps.report();
+
+  /* Every rank has received all of its messages once it gets here, so the
+   * endpoints can be torn down without waiting on peers */
+  if (bootstrap_allgather(server, port, unix_path, rank, nranks,
+                          worker_attr->address, worker_attr->address_length,
+                          &barrier_table) != 0) {
+    ret = -1;
+  }
+
+  eps.close_all(UCP_EP_CLOSE_FLAG_FORCE);
+  return ret;
+
+err:
+  return -1;
+}
+
+static void print_rank_usage() {
+  fprintf(stderr, "Usage: run_bootstrap_rank -r <rank> -N <nranks> "
+                  "[parameters]\n");
+  fprintf(stderr, "\nParameters are:\n");
+  fprintf(stderr, "  -r <rank>     This rank (required)\n");
+  fprintf(stderr, "  -N <nranks>   Number of ranks (required)\n");
+  fprintf(stderr,
+          "  -n <name>     Bootstrap server host (default:localhost)\n");
+  fprintf(stderr, "  -p <port>     Bootstrap server port (default:%d)\n",
+          BOOTSTRAP_DEFAULT_PORT);
+  fprintf(stderr, "  -u <path>     Use the Unix-domain socket at <path>\n");
+  fprintf(stderr, "  -k <count>    Send to the next <count> ranks, creating "
+                  "endpoints on first\n");
+  fprintf(stderr, "                use; needs bootstrap_server -l for the "
+                  "exit barrier\n");
+  fprintf(stderr, "  -e            Connect to those ranks before sending\n");
+}
+
+int main(int argc, char **argv) {
+  const char *server = "localhost";
+  uint16_t port = BOOTSTRAP_DEFAULT_PORT;
+  const char *unix_path = NULL;
+  int rank = -1;
+  int nranks = 0;
+  int neighbors = 0;
+  int eager = 0;
+  int c;
+
+  ucp_params_t ucp_params;
+  ucp_worker_attr_t worker_attr;
+  ucp_worker_params_t worker_params;
+  ucp_config_t *config;
+  ucp_context_h ucp_context;
+  ucp_worker_h ucp_worker;
+  ucs_status_t status;
+  struct bootstrap_table table;
+  uint64_t start_ns, end_ns;
+  int ret = -1;
+
+  while ((c = getopt(argc, argv, "r:N:n:p:u:k:eh")) != -1) {
+    switch (c) {
+    case 'r':
+      rank = atoi(optarg);
+      break;
+    case 'N':
+      nranks = atoi(optarg);
+      break;
+    case 'n':
+      server = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'u':
+      unix_path = optarg;
+      break;
+    case 'k':
+      neighbors = atoi(optarg);
+      break;
+    case 'e':
+      eager = 1;
+      break;
+    case 'h':
+    default:
+      print_rank_usage();
+      return -1;
+    }
+  }
+
+  if ((nranks <= 0) || (rank < 0) || (rank >= nranks) || (neighbors < 0) ||
+      (neighbors >= nranks)) {
+    print_rank_usage();
+    return -1;
+  }
+
+  status = ucp_config_read(NULL, NULL, &config);
+  CHKERR_JUMP(status != UCS_OK, "ucp_config_read\n", err);
+
+  initialize_ucp_params(&ucp_params, "bootstrap rank");
+  initialize_ucp_worker_attr(&worker_attr);
+  initialize_ucp_worker_params(&worker_params);
+
+  status = ucp_init(&ucp_params, config, &ucp_context);
+  ucp_config_release(config);
+  CHKERR_JUMP(status != UCS_OK, "ucp_init\n", err);
+
+  status = ucp_worker_create(ucp_context, &worker_params, &ucp_worker);
+  CHKERR_JUMP(status != UCS_OK, "ucp_worker_create\n", err_cleanup);
+
+  status = ucp_worker_query(ucp_worker, &worker_attr);
+  CHKERR_JUMP(status != UCS_OK, "ucp_worker_query\n", err_worker);
+
+  start_ns = get_time_ns();
+  ret = bootstrap_allgather(server, port, unix_path, rank, nranks,
+                            worker_attr.address, worker_attr.address_length,
+                            &table);
+  end_ns = get_time_ns();
+  CHKERR_JUMP(ret != 0, "all-gather worker addresses\n", err_addr);
+
+  LOG_INFO("rank %d/%d: all-gather of %lu address bytes took %.3f ms\n", rank,
+           nranks, table.blob.size(), (end_ns - start_ns) / 1e6);
+
+  if (neighbors > 0) {
+    ret = rank_neighbor_exchange(ucp_worker, rank, &table, neighbors, eager,
+                                 server, port, unix_path, &worker_attr);
+    CHKERR_JUMP(ret != 0, "neighbor exchange\n", err_addr);
+  }
+
+err_addr:
+  ucp_worker_release_address(ucp_worker, worker_attr.address);
+err_worker:
+  ucp_worker_destroy(ucp_worker);
+err_cleanup:
+  ucp_cleanup(ucp_context);
+err:
+  return ret;
+}
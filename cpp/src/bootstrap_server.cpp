@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h> /* getopt */
+
+#include "bootstrap.h"
+#include "logger.h"
+
+static void print_bootstrap_usage() {
+  fprintf(stderr, "Usage: bootstrap_server -N <nranks> [parameters]\n");
+  fprintf(stderr, "Worker address all-gather service for N ranks\n");
+  fprintf(stderr, "\nParameters are:\n");
+  fprintf(stderr, "  -N <nranks>   Number of ranks to wait for (required)\n");
+  fprintf(stderr, "  -p <port>     TCP port to listen on (default:%d)\n",
+          BOOTSTRAP_DEFAULT_PORT);
+  fprintf(stderr, "  -u <path>     Listen on a Unix-domain socket instead\n");
+  fprintf(stderr, "  -l            Keep serving all-gathers until killed\n");
+}
+
+int main(int argc, char **argv) {
+  uint16_t port = BOOTSTRAP_DEFAULT_PORT;
+  const char *unix_path = NULL;
+  int nranks = 0;
+  int loop = 0;
+  int ret;
+  int c;
+
+  while ((c = getopt(argc, argv, "N:p:u:lh")) != -1) {
+    switch (c) {
+    case 'N':
+      nranks = atoi(optarg);
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'u':
+      unix_path = optarg;
+      break;
+    case 'l':
+      loop = 1;
+      break;
+    case 'h':
+    default:
+      print_bootstrap_usage();
+      return -1;
+    }
+  }
+
+  if (nranks <= 0) {
+    print_bootstrap_usage();
+    return -1;
+  }
+
+  do {
+    ret = bootstrap_server_run(port, unix_path, nranks);
+  } while (loop && (ret == 0));
+
+  return ret;
+}
@@ -0,0 +1,574 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucp/api/ucp.h>
+#include <unistd.h> /* getopt */
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "common_utils.h"
+#include "logger.h"
+#include "remote_counters.h"
+#include "tag_dispatcher.h"
+#include "tag_layout.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+/**
+ * Compares ways for many clients to share counters owned by one server.
+ *
+ * -m amo: every operation is a remote fetch-add on the server's
+ *         CounterRegion.
+ * -m rpc: every operation is a tag message that the server thread applies
+ *         to its counters and answers.
+ * -m ids: clients take IDs from an IdAllocator, one fetch-add per block.
+ *
+ * Each client thread has its own context and keeps -w operations in
+ * flight. The server runs in its own thread; with -i it does not progress
+ * its worker in amo and ids modes, which works when the transport does the
+ * atomics (shared memory, RDMA) and hangs when it emulates them (TCP).
+ */
+
+#define CB_RPC_CHANNEL 3
+#define CB_DEFAULT_THREADS 4
+#define CB_DEFAULT_COUNT 100000
+#define CB_DEFAULT_COUNTERS 1
+#define CB_DEFAULT_WINDOW 1
+#define CB_DEFAULT_BLOCK 1024
+
+typedef enum { CB_MODE_AMO, CB_MODE_RPC, CB_MODE_IDS } cb_mode_t;
+
+static const char *cb_mode_names[] = {"amo", "rpc", "ids"};
+
+struct cb_rpc_req {
+  uint32_t client;
+  uint32_t slot;
+  uint32_t index;
+  uint32_t reserved;
+  uint64_t value; /* to add */
+};
+
+struct cb_rpc_reply {
+  uint32_t slot;
+  uint32_t reserved;
+  uint64_t value; /* before the add */
+};
+
+struct cb_bench;
+
+struct cb_reply_slot {
+  struct cb_bench *bench;
+  struct cb_rpc_reply reply;
+};
+
+struct cb_client;
+
+/* An operation in flight */
+struct cb_op {
+  struct cb_client *client;
+  unsigned waits; /* rpc: send completion and reply */
+  uint64_t start_ns;
+  struct cb_rpc_req req;
+};
+
+struct cb_client {
+  struct cb_bench *bench;
+  unsigned id;
+  struct bench_side side; /* ep carries the rpc requests */
+  std::vector<struct cb_op> ops;
+  std::vector<struct cb_op *> free_ops;
+  long done;
+  int failed;
+  std::vector<uint64_t> latency_ns;
+  std::vector<uint64_t> ids;
+  uint64_t elapsed_ns;
+  int ret;
+};
+
+struct cb_bench {
+  cb_mode_t mode;
+  unsigned nclients;
+  long count; /* operations per client */
+  unsigned ncounters;
+  unsigned window;
+  uint64_t block;
+  bool idle_server;
+  struct bench_side server; /* replies go on reply_eps */
+  CounterRegion *region;
+  std::vector<ucp_ep_h> reply_eps; /* per client */
+  std::vector<struct cb_reply_slot> reply_slots;
+  std::vector<struct cb_reply_slot *> free_replies;
+  uint64_t rpc_calls;
+  std::atomic<bool> stop;
+  std::vector<struct cb_client> clients;
+};
+
+static void print_cb_usage() {
+  fprintf(stderr, "Usage: run_counter_bench [parameters]\n");
+  fprintf(stderr, "\nParameters are:\n");
+  fprintf(stderr, "  -m <mode>     amo, rpc or ids (default: all)\n");
+  fprintf(stderr, "  -t <count>    Client threads (default:%d)\n",
+          CB_DEFAULT_THREADS);
+  fprintf(stderr, "  -n <count>    Operations per client (default:%d)\n",
+          CB_DEFAULT_COUNT);
+  fprintf(stderr, "  -k <count>    Counters, spread over the clients "
+                  "(default:%d)\n",
+          CB_DEFAULT_COUNTERS);
+  fprintf(stderr, "  -w <count>    Operations in flight per client "
+                  "(default:%d)\n",
+          CB_DEFAULT_WINDOW);
+  fprintf(stderr, "  -b <count>    IDs reserved per block (default:%d)\n",
+          CB_DEFAULT_BLOCK);
+  fprintf(stderr, "  -i            Do not progress the server in amo and "
+                  "ids modes\n");
+}
+
+static void cb_reply_done(void *request, ucs_status_t status,
+                          void *user_data) {
+  struct cb_reply_slot *slot = (struct cb_reply_slot *)user_data;
+
+  if (status != UCS_OK) {
+    LOG_ERROR("counter bench: reply failed (%s)\n",
+              ucs_status_string(status));
+  }
+  slot->bench->free_replies.push_back(slot);
+  ucp_request_free(request);
+}
+
+/* Server side of the RPC: apply the add and answer */
+static void cb_serve(void *arg, ucp_tag_t tag, void *buffer, size_t length) {
+  struct cb_bench *bench = (struct cb_bench *)arg;
+  const struct cb_rpc_req *req = (const struct cb_rpc_req *)buffer;
+  volatile uint64_t *counter = &bench->region->counters()[req->index];
+  ucp_request_param_t param;
+  struct cb_reply_slot *slot;
+  ucs_status_ptr_t request;
+
+  while (bench->free_replies.empty()) {
+    ucp_worker_progress(bench->server.ucp_worker);
+  }
+  slot = bench->free_replies.back();
+  bench->free_replies.pop_back();
+
+  slot->reply.slot = req->slot;
+  slot->reply.reserved = 0;
+  slot->reply.value = *counter;
+  *counter += req->value;
+  ++bench->rpc_calls;
+
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_USER_DATA;
+  param.cb.send = cb_reply_done;
+  param.user_data = slot;
+  request = ucp_tag_send_nbx(
+      bench->reply_eps[req->client], &slot->reply, sizeof(slot->reply),
+      tag_make(TAG_CLASS_CONTROL, CB_RPC_CHANNEL, 0, req->slot), &param);
+  if (UCS_PTR_IS_PTR(request)) {
+    return;
+  }
+  if (UCS_PTR_IS_ERR(request)) {
+    LOG_ERROR("counter bench: reply failed (%s)\n",
+              ucs_status_string(UCS_PTR_STATUS(request)));
+  }
+  bench->free_replies.push_back(slot);
+}
+
+static void *cb_server_thread(void *arg) {
+  struct cb_bench *bench = (struct cb_bench *)arg;
+  TagDispatcher dispatcher(bench->server.ucp_worker);
+  ucs_status_t status;
+
+  if (bench->mode == CB_MODE_RPC) {
+    status = dispatcher.add_channel(TAG_CLASS_CONTROL, CB_RPC_CHANNEL,
+                                    sizeof(struct cb_rpc_req),
+                                    bench->nclients * bench->window,
+                                    cb_serve, bench);
+    CHKERR_ACTION(status != UCS_OK, "post rpc receives\n", return NULL);
+  }
+
+  while (!bench->stop.load()) {
+    if (bench->mode == CB_MODE_RPC) {
+      dispatcher.progress();
+    } else if (!bench->idle_server) {
+      ucp_worker_progress(bench->server.ucp_worker);
+    }
+  }
+
+  /* Replies still in flight hold slots */
+  while (bench->free_replies.size() < bench->reply_slots.size()) {
+    ucp_worker_progress(bench->server.ucp_worker);
+  }
+  return NULL;
+}
+
+static void cb_op_done(struct cb_op *op) {
+  struct cb_client *client = op->client;
+
+  if (--op->waits > 0) {
+    return;
+  }
+  client->latency_ns.push_back(get_time_ns() - op->start_ns);
+  ++client->done;
+  client->free_ops.push_back(op);
+}
+
+static void cb_amo_done(void *arg, ucs_status_t status, uint64_t value) {
+  struct cb_op *op = (struct cb_op *)arg;
+
+  if (status != UCS_OK) {
+    op->client->failed = 1;
+  }
+  cb_op_done(op);
+}
+
+static void cb_rpc_sent(void *request, ucs_status_t status, void *user_data) {
+  struct cb_op *op = (struct cb_op *)user_data;
+
+  if (status != UCS_OK) {
+    LOG_ERROR("counter bench: request failed (%s)\n",
+              ucs_status_string(status));
+    op->client->failed = 1;
+  }
+  cb_op_done(op);
+  ucp_request_free(request);
+}
+
+static void cb_rpc_reply(void *arg, ucp_tag_t tag, void *buffer,
+                         size_t length) {
+  struct cb_client *client = (struct cb_client *)arg;
+  const struct cb_rpc_reply *reply = (const struct cb_rpc_reply *)buffer;
+
+  cb_op_done(&client->ops[reply->slot]);
+}
+
+static ucs_status_t cb_rpc_call(struct cb_client *client, struct cb_op *op,
+                                unsigned index) {
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+
+  op->waits = 2;
+  op->req.client = client->id;
+  op->req.slot = op - client->ops.data();
+  op->req.index = index;
+  op->req.reserved = 0;
+  op->req.value = 1;
+
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_USER_DATA;
+  param.cb.send = cb_rpc_sent;
+  param.user_data = op;
+  request = ucp_tag_send_nbx(
+      client->side.ep, &op->req, sizeof(op->req),
+      tag_make(TAG_CLASS_CONTROL, CB_RPC_CHANNEL, client->id, op->req.slot),
+      &param);
+  if (UCS_PTR_IS_ERR(request)) {
+    return UCS_PTR_STATUS(request);
+  }
+  if (request == NULL) {
+    --op->waits;
+  }
+  return UCS_OK;
+}
+
+static void *cb_client_thread(void *arg) {
+  struct cb_client *client = (struct cb_client *)arg;
+  struct cb_bench *bench = client->bench;
+  const std::vector<char> &desc = bench->region->desc();
+  CounterClient counters(client->side.ucp_worker);
+  TagDispatcher dispatcher(client->side.ucp_worker);
+  IdAllocator *ids = NULL;
+  ucs_status_t status;
+  struct cb_op *op;
+  uint64_t start_ns, id;
+  long issued = 0;
+  unsigned index;
+
+  status = counters.connect(bench->server.worker_attr.address, desc.data(),
+                            desc.size());
+  CHKERR_ACTION(status != UCS_OK, "connect to the counters\n", return NULL);
+  if (bench->mode == CB_MODE_RPC) {
+    status = dispatcher.add_channel(TAG_CLASS_CONTROL, CB_RPC_CHANNEL,
+                                    sizeof(struct cb_rpc_reply),
+                                    bench->window, cb_rpc_reply, client);
+    CHKERR_ACTION(status != UCS_OK, "post rpc receives\n", return NULL);
+  } else if (bench->mode == CB_MODE_IDS) {
+    ids = new IdAllocator(&counters, 0, bench->block);
+  }
+
+  start_ns = get_time_ns();
+  while ((client->done < bench->count) && !client->failed) {
+    if (ids != NULL) {
+      /* Most IDs are local; time each one */
+      op = client->free_ops.back();
+      client->free_ops.pop_back();
+      op->waits = 1;
+      op->start_ns = get_time_ns();
+      status = ids->next(&id);
+      if (status != UCS_OK) {
+        client->free_ops.push_back(op);
+        client->failed = 1;
+        break;
+      }
+      client->ids.push_back(id);
+      cb_op_done(op);
+      continue;
+    }
+
+    while ((issued < bench->count) && !client->free_ops.empty()) {
+      op = client->free_ops.back();
+      client->free_ops.pop_back();
+      index = (client->id + issued) % bench->ncounters;
+      op->start_ns = get_time_ns();
+      if (bench->mode == CB_MODE_AMO) {
+        op->waits = 1;
+        status = counters.fetch_add(index, 1, cb_amo_done, op);
+      } else {
+        status = cb_rpc_call(client, op, index);
+      }
+      if (status != UCS_OK) {
+        client->free_ops.push_back(op);
+        client->failed = 1;
+        break;
+      }
+      ++issued;
+    }
+    dispatcher.progress();
+  }
+  client->elapsed_ns = get_time_ns() - start_ns;
+
+  delete ids;
+  while (client->free_ops.size() < client->ops.size()) {
+    dispatcher.progress();
+  }
+  status = counters.close();
+  client->ret = (!client->failed && (status == UCS_OK)) ? 0 : -1;
+  return NULL;
+}
+
+static int cb_check(struct cb_bench *bench) {
+  std::vector<uint64_t> ids;
+  uint64_t total = 0;
+  unsigned i;
+
+  if (bench->mode == CB_MODE_IDS) {
+    for (struct cb_client &client : bench->clients) {
+      ids.insert(ids.end(), client.ids.begin(), client.ids.end());
+    }
+    std::sort(ids.begin(), ids.end());
+    if (std::adjacent_find(ids.begin(), ids.end()) != ids.end()) {
+      LOG_ERROR("counter bench: an ID was handed out twice\n");
+      return -1;
+    }
+    return 0;
+  }
+
+  for (i = 0; i < bench->ncounters; ++i) {
+    total += bench->region->counters()[i];
+  }
+  if (total != (uint64_t)bench->count * bench->nclients) {
+    LOG_ERROR("counter bench: counters sum to %lu, expected %lu\n", total,
+              (uint64_t)bench->count * bench->nclients);
+    return -1;
+  }
+  return 0;
+}
+
+static int cb_run(struct cb_bench *bench, cb_mode_t mode) {
+  std::vector<pthread_t> threads(bench->nclients);
+  std::vector<uint64_t> latency_ns;
+  CounterRegion region(bench->server.ucp_context, bench->ncounters);
+  pthread_t server_thread;
+  uint64_t elapsed_ns = 0;
+  unsigned i;
+  int ret = 0;
+
+  CHKERR_ACTION(region.init() != 0, "initialize counters\n", return -1);
+  bench->mode = mode;
+  bench->region = &region;
+  bench->rpc_calls = 0;
+  bench->stop.store(false);
+  for (struct cb_client &client : bench->clients) {
+    client.free_ops.clear();
+    for (struct cb_op &op : client.ops) {
+      op.client = &client;
+      client.free_ops.push_back(&op);
+    }
+    client.done = 0;
+    client.failed = 0;
+    client.latency_ns.clear();
+    client.ids.clear();
+    client.elapsed_ns = 0;
+    client.ret = -1;
+  }
+
+  CHKERR_ACTION(pthread_create(&server_thread, NULL, cb_server_thread,
+                               bench) != 0,
+                "create server thread\n", return -1);
+  for (i = 0; i < bench->nclients; ++i) {
+    /* Started threads never return; leave them to process exit */
+    CHKERR_ACTION(pthread_create(&threads[i], NULL, cb_client_thread,
+                                 &bench->clients[i]) != 0,
+                  "create client thread\n", return -1);
+  }
+  for (i = 0; i < bench->nclients; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  bench->stop.store(true);
+  pthread_join(server_thread, NULL);
+
+  for (struct cb_client &client : bench->clients) {
+    if (client.ret != 0) {
+      ret = -1;
+    }
+    elapsed_ns = std::max(elapsed_ns, client.elapsed_ns);
+    latency_ns.insert(latency_ns.end(), client.latency_ns.begin(),
+                      client.latency_ns.end());
+  }
+  if ((ret != 0) || (cb_check(bench) != 0)) {
+    return -1;
+  }
+
+  log_flush();
+  printf("%-5s %12.0f %10.2f %10.2f %10.2f %12lu\n", cb_mode_names[mode],
+         bench->count * bench->nclients / (elapsed_ns / 1e9),
+         percentile_us(latency_ns, 0.5), percentile_us(latency_ns, 0.99),
+         percentile_us(latency_ns, 0.999), bench->rpc_calls);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  struct cb_bench bench;
+  std::vector<cb_mode_t> modes;
+  ucs_status_t status;
+  unsigned i, mode;
+  int ret = -1;
+  int c;
+
+  bench.nclients = CB_DEFAULT_THREADS;
+  bench.count = CB_DEFAULT_COUNT;
+  bench.ncounters = CB_DEFAULT_COUNTERS;
+  bench.window = CB_DEFAULT_WINDOW;
+  bench.block = CB_DEFAULT_BLOCK;
+  bench.idle_server = false;
+
+  while ((c = getopt(argc, argv, "m:t:n:k:w:b:ih")) != -1) {
+    switch (c) {
+    case 'm':
+      for (mode = 0; mode < 3; ++mode) {
+        if (!strcmp(optarg, cb_mode_names[mode])) {
+          break;
+        }
+      }
+      if (mode == 3) {
+        print_cb_usage();
+        return -1;
+      }
+      modes.push_back((cb_mode_t)mode);
+      break;
+    case 't':
+      bench.nclients = atoi(optarg);
+      break;
+    case 'n':
+      bench.count = atol(optarg);
+      break;
+    case 'k':
+      bench.ncounters = atoi(optarg);
+      break;
+    case 'w':
+      bench.window = atoi(optarg);
+      break;
+    case 'b':
+      bench.block = strtoull(optarg, NULL, 0);
+      break;
+    case 'i':
+      bench.idle_server = true;
+      break;
+    case 'h':
+    default:
+      print_cb_usage();
+      return -1;
+    }
+  }
+
+  if ((bench.nclients == 0) || (bench.nclients > TAG_RANK.max()) ||
+      (bench.count <= 0) || (bench.ncounters == 0) || (bench.window == 0) ||
+      (bench.window > COUNTER_CLIENT_MAX_OPS) || (bench.block == 0)) {
+    print_cb_usage();
+    return -1;
+  }
+  if (modes.empty()) {
+    modes = {CB_MODE_AMO, CB_MODE_RPC, CB_MODE_IDS};
+  }
+
+  bench.clients.resize(bench.nclients);
+  for (i = 0; i < bench.nclients; ++i) {
+    bench.clients[i].bench = &bench;
+    bench.clients[i].id = i;
+    bench.clients[i].side.ucp_worker = NULL;
+    bench.clients[i].side.ep = NULL;
+    bench.clients[i].ops.resize(bench.window);
+  }
+  bench.reply_slots.resize(bench.nclients * bench.window);
+  for (struct cb_reply_slot &slot : bench.reply_slots) {
+    slot.bench = &bench;
+    bench.free_replies.push_back(&slot);
+  }
+
+  ret = bench_init_side(&bench.server, "counter server",
+                        UCP_FEATURE_TAG | UCP_FEATURE_AMO64);
+  CHKERR_JUMP(ret != 0, "initialize server\n", err);
+
+  for (struct cb_client &client : bench.clients) {
+    ucp_ep_h ep;
+
+    ret = bench_init_side(&client.side, "counter client",
+                          UCP_FEATURE_TAG | UCP_FEATURE_AMO64);
+    CHKERR_ACTION(ret != 0, "initialize client\n",
+                  client.side.ucp_worker = NULL;
+                  goto err_cleanup);
+
+    ret = -1;
+    status = bench_connect(&client.side, &bench.server, &client.side.ep);
+    ep = NULL;
+    if (status == UCS_OK) {
+      status = bench_connect(&bench.server, &client.side, &ep);
+      bench.reply_eps.push_back(ep);
+    }
+    CHKERR_JUMP(status != UCS_OK, "connect client\n", err_cleanup);
+  }
+
+  log_flush();
+  printf("\n%u clients, %ld operations each, %u counters, %u in flight; "
+         "latencies in us\n",
+         bench.nclients, bench.count, bench.ncounters, bench.window);
+  printf("%-5s %12s %10s %10s %10s %12s\n", "mode", "ops/s", "p50", "p99",
+         "p99.9", "server rpcs");
+  for (cb_mode_t run_mode : modes) {
+    ret = cb_run(&bench, run_mode);
+    if (ret != 0) {
+      break;
+    }
+  }
+
+err_cleanup:
+  for (ucp_ep_h ep : bench.reply_eps) {
+    if (ep != NULL) {
+      ep_close(bench.server.ucp_worker, ep, UCP_EP_CLOSE_FLAG_FORCE);
+    }
+  }
+  for (struct cb_client &client : bench.clients) {
+    if (client.side.ep != NULL) {
+      ep_close(client.side.ucp_worker, client.side.ep,
+               UCP_EP_CLOSE_FLAG_FORCE);
+    }
+    if (client.side.ucp_worker != NULL) {
+      bench_cleanup_side(&client.side);
+    }
+  }
+  bench_cleanup_side(&bench.server);
+err:
+  return ret;
+}
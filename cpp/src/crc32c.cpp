@@ -0,0 +1,222 @@
+#include "crc32c.h"
+
+#include <string.h>
+
+#include <mutex>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HW_TARGET __attribute__((target("sse4.2")))
+#define CRC32C_HW_U8(_crc, _v) _mm_crc32_u8(_crc, _v)
+#define CRC32C_HW_U64(_crc, _v) ((uint32_t)_mm_crc32_u64(_crc, _v))
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_HW_TARGET
+#define CRC32C_HW_U8(_crc, _v) __crc32cb(_crc, _v)
+#define CRC32C_HW_U64(_crc, _v) __crc32cd(_crc, _v)
+#endif
+
+/* Reflected CRC-32C polynomial */
+#define CRC32C_POLY 0x82f63b78u
+
+/* Block sizes of the three interleaved hardware streams */
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+static uint32_t crc32c_table[256];
+/* Operators that append CRC32C_LONG/CRC32C_SHORT zero bytes to a CRC, used
+ * to combine the interleaved streams */
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+static std::once_flag crc32c_init_flag;
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+  uint32_t sum = 0;
+
+  while (vec) {
+    if (vec & 1) {
+      sum ^= *mat;
+    }
+    vec >>= 1;
+    mat++;
+  }
+
+  return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+  for (int n = 0; n < 32; n++) {
+    square[n] = gf2_matrix_times(mat, mat[n]);
+  }
+}
+
+/* Builds the operator for appending `len` zero bytes; `len` must be a power
+ * of two */
+static void crc32c_zeros_op(uint32_t *even, size_t len) {
+  uint32_t odd[32];
+  uint32_t row = 1;
+
+  /* Operator for one zero bit */
+  odd[0] = CRC32C_POLY;
+  for (int n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+
+  /* Two, then four zero bits */
+  gf2_matrix_square(even, odd);
+  gf2_matrix_square(odd, even);
+
+  /* Each square doubles the number of zero bits, starting at one byte */
+  do {
+    gf2_matrix_square(even, odd);
+    len >>= 1;
+    if (len == 0) {
+      return;
+    }
+    gf2_matrix_square(odd, even);
+    len >>= 1;
+  } while (len);
+
+  memcpy(even, odd, sizeof(odd));
+}
+
+static void crc32c_zeros(uint32_t zeros[][256], size_t len) {
+  uint32_t op[32];
+
+  crc32c_zeros_op(op, len);
+  for (uint32_t n = 0; n < 256; n++) {
+    zeros[0][n] = gf2_matrix_times(op, n);
+    zeros[1][n] = gf2_matrix_times(op, n << 8);
+    zeros[2][n] = gf2_matrix_times(op, n << 16);
+    zeros[3][n] = gf2_matrix_times(op, n << 24);
+  }
+}
+
+static uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc) {
+  return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+         zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static void crc32c_init() {
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t crc = n;
+    for (int k = 0; k < 8; k++) {
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    crc32c_table[n] = crc;
+  }
+
+  crc32c_zeros(crc32c_long, CRC32C_LONG);
+  crc32c_zeros(crc32c_short, CRC32C_SHORT);
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+  const unsigned char *next = static_cast<const unsigned char *>(buf);
+
+  std::call_once(crc32c_init_flag, crc32c_init);
+
+  crc = ~crc;
+  while (len--) {
+    crc = crc32c_table[(crc ^ *next++) & 0xff] ^ (crc >> 8);
+  }
+
+  return ~crc;
+}
+
+#ifdef CRC32C_HW_U64
+static inline uint64_t crc32c_load64(const unsigned char *p) {
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+CRC32C_HW_TARGET
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+  const unsigned char *next = static_cast<const unsigned char *>(buf);
+  const unsigned char *end;
+  uint64_t crc0, crc1, crc2;
+
+  crc0 = ~crc;
+
+  while (len && ((uintptr_t)next & 7) != 0) {
+    crc0 = CRC32C_HW_U8((uint32_t)crc0, *next);
+    next++;
+    len--;
+  }
+
+  while (len >= CRC32C_LONG * 3) {
+    crc1 = 0;
+    crc2 = 0;
+    end = next + CRC32C_LONG;
+    do {
+      crc0 = CRC32C_HW_U64((uint32_t)crc0, crc32c_load64(next));
+      crc1 = CRC32C_HW_U64((uint32_t)crc1,
+                           crc32c_load64(next + CRC32C_LONG));
+      crc2 = CRC32C_HW_U64((uint32_t)crc2,
+                           crc32c_load64(next + CRC32C_LONG * 2));
+      next += 8;
+    } while (next < end);
+    crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc1;
+    crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc2;
+    next += CRC32C_LONG * 2;
+    len -= CRC32C_LONG * 3;
+  }
+
+  while (len >= CRC32C_SHORT * 3) {
+    crc1 = 0;
+    crc2 = 0;
+    end = next + CRC32C_SHORT;
+    do {
+      crc0 = CRC32C_HW_U64((uint32_t)crc0, crc32c_load64(next));
+      crc1 = CRC32C_HW_U64((uint32_t)crc1,
+                           crc32c_load64(next + CRC32C_SHORT));
+      crc2 = CRC32C_HW_U64((uint32_t)crc2,
+                           crc32c_load64(next + CRC32C_SHORT * 2));
+      next += 8;
+    } while (next < end);
+    crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc1;
+    crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc2;
+    next += CRC32C_SHORT * 2;
+    len -= CRC32C_SHORT * 3;
+  }
+
+  while (len >= 8) {
+    crc0 = CRC32C_HW_U64((uint32_t)crc0, crc32c_load64(next));
+    next += 8;
+    len -= 8;
+  }
+
+  while (len) {
+    crc0 = CRC32C_HW_U8((uint32_t)crc0, *next);
+    next++;
+    len--;
+  }
+
+  return ~(uint32_t)crc0;
+}
+#endif
+
+int crc32c_hw_available() {
+#if defined(__x86_64__)
+  return __builtin_cpu_supports("sse4.2") != 0;
+#elif defined(CRC32C_HW_U64)
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+#ifdef CRC32C_HW_U64
+  static const int hw = crc32c_hw_available();
+
+  if (hw) {
+    std::call_once(crc32c_init_flag, crc32c_init);
+    return crc32c_hw(crc, buf, len);
+  }
+#endif
+
+  return crc32c_sw(crc, buf, len);
+}
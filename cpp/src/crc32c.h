@@ -0,0 +1,32 @@
+#ifndef MYUCXPLAYGROUND_CRC32C_H
+#define MYUCXPLAYGROUND_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Computes the CRC32C (Castagnoli) checksum of a buffer.
+ *
+ * Uses the SSE4.2 (x86-64) or ARMv8 CRC32 instructions when the CPU has them,
+ * running three independent streams to hide the instruction latency, and a
+ * table driven implementation otherwise.
+ *
+ * @param crc The CRC of the preceding data, or 0 to start a new checksum.
+ * @param buf Host memory to checksum.
+ * @param len Number of bytes.
+ * @return The updated CRC.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * @brief Portable implementation, exposed so the accelerated path can be
+ * checked against it.
+ */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * @brief Returns 1 if crc32c() uses hardware instructions on this CPU.
+ */
+int crc32c_hw_available();
+
+#endif // MYUCXPLAYGROUND_CRC32C_H
@@ -0,0 +1,365 @@
+#include "credit_flow.h"
+#include "logger.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+#include <algorithm>
+
+static ucs_status_t credit_post_recv(ucp_worker_h ucp_worker, void *buffer,
+                                     size_t length, ucp_tag_t tag,
+                                     struct ucx_context **request_p) {
+  ucp_request_param_t param;
+  void *request;
+
+  /* Always get a request back, so completion is seen in one place */
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_DATATYPE |
+                       UCP_OP_ATTR_FLAG_NO_IMM_CMPL;
+  param.datatype = ucp_dt_make_contig(1);
+  param.cb.recv = recv_handler;
+  request =
+      ucp_tag_recv_nbx(ucp_worker, buffer, length, tag, UINT64_MAX, &param);
+  if (UCS_PTR_IS_ERR(request)) {
+    return UCS_PTR_STATUS(request);
+  }
+
+  *request_p = (struct ucx_context *)request;
+  return UCS_OK;
+}
+
+static void credit_cancel_recv(ucp_worker_h ucp_worker,
+                               struct ucx_context *request) {
+  ucp_request_cancel(ucp_worker, request);
+  while (!request->completed) {
+    ucp_worker_progress(ucp_worker);
+  }
+
+  request->completed = 0;
+  ucp_request_free(request);
+}
+
+static bool credit_stopped(const std::atomic<bool> *stop, const char *what) {
+  if ((stop != NULL) && stop->load()) {
+    LOG_WARN("%s: stopped\n", what);
+    return true;
+  }
+
+  return false;
+}
+
+static ucs_status_t credit_send(ucp_worker_h ucp_worker, ucp_ep_h ep,
+                                const void *buffer, size_t length,
+                                ucp_tag_t tag, const char *data_str) {
+  ucp_request_param_t param;
+  struct ucx_context *request;
+
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_USER_DATA;
+  param.cb.send = send_handler;
+  param.user_data = (void *)data_str;
+  request = (struct ucx_context *)ucp_tag_send_nbx(ep, buffer, length, tag,
+                                                   &param);
+  return ucx_wait(ucp_worker, request, "send", data_str);
+}
+
+CreditSender::CreditSender(ucp_worker_h ucp_worker, ucp_ep_h ep,
+                           ucp_tag_t data_tag, ucp_tag_t credit_tag,
+                           credit_policy_t policy, size_t max_queue)
+    : ucp_worker_(ucp_worker), ep_(ep), data_tag_(data_tag),
+      credit_tag_(credit_tag), policy_(policy), max_queue_(max_queue),
+      credits_(0), max_length_(0), grant_(), credit_req_(NULL), stop_(NULL),
+      stats_() {}
+
+CreditSender::~CreditSender() {
+  /* Sends cannot be cancelled; they hold on to their buffers until done */
+  while (!inflight_.empty()) {
+    ucp_worker_progress(ucp_worker_);
+    reap_sends();
+  }
+
+  if (credit_req_ != NULL) {
+    credit_cancel_recv(ucp_worker_, credit_req_);
+  }
+
+  LOG_INFO("credit sender: %lu sent, %lu stalls (%.3f ms), %lu queued "
+           "(max depth %lu), %lu grants, max %lu in flight\n",
+           stats_.sent, stats_.stalls, stats_.stall_ns / 1e6, stats_.queued,
+           stats_.max_queue_depth, stats_.grants, stats_.max_inflight);
+}
+
+ucs_status_t CreditSender::start() { return post_credit_recv(); }
+
+ucs_status_t CreditSender::post_credit_recv() {
+  return credit_post_recv(ucp_worker_, &grant_, sizeof(grant_), credit_tag_,
+                          &credit_req_);
+}
+
+ucs_status_t CreditSender::poll_credits() {
+  ucs_status_t status;
+
+  if ((credit_req_ == NULL) || !credit_req_->completed) {
+    return UCS_OK;
+  }
+
+  credit_req_->completed = 0;
+  status = ucp_request_check_status(credit_req_);
+  ucp_request_free(credit_req_);
+  credit_req_ = NULL;
+  if (status != UCS_OK) {
+    LOG_ERROR("credit grant receive failed (%s)\n",
+              ucs_status_string(status));
+    return status;
+  }
+
+  credits_ += grant_.credits;
+  max_length_ = grant_.max_length;
+  ++stats_.grants;
+  return post_credit_recv();
+}
+
+ucs_status_t CreditSender::reap_sends() {
+  ucs_status_t status = UCS_OK;
+  struct ucx_context *request;
+
+  /* Sends on one endpoint complete in order */
+  while (!inflight_.empty() && inflight_.front().request->completed) {
+    request = inflight_.front().request;
+    request->completed = 0;
+    if (status == UCS_OK) {
+      status = ucp_request_check_status(request);
+    }
+    ucp_request_free(request);
+    inflight_.pop_front();
+  }
+
+  if (status != UCS_OK) {
+    LOG_ERROR("unable to send credited message (%s)\n",
+              ucs_status_string(status));
+  }
+  return status;
+}
+
+ucs_status_t CreditSender::send_now(const void *buffer, size_t length,
+                                    std::vector<char> *data) {
+  ucp_request_param_t param;
+  void *request;
+
+  if (length > max_length_) {
+    return UCS_ERR_EXCEEDS_LIMIT;
+  }
+
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_USER_DATA;
+  param.cb.send = send_handler;
+  param.user_data = (void *)"credited message";
+  request = ucp_tag_send_nbx(ep_, buffer, length, data_tag_, &param);
+  if (UCS_PTR_IS_ERR(request)) {
+    LOG_ERROR("unable to send credited message (%s)\n",
+              ucs_status_string(UCS_PTR_STATUS(request)));
+    return UCS_PTR_STATUS(request);
+  }
+
+  --credits_;
+  ++stats_.sent;
+  if (request != NULL) {
+    inflight_.push_back({(struct ucx_context *)request, {}});
+    if (data != NULL) {
+      inflight_.back().data.swap(*data);
+    }
+    stats_.max_inflight =
+        std::max<uint64_t>(stats_.max_inflight, inflight_.size());
+  }
+
+  return UCS_OK;
+}
+
+ucs_status_t CreditSender::progress() {
+  ucs_status_t status;
+
+  status = reap_sends();
+  if (status != UCS_OK) {
+    return status;
+  }
+
+  status = poll_credits();
+  if (status != UCS_OK) {
+    return status;
+  }
+
+  while ((credits_ > 0) && !queue_.empty()) {
+    status = send_now(queue_.front().data(), queue_.front().size(),
+                      &queue_.front());
+    if (status != UCS_OK) {
+      return status;
+    }
+    queue_.pop_front();
+  }
+
+  return UCS_OK;
+}
+
+ucs_status_t CreditSender::send(const void *buffer, size_t length) {
+  uint64_t start_ns;
+  ucs_status_t status;
+
+  status = progress();
+  if (status != UCS_OK) {
+    return status;
+  }
+
+  if ((max_length_ != 0) && (length > max_length_)) {
+    return UCS_ERR_EXCEEDS_LIMIT;
+  }
+
+  /* Queued messages go first to keep the stream in order */
+  if ((credits_ > 0) && queue_.empty()) {
+    return send_now(buffer, length, NULL);
+  }
+
+  ++stats_.stalls;
+  if ((policy_ == CREDIT_POLICY_QUEUE) && (queue_.size() < max_queue_)) {
+    const char *data = static_cast<const char *>(buffer);
+    queue_.emplace_back(data, data + length);
+    ++stats_.queued;
+    stats_.max_queue_depth =
+        std::max<uint64_t>(stats_.max_queue_depth, queue_.size());
+    return UCS_OK;
+  }
+
+  start_ns = get_time_ns();
+  while ((credits_ == 0) || !queue_.empty()) {
+    if (credit_stopped(stop_, "credit sender")) {
+      return UCS_ERR_CANCELED;
+    }
+    ucp_worker_progress(ucp_worker_);
+    status = progress();
+    if (status != UCS_OK) {
+      return status;
+    }
+  }
+  stats_.stall_ns += get_time_ns() - start_ns;
+
+  return send_now(buffer, length, NULL);
+}
+
+ucs_status_t CreditSender::flush() {
+  ucs_status_t status;
+
+  while (!queue_.empty() || !inflight_.empty()) {
+    if (credit_stopped(stop_, "credit sender")) {
+      return UCS_ERR_CANCELED;
+    }
+    ucp_worker_progress(ucp_worker_);
+    status = progress();
+    if (status != UCS_OK) {
+      return status;
+    }
+  }
+
+  return UCS_OK;
+}
+
+CreditReceiver::CreditReceiver(ucp_worker_h ucp_worker, ucp_ep_h ep,
+                               ucp_tag_t data_tag, ucp_tag_t credit_tag,
+                               size_t nbufs, size_t buf_size,
+                               size_t grant_batch)
+    : ucp_worker_(ucp_worker), ep_(ep), data_tag_(data_tag),
+      credit_tag_(credit_tag), buf_size_(buf_size), slots_(nbufs), head_(0),
+      pending_credits_(0), grant_(), stop_(NULL), stats_() {
+  grant_batch_ = (grant_batch > 0) ? std::min(grant_batch, nbufs)
+                                   : std::max<size_t>(nbufs / 2, 1);
+
+  for (struct slot &slot : slots_) {
+    slot.buffer.resize(buf_size);
+    slot.request = NULL;
+  }
+}
+
+CreditReceiver::~CreditReceiver() {
+  for (struct slot &slot : slots_) {
+    if (slot.request != NULL) {
+      credit_cancel_recv(ucp_worker_, slot.request);
+    }
+  }
+
+  LOG_INFO("credit receiver: %lu received, %lu credits in %lu grants\n",
+           stats_.received, stats_.credits, stats_.grants);
+}
+
+ucs_status_t CreditReceiver::post_slot(struct slot *slot) {
+  return credit_post_recv(ucp_worker_, slot->buffer.data(), buf_size_,
+                          data_tag_, &slot->request);
+}
+
+ucs_status_t CreditReceiver::grant(uint32_t credits) {
+  ucs_status_t status;
+
+  grant_.credits = credits;
+  grant_.max_length = buf_size_;
+  status = credit_send(ucp_worker_, ep_, &grant_, sizeof(grant_), credit_tag_,
+                       "credit grant");
+  if (status == UCS_OK) {
+    ++stats_.grants;
+    stats_.credits += credits;
+  }
+
+  return status;
+}
+
+ucs_status_t CreditReceiver::start() {
+  ucs_status_t status;
+
+  for (struct slot &slot : slots_) {
+    status = post_slot(&slot);
+    if (status != UCS_OK) {
+      return status;
+    }
+  }
+
+  return grant(slots_.size());
+}
+
+ucs_status_t CreditReceiver::recv(void **data_p, size_t *length_p) {
+  struct slot *slot = &slots_[head_];
+  ucp_tag_recv_info_t info_tag;
+  ucs_status_t status;
+
+  while (!slot->request->completed) {
+    if (credit_stopped(stop_, "credit receiver")) {
+      return UCS_ERR_CANCELED;
+    }
+    ucp_worker_progress(ucp_worker_);
+  }
+
+  slot->request->completed = 0;
+  status = ucp_tag_recv_request_test(slot->request, &info_tag);
+  ucp_request_free(slot->request);
+  slot->request = NULL;
+  if (status != UCS_OK) {
+    LOG_ERROR("credited receive failed (%s)\n", ucs_status_string(status));
+    return status;
+  }
+
+  ++stats_.received;
+  *data_p = slot->buffer.data();
+  *length_p = info_tag.length;
+  return UCS_OK;
+}
+
+ucs_status_t CreditReceiver::release() {
+  struct slot *slot = &slots_[head_];
+  ucs_status_t status;
+
+  head_ = (head_ + 1) % slots_.size();
+  status = post_slot(slot);
+  if (status != UCS_OK) {
+    return status;
+  }
+
+  if (++pending_credits_ >= grant_batch_) {
+    status = grant(pending_credits_);
+    pending_credits_ = 0;
+  }
+
+  return status;
+}
@@ -0,0 +1,212 @@
+#ifndef MYUCXPLAYGROUND_CREDIT_FLOW_H
+#define MYUCXPLAYGROUND_CREDIT_FLOW_H
+
+#include <ucp/api/ucp.h>
+
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "ucx_config.h"
+
+/**
+ * Credit-based flow control for a one-way tag stream between two endpoints.
+ *
+ * The receiver pre-posts a fixed set of buffers for `data_tag` and grants the
+ * sender one credit per buffer. The sender spends a credit per message, so
+ * every message lands in a posted buffer instead of UCX's unexpected queue,
+ * and receiver memory stays bounded by the buffers it chose to post. Credits
+ * flow back on `credit_tag` as buffers are consumed, batched to keep grant
+ * traffic off the steady-state path.
+ *
+ * Both classes are single threaded: use them from the thread that progresses
+ * their worker.
+ */
+
+/* What CreditSender::send() does when no credits are left */
+typedef enum {
+  CREDIT_POLICY_BLOCK, /* progress the worker until a grant arrives */
+  CREDIT_POLICY_QUEUE  /* copy the message and send it once granted */
+} credit_policy_t;
+
+/* Grant message from receiver to sender */
+struct credit_grant {
+  uint32_t credits;
+  uint32_t max_length; /* size of the receiver's posted buffers */
+};
+
+class CreditSender {
+
+public:
+  struct stats {
+    uint64_t sent;
+    uint64_t stalls;   /* send() calls that found no credit */
+    uint64_t stall_ns; /* time spent blocked waiting for credits */
+    uint64_t queued;   /* messages that went through the queue */
+    uint64_t max_queue_depth;
+    uint64_t grants; /* grant messages received */
+    uint64_t max_inflight; /* sends posted and not yet completed */
+  };
+
+  /**
+   * @param ucp_worker Worker that progresses `ep`.
+   * @param ep Endpoint to the receiver.
+   * @param data_tag Tag of data messages.
+   * @param credit_tag Tag the receiver grants credits on.
+   * @param policy What to do when out of credits.
+   * @param max_queue Queued messages allowed before send() blocks anyway
+   * (CREDIT_POLICY_QUEUE only).
+   */
+  CreditSender(ucp_worker_h ucp_worker, ucp_ep_h ep, ucp_tag_t data_tag,
+               ucp_tag_t credit_tag, credit_policy_t policy,
+               size_t max_queue);
+  ~CreditSender();
+
+  CreditSender(const CreditSender &) = delete;
+  CreditSender &operator=(const CreditSender &) = delete;
+
+  /**
+   * @brief Posts the receive for credit grants.
+   */
+  ucs_status_t start();
+
+  /**
+   * @brief Sends `length` bytes to the receiver, spending one credit.
+   *
+   * The send is only posted, so up to a window of them are in flight at
+   * once; `buffer` must stay unchanged until flush() returns. Queued
+   * messages are copied and need not.
+   *
+   * @return UCS_OK when the message was posted or queued,
+   * UCS_ERR_EXCEEDS_LIMIT if it does not fit the receiver's buffers, or the
+   * send error.
+   */
+  ucs_status_t send(const void *buffer, size_t length);
+
+  /**
+   * @brief Reaps completed sends, picks up grants and sends queued messages
+   * they allow.
+   */
+  ucs_status_t progress();
+
+  /**
+   * @brief Progresses until every queued message has been sent and every
+   * send has completed.
+   */
+  ucs_status_t flush();
+
+  /**
+   * @brief Makes send() and flush() give up with UCS_ERR_CANCELED once
+   * `stop` is set, e.g. because the receiver failed and will grant no more
+   * credits.
+   */
+  void set_stop(const std::atomic<bool> *stop) { stop_ = stop; }
+
+  uint32_t credits() const { return credits_; }
+  const struct stats &get_stats() const { return stats_; }
+
+private:
+  struct send_op {
+    struct ucx_context *request;
+    std::vector<char> data; /* the message, when it was queued */
+  };
+
+  ucs_status_t post_credit_recv();
+  ucs_status_t poll_credits();
+  ucs_status_t reap_sends();
+  ucs_status_t send_now(const void *buffer, size_t length,
+                        std::vector<char> *data);
+
+  ucp_worker_h ucp_worker_;
+  ucp_ep_h ep_;
+  ucp_tag_t data_tag_;
+  ucp_tag_t credit_tag_;
+  credit_policy_t policy_;
+  size_t max_queue_;
+  uint32_t credits_;
+  uint32_t max_length_;
+  struct credit_grant grant_;
+  struct ucx_context *credit_req_;
+  std::deque<std::vector<char>> queue_;
+  std::deque<struct send_op> inflight_; /* in posting order */
+  const std::atomic<bool> *stop_;
+  struct stats stats_;
+};
+
+class CreditReceiver {
+
+public:
+  struct stats {
+    uint64_t received;
+    uint64_t grants;  /* grant messages sent */
+    uint64_t credits; /* credits granted in total */
+  };
+
+  /**
+   * @param ucp_worker Worker that progresses `ep`.
+   * @param ep Endpoint to the sender, used for grants.
+   * @param data_tag Tag of data messages.
+   * @param credit_tag Tag to grant credits on.
+   * @param nbufs Buffers kept posted, i.e. the sender's credit window.
+   * @param buf_size Size of each buffer, the largest message accepted.
+   * @param grant_batch Released buffers to collect before sending a grant;
+   * 0 means half the window.
+   */
+  CreditReceiver(ucp_worker_h ucp_worker, ucp_ep_h ep, ucp_tag_t data_tag,
+                 ucp_tag_t credit_tag, size_t nbufs, size_t buf_size,
+                 size_t grant_batch);
+  ~CreditReceiver();
+
+  CreditReceiver(const CreditReceiver &) = delete;
+  CreditReceiver &operator=(const CreditReceiver &) = delete;
+
+  /**
+   * @brief Posts all buffers and grants the sender the full window.
+   */
+  ucs_status_t start();
+
+  /**
+   * @brief Waits for the next message in arrival order.
+   *
+   * The buffer stays valid until release() is called; only one message can
+   * be held at a time.
+   */
+  ucs_status_t recv(void **data_p, size_t *length_p);
+
+  /**
+   * @brief Re-posts the buffer returned by recv() and credits the sender.
+   */
+  ucs_status_t release();
+
+  /**
+   * @brief Makes recv() give up with UCS_ERR_CANCELED once `stop` is set,
+   * e.g. because the sender failed.
+   */
+  void set_stop(const std::atomic<bool> *stop) { stop_ = stop; }
+
+  const struct stats &get_stats() const { return stats_; }
+
+private:
+  struct slot {
+    std::vector<char> buffer;
+    struct ucx_context *request;
+  };
+
+  ucs_status_t post_slot(struct slot *slot);
+  ucs_status_t grant(uint32_t credits);
+
+  ucp_worker_h ucp_worker_;
+  ucp_ep_h ep_;
+  ucp_tag_t data_tag_;
+  ucp_tag_t credit_tag_;
+  size_t buf_size_;
+  size_t grant_batch_;
+  std::vector<struct slot> slots_;
+  size_t head_; /* posted first, so matched first */
+  uint32_t pending_credits_;
+  struct credit_grant grant_;
+  const std::atomic<bool> *stop_;
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_CREDIT_FLOW_H
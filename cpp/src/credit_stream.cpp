@@ -0,0 +1,360 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucp/api/ucp.h>
+#include <unistd.h> /* getopt */
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "common_utils.h"
+#include "credit_flow.h"
+#include "logger.h"
+#include "memory_utils.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+/**
+ * Streams tag messages from a fast sender thread to a slow receiver thread,
+ * with or without credit-based flow control, and reports throughput, sender
+ * stalls and how far the process RSS grew while the receiver fell behind.
+ */
+
+#define CREDIT_DATA_TAG 0x1337a8a0u
+#define CREDIT_GRANT_TAG 0x1337a8a1u
+#define CREDIT_DEFAULT_WINDOW 64
+#define CREDIT_DEFAULT_COUNT 100000
+#define CREDIT_DEFAULT_SIZE 4096
+#define CREDIT_DEFAULT_DELAY_NS 2000
+#define CREDIT_RSS_SAMPLE 256 /* messages between RSS samples */
+
+struct credit_bench {
+  struct bench_side sender;
+  struct bench_side receiver;
+  long count;
+  size_t msg_size;
+  size_t window; /* 0 disables flow control */
+  size_t grant_batch;
+  size_t max_queue; /* 0 blocks when out of credits */
+  uint64_t delay_ns;
+  std::atomic<int> barrier_count;
+  std::atomic<bool> stop; /* a side failed; the other stops waiting on it */
+  /* results */
+  uint64_t send_ns;
+  CreditSender::stats sender_stats;
+  size_t base_rss;
+  size_t peak_rss;
+  int ret[2];
+};
+
+static void print_credit_usage() {
+  fprintf(stderr, "Usage: run_credit_stream [parameters]\n");
+  fprintf(stderr, "\nParameters are:\n");
+  fprintf(stderr, "  -w <credits>  Receive buffers posted, 0 disables flow "
+                  "control (default:%d)\n",
+          CREDIT_DEFAULT_WINDOW);
+  fprintf(stderr, "  -b <count>    Credits returned per grant (default: half "
+                  "the window)\n");
+  fprintf(stderr, "  -q <depth>    Queue up to <depth> messages instead of "
+                  "blocking when out of credits\n");
+  fprintf(stderr, "  -n <count>    Messages to send (default:%d)\n",
+          CREDIT_DEFAULT_COUNT);
+  fprintf(stderr, "  -s <size>     Message size (default:%d)\n",
+          CREDIT_DEFAULT_SIZE);
+  fprintf(stderr, "  -d <ns>       Receiver work per message (default:%d)\n",
+          CREDIT_DEFAULT_DELAY_NS);
+}
+
+static void credit_sample_rss(struct credit_bench *bench, long i) {
+  if ((i % CREDIT_RSS_SAMPLE) == 0) {
+    bench->peak_rss = std::max(bench->peak_rss, mem_rss_bytes());
+  }
+}
+
+static void credit_consume(uint64_t delay_ns) {
+  uint64_t end_ns = get_time_ns() + delay_ns;
+
+  while (get_time_ns() < end_ns) {
+  }
+}
+
+/* Reaps the sends that completed, or waits for all of them */
+static ucs_status_t credit_reap(ucp_worker_h ucp_worker,
+                                std::deque<struct ucx_context *> *inflight,
+                                bool wait) {
+  ucs_status_t status = UCS_OK;
+  struct ucx_context *request;
+
+  while (!inflight->empty()) {
+    request = inflight->front();
+    if (!request->completed) {
+      if (!wait) {
+        break;
+      }
+      ucp_worker_progress(ucp_worker);
+      continue;
+    }
+
+    request->completed = 0;
+    if (status == UCS_OK) {
+      status = ucp_request_check_status(request);
+    }
+    ucp_request_free(request);
+    inflight->pop_front();
+  }
+
+  return status;
+}
+
+/* Without flow control: plain sends, posted without waiting, so nothing
+ * limits how far the sender runs ahead */
+static ucs_status_t
+credit_send_unbounded(struct credit_bench *bench, const void *buffer,
+                      std::deque<struct ucx_context *> *inflight) {
+  ucp_worker_h ucp_worker = bench->sender.ucp_worker;
+  ucp_request_param_t param;
+  void *request;
+
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_USER_DATA;
+  param.cb.send = send_handler;
+  param.user_data = (void *)"stream";
+  request = ucp_tag_send_nbx(bench->sender.ep, buffer, bench->msg_size,
+                             CREDIT_DATA_TAG, &param);
+  if (UCS_PTR_IS_ERR(request)) {
+    return UCS_PTR_STATUS(request);
+  } else if (request != NULL) {
+    inflight->push_back((struct ucx_context *)request);
+  }
+
+  ucp_worker_progress(ucp_worker);
+  return credit_reap(ucp_worker, inflight, false);
+}
+
+/* Without flow control: probe and receive, as UcpClient does */
+static ucs_status_t credit_recv_unbounded(struct credit_bench *bench,
+                                          void *buffer) {
+  ucp_worker_h ucp_worker = bench->receiver.ucp_worker;
+  ucp_request_param_t param;
+  ucp_tag_recv_info_t info_tag;
+  ucp_tag_message_h msg_tag;
+  struct ucx_context *request;
+
+  msg_tag = probe_wait(ucp_worker, CREDIT_DATA_TAG, UINT64_MAX,
+                       TEST_MODE_PROBE, NULL, &info_tag, 0, &bench->stop);
+  if (msg_tag == NULL) {
+    return UCS_ERR_IO_ERROR;
+  }
+
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_DATATYPE |
+                       UCP_OP_ATTR_FLAG_NO_IMM_CMPL;
+  param.datatype = ucp_dt_make_contig(1);
+  param.cb.recv = recv_handler;
+  request = (struct ucx_context *)ucp_tag_msg_recv_nbx(
+      ucp_worker, buffer, bench->msg_size, msg_tag, &param);
+  return ucx_wait(ucp_worker, request, "receive", "stream");
+}
+
+static void *credit_sender_thread(void *arg) {
+  struct credit_bench *bench = (struct credit_bench *)arg;
+  ucp_worker_h ucp_worker = bench->sender.ucp_worker;
+  std::vector<char> buffer(bench->msg_size, 'c');
+  std::deque<struct ucx_context *> inflight;
+  CreditSender sender(ucp_worker, bench->sender.ep, CREDIT_DATA_TAG,
+                      CREDIT_GRANT_TAG,
+                      (bench->max_queue > 0) ? CREDIT_POLICY_QUEUE
+                                             : CREDIT_POLICY_BLOCK,
+                      bench->max_queue);
+  uint64_t start_ns;
+  ucs_status_t status = UCS_OK;
+
+  sender.set_stop(&bench->stop);
+  if (bench->window > 0) {
+    status = sender.start();
+  }
+
+  start_ns = get_time_ns();
+  for (long i = 0; (i < bench->count) && (status == UCS_OK); ++i) {
+    if (bench->window > 0) {
+      status = sender.send(buffer.data(), buffer.size());
+    } else {
+      status = credit_send_unbounded(bench, buffer.data(), &inflight);
+    }
+  }
+  if (bench->window > 0) {
+    if (status == UCS_OK) {
+      status = sender.flush();
+    }
+  } else {
+    /* Sends cannot be cancelled, so wait for them even after an error */
+    if (credit_reap(ucp_worker, &inflight, true) != UCS_OK) {
+      status = UCS_ERR_IO_ERROR;
+    }
+  }
+  bench->send_ns = get_time_ns() - start_ns;
+  bench->sender_stats = sender.get_stats();
+  if (status != UCS_OK) {
+    bench->stop.store(true);
+  }
+
+  bench_barrier(&bench->barrier_count, 2, 1, ucp_worker);
+  bench->ret[0] = (status == UCS_OK) ? 0 : -1;
+  return NULL;
+}
+
+static void *credit_receiver_thread(void *arg) {
+  struct credit_bench *bench = (struct credit_bench *)arg;
+  ucp_worker_h ucp_worker = bench->receiver.ucp_worker;
+  std::vector<char> buffer(bench->msg_size);
+  CreditReceiver receiver(ucp_worker, bench->receiver.ep, CREDIT_DATA_TAG,
+                          CREDIT_GRANT_TAG, bench->window, bench->msg_size,
+                          bench->grant_batch);
+  void *data;
+  size_t length;
+  ucs_status_t status = UCS_OK;
+
+  receiver.set_stop(&bench->stop);
+  if (bench->window > 0) {
+    status = receiver.start();
+  }
+
+  for (long i = 0; (i < bench->count) && (status == UCS_OK); ++i) {
+    credit_sample_rss(bench, i);
+    if (bench->window > 0) {
+      status = receiver.recv(&data, &length);
+      if (status == UCS_OK) {
+        credit_consume(bench->delay_ns);
+        status = receiver.release();
+      }
+    } else {
+      status = credit_recv_unbounded(bench, buffer.data());
+      credit_consume(bench->delay_ns);
+    }
+  }
+  if (status != UCS_OK) {
+    bench->stop.store(true);
+  }
+
+  bench_barrier(&bench->barrier_count, 2, 1, ucp_worker);
+  bench->ret[1] = (status == UCS_OK) ? 0 : -1;
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  struct credit_bench bench;
+  pthread_t sender_thread, receiver_thread;
+  ucs_status_t status;
+  double seconds;
+  int ret = -1;
+  int c;
+
+  bench.count = CREDIT_DEFAULT_COUNT;
+  bench.msg_size = CREDIT_DEFAULT_SIZE;
+  bench.window = CREDIT_DEFAULT_WINDOW;
+  bench.grant_batch = 0;
+  bench.max_queue = 0;
+  bench.delay_ns = CREDIT_DEFAULT_DELAY_NS;
+  bench.barrier_count.store(0);
+  bench.stop.store(false);
+  bench.send_ns = 0;
+  bench.sender_stats = CreditSender::stats();
+  bench.ret[0] = bench.ret[1] = -1;
+
+  while ((c = getopt(argc, argv, "w:b:q:n:s:d:h")) != -1) {
+    switch (c) {
+    case 'w':
+      bench.window = strtoul(optarg, NULL, 0);
+      break;
+    case 'b':
+      bench.grant_batch = strtoul(optarg, NULL, 0);
+      break;
+    case 'q':
+      bench.max_queue = strtoul(optarg, NULL, 0);
+      break;
+    case 'n':
+      bench.count = atol(optarg);
+      break;
+    case 's':
+      bench.msg_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'd':
+      bench.delay_ns = strtoull(optarg, NULL, 0);
+      break;
+    case 'h':
+    default:
+      print_credit_usage();
+      return -1;
+    }
+  }
+
+  if ((bench.count <= 0) || (bench.msg_size == 0)) {
+    print_credit_usage();
+    return -1;
+  }
+
+  ret = bench_init_side(&bench.sender, "credit sender", UCP_FEATURE_TAG);
+  CHKERR_JUMP(ret != 0, "initialize sender\n", err);
+
+  ret = bench_init_side(&bench.receiver, "credit receiver", UCP_FEATURE_TAG);
+  CHKERR_JUMP(ret != 0, "initialize receiver\n", err_sender);
+
+  ret = -1;
+  status = bench_connect(&bench.sender, &bench.receiver, &bench.sender.ep);
+  CHKERR_JUMP(status != UCS_OK, "connect sender\n", err_receiver);
+
+  status = bench_connect(&bench.receiver, &bench.sender, &bench.receiver.ep);
+  CHKERR_JUMP(status != UCS_OK, "connect receiver\n", err_sender_ep);
+
+  bench.base_rss = bench.peak_rss = mem_rss_bytes();
+
+  CHKERR_JUMP(pthread_create(&receiver_thread, NULL, credit_receiver_thread,
+                             &bench) != 0,
+              "create receiver thread\n", err_receiver_ep);
+  if (pthread_create(&sender_thread, NULL, credit_sender_thread, &bench) !=
+      0) {
+    fprintf(stderr, "Failed to create sender thread\n");
+    /* Stop the receiver waiting for messages, and stand in for the sender at
+     * the barrier */
+    bench.stop.store(true);
+    bench.barrier_count.fetch_add(1);
+    pthread_join(receiver_thread, NULL);
+    ret = -1;
+    goto err_receiver_ep;
+  }
+
+  pthread_join(sender_thread, NULL);
+  pthread_join(receiver_thread, NULL);
+  ret = (bench.ret[0] != 0) ? bench.ret[0] : bench.ret[1];
+
+  seconds = bench.send_ns / 1e9;
+  log_flush();
+  printf("\n%ld x %lu bytes, window %lu%s, receiver %lu ns/msg\n",
+         bench.count, bench.msg_size, bench.window,
+         (bench.window == 0) ? " (no flow control)" : "", bench.delay_ns);
+  printf("  send rate     %.0f msg/s, %.1f MB/s\n", bench.count / seconds,
+         bench.count * bench.msg_size / seconds / 1e6);
+  printf("  stalls        %lu (%.3f ms blocked), %lu queued, max depth %lu\n",
+         bench.sender_stats.stalls, bench.sender_stats.stall_ns / 1e6,
+         bench.sender_stats.queued, bench.sender_stats.max_queue_depth);
+  if (bench.window > 0) {
+    printf("  in flight     max %lu sends\n", bench.sender_stats.max_inflight);
+  }
+  printf("  peak RSS      +%.1f MB\n",
+         (bench.peak_rss - bench.base_rss) / 1e6);
+
+err_receiver_ep:
+  ep_close(bench.receiver.ucp_worker, bench.receiver.ep,
+           UCP_EP_CLOSE_FLAG_FORCE);
+err_sender_ep:
+  ep_close(bench.sender.ucp_worker, bench.sender.ep, UCP_EP_CLOSE_FLAG_FORCE);
+err_receiver:
+  bench_cleanup_side(&bench.receiver);
+err_sender:
+  bench_cleanup_side(&bench.sender);
+err:
+  return ret;
+}
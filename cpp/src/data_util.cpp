@@ -5,16 +5,63 @@
 #include "data_util.h"
 #include "common_utils.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define TEST_PATTERN_PERIOD 26
+#define TEST_PATTERN_VEC 16
+
+/* Two full periods of the pattern so that any 16-byte window starting inside
+ * the first period can be loaded without wrapping */
+static const char test_pattern[TEST_PATTERN_PERIOD * 2 + 1] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+void fill_test_pattern(char *dst, size_t length) {
+  size_t offset = 0;
+  size_t i = 0;
+
+  /* Every store is one unaligned load from the L1-resident pattern; the
+   * window start advances by 16 mod 26 per vector */
+#ifdef __SSE2__
+  for (; i + TEST_PATTERN_VEC <= length; i += TEST_PATTERN_VEC) {
+    __m128i v = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(test_pattern + offset));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), v);
+    offset += TEST_PATTERN_VEC;
+    if (offset >= TEST_PATTERN_PERIOD) {
+      offset -= TEST_PATTERN_PERIOD;
+    }
+  }
+#endif
+
+  for (; i < length; ++i) {
+    dst[i] = test_pattern[offset++];
+    if (offset == TEST_PATTERN_PERIOD) {
+      offset = 0;
+    }
+  }
+}
+
 int generate_test_string(char *str, int size) {
   char *tmp_str;
-  int i;
+
+  if (size <= 0) {
+    return 0;
+  }
+
+  /* Host buffers are filled in place; device memory still needs a bounce
+   * buffer */
+  if (test_mem_type == UCS_MEMORY_TYPE_HOST) {
+    fill_test_pattern(str, size - 1);
+    str[size - 1] = '\0';
+    return 0;
+  }
 
   tmp_str = static_cast<char *>(calloc(1, size));
   CHKERR_ACTION(tmp_str == NULL, "allocate memory\n", return -1);
 
-  for (i = 0; i < (size - 1); ++i) {
-    tmp_str[i] = 'A' + (i % 26);
-  }
+  fill_test_pattern(tmp_str, size - 1);
 
   mem_type_memcpy(str, tmp_str, size);
 
@@ -20,4 +20,14 @@
  */
 int generate_test_string(char *str, int size);
 
+/**
+ * @brief Writes the repeating 'A'..'Z' test pattern into host memory.
+ *
+ * Uses 16-byte SIMD stores straight into the destination.
+ *
+ * @param dst Host buffer to fill.
+ * @param length Number of bytes to write (no terminator is added).
+ */
+void fill_test_pattern(char *dst, size_t length);
+
 #endif // MYUCXPLAYGROUND_DATA_UTIL_H
@@ -0,0 +1,382 @@
+#include "disk_sink.h"
+#include "common_utils.h"
+#include "logger.h"
+#include "time_utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define DISK_SINK_ROUND_UP(_n) \
+  (((_n) + DISK_SINK_ALIGN - 1) & ~(DISK_SINK_ALIGN - 1))
+
+DiskSink::DiskSink(ucp_context_h ucp_context, const char *path,
+                   size_t payload_size, size_t header_len, int direct)
+    : ucp_context_(ucp_context), path_(path), payload_size_(payload_size),
+      header_len_(header_len), direct_(direct), fd_(-1), slots_(NULL),
+      slot_size_(0), memh_(NULL), inflight_(0), busy_start_ns_(0),
+      file_offset_(0), failed_(0), ring_fd_(-1), sq_ring_(NULL),
+      sq_ring_size_(0), cq_ring_(NULL), cq_ring_size_(0), sqes_(NULL),
+      sqes_size_(0), sq_tail_(NULL), sq_mask_(NULL), sq_array_(NULL),
+      cq_head_(NULL), cq_tail_(NULL), cq_mask_(NULL), cqes_(NULL), stats_() {}
+
+DiskSink::~DiskSink() {
+  if (fd_ >= 0) {
+    flush();
+  }
+  ring_cleanup();
+  if (memh_ != NULL) {
+    ucp_mem_unmap(ucp_context_, memh_);
+  }
+  if (slots_ != NULL) {
+    munmap(slots_, slot_size_ * DISK_SINK_BUFFERS);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    LOG_INFO("disk sink: %lu writes, %lu bytes, %lu waits for a buffer\n",
+             stats_.writes, stats_.bytes, stats_.buffer_waits);
+  }
+}
+
+int DiskSink::init() {
+  ucp_mem_map_params_t params;
+  ucs_status_t status;
+  int i;
+
+  CHKERR_ACTION(header_len_ > DISK_SINK_ALIGN, "fit the header\n",
+                return -1);
+  if (direct_ && ((payload_size_ % DISK_SINK_ALIGN) != 0)) {
+    LOG_ERROR("O_DIRECT needs a payload size that is a multiple of %lu, "
+              "not %lu\n",
+              DISK_SINK_ALIGN, payload_size_);
+    return -1;
+  }
+
+  fd_ = open(path_, O_WRONLY | O_CREAT | O_TRUNC | (direct_ ? O_DIRECT : 0),
+             0644);
+  if ((fd_ < 0) && direct_ && (errno == EINVAL)) {
+    /* tmpfs and some others have no O_DIRECT */
+    LOG_WARN("%s does not support O_DIRECT, using buffered writes\n", path_);
+    direct_ = 0;
+    fd_ = open(path_, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+  CHKERR_ACTION(fd_ < 0, "open the sink file\n", return -1);
+
+  /* The header ends where the slot's second page starts, so the payload is
+   * aligned for O_DIRECT */
+  slot_size_ = DISK_SINK_ALIGN + DISK_SINK_ROUND_UP(payload_size_);
+  slots_ = static_cast<char *>(mmap(NULL, slot_size_ * DISK_SINK_BUFFERS,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  CHKERR_ACTION(slots_ == MAP_FAILED, "allocate sink buffers\n",
+                slots_ = NULL; return -1);
+
+  params.field_mask =
+      UCP_MEM_MAP_PARAM_FIELD_ADDRESS | UCP_MEM_MAP_PARAM_FIELD_LENGTH;
+  params.address = slots_;
+  params.length = slot_size_ * DISK_SINK_BUFFERS;
+  status = ucp_mem_map(ucp_context_, &params, &memh_);
+  CHKERR_ACTION(status != UCS_OK, "register sink buffers\n",
+                memh_ = NULL; return -1);
+
+  for (i = DISK_SINK_BUFFERS - 1; i >= 0; --i) {
+    free_.push_back(i);
+  }
+  write_len_.assign(DISK_SINK_BUFFERS, 0);
+
+  if (ring_init() != 0) {
+    LOG_WARN("io_uring unavailable (%s), using pwrite\n", strerror(errno));
+    ring_cleanup();
+  }
+
+  LOG_INFO("disk sink: %s, %d buffers of %lu bytes, %s%s\n", path_,
+           DISK_SINK_BUFFERS, payload_size_,
+           (ring_fd_ >= 0) ? "io_uring" : "pwrite",
+           direct_ ? ", O_DIRECT" : "");
+  return 0;
+}
+
+int DiskSink::ring_init() {
+  struct io_uring_params params;
+  struct iovec iov[DISK_SINK_BUFFERS];
+  char *sq, *cq;
+  int i;
+
+  memset(&params, 0, sizeof(params));
+  ring_fd_ = syscall(__NR_io_uring_setup, DISK_SINK_BUFFERS, &params);
+  if (ring_fd_ < 0) {
+    return -1;
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    /* One mapping holds both rings */
+    if (cq_ring_size_ > sq_ring_size_) {
+      sq_ring_size_ = cq_ring_size_;
+    }
+    cq_ring_size_ = 0;
+  }
+
+  sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = NULL;
+    return -1;
+  }
+
+  if (cq_ring_size_ > 0) {
+    cq_ring_ = mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = NULL;
+      return -1;
+    }
+  }
+
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ = static_cast<struct io_uring_sqe *>(
+      mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+  if (sqes_ == MAP_FAILED) {
+    sqes_ = NULL;
+    return -1;
+  }
+
+  sq = static_cast<char *>(sq_ring_);
+  cq = static_cast<char *>((cq_ring_ != NULL) ? cq_ring_ : sq_ring_);
+  sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+  /* Fixed buffers spare the kernel a page walk per write */
+  for (i = 0; i < DISK_SINK_BUFFERS; ++i) {
+    iov[i].iov_base = slots_ + i * slot_size_;
+    iov[i].iov_len = slot_size_;
+  }
+  return syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS,
+                 iov, DISK_SINK_BUFFERS);
+}
+
+void DiskSink::ring_cleanup() {
+  if (sqes_ != NULL) {
+    munmap(sqes_, sqes_size_);
+    sqes_ = NULL;
+  }
+  if (cq_ring_ != NULL) {
+    munmap(cq_ring_, cq_ring_size_);
+    cq_ring_ = NULL;
+  }
+  if (sq_ring_ != NULL) {
+    munmap(sq_ring_, sq_ring_size_);
+    sq_ring_ = NULL;
+  }
+  if (ring_fd_ >= 0) {
+    close(ring_fd_);
+    ring_fd_ = -1;
+  }
+}
+
+int DiskSink::buffer_index(const void *buf) const {
+  return (static_cast<const char *>(buf) - slots_) / slot_size_;
+}
+
+void *DiskSink::acquire(ucp_mem_h *memh) {
+  uint64_t start;
+  int index;
+
+  if (stats_.first_ns == 0) {
+    stats_.first_ns = get_time_ns();
+  }
+
+  if (free_.empty()) {
+    ++stats_.buffer_waits;
+    start = get_time_ns();
+    while (free_.empty()) {
+      if (reap(1) != 0) {
+        return NULL;
+      }
+    }
+    stats_.wait_ns += get_time_ns() - start;
+  }
+
+  if (failed_) {
+    return NULL;
+  }
+
+  index = free_.back();
+  free_.pop_back();
+  *memh = memh_;
+  return slots_ + index * slot_size_ + DISK_SINK_ALIGN - header_len_;
+}
+
+void DiskSink::release(void *buf) { free_.push_back(buffer_index(buf)); }
+
+int DiskSink::commit(void *buf, size_t length) {
+  int index = buffer_index(buf);
+
+  if ((length > payload_size_) ||
+      (direct_ && ((length % DISK_SINK_ALIGN) != 0))) {
+    LOG_ERROR("cannot write %lu bytes to %s%s\n", length, path_,
+              direct_ ? " with O_DIRECT" : "");
+    free_.push_back(index);
+    return -1;
+  }
+
+  return submit_write(index, static_cast<char *>(buf) + header_len_, length);
+}
+
+int DiskSink::submit_write(int index, const void *payload, size_t length) {
+  struct io_uring_sqe *sqe;
+  unsigned tail, slot;
+  ssize_t written;
+  uint64_t start;
+  int ret;
+
+  if (ring_fd_ < 0) {
+    start = get_time_ns();
+    written = pwrite(fd_, payload, length, file_offset_);
+    stats_.busy_ns += get_time_ns() - start;
+    free_.push_back(index);
+    if (written != (ssize_t)length) {
+      LOG_ERROR("write to %s failed (%s)\n", path_,
+                (written < 0) ? strerror(errno) : "short write");
+      failed_ = 1;
+      return -1;
+    }
+    file_offset_ += length;
+    ++stats_.writes;
+    stats_.bytes += length;
+    stats_.last_ns = get_time_ns();
+    return 0;
+  }
+
+  /* At most DISK_SINK_BUFFERS writes are queued, so the ring never fills */
+  tail = *sq_tail_;
+  slot = tail & *sq_mask_;
+  sqe = &sqes_[slot];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = fd_;
+  sqe->addr = (uint64_t)payload;
+  sqe->len = length;
+  sqe->off = file_offset_;
+  sqe->buf_index = index;
+  sqe->user_data = index;
+  sq_array_[slot] = slot;
+  write_len_[index] = length;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+  ret = syscall(__NR_io_uring_enter, ring_fd_, 1, 0, 0, NULL, 0);
+  if (ret != 1) {
+    LOG_ERROR("io_uring_enter failed (%s)\n",
+              (ret < 0) ? strerror(errno) : "nothing submitted");
+    /* The kernel did not take the entry: withdraw it and the buffer */
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+    free_.push_back(index);
+    failed_ = 1;
+    return -1;
+  }
+
+  file_offset_ += length;
+  if (inflight_++ == 0) {
+    busy_start_ns_ = get_time_ns();
+  }
+  return 0;
+}
+
+int DiskSink::reap(unsigned min_complete) {
+  struct io_uring_cqe *cqe;
+  unsigned head, tail;
+  int index, ret;
+
+  if (ring_fd_ < 0) {
+    /* Writes completed on submission */
+    return 0;
+  }
+
+  if (min_complete > 0) {
+    do {
+      ret = syscall(__NR_io_uring_enter, ring_fd_, 0, min_complete,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+    } while ((ret < 0) && (errno == EINTR));
+    CHKERR_ACTION(ret < 0, "wait for io_uring completions\n",
+                  failed_ = 1; return -1);
+  }
+
+  head = *cq_head_;
+  tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    cqe = &cqes_[head & *cq_mask_];
+    index = cqe->user_data;
+    if (cqe->res != (int)write_len_[index]) {
+      LOG_ERROR("write to %s failed (%s)\n", path_,
+                (cqe->res < 0) ? strerror(-cqe->res) : "short write");
+      failed_ = 1;
+    } else {
+      ++stats_.writes;
+      stats_.bytes += cqe->res;
+    }
+    free_.push_back(index);
+    stats_.last_ns = get_time_ns();
+    if (--inflight_ == 0) {
+      stats_.busy_ns += stats_.last_ns - busy_start_ns_;
+    }
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+int DiskSink::flush() {
+  uint64_t start;
+
+  while (inflight_ > 0) {
+    if (reap(1) != 0) {
+      break;
+    }
+  }
+
+  /* Writes have completed; make the throughput count the writeback too */
+  if (!failed_ && (stats_.writes > 0)) {
+    start = get_time_ns();
+    if (fdatasync(fd_) != 0) {
+      LOG_ERROR("fdatasync %s failed (%s)\n", path_, strerror(errno));
+      failed_ = 1;
+    }
+    stats_.last_ns = get_time_ns();
+    stats_.busy_ns += stats_.last_ns - start;
+  }
+
+  return failed_ ? -1 : 0;
+}
+
+void DiskSink::report() const {
+  double seconds = (stats_.last_ns - stats_.first_ns) / 1e9;
+
+  printf("\n----- DISK SINK -----\n");
+  printf("file        : %s (%s%s)\n", path_,
+         (ring_fd_ >= 0) ? "io_uring" : "pwrite", direct_ ? ", O_DIRECT" : "");
+  printf("written     : %lu bytes in %lu writes\n", stats_.bytes,
+         stats_.writes);
+  printf("throughput  : %.3f GB/s end to end\n",
+         (seconds > 0) ? stats_.bytes / seconds / 1e9 : 0.0);
+  printf("disk        : %.3f GB/s over %.3f ms with writes in flight\n",
+         (stats_.busy_ns > 0) ? stats_.bytes / (stats_.busy_ns / 1e9) / 1e9
+                              : 0.0,
+         stats_.busy_ns / 1e6);
+  printf("buffer waits: %lu (%.3f ms)\n", stats_.buffer_waits,
+         stats_.wait_ns / 1e6);
+  printf("---------------------\n\n");
+}
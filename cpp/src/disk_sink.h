@@ -0,0 +1,159 @@
+#ifndef MYUCXPLAYGROUND_DISK_SINK_H
+#define MYUCXPLAYGROUND_DISK_SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ucp/api/ucp.h>
+
+#include <vector>
+
+/* Buffer, length and file offset alignment of O_DIRECT writes */
+#define DISK_SINK_ALIGN 4096ul
+
+/* Buffers in rotation: one receiving while the others are being written */
+#define DISK_SINK_BUFFERS 4
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * Persists received payloads to a file through io_uring.
+ *
+ * The sink owns a rotating set of receive buffers, registered both with UCX
+ * (ucp_mem_map) and with the kernel (io_uring fixed buffers). A buffer is
+ * received into, handed to commit(), written straight from where it landed
+ * with IORING_OP_WRITE_FIXED, and only returned to the free set when that
+ * write completes. So the next receive proceeds while the previous payloads
+ * are still going to disk, and nothing is copied in between. acquire()
+ * blocks only when every buffer is still being written, i.e. when the disk
+ * is the bottleneck.
+ *
+ * Payloads are appended to the file in commit() order. With O_DIRECT the
+ * payloads must be a multiple of DISK_SINK_ALIGN bytes, which init() checks
+ * for `payload_size`; buffers are laid out so the payload after a
+ * `header_len` header is aligned.
+ *
+ * If the kernel refuses io_uring (old kernel, seccomp) the sink falls back
+ * to synchronous pwrite().
+ *
+ * Not thread safe: use it from the thread that receives.
+ */
+class DiskSink {
+
+public:
+  struct stats {
+    uint64_t writes;
+    uint64_t bytes;
+    uint64_t buffer_waits; /* acquire() calls that found no free buffer */
+    uint64_t wait_ns;      /* time spent in those */
+    uint64_t first_ns;     /* first acquire() */
+    uint64_t last_ns;      /* last write completion */
+    uint64_t busy_ns;      /* time with a write (or the final sync) running */
+  };
+
+  /**
+   * @param ucp_context Context the buffers are registered with.
+   * @param path File to write; created or truncated.
+   * @param payload_size Largest payload committed.
+   * @param header_len Bytes received ahead of each payload and not written.
+   * @param direct Open the file with O_DIRECT.
+   */
+  DiskSink(ucp_context_h ucp_context, const char *path, size_t payload_size,
+           size_t header_len, int direct);
+  ~DiskSink();
+
+  DiskSink(const DiskSink &) = delete;
+  DiskSink &operator=(const DiskSink &) = delete;
+
+  /**
+   * @brief Opens the file and sets up the buffers and the ring.
+   *
+   * @return 0 on success, -1 on failure.
+   */
+  int init();
+
+  /**
+   * @brief Takes a free buffer to receive into, waiting for a write to
+   * complete if there is none.
+   *
+   * @param memh Set to the UCX memory handle of the buffer.
+   * @return A buffer of recv_capacity() bytes, or NULL if a write failed.
+   */
+  void *acquire(ucp_mem_h *memh);
+
+  /**
+   * @brief Appends the `length` payload bytes of `buf` (those after the
+   * header) to the file. The buffer goes back to the free set once written.
+   *
+   * @return 0 if the write was queued, -1 on error (the buffer is released).
+   */
+  int commit(void *buf, size_t length);
+
+  /**
+   * @brief Returns a buffer without writing it.
+   */
+  void release(void *buf);
+
+  /**
+   * @brief Waits for every queued write to complete.
+   *
+   * @return 0 if all writes so far succeeded, -1 otherwise.
+   */
+  int flush();
+
+  size_t recv_capacity() const { return header_len_ + payload_size_; }
+
+  const struct stats &get_stats() const { return stats_; }
+
+  /**
+   * @brief Prints the bytes written, the end-to-end throughput and the
+   * throughput while the disk was busy, which leaves out the time spent
+   * receiving with no write in flight.
+   */
+  void report() const;
+
+private:
+  int ring_init();
+  void ring_cleanup();
+  int submit_write(int index, const void *payload, size_t length);
+  int reap(unsigned min_complete);
+  int buffer_index(const void *buf) const;
+
+  ucp_context_h ucp_context_;
+  const char *path_;
+  size_t payload_size_;
+  size_t header_len_;
+  int direct_;
+  int fd_;
+
+  /* Buffers: DISK_SINK_BUFFERS slots of slot_size_ bytes */
+  char *slots_;
+  size_t slot_size_;
+  ucp_mem_h memh_;
+  std::vector<int> free_;
+  std::vector<size_t> write_len_; /* length of the write in flight */
+  int inflight_;
+  uint64_t busy_start_ns_; /* when inflight_ last became non-zero */
+  uint64_t file_offset_;
+  int failed_;
+
+  /* io_uring, -1 when writes go through pwrite() */
+  int ring_fd_;
+  void *sq_ring_;
+  size_t sq_ring_size_;
+  void *cq_ring_;
+  size_t cq_ring_size_;
+  struct io_uring_sqe *sqes_;
+  size_t sqes_size_;
+  unsigned *sq_tail_;
+  unsigned *sq_mask_;
+  unsigned *sq_array_;
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned *cq_mask_;
+  struct io_uring_cqe *cqes_;
+
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_DISK_SINK_H
@@ -0,0 +1,175 @@
+#include "ep_cache.h"
+#include "logger.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+#include <vector>
+
+/* Key prefixes keep worker addresses and sockaddrs from ever colliding */
+#define EP_CACHE_KEY_WORKER 'w'
+#define EP_CACHE_KEY_SOCKADDR 's'
+
+EpCache::EpCache(ucp_worker_h ucp_worker, size_t capacity,
+                 err_handling err_handling_opt)
+    : ucp_worker_(ucp_worker), capacity_(capacity > 0 ? capacity : 1),
+      err_handling_opt_(err_handling_opt), stats_() {}
+
+EpCache::~EpCache() {
+  std::vector<ucp_ep_h> live, failed;
+
+  /* Close everything at once rather than one round trip per entry */
+  for (const entry &e : lru_) {
+    (e.status == UCS_OK ? live : failed).push_back(e.ep);
+  }
+
+  if (!live.empty()) {
+    ep_close_batch(ucp_worker_, live.data(), live.size(),
+                   (err_handling_opt_.ucp_err_mode ==
+                    UCP_ERR_HANDLING_MODE_PEER)
+                       ? UCP_EP_CLOSE_FLAG_FORCE
+                       : 0);
+  }
+  if (!failed.empty()) {
+    ep_close_batch(ucp_worker_, failed.data(), failed.size(),
+                   UCP_EP_CLOSE_FLAG_FORCE);
+  }
+
+  LOG_INFO("ep cache: %lu hits, %lu misses, %lu evictions, %lu failures\n",
+           stats_.hits, stats_.misses, stats_.evictions, stats_.failures);
+}
+
+ucs_status_t EpCache::get(const ucp_address_t *address, size_t address_len,
+                          ucp_ep_h *ep_p, const ucs_status_t **status_p) {
+  ucp_ep_params_t ep_params;
+  std::string key(1, EP_CACHE_KEY_WORKER);
+
+  key.append(reinterpret_cast<const char *>(address), address_len);
+
+  ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS;
+  ep_params.address = address;
+  return lookup(key, &ep_params, ep_p, status_p);
+}
+
+ucs_status_t EpCache::get_sockaddr(const struct sockaddr *addr,
+                                   socklen_t addrlen, ucp_ep_h *ep_p,
+                                   const ucs_status_t **status_p) {
+  ucp_ep_params_t ep_params;
+  std::string key(1, EP_CACHE_KEY_SOCKADDR);
+
+  key.append(reinterpret_cast<const char *>(addr), addrlen);
+
+  ep_params.field_mask =
+      UCP_EP_PARAM_FIELD_SOCK_ADDR | UCP_EP_PARAM_FIELD_FLAGS;
+  ep_params.flags = UCP_EP_PARAMS_FLAGS_CLIENT_SERVER;
+  ep_params.sockaddr.addr = addr;
+  ep_params.sockaddr.addrlen = addrlen;
+  return lookup(key, &ep_params, ep_p, status_p);
+}
+
+ucs_status_t EpCache::lookup(const std::string &key,
+                             ucp_ep_params_t *ep_params, ucp_ep_h *ep_p,
+                             const ucs_status_t **status_p) {
+  auto found = index_.find(key);
+  ucs_status_t status;
+
+  if (found != index_.end()) {
+    entry_iter it = found->second;
+    if (it->status == UCS_OK) {
+      it->last_used_ns = get_time_ns();
+      lru_.splice(lru_.begin(), lru_, it);
+      ++stats_.hits;
+      *ep_p = it->ep;
+      if (status_p != NULL) {
+        *status_p = &it->status;
+      }
+      return UCS_OK;
+    }
+
+    /* The error handler fired for this peer, reconnect */
+    ++stats_.failures;
+    close_entry(it);
+  }
+
+  ++stats_.misses;
+  lru_.push_front(entry{key, NULL, UCS_OK, get_time_ns()});
+
+  ep_params->field_mask |= UCP_EP_PARAM_FIELD_ERR_HANDLING_MODE |
+                           UCP_EP_PARAM_FIELD_ERR_HANDLER |
+                           UCP_EP_PARAM_FIELD_USER_DATA;
+  ep_params->err_mode = err_handling_opt_.ucp_err_mode;
+  ep_params->err_handler.cb = failure_handler;
+  ep_params->err_handler.arg = &lru_.front().status;
+  ep_params->user_data = &lru_.front().status;
+
+  status = ucp_ep_create(ucp_worker_, ep_params, &lru_.front().ep);
+  if (status != UCS_OK) {
+    lru_.pop_front();
+    return status;
+  }
+
+  index_[key] = lru_.begin();
+  by_ep_[lru_.front().ep] = lru_.begin();
+  *ep_p = lru_.front().ep;
+  if (status_p != NULL) {
+    *status_p = &lru_.front().status;
+  }
+
+  while (lru_.size() > capacity_) {
+    ++stats_.evictions;
+    close_entry(std::prev(lru_.end()));
+  }
+
+  return UCS_OK;
+}
+
+void EpCache::close_entry(entry_iter it) {
+  err_handling close_mode = err_handling_opt_;
+
+  /* A failed endpoint cannot be flushed, force the close */
+  if (it->status != UCS_OK) {
+    close_mode.ucp_err_mode = UCP_ERR_HANDLING_MODE_PEER;
+  }
+
+  ep_close_err_mode(ucp_worker_, it->ep, close_mode);
+  index_.erase(it->key);
+  by_ep_.erase(it->ep);
+  lru_.erase(it);
+}
+
+ucs_status_t EpCache::ep_status(ucp_ep_h ep) const {
+  auto found = by_ep_.find(ep);
+
+  return (found == by_ep_.end()) ? UCS_ERR_NO_ELEM : found->second->status;
+}
+
+void EpCache::invalidate(ucp_ep_h ep) {
+  auto found = by_ep_.find(ep);
+
+  if (found != by_ep_.end()) {
+    close_entry(found->second);
+  }
+}
+
+void EpCache::forget(ucp_ep_h ep) {
+  auto found = by_ep_.find(ep);
+
+  if (found != by_ep_.end()) {
+    index_.erase(found->second->key);
+    lru_.erase(found->second);
+    by_ep_.erase(found);
+    ++stats_.failures;
+  }
+}
+
+size_t EpCache::evict_idle(uint64_t idle_ns) {
+  uint64_t now = get_time_ns();
+  size_t count = 0;
+
+  while (!lru_.empty() && (now - lru_.back().last_used_ns > idle_ns)) {
+    close_entry(std::prev(lru_.end()));
+    ++count;
+  }
+
+  stats_.evictions += count;
+  return count;
+}
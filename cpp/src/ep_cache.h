@@ -0,0 +1,116 @@
+#ifndef MYUCXPLAYGROUND_EP_CACHE_H
+#define MYUCXPLAYGROUND_EP_CACHE_H
+
+#include <ucp/api/ucp.h>
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include "ucx_config.h"
+
+/* Endpoints unused for this long are closed before the next lookup */
+#define EP_CACHE_IDLE_NS (30 * 1000000000ull)
+
+/**
+ * Cache of live endpoints keyed by the peer's worker address (or sockaddr),
+ * so repeated conversations with the same peer skip wireup.
+ *
+ * Each endpoint is created with `failure_handler` pointed at the entry's
+ * status; an entry whose status is no longer UCS_OK is treated as dead and
+ * recreated on the next lookup. When more than `capacity` endpoints are live,
+ * the least recently used one is closed; UcpClient and UcpServer also close
+ * endpoints idle for EP_CACHE_IDLE_NS before each lookup.
+ *
+ * Not thread safe: use it from the thread that progresses `ucp_worker`.
+ */
+class EpCache {
+
+public:
+  struct stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t failures; /* entries dropped because the peer failed */
+  };
+
+  EpCache(ucp_worker_h ucp_worker, size_t capacity,
+          err_handling err_handling_opt);
+  ~EpCache();
+
+  EpCache(const EpCache &) = delete;
+  EpCache &operator=(const EpCache &) = delete;
+
+  /**
+   * @brief Returns an endpoint to the peer worker at `address`.
+   *
+   * @param address Packed worker address of the peer.
+   * @param address_len Length of `address` in bytes.
+   * @param ep_p Filled with the cached or newly created endpoint.
+   * @param status_p If not NULL, filled with the location the error handler
+   * writes the endpoint's status to; valid while the endpoint stays cached.
+   * @return UCS_OK, or the ucp_ep_create() error.
+   */
+  ucs_status_t get(const ucp_address_t *address, size_t address_len,
+                   ucp_ep_h *ep_p, const ucs_status_t **status_p = NULL);
+
+  /**
+   * @brief Returns a client-server endpoint connected to `addr`.
+   */
+  ucs_status_t get_sockaddr(const struct sockaddr *addr, socklen_t addrlen,
+                            ucp_ep_h *ep_p,
+                            const ucs_status_t **status_p = NULL);
+
+  /**
+   * @brief Returns the status recorded by the error handler for `ep`, or
+   * UCS_ERR_NO_ELEM if the endpoint is not cached.
+   */
+  ucs_status_t ep_status(ucp_ep_h ep) const;
+
+  /**
+   * @brief Closes and forgets `ep`, e.g. after a protocol error.
+   */
+  void invalidate(ucp_ep_h ep);
+
+  /**
+   * @brief Forgets `ep` without closing it, once it was closed elsewhere,
+   * e.g. by OpDeadlines::wait().
+   */
+  void forget(ucp_ep_h ep);
+
+  /**
+   * @brief Closes endpoints unused for longer than `idle_ns`.
+   *
+   * @return The number of endpoints closed.
+   */
+  size_t evict_idle(uint64_t idle_ns);
+
+  size_t size() const { return lru_.size(); }
+  const struct stats &get_stats() const { return stats_; }
+
+private:
+  struct entry {
+    std::string key;
+    ucp_ep_h ep;
+    ucs_status_t status;
+    uint64_t last_used_ns;
+  };
+
+  typedef std::list<entry>::iterator entry_iter;
+
+  ucs_status_t lookup(const std::string &key, ucp_ep_params_t *ep_params,
+                      ucp_ep_h *ep_p, const ucs_status_t **status_p);
+  void close_entry(entry_iter it);
+
+  ucp_worker_h ucp_worker_;
+  size_t capacity_;
+  err_handling err_handling_opt_;
+  /* Most recently used first; list nodes keep `status` at a stable address
+   * for the error handler */
+  std::list<entry> lru_;
+  std::unordered_map<std::string, entry_iter> index_;
+  std::unordered_map<ucp_ep_h, entry_iter> by_ep_;
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_EP_CACHE_H
@@ -0,0 +1,521 @@
+#include "file_transfer.h"
+#include "common_utils.h"
+#include "crc32c.h"
+#include "logger.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+#include <errno.h>
+#include <fcntl.h> /* fallocate */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vector>
+
+static const char *file_data_str = "file chunk";
+static const char *file_ctrl_str = "file control message";
+
+/* One FILE_XFER_REGION_SIZE slice of a mapped file */
+struct file_region {
+  ucp_mem_h memh; /* NULL while not registered */
+  size_t pending; /* chunks of the region not completed yet */
+};
+
+struct file_mapping {
+  ucp_context_h context;
+  char *base;
+  size_t length;
+  unsigned prot; /* UCP_MEM_MAP_PROT_* */
+  std::vector<struct file_region> regions;
+  uint64_t mapped; /* ucp_mem_map() calls */
+};
+
+/* Posts the transfer of one chunk, see file_stream() */
+typedef ucs_status_ptr_t (*file_post_cb_t)(void *arg, size_t chunk,
+                                           void *buf, size_t length,
+                                           const ucp_request_param_t *param);
+
+static size_t file_chunk_count(size_t length) {
+  return (length + FILE_XFER_CHUNK_SIZE - 1) / FILE_XFER_CHUNK_SIZE;
+}
+
+static void file_mapping_init(struct file_mapping *map,
+                              ucp_context_h ucp_context, void *base,
+                              size_t length, unsigned prot) {
+  struct file_region region = {NULL, 0};
+
+  map->context = ucp_context;
+  map->base = static_cast<char *>(base);
+  map->length = length;
+  map->prot = prot;
+  map->regions.assign(
+      (length + FILE_XFER_REGION_SIZE - 1) / FILE_XFER_REGION_SIZE, region);
+  map->mapped = 0;
+}
+
+static void file_mapping_release(struct file_mapping *map) {
+  for (struct file_region &region : map->regions) {
+    if (region.memh != NULL) {
+      ucp_mem_unmap(map->context, region.memh);
+      region.memh = NULL;
+    }
+  }
+}
+
+/* Registers the region holding `chunk` the first time one of its chunks is
+ * posted. Chunks are posted in order, so all of them follow. */
+static ucs_status_t file_region_get(struct file_mapping *map, size_t chunk,
+                                    ucp_mem_h *memh_p) {
+  size_t index = chunk * FILE_XFER_CHUNK_SIZE / FILE_XFER_REGION_SIZE;
+  struct file_region *region = &map->regions[index];
+  size_t offset = index * FILE_XFER_REGION_SIZE;
+  ucp_mem_map_params_t params;
+  ucs_status_t status;
+
+  if (region->memh == NULL) {
+    params.field_mask = UCP_MEM_MAP_PARAM_FIELD_ADDRESS |
+                        UCP_MEM_MAP_PARAM_FIELD_LENGTH |
+                        UCP_MEM_MAP_PARAM_FIELD_PROT;
+    params.address = map->base + offset;
+    params.length = map->length - offset;
+    if (params.length > FILE_XFER_REGION_SIZE) {
+      params.length = FILE_XFER_REGION_SIZE;
+    }
+    params.prot = map->prot;
+
+    status = ucp_mem_map(map->context, &params, &region->memh);
+    if (status != UCS_OK) {
+      LOG_ERROR("ucp_mem_map of %lu bytes at offset %lu failed (%s)\n",
+                params.length, offset, ucs_status_string(status));
+      region->memh = NULL;
+      return status;
+    }
+    region->pending = file_chunk_count(params.length);
+    ++map->mapped;
+  }
+
+  *memh_p = region->memh;
+  return UCS_OK;
+}
+
+/* Unregisters the region holding `chunk` once its last chunk completed */
+static void file_region_put(struct file_mapping *map, size_t chunk) {
+  size_t index = chunk * FILE_XFER_CHUNK_SIZE / FILE_XFER_REGION_SIZE;
+  struct file_region *region = &map->regions[index];
+
+  if (--region->pending == 0) {
+    ucp_mem_unmap(map->context, region->memh);
+    region->memh = NULL;
+  }
+}
+
+/* Moves every chunk of `map` with at most FILE_XFER_WINDOW in flight.
+ * Sends cannot be cancelled, so on failure the sender's endpoint `*send_ep`
+ * is force-closed to fail the chunks in flight, and set to NULL; receives
+ * (`send_ep` NULL) are cancelled. */
+static int file_stream(ucp_worker_h ucp_worker, struct file_mapping *map,
+                       const ucp_request_param_t *base_param,
+                       file_post_cb_t post, void *arg,
+                       const ucs_status_t *ep_status, ucp_ep_h *send_ep) {
+  struct ucx_context *window[FILE_XFER_WINDOW] = {};
+  size_t window_chunk[FILE_XFER_WINDOW];
+  size_t nchunks = file_chunk_count(map->length);
+  size_t next = 0, done = 0, offset, length, i;
+  ucp_request_param_t param = *base_param;
+  ucs_status_t status = UCS_OK;
+  ucs_status_ptr_t request;
+
+  param.op_attr_mask |= UCP_OP_ATTR_FIELD_DATATYPE | UCP_OP_ATTR_FIELD_MEMH |
+                        UCP_OP_ATTR_FLAG_NO_IMM_CMPL;
+  param.datatype = ucp_dt_make_contig(1);
+
+  while (done < nchunks) {
+    for (i = 0; i < FILE_XFER_WINDOW; ++i) {
+      if (window[i] != NULL) {
+        if (!window[i]->completed) {
+          continue;
+        }
+        window[i]->completed = 0;
+        status = ucp_request_check_status(window[i]);
+        ucp_request_free(window[i]);
+        window[i] = NULL;
+        file_region_put(map, window_chunk[i]);
+        ++done;
+        if (status != UCS_OK) {
+          LOG_ERROR("transfer of chunk %lu failed (%s)\n", window_chunk[i],
+                    ucs_status_string(status));
+          goto err_drain;
+        }
+      }
+
+      if (next == nchunks) {
+        continue;
+      }
+
+      status = file_region_get(map, next, &param.memh);
+      if (status != UCS_OK) {
+        goto err_drain;
+      }
+
+      offset = next * FILE_XFER_CHUNK_SIZE;
+      length = map->length - offset;
+      if (length > FILE_XFER_CHUNK_SIZE) {
+        length = FILE_XFER_CHUNK_SIZE;
+      }
+
+      request = post(arg, next, map->base + offset, length, &param);
+      if (UCS_PTR_IS_ERR(request)) {
+        status = UCS_PTR_STATUS(request);
+        LOG_ERROR("unable to post chunk %lu (%s)\n", next,
+                  ucs_status_string(status));
+        goto err_drain;
+      }
+      window[i] = static_cast<struct ucx_context *>(request);
+      window_chunk[i] = next++;
+    }
+
+    if ((ep_status != NULL) && (*ep_status != UCS_OK)) {
+      status = *ep_status;
+      LOG_ERROR("peer failed after %lu of %lu chunks (%s)\n", done, nchunks,
+                ucs_status_string(status));
+      goto err_drain;
+    }
+
+    ucp_worker_progress(ucp_worker);
+  }
+
+  return 0;
+
+err_drain:
+  if (send_ep != NULL) {
+    ep_close(ucp_worker, *send_ep, UCP_EP_CLOSE_FLAG_FORCE);
+    *send_ep = NULL;
+  }
+  for (i = 0; i < FILE_XFER_WINDOW; ++i) {
+    if (window[i] == NULL) {
+      continue;
+    }
+    if (send_ep == NULL) {
+      ucp_request_cancel(ucp_worker, window[i]);
+    }
+    while (!window[i]->completed) {
+      ucp_worker_progress(ucp_worker);
+    }
+    window[i]->completed = 0;
+    ucp_request_free(window[i]);
+  }
+  /* Regions with chunks never posted are released by the caller */
+  return -1;
+}
+
+static ucs_status_ptr_t file_send_chunk(void *arg, size_t chunk, void *buf,
+                                        size_t length,
+                                        const ucp_request_param_t *param) {
+  return ucp_tag_send_nbx(static_cast<ucp_ep_h>(arg), buf, length,
+                          FILE_TAG_DATA | chunk, param);
+}
+
+static ucs_status_ptr_t file_recv_chunk(void *arg, size_t chunk, void *buf,
+                                        size_t length,
+                                        const ucp_request_param_t *param) {
+  return ucp_tag_recv_nbx(static_cast<ucp_worker_h>(arg), buf, length,
+                          FILE_TAG_DATA | chunk, UINT64_MAX, param);
+}
+
+static ucs_status_t file_ep_create(ucp_worker_h ucp_worker,
+                                   const ucp_address_t *peer_addr,
+                                   err_handling err_handling_opt,
+                                   ucs_status_t *ep_status, ucp_ep_h *ep) {
+  ucp_ep_params_t ep_params;
+
+  ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS |
+                         UCP_EP_PARAM_FIELD_ERR_HANDLING_MODE |
+                         UCP_EP_PARAM_FIELD_ERR_HANDLER |
+                         UCP_EP_PARAM_FIELD_USER_DATA;
+  ep_params.address = peer_addr;
+  ep_params.err_mode = err_handling_opt.ucp_err_mode;
+  ep_params.err_handler.cb = failure_handler;
+  ep_params.err_handler.arg = ep_status;
+  ep_params.user_data = ep_status;
+
+  return ucp_ep_create(ucp_worker, &ep_params, ep);
+}
+
+static ucs_status_t file_send_ctrl(ucp_worker_h ucp_worker, ucp_ep_h ep,
+                                   const void *buf, size_t length,
+                                   ucp_tag_t tag) {
+  ucp_request_param_t param;
+  struct ucx_context *request;
+
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_USER_DATA;
+  param.cb.send = send_handler;
+  param.user_data = (void *)file_ctrl_str;
+  request = static_cast<struct ucx_context *>(
+      ucp_tag_send_nbx(ep, buf, length, tag, &param));
+  return ucx_wait(ucp_worker, request, "send", file_ctrl_str);
+}
+
+static ucs_status_t file_recv_ctrl(ucp_worker_h ucp_worker, void *buf,
+                                   size_t length, ucp_tag_t tag) {
+  ucp_request_param_t param;
+  struct ucx_context *request;
+
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_DATATYPE |
+                       UCP_OP_ATTR_FLAG_NO_IMM_CMPL;
+  param.datatype = ucp_dt_make_contig(1);
+  param.cb.recv = recv_handler;
+  request = static_cast<struct ucx_context *>(
+      ucp_tag_recv_nbx(ucp_worker, buf, length, tag, UINT64_MAX, &param));
+  return ucx_wait(ucp_worker, request, "receive", file_ctrl_str);
+}
+
+int file_send(ucp_context_h ucp_context, ucp_worker_h ucp_worker,
+              const char *path, int verify_crc, err_handling err_handling_opt,
+              ucp_test_mode_t test_mode, uint64_t timeout_ns,
+              struct file_xfer_stats *stats) {
+  ucs_status_t ep_status = UCS_OK;
+  struct file_mapping map;
+  ucp_request_param_t param;
+  ucp_tag_recv_info_t info_tag;
+  ucp_tag_message_h msg_tag;
+  struct ucx_context *request;
+  struct msg *hello = NULL;
+  struct msg hdr;
+  struct stat st;
+  ucs_status_t status;
+  void *base = NULL;
+  uint64_t start;
+  uint32_t ack;
+  ucp_ep_h ep;
+  int ret = -1;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  CHKERR_JUMP(fd < 0, "open the file to send\n", err);
+  CHKERR_JUMP(fstat(fd, &st) != 0, "stat the file to send\n", err_fd);
+
+  if (st.st_size > 0) {
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    CHKERR_ACTION(base == MAP_FAILED, "map the file to send\n",
+                  base = NULL; goto err_fd);
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+  }
+  file_mapping_init(&map, ucp_context, base, st.st_size,
+                    UCP_MEM_MAP_PROT_LOCAL_READ);
+
+  /* The receiver introduces itself with its worker address */
+  msg_tag = probe_wait(ucp_worker, FILE_TAG_HELLO, UINT64_MAX, test_mode,
+                       NULL, &info_tag, timeout_ns);
+  CHKERR_JUMP(msg_tag == NULL, "receive the receiver address\n", err_map);
+
+  hello = static_cast<struct msg *>(malloc(info_tag.length));
+  CHKERR_JUMP(hello == NULL, "allocate memory\n", err_map);
+
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_DATATYPE |
+                       UCP_OP_ATTR_FLAG_NO_IMM_CMPL;
+  param.datatype = ucp_dt_make_contig(1);
+  param.cb.recv = recv_handler;
+  request = static_cast<struct ucx_context *>(ucp_tag_msg_recv_nbx(
+      ucp_worker, hello, info_tag.length, msg_tag, &param));
+  status = ucx_wait(ucp_worker, request, "receive", file_ctrl_str);
+  CHKERR_ACTION(status != UCS_OK, "receive the receiver address\n",
+                free(hello); goto err_map);
+
+  status = file_ep_create(ucp_worker, (ucp_address_t *)(hello + 1),
+                          err_handling_opt, &ep_status, &ep);
+  free(hello);
+  CHKERR_JUMP(status != UCS_OK, "ucp_ep_create\n", err_map);
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.data_len = st.st_size;
+  if (verify_crc) {
+    start = get_time_ns();
+    hdr.flags = MSG_FLAG_CRC32C;
+    hdr.crc = crc32c(0, base, st.st_size);
+    stats->crc_ns = get_time_ns() - start;
+  } else {
+    stats->crc_ns = 0;
+  }
+
+  status = file_send_ctrl(ucp_worker, ep, &hdr, sizeof(hdr), FILE_TAG_HDR);
+  CHKERR_JUMP(status != UCS_OK, "send the file header\n", err_ep);
+
+  LOG_INFO("sending %s: %lu bytes in %lu chunks\n", path, hdr.data_len,
+           file_chunk_count(hdr.data_len));
+
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_USER_DATA;
+  param.cb.send = send_handler;
+  param.user_data = (void *)file_data_str;
+
+  start = get_time_ns();
+  ret = file_stream(ucp_worker, &map, &param, file_send_chunk, ep,
+                    &ep_status, &ep);
+  stats->elapsed_ns = get_time_ns() - start;
+  CHKERR_JUMP(ret != 0, "stream the file\n", err_ep);
+
+  ret = -1;
+  status = file_recv_ctrl(ucp_worker, &ack, sizeof(ack), FILE_TAG_ACK);
+  CHKERR_JUMP(status != UCS_OK, "receive the acknowledgement\n", err_ep);
+  if (ack != 0) {
+    LOG_ERROR("receiver rejected %s\n", path);
+    goto err_ep;
+  }
+
+  stats->bytes = hdr.data_len;
+  stats->chunks = file_chunk_count(hdr.data_len);
+  stats->regions = map.mapped;
+  ret = 0;
+
+err_ep:
+  if (ep != NULL) {
+    ep_close_err_mode(ucp_worker, ep, err_handling_opt);
+  }
+err_map:
+  file_mapping_release(&map);
+  if (base != NULL) {
+    munmap(base, st.st_size);
+  }
+err_fd:
+  close(fd);
+err:
+  return ret;
+}
+
+/* Sizes `fd` to `length` with its blocks allocated up front, so the receive
+ * path never takes a block-allocation fault */
+static int file_preallocate(int fd, size_t length) {
+  if (fallocate(fd, 0, 0, length) == 0) {
+    return 0;
+  }
+  if ((errno != EOPNOTSUPP) && (errno != ENOSYS)) {
+    return -1;
+  }
+  LOG_WARN("fallocate is not supported here, extending the file instead\n");
+  return ftruncate(fd, length);
+}
+
+int file_recv(ucp_context_h ucp_context, ucp_worker_h ucp_worker,
+              const ucp_address_t *local_addr, size_t local_addr_len,
+              const ucp_address_t *server_addr, const char *path,
+              err_handling err_handling_opt, struct file_xfer_stats *stats) {
+  ucs_status_t ep_status = UCS_OK;
+  struct file_mapping map;
+  ucp_request_param_t param;
+  struct msg *hello;
+  struct msg hdr;
+  ucs_status_t status;
+  void *base = NULL;
+  size_t hello_len;
+  uint64_t start;
+  uint32_t ack = 0;
+  ucp_ep_h ep;
+  int ret = -1;
+  int fd = -1;
+
+  status = file_ep_create(ucp_worker, server_addr, err_handling_opt,
+                          &ep_status, &ep);
+  CHKERR_JUMP(status != UCS_OK, "ucp_ep_create\n", err);
+
+  hello_len = sizeof(*hello) + local_addr_len;
+  hello = static_cast<struct msg *>(calloc(1, hello_len));
+  CHKERR_JUMP(hello == NULL, "allocate memory\n", err_ep);
+  hello->data_len = local_addr_len;
+  memcpy(hello + 1, local_addr, local_addr_len);
+
+  status = file_send_ctrl(ucp_worker, ep, hello, hello_len, FILE_TAG_HELLO);
+  free(hello);
+  CHKERR_JUMP(status != UCS_OK, "send the local address\n", err_ep);
+
+  status = file_recv_ctrl(ucp_worker, &hdr, sizeof(hdr), FILE_TAG_HDR);
+  CHKERR_JUMP(status != UCS_OK, "receive the file header\n", err_ep);
+
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  CHKERR_JUMP(fd < 0, "create the destination file\n", err_ep);
+
+  if (hdr.data_len > 0) {
+    CHKERR_JUMP(file_preallocate(fd, hdr.data_len) != 0,
+                "preallocate the destination file\n", err_fd);
+    base = mmap(NULL, hdr.data_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                0);
+    CHKERR_ACTION(base == MAP_FAILED, "map the destination file\n",
+                  base = NULL; goto err_fd);
+  }
+  file_mapping_init(&map, ucp_context, base, hdr.data_len,
+                    UCP_MEM_MAP_PROT_LOCAL_READ | UCP_MEM_MAP_PROT_LOCAL_WRITE);
+
+  LOG_INFO("receiving %s: %lu bytes in %lu chunks\n", path, hdr.data_len,
+           file_chunk_count(hdr.data_len));
+
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK;
+  param.cb.recv = recv_handler;
+
+  start = get_time_ns();
+  ret = file_stream(ucp_worker, &map, &param, file_recv_chunk, ucp_worker,
+                    &ep_status, NULL);
+  stats->elapsed_ns = get_time_ns() - start;
+  CHKERR_JUMP(ret != 0, "stream the file\n", err_map);
+
+  stats->crc_ns = 0;
+  if (hdr.flags & MSG_FLAG_CRC32C) {
+    start = get_time_ns();
+    uint32_t crc = crc32c(0, base, hdr.data_len);
+    stats->crc_ns = get_time_ns() - start;
+    if (crc != hdr.crc) {
+      LOG_ERROR("CRC32C mismatch on %s: received 0x%08x, expected 0x%08x\n",
+                path, crc, hdr.crc);
+      ack = 1;
+    } else {
+      LOG_INFO("CRC32C verified over %lu bytes\n", hdr.data_len);
+    }
+  }
+
+  ret = -1;
+  status = file_send_ctrl(ucp_worker, ep, &ack, sizeof(ack), FILE_TAG_ACK);
+  CHKERR_JUMP(status != UCS_OK, "send the acknowledgement\n", err_map);
+
+  if (ack == 0) {
+    stats->bytes = hdr.data_len;
+    stats->chunks = file_chunk_count(hdr.data_len);
+    stats->regions = map.mapped;
+    ret = 0;
+  }
+
+err_map:
+  file_mapping_release(&map);
+  if (base != NULL) {
+    munmap(base, hdr.data_len);
+  }
+err_fd:
+  close(fd);
+err_ep:
+  ep_close_err_mode(ucp_worker, ep, err_handling_opt);
+err:
+  return ret;
+}
+
+void file_xfer_print(const char *role, const char *path,
+                     const struct file_xfer_stats *stats) {
+  double seconds = stats->elapsed_ns / 1e9;
+
+  printf("\n----- FILE TRANSFER (%s) -----\n", role);
+  printf("file        : %s\n", path);
+  printf("bytes       : %lu in %lu chunks of %lu\n", stats->bytes,
+         stats->chunks, FILE_XFER_CHUNK_SIZE);
+  printf("time        : %.3f ms\n", stats->elapsed_ns / 1e6);
+  printf("throughput  : %.3f GB/s\n",
+         (seconds > 0) ? stats->bytes / seconds / 1e9 : 0.0);
+  printf("registered  : %lu regions of up to %lu bytes\n", stats->regions,
+         FILE_XFER_REGION_SIZE);
+  if (stats->crc_ns > 0) {
+    printf("crc32c      : %.3f ms\n", stats->crc_ns / 1e6);
+  }
+  printf("--------------------------------\n\n");
+}
@@ -0,0 +1,85 @@
+#ifndef MYUCXPLAYGROUND_FILE_TRANSFER_H
+#define MYUCXPLAYGROUND_FILE_TRANSFER_H
+
+#include <stdint.h>
+#include <ucp/api/ucp.h>
+
+#include "ucx_config.h"
+
+/**
+ * Zero-copy file transfer over UCP tags.
+ *
+ * The sender mmap()s the source file and sends it straight out of the page
+ * cache. The receiver fallocate()s and mmap()s the destination and receives
+ * every chunk directly at its file offset. Both sides register their mapping
+ * with ucp_mem_map() one region at a time and pass the memory handle with
+ * each operation, so no byte is copied in user space, nothing is registered
+ * on the fly, and only regions with chunks in flight stay pinned.
+ *
+ * Up to FILE_XFER_WINDOW chunks are in flight at once. Chunk i travels on
+ * tag FILE_TAG_DATA | i, so chunks can complete in any order.
+ *
+ * Protocol: the receiver sends its worker address on FILE_TAG_HELLO, the
+ * sender answers with a struct msg header on FILE_TAG_HDR (`data_len` is the
+ * file size, plus an optional CRC32C of the whole file), streams the chunks,
+ * and the receiver acknowledges on FILE_TAG_ACK once the data is verified.
+ */
+
+#define FILE_XFER_CHUNK_SIZE (1ul << 20)
+#define FILE_XFER_REGION_SIZE (64ul << 20) /* multiple of the chunk size */
+#define FILE_XFER_WINDOW 16
+
+#define FILE_TAG_HELLO 0x1337a8b0u
+#define FILE_TAG_HDR 0x1337a8b1u
+#define FILE_TAG_ACK 0x1337a8b2u
+#define FILE_TAG_DATA 0xf11e000000000000ull
+
+struct file_xfer_stats {
+  uint64_t bytes;
+  uint64_t chunks;
+  uint64_t regions;    /* ucp_mem_map() calls */
+  uint64_t elapsed_ns; /* first chunk posted to last chunk completed */
+  uint64_t crc_ns;     /* time spent computing the CRC32C, 0 if none */
+};
+
+/**
+ * @brief Waits for a receiver and sends it the file at `path`.
+ *
+ * @param ucp_context Context the file mapping is registered with.
+ * @param ucp_worker Worker the receiver sends its address to.
+ * @param path File to send.
+ * @param verify_crc Send a CRC32C of the file for the receiver to check.
+ * @param err_handling_opt Error handling mode of the endpoint.
+ * @param test_mode How to wait for the receiver, see probe_wait().
+ * @param timeout_ns Give up if no receiver shows up within this long, 0 to
+ * wait forever.
+ * @param stats Filled on success.
+ * @return 0 once the receiver has acknowledged the file, -1 on failure.
+ */
+int file_send(ucp_context_h ucp_context, ucp_worker_h ucp_worker,
+              const char *path, int verify_crc, err_handling err_handling_opt,
+              ucp_test_mode_t test_mode, uint64_t timeout_ns,
+              struct file_xfer_stats *stats);
+
+/**
+ * @brief Receives a file from the sender at `server_addr` into `path`.
+ *
+ * `path` is created or truncated, and preallocated to the full size before
+ * any data arrives.
+ *
+ * @param local_addr Worker address sent to the sender.
+ * @return 0 once the file is written (and its CRC32C matches, if the sender
+ * sent one), -1 on failure.
+ */
+int file_recv(ucp_context_h ucp_context, ucp_worker_h ucp_worker,
+              const ucp_address_t *local_addr, size_t local_addr_len,
+              const ucp_address_t *server_addr, const char *path,
+              err_handling err_handling_opt, struct file_xfer_stats *stats);
+
+/**
+ * @brief Prints the size, throughput and registration count of a transfer.
+ */
+void file_xfer_print(const char *role, const char *path,
+                     const struct file_xfer_stats *stats);
+
+#endif // MYUCXPLAYGROUND_FILE_TRANSFER_H
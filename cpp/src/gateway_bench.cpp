@@ -0,0 +1,534 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> /* TCP_NODELAY */
+#include <pthread.h>
+#include <sched.h> /* sched_yield */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h> /* setrlimit */
+#include <sys/socket.h>
+#include <ucp/api/ucp.h>
+#include <unistd.h> /* getopt */
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "common_utils.h"
+#include "logger.h"
+#include "tcp_gateway.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+/**
+ * Drives a TcpGateway with many plain TCP connections and measures request
+ * rate and round-trip latency as the clients see them, next to the time
+ * the gateway attributes to each hop.
+ *
+ * Client threads spread -c connections between them and keep one request
+ * in flight on each, in their own epoll loop. The gateway runs on one
+ * thread and forwards to -b GatewayBackend threads, which echo every
+ * request; the clients check the echoes.
+ */
+
+#define GW_DEFAULT_CONNS 1000
+#define GW_DEFAULT_CLIENTS 2
+#define GW_DEFAULT_BACKENDS 2
+#define GW_DEFAULT_REQUESTS 100
+#define GW_DEFAULT_SIZE 64
+#define GW_MAX_EVENTS 256
+
+struct gw_bench;
+
+struct gw_client {
+  struct gw_bench *bench;
+  unsigned index;
+  std::vector<uint64_t> latency_ns;
+  std::vector<char> expected; /* payload of the reply being checked */
+  uint64_t start_ns;
+  uint64_t end_ns;
+  int ret;
+};
+
+/* One client connection */
+struct gw_conn {
+  int fd;
+  unsigned id;
+  long sent;
+  long received;
+  uint64_t send_ns;
+  std::vector<char> rbuf;
+  size_t rlen;
+  std::vector<char> wbuf;
+  size_t woff;
+};
+
+struct gw_bench {
+  struct bench_side gateway;
+  std::vector<struct bench_side> backends;
+  uint16_t port;
+  unsigned nconns;
+  unsigned nclients;
+  unsigned nbackends;
+  long requests; /* per connection */
+  size_t size;
+  size_t batch_bytes;
+  std::atomic<int> barrier_count;
+  std::atomic<bool> listening;
+  std::atomic<unsigned> clients_done;
+  std::atomic<bool> gateway_done;
+  std::atomic<long> corrupt;
+  std::vector<struct gw_client> clients;
+  /* results */
+  struct TcpGateway::stats stats;
+  int gateway_ret;
+  std::vector<int> backend_ret;
+};
+
+struct gw_backend_arg {
+  struct gw_bench *bench;
+  unsigned index;
+};
+
+static void print_gw_usage() {
+  fprintf(stderr, "Usage: run_tcp_gateway [parameters]\n");
+  fprintf(stderr, "\nParameters are:\n");
+  fprintf(stderr, "  -c <count>    TCP connections (default:%d)\n",
+          GW_DEFAULT_CONNS);
+  fprintf(stderr, "  -t <count>    Client threads (default:%d)\n",
+          GW_DEFAULT_CLIENTS);
+  fprintf(stderr, "  -b <count>    Backends (default:%d)\n",
+          GW_DEFAULT_BACKENDS);
+  fprintf(stderr, "  -n <count>    Requests per connection (default:%d)\n",
+          GW_DEFAULT_REQUESTS);
+  fprintf(stderr, "  -s <size>     Request size (default:%d)\n",
+          GW_DEFAULT_SIZE);
+  fprintf(stderr, "  -B <size>     Batch size (default:%d)\n",
+          GATEWAY_DEFAULT_BATCH);
+  fprintf(stderr, "  -p <port>     Gateway port (default:%d)\n",
+          GATEWAY_DEFAULT_PORT);
+}
+
+/* Both ends of every connection live in this process */
+static void gw_raise_fd_limit(rlim_t needed) {
+  struct rlimit limit;
+
+  if ((getrlimit(RLIMIT_NOFILE, &limit) != 0) || (limit.rlim_cur >= needed)) {
+    return;
+  }
+  limit.rlim_cur = std::min(needed, limit.rlim_max);
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < needed) {
+    LOG_WARN("only %lu file descriptors allowed, %lu needed\n",
+             (unsigned long)limit.rlim_cur, (unsigned long)needed);
+  }
+}
+
+static size_t gw_echo(void *arg, const void *request, size_t length,
+                      void *reply, size_t max_length) {
+  length = std::min(length, max_length);
+  memcpy(reply, request, length);
+  return length;
+}
+
+static void *gw_backend_thread(void *arg) {
+  struct gw_backend_arg *backend_arg = (struct gw_backend_arg *)arg;
+  struct gw_bench *bench = backend_arg->bench;
+  ucp_worker_h ucp_worker = bench->backends[backend_arg->index].ucp_worker;
+  GatewayBackend backend(ucp_worker, gw_echo, NULL);
+  ucs_status_t status;
+
+  status = backend.start();
+
+  bench_barrier(&bench->barrier_count, 1 + bench->nbackends, 1,
+                ucp_worker);
+
+  /* Replies by rendezvous complete only once the gateway has them */
+  while (!bench->gateway_done.load() || (backend.inflight() > 0)) {
+    ucp_worker_progress(ucp_worker);
+  }
+
+  bench_barrier(&bench->barrier_count, 1 + bench->nbackends, 2,
+                ucp_worker);
+  bench->backend_ret[backend_arg->index] = (status == UCS_OK) ? 0 : -1;
+  return NULL;
+}
+
+static void *gw_gateway_thread(void *arg) {
+  struct gw_bench *bench = (struct gw_bench *)arg;
+  ucp_worker_h ucp_worker = bench->gateway.ucp_worker;
+  TcpGateway *gateway = new TcpGateway(ucp_worker, bench->batch_bytes);
+  unsigned i;
+  int ret;
+
+  ret = gateway->listen(bench->port);
+  for (i = 0; (ret == 0) && (i < bench->nbackends); ++i) {
+    if (gateway->connect(bench->backends[i].worker_attr.address) !=
+        UCS_OK) {
+      ret = -1;
+    }
+  }
+
+  bench_barrier(&bench->barrier_count, 1 + bench->nbackends, 1,
+                ucp_worker);
+  /* Clients that cannot connect give up, so they finish either way */
+  bench->listening.store(true);
+
+  while ((bench->clients_done.load() < bench->nclients) ||
+         (gateway->inflight() > 0)) {
+    gateway->progress();
+  }
+  bench->gateway_done.store(true);
+
+  bench_barrier(&bench->barrier_count, 1 + bench->nbackends, 2,
+                ucp_worker);
+  bench->stats = gateway->get_stats();
+  delete gateway;
+  bench->gateway_ret = ret;
+  return NULL;
+}
+
+/* Returns -1 if the connection broke */
+static int gw_flush(struct gw_conn *conn) {
+  ssize_t n;
+
+  while (conn->woff < conn->wbuf.size()) {
+    n = send(conn->fd, conn->wbuf.data() + conn->woff,
+             conn->wbuf.size() - conn->woff, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+    }
+    conn->woff += n;
+  }
+  conn->wbuf.clear();
+  conn->woff = 0;
+  return 0;
+}
+
+static void gw_fill(const struct gw_conn *conn, char *p, size_t size) {
+  size_t i;
+
+  for (i = 0; i < size; ++i) {
+    p[i] = (char)(conn->id + conn->sent + i);
+  }
+}
+
+static int gw_send_request(struct gw_conn *conn, size_t size) {
+  struct gateway_frame frame;
+  size_t pos = conn->wbuf.size();
+
+  frame.length = size;
+  conn->wbuf.resize(pos + sizeof(frame) + size);
+  memcpy(conn->wbuf.data() + pos, &frame, sizeof(frame));
+  gw_fill(conn, conn->wbuf.data() + pos + sizeof(frame), size);
+  conn->send_ns = get_time_ns();
+  return gw_flush(conn);
+}
+
+/* Reads replies until the socket is drained. Returns 1 once the connection
+ * has all its replies, 0 if it has not and -1 on error */
+static int gw_read_replies(struct gw_client *client, struct gw_conn *conn) {
+  struct gw_bench *bench = client->bench;
+  struct gateway_frame frame;
+  size_t pos;
+  ssize_t n;
+
+  for (;;) {
+    n = recv(conn->fd, conn->rbuf.data() + conn->rlen,
+             conn->rbuf.size() - conn->rlen, 0);
+    if (n == 0) {
+      return -1;
+    } else if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        return -1;
+      }
+      return (conn->received == bench->requests) ? 1 : 0;
+    }
+    conn->rlen += n;
+
+    for (pos = 0; conn->rlen - pos >= sizeof(frame);
+         pos += sizeof(frame) + frame.length) {
+      memcpy(&frame, conn->rbuf.data() + pos, sizeof(frame));
+      if (frame.length != bench->size) {
+        return -1;
+      }
+      if (conn->rlen - pos - sizeof(frame) < frame.length) {
+        break;
+      }
+
+      client->latency_ns.push_back(get_time_ns() - conn->send_ns);
+      gw_fill(conn, client->expected.data(), bench->size);
+      if (memcmp(conn->rbuf.data() + pos + sizeof(frame),
+                 client->expected.data(), bench->size)) {
+        bench->corrupt.fetch_add(1);
+      }
+      ++conn->received;
+      if ((++conn->sent < bench->requests) &&
+          (gw_send_request(conn, bench->size) != 0)) {
+        return -1;
+      }
+    }
+    memmove(conn->rbuf.data(), conn->rbuf.data() + pos, conn->rlen - pos);
+    conn->rlen -= pos;
+  }
+}
+
+static void *gw_client_thread(void *arg) {
+  struct gw_client *client = (struct gw_client *)arg;
+  struct gw_bench *bench = client->bench;
+  struct epoll_event events[GW_MAX_EVENTS];
+  std::vector<struct gw_conn> conns;
+  struct gw_conn *conn;
+  struct epoll_event ev;
+  unsigned first, count, i;
+  unsigned done = 0;
+  int optval = 1;
+  int epoll_fd;
+  int n, j, ret = -1;
+
+  /* Connections are split as evenly as they go */
+  first = bench->nconns * client->index / bench->nclients;
+  count = bench->nconns * (client->index + 1) / bench->nclients - first;
+  conns.resize(count);
+  for (struct gw_conn &c : conns) {
+    c.fd = -1;
+  }
+  client->latency_ns.reserve(count * bench->requests);
+  client->expected.resize(bench->size);
+
+  epoll_fd = epoll_create1(0);
+  CHKERR_JUMP(epoll_fd < 0, "create client epoll\n", out);
+
+  /* Connecting before the gateway listens would be refused */
+  while (!bench->listening.load()) {
+    sched_yield();
+  }
+
+  for (i = 0; i < count; ++i) {
+    conn = &conns[i];
+    conn->fd = connect_client("127.0.0.1", bench->port, AF_INET);
+    CHKERR_JUMP(conn->fd < 0, "connect to the gateway\n", out_close);
+    set_nonblock(conn->fd);
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    conn->id = first + i;
+    conn->sent = 0;
+    conn->received = 0;
+    conn->rbuf.resize(2 * (sizeof(struct gateway_frame) + bench->size));
+    conn->rlen = 0;
+    conn->woff = 0;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = conn;
+    CHKERR_JUMP(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) < 0,
+                "add a client connection to epoll\n", out_close);
+  }
+
+  client->start_ns = get_time_ns();
+  for (i = 0; i < count; ++i) {
+    CHKERR_JUMP(gw_send_request(&conns[i], bench->size) != 0,
+                "send a request\n", out_close);
+  }
+
+  while (done < count) {
+    n = epoll_wait(epoll_fd, events, GW_MAX_EVENTS, -1);
+    if (n < 0) {
+      CHKERR_JUMP(errno != EINTR, "client epoll_wait\n", out_close);
+      continue;
+    }
+    for (j = 0; j < n; ++j) {
+      conn = (struct gw_conn *)events[j].data.ptr;
+      if ((events[j].events & EPOLLOUT) && (gw_flush(conn) != 0)) {
+        LOG_ERROR("client connection %u broke\n", conn->id);
+        goto out_close;
+      }
+      if (!(events[j].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ||
+          (conn->received == bench->requests)) {
+        continue;
+      }
+      switch (gw_read_replies(client, conn)) {
+      case 1:
+        ++done;
+        break;
+      case 0:
+        break;
+      default:
+        LOG_ERROR("client connection %u broke\n", conn->id);
+        goto out_close;
+      }
+    }
+  }
+  client->end_ns = get_time_ns();
+  ret = 0;
+
+out_close:
+  for (struct gw_conn &c : conns) {
+    if (c.fd >= 0) {
+      close(c.fd);
+    }
+  }
+  close(epoll_fd);
+out:
+  client->ret = ret;
+  bench->clients_done.fetch_add(1);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  struct gw_bench bench;
+  std::vector<struct gw_backend_arg> backend_args;
+  std::vector<pthread_t> threads;
+  std::vector<uint64_t> latency_ns;
+  const struct TcpGateway::stats *stats = &bench.stats;
+  uint64_t start_ns, end_ns;
+  pthread_t thread;
+  unsigned i, ready = 0;
+  double replies;
+  int ret = -1;
+  int c;
+
+  bench.port = GATEWAY_DEFAULT_PORT;
+  bench.nconns = GW_DEFAULT_CONNS;
+  bench.nclients = GW_DEFAULT_CLIENTS;
+  bench.nbackends = GW_DEFAULT_BACKENDS;
+  bench.requests = GW_DEFAULT_REQUESTS;
+  bench.size = GW_DEFAULT_SIZE;
+  bench.batch_bytes = GATEWAY_DEFAULT_BATCH;
+
+  while ((c = getopt(argc, argv, "c:t:b:n:s:B:p:h")) != -1) {
+    switch (c) {
+    case 'c':
+      bench.nconns = atoi(optarg);
+      break;
+    case 't':
+      bench.nclients = atoi(optarg);
+      break;
+    case 'b':
+      bench.nbackends = atoi(optarg);
+      break;
+    case 'n':
+      bench.requests = atol(optarg);
+      break;
+    case 's':
+      bench.size = strtoul(optarg, NULL, 0);
+      break;
+    case 'B':
+      bench.batch_bytes = strtoul(optarg, NULL, 0);
+      break;
+    case 'p':
+      bench.port = atoi(optarg);
+      break;
+    case 'h':
+    default:
+      print_gw_usage();
+      return -1;
+    }
+  }
+
+  if ((bench.nconns == 0) || (bench.nclients == 0) ||
+      (bench.nclients > bench.nconns) || (bench.nbackends == 0) ||
+      (bench.requests <= 0) || (bench.size == 0) ||
+      (bench.size > GATEWAY_MAX_FRAME) || (bench.batch_bytes == 0)) {
+    print_gw_usage();
+    return -1;
+  }
+
+  gw_raise_fd_limit(2 * bench.nconns + 64);
+  bench.barrier_count.store(0);
+  bench.listening.store(false);
+  bench.clients_done.store(0);
+  bench.gateway_done.store(false);
+  bench.corrupt.store(0);
+  bench.gateway_ret = -1;
+  bench.backend_ret.assign(bench.nbackends, -1);
+  bench.backends.resize(bench.nbackends);
+  bench.clients.resize(bench.nclients);
+  backend_args.resize(bench.nbackends);
+
+  ret = bench_init_side(&bench.gateway, "tcp gateway", UCP_FEATURE_AM);
+  CHKERR_JUMP(ret != 0, "initialize gateway\n", err);
+
+  for (ready = 0; ready < bench.nbackends; ++ready) {
+    ret = bench_init_side(&bench.backends[ready], "tcp gateway backend",
+                          UCP_FEATURE_AM);
+    CHKERR_JUMP(ret != 0, "initialize backend\n", err_backends);
+  }
+
+  /* Started threads never return; leave them to process exit */
+  ret = -1;
+  for (i = 0; i < bench.nbackends; ++i) {
+    backend_args[i].bench = &bench;
+    backend_args[i].index = i;
+    CHKERR_JUMP(pthread_create(&thread, NULL, gw_backend_thread,
+                               &backend_args[i]) != 0,
+                "create backend thread\n", err_backends);
+    threads.push_back(thread);
+  }
+  CHKERR_JUMP(pthread_create(&thread, NULL, gw_gateway_thread, &bench) != 0,
+              "create gateway thread\n", err_backends);
+  threads.push_back(thread);
+  for (i = 0; i < bench.nclients; ++i) {
+    bench.clients[i].bench = &bench;
+    bench.clients[i].index = i;
+    bench.clients[i].ret = -1;
+    CHKERR_JUMP(pthread_create(&thread, NULL, gw_client_thread,
+                               &bench.clients[i]) != 0,
+                "create client thread\n", err_backends);
+    threads.push_back(thread);
+  }
+  for (pthread_t t : threads) {
+    pthread_join(t, NULL);
+  }
+
+  ret = ((bench.gateway_ret == 0) && (bench.corrupt.load() == 0)) ? 0 : -1;
+  for (i = 0; i < bench.nbackends; ++i) {
+    ret |= bench.backend_ret[i];
+  }
+  start_ns = UINT64_MAX;
+  end_ns = 0;
+  for (struct gw_client &client : bench.clients) {
+    ret |= client.ret;
+    if (client.ret == 0) {
+      start_ns = std::min(start_ns, client.start_ns);
+      end_ns = std::max(end_ns, client.end_ns);
+      latency_ns.insert(latency_ns.end(), client.latency_ns.begin(),
+                        client.latency_ns.end());
+    }
+  }
+  if (ret != 0) {
+    LOG_ERROR("tcp gateway bench failed, %ld corrupt replies\n",
+              bench.corrupt.load());
+    goto err_backends;
+  }
+
+  log_flush();
+  replies = std::max(stats->replies, (uint64_t)1);
+  printf("\n%ld requests of %lu bytes on %u connections from %u threads, "
+         "%u backends, %lu byte batches; latencies in us\n",
+         bench.requests * bench.nconns, bench.size, bench.nconns,
+         bench.nclients, bench.nbackends, bench.batch_bytes);
+  printf("%12s %10s %10s %10s %10s %10s %10s %10s %10s\n", "req/s", "p50",
+         "p99", "p99.9", "per batch", "queue", "ucx", "backend", "egress");
+  printf("%12.0f %10.2f %10.2f %10.2f %10.1f %10.2f %10.2f %10.2f %10.2f\n",
+         latency_ns.size() / ((end_ns - start_ns) / 1e9),
+         percentile_us(latency_ns, 0.5), percentile_us(latency_ns, 0.99),
+         percentile_us(latency_ns, 0.999),
+         stats->frames / (double)std::max(stats->batches, (uint64_t)1),
+         stats->queue_ns / replies / 1e3, stats->ucx_ns / replies / 1e3,
+         stats->service_ns / replies / 1e3, stats->egress_ns / replies / 1e3);
+
+err_backends:
+  for (i = 0; i < ready; ++i) {
+    bench_cleanup_side(&bench.backends[i]);
+  }
+  bench_cleanup_side(&bench.gateway);
+err:
+  return ret;
+}
@@ -0,0 +1,480 @@
+#include "kv_client.h"
+#include "common_utils.h"
+#include "logger.h"
+#include "ucx_utils.h"
+
+#include <string.h>
+
+#define KV_HEADER_MAX                                                          \
+  (sizeof(struct kv_req_hdr) + KV_MAX_MGET * (sizeof(uint16_t) + KV_MAX_KEY))
+
+const char *kv_status_string(int status) {
+  switch (status) {
+  case KV_OK:
+    return "ok";
+  case KV_NOT_FOUND:
+    return "not found";
+  case KV_NO_SPACE:
+    return "no space";
+  case KV_TOO_LARGE:
+    return "value too large";
+  case KV_BAD_REQUEST:
+    return "bad request";
+  case KV_IO_ERROR:
+    return "I/O error";
+  default:
+    return "unknown";
+  }
+}
+
+static char *kv_pack_hdr(char *p, uint64_t req_id, kv_op_t op,
+                         unsigned nkeys) {
+  struct kv_req_hdr *hdr = reinterpret_cast<struct kv_req_hdr *>(p);
+
+  hdr->req_id = req_id;
+  hdr->op = op;
+  hdr->reserved = 0;
+  hdr->nkeys = nkeys;
+  hdr->reserved2 = 0;
+  return reinterpret_cast<char *>(hdr + 1);
+}
+
+KvClient::KvClient(ucp_worker_h ucp_worker)
+    : ucp_worker_(ucp_worker), max_header_(0), ops_(KV_CLIENT_MAX_OPS),
+      pending_(0), stats_() {
+  size_t i;
+
+  free_ops_.reserve(ops_.size());
+  for (i = ops_.size(); i > 0; --i) {
+    ops_[i - 1].client = this;
+    free_ops_.push_back(&ops_[i - 1]);
+  }
+}
+
+KvClient::~KvClient() {
+  if (!eps_.empty()) {
+    ep_close_batch(ucp_worker_, eps_.data(), eps_.size(),
+                   UCP_EP_CLOSE_FLAG_FORCE);
+  }
+  LOG_INFO("kv client: %lu requests, %lu rendezvous values, %lu errors\n",
+           stats_.requests, stats_.rndv_values, stats_.errors);
+}
+
+ucs_status_t
+KvClient::connect(const std::vector<const ucp_address_t *> &shards) {
+  ucp_am_handler_param_t handler_param;
+  ucp_worker_attr_t worker_attr;
+  ucp_ep_params_t ep_params;
+  ucs_status_t status;
+  ucp_ep_h ep;
+
+  worker_attr.field_mask = UCP_WORKER_ATTR_FIELD_MAX_AM_HEADER;
+  status = ucp_worker_query(ucp_worker_, &worker_attr);
+  CHKERR_ACTION(status != UCS_OK, "ucp_worker_query\n", return status);
+  max_header_ = worker_attr.max_am_header;
+
+  handler_param.field_mask = UCP_AM_HANDLER_PARAM_FIELD_ID |
+                             UCP_AM_HANDLER_PARAM_FIELD_CB |
+                             UCP_AM_HANDLER_PARAM_FIELD_ARG;
+  handler_param.id = KV_AM_REPLY;
+  handler_param.cb = reply_cb;
+  handler_param.arg = this;
+  status = ucp_worker_set_am_recv_handler(ucp_worker_, &handler_param);
+  CHKERR_ACTION(status != UCS_OK, "set the kv reply handler\n",
+                return status);
+
+  for (const ucp_address_t *address : shards) {
+    ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS;
+    ep_params.address = address;
+    status = ucp_ep_create(ucp_worker_, &ep_params, &ep);
+    CHKERR_ACTION(status != UCS_OK, "ucp_ep_create\n", return status);
+    eps_.push_back(ep);
+  }
+
+  return UCS_OK;
+}
+
+ucs_status_t KvClient::close() {
+  ucs_status_t status;
+
+  while (pending_ > 0) {
+    ucp_worker_progress(ucp_worker_);
+  }
+
+  status = worker_drain(ucp_worker_, eps_.data(), eps_.size());
+  eps_.clear();
+  return status;
+}
+
+struct KvClient::op *KvClient::get_op(kv_done_cb_t cb, void *arg) {
+  struct op *op;
+
+  if (free_ops_.empty()) {
+    return NULL;
+  }
+
+  op = free_ops_.back();
+  free_ops_.pop_back();
+  op->parent = NULL;
+  op->cb = cb;
+  op->arg = arg;
+  op->waits = 1; /* the reply */
+  op->status = KV_OK;
+  op->length = 0;
+  op->buffer = NULL;
+  op->buffer_len = 0;
+  op->nkeys = 0;
+  return op;
+}
+
+void KvClient::put_op(struct op *op) {
+  op->waits = 0;
+  free_ops_.push_back(op);
+}
+
+void KvClient::op_done(struct op *op) {
+  struct op *parent = op->parent;
+  kv_done_cb_t cb;
+  void *arg;
+  int status;
+  size_t length;
+
+  if (--op->waits > 0) {
+    return;
+  }
+
+  if (parent != NULL) {
+    if ((op->status != KV_OK) && (parent->status == KV_OK)) {
+      parent->status = op->status;
+    }
+    put_op(op);
+    op_done(parent);
+    return;
+  }
+
+  /* The callback may start a new operation in this slot */
+  cb = op->cb;
+  arg = op->arg;
+  status = op->status;
+  length = op->length;
+  put_op(op);
+  --pending_;
+  cb(arg, status, length);
+}
+
+void KvClient::fail(struct op *op, int status) {
+  if (op->status == KV_OK) {
+    op->status = status;
+  }
+  ++stats_.errors;
+  op_done(op);
+}
+
+void KvClient::send_done(void *request, ucs_status_t status,
+                         void *user_data) {
+  struct op *op = static_cast<struct op *>(user_data);
+
+  if (status != UCS_OK) {
+    LOG_WARN("kv client: request failed (%s)\n", ucs_status_string(status));
+    op->status = KV_IO_ERROR;
+    ++op->client->stats_.errors;
+  }
+  op->client->op_done(op);
+  ucp_request_free(request);
+}
+
+void KvClient::recv_done(void *request, ucs_status_t status, size_t length,
+                         void *user_data) {
+  struct op *op = static_cast<struct op *>(user_data);
+
+  if (status != UCS_OK) {
+    LOG_WARN("kv client: receiving a value failed (%s)\n",
+             ucs_status_string(status));
+    op->status = KV_IO_ERROR;
+    ++op->client->stats_.errors;
+  }
+  op->client->op_done(op);
+  if (request != NULL) {
+    ucp_request_free(request);
+  }
+}
+
+void KvClient::send(unsigned shard, struct op *op, const char *header,
+                    size_t header_len, const void *value, size_t length) {
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+
+  /* The header is on the caller's stack; the value is the caller's buffer */
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_FLAGS | UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_USER_DATA;
+  param.flags = UCP_AM_SEND_FLAG_REPLY | UCP_AM_SEND_FLAG_COPY_HEADER;
+  if (length >= KV_RNDV_THRESHOLD) {
+    param.flags |= UCP_AM_SEND_FLAG_RNDV;
+  }
+  param.cb.send = send_done;
+  param.user_data = op;
+
+  ++stats_.requests;
+  request = ucp_am_send_nbx(eps_[shard], KV_AM_REQUEST, header, header_len,
+                            value, length, &param);
+  if (UCS_PTR_IS_PTR(request)) {
+    ++op->waits;
+  } else if (UCS_PTR_IS_ERR(request)) {
+    LOG_WARN("kv client: sending a request to shard %u failed (%s)\n", shard,
+             ucs_status_string(UCS_PTR_STATUS(request)));
+    /* No reply is coming */
+    fail(op, KV_IO_ERROR);
+  }
+}
+
+unsigned KvClient::shard_of(const void *key, size_t key_len) const {
+  return kv_shard_of(kv_hash(key, key_len), (unsigned)eps_.size());
+}
+
+void KvClient::recv_value(struct op *op, void *data, size_t length,
+                          const ucp_am_recv_param_t *param,
+                          const void *buffer, size_t count, bool iov) {
+  const ucp_dt_iov_t *segs = static_cast<const ucp_dt_iov_t *>(buffer);
+  const char *src = static_cast<const char *>(data);
+  ucp_request_param_t recv_param;
+  ucs_status_ptr_t request;
+  size_t i;
+
+  if (!(param->recv_attr & UCP_AM_RECV_ATTR_FLAG_RNDV)) {
+    if (!iov) {
+      memcpy(const_cast<void *>(buffer), data, length);
+      return;
+    }
+    for (i = 0; i < count; ++i) {
+      memcpy(segs[i].buffer, src, segs[i].length);
+      src += segs[i].length;
+    }
+    return;
+  }
+
+  ++stats_.rndv_values;
+  ++op->waits;
+  recv_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                            UCP_OP_ATTR_FIELD_USER_DATA |
+                            UCP_OP_ATTR_FIELD_DATATYPE;
+  recv_param.cb.recv_am = recv_done;
+  recv_param.user_data = op;
+  recv_param.datatype = iov ? ucp_dt_make_iov() : ucp_dt_make_contig(1);
+  request = ucp_am_recv_data_nbx(ucp_worker_, data,
+                                 const_cast<void *>(buffer), count,
+                                 &recv_param);
+  if (!UCS_PTR_IS_PTR(request)) {
+    recv_done(NULL, UCS_PTR_STATUS(request), length, op);
+  }
+}
+
+ucs_status_t KvClient::reply_cb(void *arg, const void *header,
+                                size_t header_length, void *data,
+                                size_t length,
+                                const ucp_am_recv_param_t *param) {
+  KvClient *client = static_cast<KvClient *>(arg);
+  const struct kv_reply_hdr *hdr;
+  const char *lens;
+  struct op *op;
+  uint32_t len;
+  size_t total = 0;
+  unsigned i, n = 0;
+
+  hdr = static_cast<const struct kv_reply_hdr *>(header);
+  if ((header_length < sizeof(*hdr)) ||
+      (hdr->req_id >= client->ops_.size()) ||
+      (client->ops_[hdr->req_id].waits == 0)) {
+    LOG_WARN("kv client: dropping an unexpected reply\n");
+    ++client->stats_.errors;
+    return UCS_OK;
+  }
+
+  op = &client->ops_[hdr->req_id];
+  if (hdr->status != KV_OK) {
+    if (op->status == KV_OK) {
+      op->status = hdr->status;
+    }
+  } else if (op->parent == NULL) {
+    op->length = length;
+    if (length > op->buffer_len) {
+      op->status = KV_TOO_LARGE;
+    } else if (length > 0) {
+      client->recv_value(op, data, length, param, op->buffer, length, false);
+    }
+  } else if ((hdr->nvalues != op->nkeys) ||
+             (header_length < sizeof(*hdr) + op->nkeys * sizeof(len))) {
+    op->status = KV_BAD_REQUEST;
+  } else {
+    /* Found values arrive back to back; scatter them to their buffers */
+    lens = reinterpret_cast<const char *>(hdr + 1);
+    for (i = 0; i < op->nkeys; ++i) {
+      memcpy(&len, lens + i * sizeof(len), sizeof(len));
+      op->lengths[op->keys[i]] = len;
+      if ((len == KV_MISSING) || (len == 0)) {
+        continue;
+      }
+      if (len > op->buffer_len) {
+        op->status = KV_TOO_LARGE;
+      }
+      op->iov[n].buffer = op->buffers[op->keys[i]];
+      op->iov[n].length = len;
+      total += len;
+      ++n;
+    }
+
+    if (total != length) {
+      op->status = KV_BAD_REQUEST;
+    }
+    if ((op->status == KV_OK) && (n == 1)) {
+      client->recv_value(op, data, length, param, op->iov[0].buffer, length,
+                         false);
+    } else if ((op->status == KV_OK) && (n > 1)) {
+      client->recv_value(op, data, length, param, op->iov, n, true);
+    }
+  }
+
+  client->op_done(op);
+  return UCS_OK;
+}
+
+ucs_status_t KvClient::get(const void *key, size_t key_len, void *buffer,
+                           size_t length, kv_done_cb_t cb, void *arg) {
+  char header[sizeof(struct kv_req_hdr) + sizeof(uint16_t) + KV_MAX_KEY];
+  struct op *op;
+  char *p;
+
+  if (key_len > KV_MAX_KEY) {
+    return UCS_ERR_INVALID_PARAM;
+  }
+
+  op = get_op(cb, arg);
+  if (op == NULL) {
+    return UCS_ERR_NO_RESOURCE;
+  }
+
+  op->buffer = buffer;
+  op->buffer_len = length;
+  ++pending_;
+  p = kv_pack_hdr(header, op - ops_.data(), KV_OP_GET, 1);
+  p = kv_pack_key(p, key, key_len);
+  send(shard_of(key, key_len), op, header, p - header, NULL, 0);
+  return UCS_OK;
+}
+
+ucs_status_t KvClient::put(const void *key, size_t key_len, const void *value,
+                           size_t length, kv_done_cb_t cb, void *arg) {
+  char header[sizeof(struct kv_req_hdr) + sizeof(uint16_t) + KV_MAX_KEY];
+  struct op *op;
+  char *p;
+
+  if ((key_len > KV_MAX_KEY) || (length > KV_MAX_VALUE)) {
+    return UCS_ERR_INVALID_PARAM;
+  }
+
+  op = get_op(cb, arg);
+  if (op == NULL) {
+    return UCS_ERR_NO_RESOURCE;
+  }
+
+  ++pending_;
+  p = kv_pack_hdr(header, op - ops_.data(), KV_OP_PUT, 1);
+  p = kv_pack_key(p, key, key_len);
+  send(shard_of(key, key_len), op, header, p - header, value, length);
+  return UCS_OK;
+}
+
+ucs_status_t KvClient::remove(const void *key, size_t key_len,
+                              kv_done_cb_t cb, void *arg) {
+  char header[sizeof(struct kv_req_hdr) + sizeof(uint16_t) + KV_MAX_KEY];
+  struct op *op;
+  char *p;
+
+  if (key_len > KV_MAX_KEY) {
+    return UCS_ERR_INVALID_PARAM;
+  }
+
+  op = get_op(cb, arg);
+  if (op == NULL) {
+    return UCS_ERR_NO_RESOURCE;
+  }
+
+  ++pending_;
+  p = kv_pack_hdr(header, op - ops_.data(), KV_OP_DELETE, 1);
+  p = kv_pack_key(p, key, key_len);
+  send(shard_of(key, key_len), op, header, p - header, NULL, 0);
+  return UCS_OK;
+}
+
+ucs_status_t KvClient::multi_get(unsigned nkeys, const void *const *keys,
+                                 const size_t *key_lens,
+                                 void *const *buffers, size_t buffer_len,
+                                 uint32_t *lengths, kv_done_cb_t cb,
+                                 void *arg) {
+  char header[KV_HEADER_MAX];
+  unsigned shards[KV_MAX_MGET];
+  unsigned nparts = 0;
+  struct op *parent, *part;
+  size_t header_len;
+  unsigned i, shard;
+  char *p = NULL;
+
+  if ((nkeys == 0) || (nkeys > KV_MAX_MGET)) {
+    return UCS_ERR_INVALID_PARAM;
+  }
+
+  /* Check everything before anything is sent */
+  for (i = 0; i < nkeys; ++i) {
+    if (key_lens[i] > KV_MAX_KEY) {
+      return UCS_ERR_INVALID_PARAM;
+    }
+    shards[i] = shard_of(keys[i], key_lens[i]);
+  }
+  for (shard = 0; shard < eps_.size(); ++shard) {
+    header_len = 0;
+    for (i = 0; i < nkeys; ++i) {
+      if (shards[i] == shard) {
+        header_len += sizeof(uint16_t) + key_lens[i];
+      }
+    }
+    if (header_len == 0) {
+      continue;
+    }
+    if (sizeof(struct kv_req_hdr) + header_len > max_header_) {
+      return UCS_ERR_INVALID_PARAM;
+    }
+    ++nparts;
+  }
+  if (free_ops_.size() < nparts + 1) {
+    return UCS_ERR_NO_RESOURCE;
+  }
+
+  parent = get_op(cb, arg);
+  parent->waits = nparts;
+  ++pending_;
+
+  for (shard = 0; shard < eps_.size(); ++shard) {
+    part = NULL;
+    for (i = 0; i < nkeys; ++i) {
+      if (shards[i] != shard) {
+        continue;
+      }
+      if (part == NULL) {
+        part = get_op(NULL, NULL);
+        part->parent = parent;
+        part->buffers = buffers;
+        part->buffer_len = buffer_len;
+        part->lengths = lengths;
+        p = header + sizeof(struct kv_req_hdr);
+      }
+      lengths[i] = KV_MISSING;
+      part->keys[part->nkeys++] = i;
+      p = kv_pack_key(p, keys[i], key_lens[i]);
+    }
+    if (part != NULL) {
+      kv_pack_hdr(header, part - ops_.data(), KV_OP_MGET, part->nkeys);
+      send(shard, part, header, p - header, NULL, 0);
+    }
+  }
+
+  return UCS_OK;
+}
@@ -0,0 +1,162 @@
+#ifndef MYUCXPLAYGROUND_KV_CLIENT_H
+#define MYUCXPLAYGROUND_KV_CLIENT_H
+
+#include <ucp/api/ucp.h>
+
+#include <vector>
+
+#include "kv_protocol.h"
+
+#define KV_CLIENT_MAX_OPS 1024 /* outstanding requests, MULTI-GET parts too */
+
+/**
+ * @brief Called once per operation with its kv_status_t and, for GET, the
+ * value length.
+ */
+typedef void (*kv_done_cb_t)(void *arg, int status, size_t length);
+
+/**
+ * Asynchronous client of the key-value service (see KvShard).
+ *
+ * Holds an endpoint to every shard and sends each request to its key's
+ * shard. Operations complete through their callback while the worker is
+ * progressed; once an operation is accepted its callback is always called,
+ * possibly before the call returns if the request could not be sent.
+ *
+ * GET values are received straight into the caller's buffer, by rendezvous
+ * when they are large; a PUT value is sent from the caller's buffer, which
+ * must stay valid until the callback. A MULTI-GET is split into one request
+ * per shard and completes when every part has.
+ *
+ * Not thread safe: use it from the thread that progresses `ucp_worker`.
+ */
+class KvClient {
+
+public:
+  struct stats {
+    uint64_t requests;    /* sent to shards, MULTI-GET parts counted apart */
+    uint64_t rndv_values; /* replies received by rendezvous */
+    uint64_t errors;
+  };
+
+  /**
+   * @param ucp_worker Worker created with UCP_FEATURE_AM.
+   */
+  explicit KvClient(ucp_worker_h ucp_worker);
+  ~KvClient();
+
+  KvClient(const KvClient &) = delete;
+  KvClient &operator=(const KvClient &) = delete;
+
+  /**
+   * @brief Connects to the shards, in shard index order, and installs the
+   * reply handler.
+   *
+   * @return UCS_OK on success.
+   */
+  ucs_status_t connect(const std::vector<const ucp_address_t *> &shards);
+
+  /**
+   * @brief Reads `key` into `buffer`. Completes with KV_TOO_LARGE if the
+   * value is longer than `length`.
+   *
+   * @return UCS_OK if the request was accepted, UCS_ERR_NO_RESOURCE if
+   * KV_CLIENT_MAX_OPS are outstanding, UCS_ERR_INVALID_PARAM for a bad key.
+   */
+  ucs_status_t get(const void *key, size_t key_len, void *buffer,
+                   size_t length, kv_done_cb_t cb, void *arg);
+
+  /**
+   * @brief Stores `length` bytes from `value` under `key`.
+   *
+   * @return As get(); UCS_ERR_INVALID_PARAM also for a value over
+   * KV_MAX_VALUE.
+   */
+  ucs_status_t put(const void *key, size_t key_len, const void *value,
+                   size_t length, kv_done_cb_t cb, void *arg);
+
+  /**
+   * @brief Deletes `key`; completes with KV_NOT_FOUND if it did not exist.
+   */
+  ucs_status_t remove(const void *key, size_t key_len, kv_done_cb_t cb,
+                      void *arg);
+
+  /**
+   * @brief Reads up to KV_MAX_MGET keys, key `i` into `buffers[i]`, and sets
+   * `lengths[i]` to its value length or KV_MISSING. The arrays must stay
+   * valid until the callback, which gets the first error of any part.
+   *
+   * @return As get(); UCS_ERR_INVALID_PARAM also if a shard's keys do not
+   * fit the worker's maximum AM header.
+   */
+  ucs_status_t multi_get(unsigned nkeys, const void *const *keys,
+                         const size_t *key_lens, void *const *buffers,
+                         size_t buffer_len, uint32_t *lengths,
+                         kv_done_cb_t cb, void *arg);
+
+  unsigned progress() { return ucp_worker_progress(ucp_worker_); }
+
+  /**
+   * @return Operations not completed yet.
+   */
+  unsigned pending() const { return pending_; }
+
+  /**
+   * @brief Waits for outstanding operations, then closes the endpoints; see
+   * worker_drain().
+   */
+  ucs_status_t close();
+
+  unsigned nshards() const { return (unsigned)eps_.size(); }
+  const struct stats &get_stats() const { return stats_; }
+
+private:
+  struct op {
+    KvClient *client;
+    struct op *parent; /* MULTI-GET this is a part of, or NULL */
+    kv_done_cb_t cb;
+    void *arg;
+    unsigned waits; /* reply, send and receive completions still due */
+    int status;
+    size_t length;
+    /* GET: destination; MULTI-GET part: the caller's arrays and which of
+     * their slots this part's keys are */
+    void *buffer;
+    size_t buffer_len;
+    unsigned nkeys;
+    unsigned keys[KV_MAX_MGET];
+    void *const *buffers;
+    uint32_t *lengths;
+    ucp_dt_iov_t iov[KV_MAX_MGET];
+  };
+
+  static ucs_status_t reply_cb(void *arg, const void *header,
+                               size_t header_length, void *data,
+                               size_t length,
+                               const ucp_am_recv_param_t *param);
+  static void send_done(void *request, ucs_status_t status,
+                        void *user_data);
+  static void recv_done(void *request, ucs_status_t status, size_t length,
+                        void *user_data);
+
+  struct op *get_op(kv_done_cb_t cb, void *arg);
+  void put_op(struct op *op);
+  void op_done(struct op *op);
+  void fail(struct op *op, int status);
+  void send(unsigned shard, struct op *op, const char *header,
+            size_t header_len, const void *value, size_t length);
+  unsigned shard_of(const void *key, size_t key_len) const;
+  void recv_value(struct op *op, void *data, size_t length,
+                  const ucp_am_recv_param_t *param, const void *buffer,
+                  size_t count, bool iov);
+
+  ucp_worker_h ucp_worker_;
+  size_t max_header_; /* keys of a request travel in the AM header */
+  std::vector<ucp_ep_h> eps_;
+  std::vector<struct op> ops_;
+  std::vector<struct op *> free_ops_;
+  unsigned pending_;
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_KV_CLIENT_H
@@ -0,0 +1,136 @@
+#ifndef MYUCXPLAYGROUND_KV_PROTOCOL_H
+#define MYUCXPLAYGROUND_KV_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Wire format of the key-value service (KvShard / KvClient).
+ *
+ * Requests are active messages on KV_AM_REQUEST, sent with
+ * UCP_AM_SEND_FLAG_REPLY so the shard can answer on the reply endpoint.
+ * Keys travel in the AM header, after struct kv_req_hdr; a PUT value is the
+ * AM data, so a large one arrives by rendezvous straight into the store.
+ *
+ * Replies are active messages on KV_AM_REPLY. A GET reply carries the value
+ * as AM data. A MULTI-GET reply lists the value lengths in its header and
+ * carries the found values back to back as AM data, in key order.
+ *
+ * Keys are sharded by kv_shard_of(): each shard owns a disjoint part of the
+ * key space and the client sends every request to its key's shard.
+ */
+
+#define KV_AM_REQUEST 10
+#define KV_AM_REPLY 11
+
+#define KV_MAX_KEY 250  /* bytes per key */
+#define KV_MAX_MGET 32  /* keys per MULTI-GET request */
+
+/* Value length in a MULTI-GET reply for a key that does not exist */
+#define KV_MISSING UINT32_MAX
+
+/* Largest value stored: MULTI-GET replies carry lengths as uint32_t, with
+ * KV_MISSING taken */
+#define KV_MAX_VALUE (KV_MISSING - 1ul)
+
+/* Values at least this large are sent by rendezvous, from where they are
+ * stored and into where they are wanted */
+#define KV_RNDV_THRESHOLD (64ul << 10)
+
+typedef enum {
+  KV_OP_GET,
+  KV_OP_PUT,
+  KV_OP_DELETE,
+  KV_OP_MGET
+} kv_op_t;
+
+typedef enum {
+  KV_OK,
+  KV_NOT_FOUND,
+  KV_NO_SPACE,    /* the store could not allocate the value */
+  KV_TOO_LARGE,   /* the value does not fit the caller's buffer, or is over
+                     KV_MAX_VALUE on PUT */
+  KV_BAD_REQUEST, /* malformed request */
+  KV_IO_ERROR     /* the transfer itself failed */
+} kv_status_t;
+
+struct kv_req_hdr {
+  uint64_t req_id;
+  uint8_t op;       /* kv_op_t */
+  uint8_t reserved;
+  uint16_t nkeys;   /* keys that follow, each a uint16_t length and bytes */
+  uint32_t reserved2;
+};
+
+struct kv_reply_hdr {
+  uint64_t req_id;
+  int32_t status;   /* kv_status_t */
+  uint32_t nvalues; /* MULTI-GET: uint32_t lengths that follow */
+};
+
+/**
+ * @brief FNV-1a hash of a key, never 0 or 1 (the table's empty and deleted
+ * markers).
+ */
+static inline uint64_t kv_hash(const void *key, size_t key_len) {
+  const unsigned char *p = static_cast<const unsigned char *>(key);
+  uint64_t hash = 0xcbf29ce484222325ull;
+  size_t i;
+
+  for (i = 0; i < key_len; ++i) {
+    hash = (hash ^ p[i]) * 0x100000001b3ull;
+  }
+  return (hash < 2) ? hash + 2 : hash;
+}
+
+/**
+ * @brief Shard that owns a key. Uses the high bits of the hash; the table
+ * inside a shard indexes with the low ones.
+ */
+static inline unsigned kv_shard_of(uint64_t hash, unsigned nshards) {
+  return (unsigned)((hash >> 32) % nshards);
+}
+
+/**
+ * @brief Appends a key to a request header at `p`.
+ *
+ * @return The position after the key.
+ */
+static inline char *kv_pack_key(char *p, const void *key, size_t key_len) {
+  uint16_t len = (uint16_t)key_len;
+
+  memcpy(p, &len, sizeof(len));
+  memcpy(p + sizeof(len), key, key_len);
+  return p + sizeof(len) + key_len;
+}
+
+/**
+ * @brief Reads the key at `*p`, checking it lies before `end`, and advances
+ * `*p` past it.
+ *
+ * @return 0 on success, -1 if the header is truncated.
+ */
+static inline int kv_unpack_key(const char **p, const char *end,
+                                const char **key, size_t *key_len) {
+  uint16_t len;
+
+  if ((size_t)(end - *p) < sizeof(len)) {
+    return -1;
+  }
+  memcpy(&len, *p, sizeof(len));
+  if ((len > KV_MAX_KEY) || ((size_t)(end - *p) < sizeof(len) + len)) {
+    return -1;
+  }
+  *key = *p + sizeof(len);
+  *key_len = len;
+  *p += sizeof(len) + len;
+  return 0;
+}
+
+/**
+ * @brief Returns a printable name for a kv_status_t.
+ */
+const char *kv_status_string(int status);
+
+#endif // MYUCXPLAYGROUND_KV_PROTOCOL_H
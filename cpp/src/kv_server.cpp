@@ -0,0 +1,196 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <ucp/api/ucp.h>
+#include <unistd.h> /* getopt */
+
+#include <atomic>
+#include <vector>
+
+#include "common_utils.h"
+#include "kv_shard.h"
+#include "logger.h"
+#include "print_utils.h"
+#include "ucx_utils.h"
+
+/**
+ * Key-value server: runs one KvShard per thread, each on its own context
+ * and worker, and hands the shard addresses to a client (run_kv_ycsb) over
+ * the out-of-band socket. Serves that client until it disconnects, then
+ * prints what every shard did.
+ */
+
+#define KV_DEFAULT_SHARDS 2
+#define KV_DEFAULT_CAPACITY 65536
+
+struct kv_server_side {
+  struct bench_side ucp;
+  KvShard *shard;
+  pthread_t thread;
+};
+
+static std::atomic<bool> kv_stop(false);
+
+static void print_kv_server_usage() {
+  fprintf(stderr, "Usage: run_kv_server [parameters]\n");
+  fprintf(stderr, "\nParameters are:\n");
+  fprintf(stderr, "  -p <port>     Out-of-band port (default:%d)\n",
+          DEFAULT_SERVER_PORT);
+  fprintf(stderr, "  -S <shards>   Shards, one thread each (default:%d)\n",
+          KV_DEFAULT_SHARDS);
+  fprintf(stderr, "  -c <items>    Initial table capacity per shard "
+                  "(default:%d)\n",
+          KV_DEFAULT_CAPACITY);
+}
+
+static int kv_init_side(struct kv_server_side *side, unsigned index,
+                        unsigned nshards, size_t capacity) {
+  ucs_status_t status;
+
+  if (bench_init_side(&side->ucp, "kv shard", UCP_FEATURE_AM) != 0) {
+    return -1;
+  }
+
+  side->shard = new KvShard(side->ucp.ucp_worker, index, nshards, capacity);
+  status = side->shard->start();
+  CHKERR_JUMP(status != UCS_OK, "start kv shard\n", err_shard);
+  return 0;
+
+err_shard:
+  delete side->shard;
+  bench_cleanup_side(&side->ucp);
+  return -1;
+}
+
+static void kv_cleanup_side(struct kv_server_side *side) {
+  delete side->shard;
+  bench_cleanup_side(&side->ucp);
+}
+
+/* Requests are served from the AM callback, so a shard only spins */
+static void *kv_shard_thread(void *arg) {
+  struct kv_server_side *side = (struct kv_server_side *)arg;
+
+  while (!kv_stop.load(std::memory_order_relaxed)) {
+    ucp_worker_progress(side->ucp.ucp_worker);
+  }
+  return NULL;
+}
+
+/* The shard threads progress their own workers */
+static void kv_progress_nothing(void *arg) {}
+
+static int kv_send_addresses(int oob_sock,
+                             const std::vector<struct kv_server_side> &sides) {
+  uint32_t nshards = sides.size();
+  uint64_t addr_len;
+  int ret;
+
+  ret = send(oob_sock, &nshards, sizeof(nshards), 0);
+  CHKERR_ACTION(ret != (int)sizeof(nshards), "send shard count\n",
+                return -1);
+
+  for (const struct kv_server_side &side : sides) {
+    addr_len = side.ucp.worker_attr.address_length;
+    ret = send(oob_sock, &addr_len, sizeof(addr_len), 0);
+    CHKERR_ACTION(ret != (int)sizeof(addr_len), "send address length\n",
+                  return -1);
+    ret = send(oob_sock, side.ucp.worker_attr.address, addr_len, 0);
+    CHKERR_ACTION(ret != (int)addr_len, "send address\n", return -1);
+  }
+  return 0;
+}
+
+static void kv_print_shard(unsigned index,
+                           const struct kv_server_side *side) {
+  const KvShard::stats &stats = side->shard->get_stats();
+  const KvTable::stats &table = side->shard->table().get_stats();
+
+  printf("%5u %10lu %10lu %10lu %10lu %10lu %10lu %10lu %10.1f %10lu\n",
+         index, stats.gets, stats.puts, stats.deletes, stats.mgets,
+         stats.misses, stats.rndv_puts + stats.rndv_values, table.items,
+         side->shard->table().arena_bytes() / 1048576.0, stats.errors);
+}
+
+int main(int argc, char **argv) {
+  std::vector<struct kv_server_side> sides;
+  uint16_t port = DEFAULT_SERVER_PORT;
+  unsigned nshards = KV_DEFAULT_SHARDS;
+  size_t capacity = KV_DEFAULT_CAPACITY;
+  unsigned i, started = 0;
+  int oob_sock = -1;
+  int ret = -1;
+  int c;
+
+  while ((c = getopt(argc, argv, "p:S:c:h")) != -1) {
+    switch (c) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'S':
+      nshards = atoi(optarg);
+      break;
+    case 'c':
+      capacity = atol(optarg);
+      break;
+    case 'h':
+    default:
+      print_kv_server_usage();
+      return -1;
+    }
+  }
+
+  if ((nshards == 0) || (capacity == 0)) {
+    print_kv_server_usage();
+    return -1;
+  }
+
+  sides.resize(nshards);
+  for (i = 0; i < nshards; ++i) {
+    ret = kv_init_side(&sides[i], i, nshards, capacity);
+    CHKERR_JUMP(ret != 0, "initialize kv shard\n", err_sides);
+    ++started;
+  }
+
+  for (i = 0; i < nshards; ++i) {
+    ret = pthread_create(&sides[i].thread, NULL, kv_shard_thread, &sides[i]);
+    CHKERR_JUMP(ret != 0, "create kv shard thread\n", err_threads);
+  }
+
+  LOG_INFO("kv server: %u shards, waiting for a client\n", nshards);
+  ret = -1;
+  oob_sock = connect_server(port, AF_INET);
+  CHKERR_JUMP(oob_sock < 0, "server_connect\n", err_threads);
+
+  ret = kv_send_addresses(oob_sock, sides);
+  CHKERR_JUMP(ret != 0, "send shard addresses\n", err_sock);
+
+  /* The client closes its endpoints before it reaches the barrier */
+  ret = barrier(oob_sock, kv_progress_nothing, NULL);
+
+err_sock:
+  close(oob_sock);
+err_threads:
+  kv_stop.store(true);
+  while (i > 0) {
+    pthread_join(sides[--i].thread, NULL);
+  }
+
+  if (ret == 0) {
+    log_flush();
+    printf("\n%5s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "shard",
+           "gets", "puts", "deletes", "mgets", "misses", "rndv", "items",
+           "arena MiB", "errors");
+    for (i = 0; i < nshards; ++i) {
+      kv_print_shard(i, &sides[i]);
+    }
+  }
+
+err_sides:
+  while (started > 0) {
+    kv_cleanup_side(&sides[--started]);
+  }
+  return ret;
+}
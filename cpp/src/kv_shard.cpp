@@ -0,0 +1,352 @@
+#include "kv_shard.h"
+#include "logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+KvShard::KvShard(ucp_worker_h ucp_worker, unsigned index, unsigned nshards,
+                 size_t capacity)
+    : ucp_worker_(ucp_worker), index_(index), nshards_(nshards),
+      table_(capacity), stats_() {}
+
+KvShard::~KvShard() {
+  for (struct reply_ctx *ctx : free_ctx_) {
+    delete ctx;
+  }
+  LOG_INFO("kv shard %u: %lu gets, %lu puts, %lu deletes, %lu multi-gets, "
+           "%lu items\n",
+           index_, stats_.gets, stats_.puts, stats_.deletes, stats_.mgets,
+           table_.get_stats().items);
+}
+
+ucs_status_t KvShard::start() {
+  ucp_am_handler_param_t param;
+
+  param.field_mask = UCP_AM_HANDLER_PARAM_FIELD_ID |
+                     UCP_AM_HANDLER_PARAM_FIELD_CB |
+                     UCP_AM_HANDLER_PARAM_FIELD_ARG;
+  param.id = KV_AM_REQUEST;
+  param.cb = request_cb;
+  param.arg = this;
+  return ucp_worker_set_am_recv_handler(ucp_worker_, &param);
+}
+
+struct KvShard::reply_ctx *KvShard::get_reply_ctx() {
+  struct reply_ctx *ctx;
+
+  if (free_ctx_.empty()) {
+    ctx = new reply_ctx;
+    ctx->shard = this;
+  } else {
+    ctx = free_ctx_.back();
+    free_ctx_.pop_back();
+  }
+  ctx->nitems = 0;
+  return ctx;
+}
+
+void KvShard::put_reply_ctx(struct reply_ctx *ctx) {
+  unsigned i;
+
+  for (i = 0; i < ctx->nitems; ++i) {
+    table_.unref(ctx->items[i]);
+  }
+  free_ctx_.push_back(ctx);
+}
+
+void KvShard::reply_done(void *request, ucs_status_t status,
+                         void *user_data) {
+  struct reply_ctx *ctx = static_cast<struct reply_ctx *>(user_data);
+
+  if (status != UCS_OK) {
+    LOG_WARN("kv shard %u: reply failed (%s)\n", ctx->shard->index_,
+             ucs_status_string(status));
+    ++ctx->shard->stats_.errors;
+  }
+  ctx->shard->put_reply_ctx(ctx);
+  ucp_request_free(request);
+}
+
+void KvShard::reply(ucp_ep_h ep, uint64_t req_id, int status,
+                    const uint32_t *lens, unsigned nvalues,
+                    struct reply_ctx *ctx) {
+  char header[sizeof(struct kv_reply_hdr) + KV_MAX_MGET * sizeof(uint32_t)];
+  struct kv_reply_hdr *hdr = reinterpret_cast<struct kv_reply_hdr *>(header);
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+  const void *buffer = NULL;
+  size_t count = 0, bytes = 0;
+  unsigned i;
+
+  if ((ctx != NULL) && (ctx->nitems == 0)) {
+    put_reply_ctx(ctx);
+    ctx = NULL;
+  }
+
+  hdr->req_id = req_id;
+  hdr->status = status;
+  hdr->nvalues = nvalues;
+  if (nvalues > 0) {
+    memcpy(hdr + 1, lens, nvalues * sizeof(uint32_t));
+  }
+
+  /* The header is on the stack, the values stay where they are stored */
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_FLAGS;
+  param.flags = UCP_AM_SEND_FLAG_COPY_HEADER;
+
+  if (ctx != NULL) {
+    for (i = 0; i < ctx->nitems; ++i) {
+      bytes += ctx->iov[i].length;
+    }
+    if (ctx->nitems == 1) {
+      buffer = ctx->iov[0].buffer;
+      count = ctx->iov[0].length;
+    } else {
+      param.op_attr_mask |= UCP_OP_ATTR_FIELD_DATATYPE;
+      param.datatype = ucp_dt_make_iov();
+      buffer = ctx->iov;
+      count = ctx->nitems;
+    }
+    if (bytes >= KV_RNDV_THRESHOLD) {
+      param.flags |= UCP_AM_SEND_FLAG_RNDV;
+      ++stats_.rndv_values;
+    }
+    param.op_attr_mask |= UCP_OP_ATTR_FIELD_CALLBACK |
+                          UCP_OP_ATTR_FIELD_USER_DATA;
+    param.cb.send = reply_done;
+    param.user_data = ctx;
+  }
+
+  request = ucp_am_send_nbx(ep, KV_AM_REPLY, header,
+                            sizeof(*hdr) + nvalues * sizeof(uint32_t), buffer,
+                            count, &param);
+  if (UCS_PTR_IS_PTR(request)) {
+    if (ctx == NULL) {
+      ucp_request_free(request);
+    }
+    return;
+  }
+
+  if (UCS_PTR_IS_ERR(request)) {
+    LOG_WARN("kv shard %u: reply failed (%s)\n", index_,
+             ucs_status_string(UCS_PTR_STATUS(request)));
+    ++stats_.errors;
+  }
+  if (ctx != NULL) {
+    put_reply_ctx(ctx);
+  }
+}
+
+ucs_status_t KvShard::handle_get(ucp_ep_h ep, uint64_t req_id,
+                                 const char *key, size_t key_len,
+                                 uint64_t hash) {
+  struct kv_item *item = table_.find(hash, key, key_len);
+  struct reply_ctx *ctx;
+
+  ++stats_.gets;
+  if (item == NULL) {
+    ++stats_.misses;
+    reply(ep, req_id, KV_NOT_FOUND, NULL, 0, NULL);
+    return UCS_OK;
+  }
+
+  ctx = get_reply_ctx();
+  table_.ref(item);
+  ctx->items[0] = item;
+  ctx->iov[0].buffer = kv_item_value(item);
+  ctx->iov[0].length = item->value_len;
+  ctx->nitems = 1;
+  reply(ep, req_id, KV_OK, NULL, 0, ctx);
+  return UCS_OK;
+}
+
+void KvShard::put_done(void *request, ucs_status_t status, size_t length,
+                       void *user_data) {
+  struct put_ctx *ctx = static_cast<struct put_ctx *>(user_data);
+  KvShard *shard = ctx->shard;
+
+  if (status == UCS_OK) {
+    shard->table_.insert(ctx->hash, ctx->item);
+    shard->reply(ctx->reply_ep, ctx->req_id, KV_OK, NULL, 0, NULL);
+  } else {
+    LOG_WARN("kv shard %u: receiving a value failed (%s)\n", shard->index_,
+             ucs_status_string(status));
+    ++shard->stats_.errors;
+    shard->table_.unref(ctx->item);
+    shard->reply(ctx->reply_ep, ctx->req_id, KV_IO_ERROR, NULL, 0, NULL);
+  }
+
+  free(ctx);
+  if (request != NULL) {
+    ucp_request_free(request);
+  }
+}
+
+ucs_status_t KvShard::handle_put(ucp_ep_h ep, uint64_t req_id,
+                                 const char *key, size_t key_len,
+                                 uint64_t hash, void *data, size_t length,
+                                 const ucp_am_recv_param_t *param) {
+  ucp_request_param_t recv_param;
+  struct kv_item *item;
+  struct put_ctx *ctx;
+  ucs_status_ptr_t request;
+
+  ++stats_.puts;
+  if (length > KV_MAX_VALUE) {
+    /* Its length would not fit a MULTI-GET reply */
+    reply(ep, req_id, KV_TOO_LARGE, NULL, 0, NULL);
+    return UCS_OK;
+  }
+
+  item = table_.create(key, key_len, length);
+  if (item == NULL) {
+    /* Returning UCS_OK drops the data, rendezvous included */
+    reply(ep, req_id, KV_NO_SPACE, NULL, 0, NULL);
+    return UCS_OK;
+  }
+
+  if (!(param->recv_attr & UCP_AM_RECV_ATTR_FLAG_RNDV)) {
+    memcpy(kv_item_value(item), data, length);
+    table_.insert(hash, item);
+    reply(ep, req_id, KV_OK, NULL, 0, NULL);
+    return UCS_OK;
+  }
+
+  /* Fetch the value into the item; it is inserted once it has arrived */
+  ctx = static_cast<struct put_ctx *>(malloc(sizeof(*ctx)));
+  if (ctx == NULL) {
+    table_.unref(item);
+    reply(ep, req_id, KV_NO_SPACE, NULL, 0, NULL);
+    return UCS_OK;
+  }
+  ctx->shard = this;
+  ctx->item = item;
+  ctx->hash = hash;
+  ctx->reply_ep = ep;
+  ctx->req_id = req_id;
+  ++stats_.rndv_puts;
+
+  recv_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                            UCP_OP_ATTR_FIELD_USER_DATA |
+                            UCP_OP_ATTR_FIELD_DATATYPE;
+  recv_param.cb.recv_am = put_done;
+  recv_param.user_data = ctx;
+  recv_param.datatype = ucp_dt_make_contig(1);
+  request = ucp_am_recv_data_nbx(ucp_worker_, data, kv_item_value(item),
+                                 length, &recv_param);
+  if (!UCS_PTR_IS_PTR(request)) {
+    put_done(NULL, UCS_PTR_STATUS(request), length, ctx);
+  }
+  return UCS_INPROGRESS;
+}
+
+ucs_status_t KvShard::handle_mget(ucp_ep_h ep, uint64_t req_id,
+                                  const char *keys, const char *end,
+                                  unsigned nkeys) {
+  struct reply_ctx *ctx = get_reply_ctx();
+  uint32_t lens[KV_MAX_MGET];
+  struct kv_item *item;
+  const char *key;
+  size_t key_len;
+  uint64_t hash;
+  unsigned i;
+
+  ++stats_.mgets;
+  for (i = 0; i < nkeys; ++i) {
+    if (kv_unpack_key(&keys, end, &key, &key_len) != 0) {
+      ++stats_.errors;
+      put_reply_ctx(ctx);
+      reply(ep, req_id, KV_BAD_REQUEST, NULL, 0, NULL);
+      return UCS_OK;
+    }
+
+    hash = kv_hash(key, key_len);
+    item = (kv_shard_of(hash, nshards_) == index_)
+               ? table_.find(hash, key, key_len)
+               : NULL;
+    ++stats_.mget_keys;
+    if (item == NULL) {
+      ++stats_.misses;
+      lens[i] = KV_MISSING;
+      continue;
+    }
+
+    lens[i] = item->value_len;
+    if (item->value_len > 0) {
+      table_.ref(item);
+      ctx->items[ctx->nitems] = item;
+      ctx->iov[ctx->nitems].buffer = kv_item_value(item);
+      ctx->iov[ctx->nitems].length = item->value_len;
+      ++ctx->nitems;
+    }
+  }
+
+  reply(ep, req_id, KV_OK, lens, nkeys, ctx);
+  return UCS_OK;
+}
+
+ucs_status_t KvShard::request_cb(void *arg, const void *header,
+                                  size_t header_length, void *data,
+                                  size_t length,
+                                  const ucp_am_recv_param_t *param) {
+  KvShard *shard = static_cast<KvShard *>(arg);
+  const struct kv_req_hdr *hdr;
+  const char *p, *end, *key;
+  size_t key_len;
+  uint64_t hash;
+
+  if (!(param->recv_attr & UCP_AM_RECV_ATTR_FIELD_REPLY_EP) ||
+      (header_length < sizeof(*hdr))) {
+    LOG_WARN("kv shard %u: dropping a request without reply endpoint or "
+             "header\n",
+             shard->index_);
+    ++shard->stats_.errors;
+    return UCS_OK;
+  }
+
+  hdr = static_cast<const struct kv_req_hdr *>(header);
+  p = reinterpret_cast<const char *>(hdr + 1);
+  end = static_cast<const char *>(header) + header_length;
+
+  if (hdr->op == KV_OP_MGET) {
+    if ((hdr->nkeys == 0) || (hdr->nkeys > KV_MAX_MGET)) {
+      goto bad_request;
+    }
+    return shard->handle_mget(param->reply_ep, hdr->req_id, p, end,
+                              hdr->nkeys);
+  }
+
+  if ((hdr->nkeys != 1) || (kv_unpack_key(&p, end, &key, &key_len) != 0)) {
+    goto bad_request;
+  }
+  hash = kv_hash(key, key_len);
+  if (kv_shard_of(hash, shard->nshards_) != shard->index_) {
+    goto bad_request;
+  }
+
+  switch (hdr->op) {
+  case KV_OP_GET:
+    return shard->handle_get(param->reply_ep, hdr->req_id, key, key_len,
+                             hash);
+  case KV_OP_PUT:
+    return shard->handle_put(param->reply_ep, hdr->req_id, key, key_len,
+                             hash, data, length, param);
+  case KV_OP_DELETE:
+    ++shard->stats_.deletes;
+    if (shard->table_.remove(hash, key, key_len)) {
+      shard->reply(param->reply_ep, hdr->req_id, KV_OK, NULL, 0, NULL);
+    } else {
+      ++shard->stats_.misses;
+      shard->reply(param->reply_ep, hdr->req_id, KV_NOT_FOUND, NULL, 0,
+                   NULL);
+    }
+    return UCS_OK;
+  default:
+    break;
+  }
+
+bad_request:
+  ++shard->stats_.errors;
+  shard->reply(param->reply_ep, hdr->req_id, KV_BAD_REQUEST, NULL, 0, NULL);
+  return UCS_OK;
+}
@@ -0,0 +1,113 @@
+#ifndef MYUCXPLAYGROUND_KV_SHARD_H
+#define MYUCXPLAYGROUND_KV_SHARD_H
+
+#include <ucp/api/ucp.h>
+
+#include <vector>
+
+#include "kv_protocol.h"
+#include "kv_table.h"
+
+/**
+ * One shard of the key-value service: a KvTable served over active
+ * messages on one worker.
+ *
+ * Requests are handled inside the AM callback, so a shard needs nothing but
+ * its worker being progressed. GET and MULTI-GET replies send values from
+ * the table's own memory (an IOV of them for MULTI-GET), holding a reference
+ * on each item until the send completes; values of KV_RNDV_THRESHOLD bytes
+ * and up are forced to rendezvous, so they are never copied on this side. A
+ * large PUT value is received by rendezvous straight into its new item.
+ *
+ * The service shards by key hash (kv_shard_of()); a shard rejects keys that
+ * belong to another one. Each shard runs on its own thread with its own
+ * worker, so shards share no state and take no locks.
+ */
+class KvShard {
+
+public:
+  struct stats {
+    uint64_t gets;
+    uint64_t puts;
+    uint64_t deletes;
+    uint64_t mgets;
+    uint64_t mget_keys;
+    uint64_t misses;       /* keys not found */
+    uint64_t rndv_puts;    /* values received by rendezvous */
+    uint64_t rndv_values;  /* values sent by rendezvous */
+    uint64_t errors;       /* malformed requests and failed transfers */
+  };
+
+  /**
+   * @param ucp_worker Worker created with UCP_FEATURE_AM.
+   * @param index This shard's index.
+   * @param nshards Number of shards in the service.
+   * @param capacity Initial table capacity.
+   */
+  KvShard(ucp_worker_h ucp_worker, unsigned index, unsigned nshards,
+          size_t capacity);
+  ~KvShard();
+
+  KvShard(const KvShard &) = delete;
+  KvShard &operator=(const KvShard &) = delete;
+
+  /**
+   * @brief Installs the request handler on the worker.
+   *
+   * @return UCS_OK on success.
+   */
+  ucs_status_t start();
+
+  const struct stats &get_stats() const { return stats_; }
+
+  const KvTable &table() const { return table_; }
+
+private:
+  /* Items a reply is sending from, released when the send completes */
+  struct reply_ctx {
+    KvShard *shard;
+    unsigned nitems;
+    struct kv_item *items[KV_MAX_MGET];
+    ucp_dt_iov_t iov[KV_MAX_MGET];
+  };
+
+  /* A PUT whose value is arriving by rendezvous */
+  struct put_ctx {
+    KvShard *shard;
+    struct kv_item *item;
+    uint64_t hash;
+    ucp_ep_h reply_ep;
+    uint64_t req_id;
+  };
+
+  static ucs_status_t request_cb(void *arg, const void *header,
+                                 size_t header_length, void *data,
+                                 size_t length,
+                                 const ucp_am_recv_param_t *param);
+  static void reply_done(void *request, ucs_status_t status,
+                         void *user_data);
+  static void put_done(void *request, ucs_status_t status, size_t length,
+                       void *user_data);
+
+  ucs_status_t handle_get(ucp_ep_h ep, uint64_t req_id, const char *key,
+                          size_t key_len, uint64_t hash);
+  ucs_status_t handle_put(ucp_ep_h ep, uint64_t req_id, const char *key,
+                          size_t key_len, uint64_t hash, void *data,
+                          size_t length, const ucp_am_recv_param_t *param);
+  ucs_status_t handle_mget(ucp_ep_h ep, uint64_t req_id, const char *keys,
+                           const char *end, unsigned nkeys);
+  void reply(ucp_ep_h ep, uint64_t req_id, int status,
+             const uint32_t *lens, unsigned nvalues, struct reply_ctx *ctx);
+
+  struct reply_ctx *get_reply_ctx();
+  void put_reply_ctx(struct reply_ctx *ctx);
+
+  ucp_worker_h ucp_worker_;
+  unsigned index_;
+  unsigned nshards_;
+  KvTable table_;
+  std::vector<struct reply_ctx *> free_ctx_;
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_KV_SHARD_H
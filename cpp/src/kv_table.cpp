@@ -0,0 +1,229 @@
+#include "kv_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define KV_SLOT_EMPTY 0
+#define KV_SLOT_DELETED 1
+
+/* Size class of a block, stored in front of it */
+#define KV_ARENA_LARGE KV_ARENA_CLASSES
+
+struct kv_block_hdr {
+  uint32_t size_class;
+  uint32_t reserved;
+};
+
+KvArena::KvArena() : bump_(NULL), bump_end_(NULL) {
+  memset(free_, 0, sizeof(free_));
+}
+
+KvArena::~KvArena() {
+  for (char *chunk : chunks_) {
+    ::free(chunk);
+  }
+}
+
+void *KvArena::alloc(size_t size) {
+  size_t total = size + sizeof(struct kv_block_hdr);
+  struct kv_block_hdr *hdr;
+  unsigned size_class = 0;
+  size_t block_size;
+  char *chunk;
+
+  if (total > KV_ARENA_CHUNK_SIZE) {
+    hdr = static_cast<struct kv_block_hdr *>(malloc(total));
+    if (hdr == NULL) {
+      return NULL;
+    }
+    hdr->size_class = KV_ARENA_LARGE;
+    return hdr + 1;
+  }
+
+  while ((1ul << (size_class + KV_ARENA_MIN_SHIFT)) < total) {
+    ++size_class;
+  }
+  block_size = 1ul << (size_class + KV_ARENA_MIN_SHIFT);
+
+  if (free_[size_class] != NULL) {
+    hdr = reinterpret_cast<struct kv_block_hdr *>(free_[size_class]);
+    free_[size_class] = free_[size_class]->next;
+  } else {
+    if ((bump_ == NULL) || ((size_t)(bump_end_ - bump_) < block_size)) {
+      chunk = static_cast<char *>(malloc(KV_ARENA_CHUNK_SIZE));
+      if (chunk == NULL) {
+        return NULL;
+      }
+      chunks_.push_back(chunk);
+      bump_ = chunk;
+      bump_end_ = chunk + KV_ARENA_CHUNK_SIZE;
+    }
+    hdr = reinterpret_cast<struct kv_block_hdr *>(bump_);
+    bump_ += block_size;
+  }
+
+  hdr->size_class = size_class;
+  return hdr + 1;
+}
+
+void KvArena::free(void *ptr) {
+  struct kv_block_hdr *hdr = static_cast<struct kv_block_hdr *>(ptr) - 1;
+  unsigned size_class = hdr->size_class;
+  struct free_block *block;
+
+  if (size_class == KV_ARENA_LARGE) {
+    ::free(hdr);
+    return;
+  }
+
+  block = reinterpret_cast<struct free_block *>(hdr);
+  block->next = free_[size_class];
+  free_[size_class] = block;
+}
+
+KvTable::KvTable(size_t capacity) : mask_(0), used_(0), dead_(0), stats_() {
+  size_t size = 16;
+
+  while (size < capacity) {
+    size <<= 1;
+  }
+  slots_.assign(size, {KV_SLOT_EMPTY, NULL});
+  mask_ = size - 1;
+}
+
+KvTable::~KvTable() {
+  for (struct slot &slot : slots_) {
+    if (slot.item != NULL) {
+      unref(slot.item);
+    }
+  }
+}
+
+size_t KvTable::lookup(uint64_t hash, const void *key, size_t key_len) const {
+  size_t index = hash & mask_;
+  const struct slot *slot;
+
+  for (;; index = (index + 1) & mask_) {
+    slot = &slots_[index];
+    if (slot->hash == KV_SLOT_EMPTY) {
+      return SIZE_MAX;
+    }
+    if ((slot->hash == hash) && (slot->item->key_len == key_len) &&
+        (memcmp(kv_item_key(slot->item), key, key_len) == 0)) {
+      return index;
+    }
+  }
+}
+
+struct kv_item *KvTable::find(uint64_t hash, const void *key,
+                              size_t key_len) const {
+  size_t index = lookup(hash, key, key_len);
+
+  return (index == SIZE_MAX) ? NULL : slots_[index].item;
+}
+
+struct kv_item *KvTable::create(const void *key, size_t key_len,
+                                size_t value_len) {
+  struct kv_item *item;
+
+  item = static_cast<struct kv_item *>(
+      arena_.alloc(sizeof(*item) + key_len + value_len));
+  if (item == NULL) {
+    return NULL;
+  }
+
+  item->refs = 1;
+  item->key_len = key_len;
+  item->reserved = 0;
+  item->value_len = value_len;
+  memcpy(kv_item_key(item), key, key_len);
+  return item;
+}
+
+void KvTable::rehash(size_t capacity) {
+  std::vector<struct slot> old;
+  size_t index;
+
+  old.swap(slots_);
+  slots_.assign(capacity, {KV_SLOT_EMPTY, NULL});
+  mask_ = capacity - 1;
+  dead_ = 0;
+
+  for (const struct slot &slot : old) {
+    if (slot.item == NULL) {
+      continue;
+    }
+    for (index = slot.hash & mask_; slots_[index].item != NULL;
+         index = (index + 1) & mask_) {
+    }
+    slots_[index] = slot;
+  }
+  ++stats_.resizes;
+}
+
+void KvTable::insert(uint64_t hash, struct kv_item *item) {
+  size_t index, free_index = SIZE_MAX;
+  struct slot *slot;
+
+  /* Keep probe sequences short: at most 3/4 of the slots in use */
+  if ((used_ + dead_ + 1) * 4 > slots_.size() * 3) {
+    rehash(((used_ + 1) * 2 > slots_.size()) ? slots_.size() * 2
+                                             : slots_.size());
+  }
+
+  for (index = hash & mask_;; index = (index + 1) & mask_) {
+    slot = &slots_[index];
+    if (slot->hash == KV_SLOT_EMPTY) {
+      break;
+    }
+    if (slot->hash == KV_SLOT_DELETED) {
+      if (free_index == SIZE_MAX) {
+        free_index = index;
+      }
+      continue;
+    }
+    if ((slot->hash == hash) && (slot->item->key_len == item->key_len) &&
+        (memcmp(kv_item_key(slot->item), kv_item_key(item), item->key_len) ==
+         0)) {
+      stats_.value_bytes += item->value_len - slot->item->value_len;
+      unref(slot->item);
+      slot->item = item;
+      return;
+    }
+  }
+
+  if (free_index != SIZE_MAX) {
+    slot = &slots_[free_index];
+    --dead_;
+  }
+  slot->hash = hash;
+  slot->item = item;
+  ++used_;
+  stats_.items = used_;
+  stats_.value_bytes += item->value_len;
+}
+
+int KvTable::remove(uint64_t hash, const void *key, size_t key_len) {
+  size_t index = lookup(hash, key, key_len);
+  struct kv_item *item;
+
+  if (index == SIZE_MAX) {
+    return 0;
+  }
+
+  item = slots_[index].item;
+  slots_[index].hash = KV_SLOT_DELETED;
+  slots_[index].item = NULL;
+  --used_;
+  ++dead_;
+  stats_.items = used_;
+  stats_.value_bytes -= item->value_len;
+  unref(item);
+  return 1;
+}
+
+void KvTable::unref(struct kv_item *item) {
+  if (--item->refs == 0) {
+    arena_.free(item);
+  }
+}
@@ -0,0 +1,161 @@
+#ifndef MYUCXPLAYGROUND_KV_TABLE_H
+#define MYUCXPLAYGROUND_KV_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+/* Arena chunk size; blocks up to this size come from chunks */
+#define KV_ARENA_CHUNK_SIZE (4ul << 20)
+#define KV_ARENA_MIN_SHIFT 6 /* smallest block: 64 bytes */
+#define KV_ARENA_CLASSES 17  /* 64 B ... 4 MiB */
+
+/**
+ * Size-class allocator for stored items.
+ *
+ * Blocks are carved from KV_ARENA_CHUNK_SIZE chunks in power-of-two classes
+ * and recycled through a free list per class, so a store churning through
+ * same-sized values reuses the same memory instead of going back to
+ * malloc(). Memory UCX has registered for a send (its registration cache)
+ * stays registered across reuse. Blocks larger than a chunk get their own
+ * allocation. Chunks are only returned when the arena is destroyed.
+ *
+ * Not thread safe.
+ */
+class KvArena {
+
+public:
+  KvArena();
+  ~KvArena();
+
+  KvArena(const KvArena &) = delete;
+  KvArena &operator=(const KvArena &) = delete;
+
+  /**
+   * @return `size` bytes aligned to 8, or NULL if out of memory.
+   */
+  void *alloc(size_t size);
+
+  void free(void *ptr);
+
+  size_t chunk_bytes() const { return chunks_.size() * KV_ARENA_CHUNK_SIZE; }
+
+private:
+  struct free_block {
+    struct free_block *next;
+  };
+
+  std::vector<char *> chunks_;
+  char *bump_;     /* next free byte of the last chunk */
+  char *bump_end_;
+  struct free_block *free_[KV_ARENA_CLASSES];
+};
+
+/**
+ * A stored key and value, contiguous so the value can be sent from where
+ * it lives.
+ *
+ * `refs` counts the table's reference and every reply still reading the
+ * value. An overwritten or deleted item leaves the table at once but is
+ * only freed when the last reply referencing it completes.
+ */
+struct kv_item {
+  uint32_t refs;
+  uint16_t key_len;
+  uint16_t reserved;
+  uint64_t value_len;
+  /* key bytes, then value bytes */
+};
+
+static inline char *kv_item_key(struct kv_item *item) {
+  return reinterpret_cast<char *>(item + 1);
+}
+
+static inline char *kv_item_value(struct kv_item *item) {
+  return kv_item_key(item) + item->key_len;
+}
+
+/**
+ * Open-addressing hash table from keys to arena-allocated items.
+ *
+ * Linear probing over a power-of-two array of (hash, item) slots; deleted
+ * slots become tombstones and the array is rebuilt (doubled if needed) when
+ * live plus dead slots pass 3/4. The full 64-bit hash is kept in the slot,
+ * so probes compare keys only on a hash match.
+ *
+ * Not thread safe: each shard owns a table.
+ */
+class KvTable {
+
+public:
+  struct stats {
+    uint64_t items;
+    uint64_t value_bytes;
+    uint64_t resizes;
+  };
+
+  /**
+   * @param capacity Initial number of slots, rounded up to a power of two.
+   */
+  explicit KvTable(size_t capacity);
+  ~KvTable();
+
+  KvTable(const KvTable &) = delete;
+  KvTable &operator=(const KvTable &) = delete;
+
+  /**
+   * @return The item for `key`, or NULL. Take a reference with ref() to
+   * keep it past the next insert() or remove().
+   */
+  struct kv_item *find(uint64_t hash, const void *key, size_t key_len) const;
+
+  /**
+   * @brief Allocates an item for `key` with room for a `value_len` value,
+   * not yet in the table, holding one reference. The caller fills the value
+   * and insert()s it, which hands that reference to the table, or unref()s
+   * it to drop it.
+   *
+   * @return The item, or NULL if out of memory.
+   */
+  struct kv_item *create(const void *key, size_t key_len, size_t value_len);
+
+  /**
+   * @brief Adds `item`, replacing any item with the same key.
+   */
+  void insert(uint64_t hash, struct kv_item *item);
+
+  /**
+   * @return 1 if `key` was removed, 0 if it was not there.
+   */
+  int remove(uint64_t hash, const void *key, size_t key_len);
+
+  void ref(struct kv_item *item) { ++item->refs; }
+
+  /**
+   * @brief Drops a reference, freeing the item with the last one.
+   */
+  void unref(struct kv_item *item);
+
+  const struct stats &get_stats() const { return stats_; }
+
+  size_t arena_bytes() const { return arena_.chunk_bytes(); }
+
+private:
+  struct slot {
+    uint64_t hash; /* KV_SLOT_EMPTY, KV_SLOT_DELETED or the key's hash */
+    struct kv_item *item;
+  };
+
+  size_t lookup(uint64_t hash, const void *key, size_t key_len) const;
+  void rehash(size_t capacity);
+
+  std::vector<struct slot> slots_;
+  size_t mask_;
+  size_t used_; /* live items */
+  size_t dead_; /* tombstones */
+  KvArena arena_;
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_KV_TABLE_H
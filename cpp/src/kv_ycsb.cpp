@@ -0,0 +1,493 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <ucp/api/ucp.h>
+#include <unistd.h> /* getopt */
+
+#include <algorithm>
+#include <vector>
+
+#include "common_utils.h"
+#include "kv_client.h"
+#include "logger.h"
+#include "print_utils.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+/**
+ * YCSB-style load generator for run_kv_server.
+ *
+ * Loads `records` keys, then runs a timed mix of reads, updates and deletes
+ * over them with a fixed number of operations in flight. Keys are drawn
+ * from a scrambled Zipfian distribution as in YCSB, so a few keys are hot
+ * but they are spread over all shards. Reads can be batched into
+ * MULTI-GETs. Reports throughput and latency percentiles per operation.
+ */
+
+#define YCSB_DEFAULT_RECORDS 100000
+#define YCSB_DEFAULT_OPS 1000000
+#define YCSB_DEFAULT_VALUE 1000
+#define YCSB_DEFAULT_DEPTH 16
+#define YCSB_DEFAULT_THETA 0.99
+#define YCSB_KEY_LEN 16 /* "user" and ten digits */
+
+struct ycsb_bench;
+
+struct ycsb_slot {
+  struct ycsb_bench *bench;
+  kv_op_t op;
+  unsigned nkeys;
+  uint64_t start_ns;
+  char keys[KV_MAX_MGET][YCSB_KEY_LEN];
+  const void *key_ptrs[KV_MAX_MGET];
+  size_t key_lens[KV_MAX_MGET];
+  void *buffers[KV_MAX_MGET];
+  uint32_t lengths[KV_MAX_MGET];
+};
+
+/* Zipfian ranks as generated by YCSB, after Gray et al., "Quickly
+ * generating billion-record synthetic databases" */
+struct ycsb_zipf {
+  uint64_t items;
+  double theta;
+  double alpha;
+  double zetan;
+  double eta;
+};
+
+struct ycsb_bench {
+  KvClient *client;
+  char workload;
+  long records;
+  long ops;
+  size_t value_size;
+  unsigned depth;
+  unsigned mget;
+  int read_pct;
+  int delete_pct;
+  struct ycsb_zipf zipf;
+  uint64_t rng;
+  std::vector<char> value;
+  std::vector<char> buffers;
+  std::vector<struct ycsb_slot> slots;
+  std::vector<struct ycsb_slot *> free_slots;
+  /* results, indexed by kv_op_t */
+  std::vector<uint64_t> latency_ns[KV_OP_MGET + 1];
+  uint64_t misses;
+  uint64_t errors;
+};
+
+static const char *op_names[] = {"get", "put", "delete", "mget"};
+
+static void print_kv_ycsb_usage() {
+  fprintf(stderr, "Usage: run_kv_ycsb [parameters]\n");
+  fprintf(stderr, "\nParameters are:\n");
+  fprintf(stderr, "  -n <name>     Server name (default: localhost)\n");
+  fprintf(stderr, "  -p <port>     Out-of-band port (default:%d)\n",
+          DEFAULT_SERVER_PORT);
+  fprintf(stderr, "  -w <a|b|c>    Workload: a 50%% reads, b 95%% reads, "
+                  "c read only (default: a)\n");
+  fprintf(stderr, "  -d <pct>      Percentage of operations that are "
+                  "deletes (default:0)\n");
+  fprintf(stderr, "  -r <count>    Records loaded (default:%d)\n",
+          YCSB_DEFAULT_RECORDS);
+  fprintf(stderr, "  -o <count>    Operations in the run (default:%d)\n",
+          YCSB_DEFAULT_OPS);
+  fprintf(stderr, "  -v <size>     Value size (default:%d)\n",
+          YCSB_DEFAULT_VALUE);
+  fprintf(stderr, "  -q <depth>    Operations in flight (default:%d)\n",
+          YCSB_DEFAULT_DEPTH);
+  fprintf(stderr, "  -z <theta>    Zipfian constant, 0 for uniform keys "
+                  "(default:%.2f)\n",
+          YCSB_DEFAULT_THETA);
+  fprintf(stderr, "  -M <keys>     Read <keys> keys per MULTI-GET instead of "
+                  "single GETs (max:%d)\n",
+          KV_MAX_MGET);
+}
+
+static double ycsb_uniform(struct ycsb_bench *bench) {
+  return (bench_rand(&bench->rng) >> 11) * (1.0 / (1ull << 53));
+}
+
+static void ycsb_zipf_init(struct ycsb_zipf *zipf, uint64_t items,
+                           double theta) {
+  double zeta2 = 1 + pow(0.5, theta);
+  uint64_t i;
+
+  zipf->items = items;
+  zipf->theta = theta;
+  zipf->zetan = 0;
+  for (i = 1; i <= items; ++i) {
+    zipf->zetan += 1 / pow((double)i, theta);
+  }
+  zipf->alpha = 1 / (1 - theta);
+  zipf->eta =
+      (1 - pow(2.0 / items, 1 - theta)) / (1 - zeta2 / zipf->zetan);
+}
+
+static uint64_t ycsb_next_key(struct ycsb_bench *bench) {
+  struct ycsb_zipf *zipf = &bench->zipf;
+  double u, uz;
+  uint64_t rank;
+
+  if (zipf->theta == 0) {
+    return bench_rand(&bench->rng) % zipf->items;
+  }
+
+  u = ycsb_uniform(bench);
+  uz = u * zipf->zetan;
+  if (uz < 1) {
+    rank = 0;
+  } else if (uz < 1 + pow(0.5, zipf->theta)) {
+    rank = 1;
+  } else {
+    rank = zipf->items * pow(zipf->eta * u - zipf->eta + 1, zipf->alpha);
+  }
+
+  /* Scatter the popular ranks over the key space */
+  return kv_hash(&rank, sizeof(rank)) % zipf->items;
+}
+
+static void ycsb_set_key(struct ycsb_slot *slot, unsigned i, uint64_t id) {
+  slot->key_lens[i] = snprintf(slot->keys[i], YCSB_KEY_LEN, "user%010lu",
+                               (unsigned long)id);
+  slot->key_ptrs[i] = slot->keys[i];
+}
+
+static void ycsb_done(void *arg, int status, size_t length) {
+  struct ycsb_slot *slot = (struct ycsb_slot *)arg;
+  struct ycsb_bench *bench = slot->bench;
+  unsigned i;
+
+  bench->latency_ns[slot->op].push_back(get_time_ns() - slot->start_ns);
+  if (status == KV_NOT_FOUND) {
+    ++bench->misses;
+  } else if (status != KV_OK) {
+    ++bench->errors;
+  } else if (slot->op == KV_OP_MGET) {
+    for (i = 0; i < slot->nkeys; ++i) {
+      bench->misses += (slot->lengths[i] == KV_MISSING);
+    }
+  }
+  bench->free_slots.push_back(slot);
+}
+
+static ucs_status_t ycsb_issue(struct ycsb_bench *bench,
+                               struct ycsb_slot *slot, kv_op_t op) {
+  KvClient *client = bench->client;
+  ucs_status_t status;
+  unsigned i;
+
+  slot->op = op;
+  slot->nkeys = (op == KV_OP_MGET) ? bench->mget : 1;
+  for (i = 0; i < slot->nkeys; ++i) {
+    ycsb_set_key(slot, i, ycsb_next_key(bench));
+  }
+
+  slot->start_ns = get_time_ns();
+  switch (op) {
+  case KV_OP_GET:
+    status = client->get(slot->keys[0], slot->key_lens[0], slot->buffers[0],
+                         bench->value_size, ycsb_done, slot);
+    break;
+  case KV_OP_PUT:
+    status = client->put(slot->keys[0], slot->key_lens[0],
+                         bench->value.data(), bench->value_size, ycsb_done,
+                         slot);
+    break;
+  case KV_OP_DELETE:
+    status = client->remove(slot->keys[0], slot->key_lens[0], ycsb_done,
+                            slot);
+    break;
+  default:
+    status = client->multi_get(slot->nkeys, slot->key_ptrs, slot->key_lens,
+                               slot->buffers, bench->value_size,
+                               slot->lengths, ycsb_done, slot);
+    break;
+  }
+  return status;
+}
+
+/* Loads records 0..records-1 in order */
+static ucs_status_t ycsb_load(struct ycsb_bench *bench) {
+  struct ycsb_slot *slot;
+  ucs_status_t status;
+  long id = 0;
+
+  while ((id < bench->records) || (bench->client->pending() > 0)) {
+    if ((id < bench->records) && !bench->free_slots.empty()) {
+      slot = bench->free_slots.back();
+      slot->op = KV_OP_PUT;
+      slot->nkeys = 1;
+      ycsb_set_key(slot, 0, id);
+      slot->start_ns = get_time_ns();
+      status = bench->client->put(slot->keys[0], slot->key_lens[0],
+                                  bench->value.data(), bench->value_size,
+                                  ycsb_done, slot);
+      if (status == UCS_OK) {
+        /* A request that failed to send has already pushed its slot again */
+        bench->free_slots.pop_back();
+        ++id;
+        continue;
+      }
+      CHKERR_ACTION(status != UCS_ERR_NO_RESOURCE, "kv put\n",
+                    return status);
+    }
+    bench->client->progress();
+  }
+
+  bench->latency_ns[KV_OP_PUT].clear();
+  return UCS_OK;
+}
+
+static kv_op_t ycsb_next_op(struct ycsb_bench *bench) {
+  int pct = bench_rand(&bench->rng) % 100;
+
+  if (pct < bench->delete_pct) {
+    return KV_OP_DELETE;
+  }
+  if ((bench_rand(&bench->rng) % 100) < (uint64_t)bench->read_pct) {
+    return (bench->mget > 0) ? KV_OP_MGET : KV_OP_GET;
+  }
+  return KV_OP_PUT;
+}
+
+static ucs_status_t ycsb_run(struct ycsb_bench *bench) {
+  struct ycsb_slot *slot;
+  ucs_status_t status;
+  long issued = 0;
+  kv_op_t op = ycsb_next_op(bench);
+
+  while ((issued < bench->ops) || (bench->client->pending() > 0)) {
+    if ((issued < bench->ops) && !bench->free_slots.empty()) {
+      slot = bench->free_slots.back();
+      status = ycsb_issue(bench, slot, op);
+      if (status == UCS_OK) {
+        /* A request that failed to send has already pushed its slot again */
+        bench->free_slots.pop_back();
+        op = ycsb_next_op(bench);
+        ++issued;
+        continue;
+      }
+      CHKERR_ACTION(status != UCS_ERR_NO_RESOURCE, "kv request\n",
+                    return status);
+    }
+    bench->client->progress();
+  }
+
+  return UCS_OK;
+}
+
+static int ycsb_connect(struct ycsb_bench *bench, int oob_sock) {
+  std::vector<const ucp_address_t *> shards;
+  std::vector<std::vector<char>> addresses;
+  uint32_t nshards, i;
+  uint64_t addr_len;
+  ucs_status_t status;
+  int ret;
+
+  ret = recv(oob_sock, &nshards, sizeof(nshards), MSG_WAITALL);
+  CHKERR_ACTION(ret != (int)sizeof(nshards), "receive shard count\n",
+                return -1);
+
+  addresses.resize(nshards);
+  for (i = 0; i < nshards; ++i) {
+    ret = recv(oob_sock, &addr_len, sizeof(addr_len), MSG_WAITALL);
+    CHKERR_ACTION(ret != (int)sizeof(addr_len), "receive address length\n",
+                  return -1);
+    addresses[i].resize(addr_len);
+    ret = recv(oob_sock, addresses[i].data(), addr_len, MSG_WAITALL);
+    CHKERR_ACTION(ret != (int)addr_len, "receive address\n", return -1);
+    shards.push_back((const ucp_address_t *)addresses[i].data());
+  }
+
+  /* Endpoints keep what they need from the addresses */
+  status = bench->client->connect(shards);
+  CHKERR_ACTION(status != UCS_OK, "connect to kv shards\n", return -1);
+  return 0;
+}
+
+static void ycsb_progress(void *arg) {
+  ucp_worker_progress((ucp_worker_h)arg);
+}
+
+int main(int argc, char **argv) {
+  struct ycsb_bench bench;
+  const char *server = "localhost";
+  uint16_t port = DEFAULT_SERVER_PORT;
+  double theta = YCSB_DEFAULT_THETA;
+  ucp_params_t ucp_params;
+  ucp_worker_params_t worker_params;
+  ucp_context_h ucp_context;
+  ucp_worker_h ucp_worker;
+  ucp_config_t *config;
+  ucs_status_t status;
+  uint64_t start_ns, load_ns, run_ns;
+  size_t per_slot;
+  unsigned i, j;
+  int oob_sock = -1;
+  int ret = -1;
+  int c;
+
+  bench.workload = 'a';
+  bench.records = YCSB_DEFAULT_RECORDS;
+  bench.ops = YCSB_DEFAULT_OPS;
+  bench.value_size = YCSB_DEFAULT_VALUE;
+  bench.depth = YCSB_DEFAULT_DEPTH;
+  bench.mget = 0;
+  bench.delete_pct = 0;
+  bench.rng = 0x9e3779b97f4a7c15ull;
+  bench.misses = bench.errors = 0;
+
+  while ((c = getopt(argc, argv, "n:p:w:d:r:o:v:q:z:M:h")) != -1) {
+    switch (c) {
+    case 'n':
+      server = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'w':
+      bench.workload = optarg[0];
+      break;
+    case 'd':
+      bench.delete_pct = atoi(optarg);
+      break;
+    case 'r':
+      bench.records = atol(optarg);
+      break;
+    case 'o':
+      bench.ops = atol(optarg);
+      break;
+    case 'v':
+      bench.value_size = atol(optarg);
+      break;
+    case 'q':
+      bench.depth = atoi(optarg);
+      break;
+    case 'z':
+      theta = atof(optarg);
+      break;
+    case 'M':
+      bench.mget = atoi(optarg);
+      break;
+    case 'h':
+    default:
+      print_kv_ycsb_usage();
+      return -1;
+    }
+  }
+
+  switch (bench.workload) {
+  case 'a':
+    bench.read_pct = 50;
+    break;
+  case 'b':
+    bench.read_pct = 95;
+    break;
+  case 'c':
+    bench.read_pct = 100;
+    break;
+  default:
+    bench.read_pct = -1;
+    break;
+  }
+
+  if ((bench.read_pct < 0) || (bench.records <= 0) || (bench.ops <= 0) ||
+      (bench.depth == 0) || (bench.depth > KV_CLIENT_MAX_OPS / 2) ||
+      (bench.mget > KV_MAX_MGET) || (bench.delete_pct < 0) ||
+      (bench.delete_pct > 100) || (theta < 0) || (theta >= 1)) {
+    print_kv_ycsb_usage();
+    return -1;
+  }
+
+  ycsb_zipf_init(&bench.zipf, bench.records, theta);
+  bench.value.resize(bench.value_size);
+  for (i = 0; i < bench.value_size; ++i) {
+    bench.value[i] = 'a' + i % 26;
+  }
+
+  /* A slot reads at most one value per MULTI-GET key */
+  per_slot = bench.value_size * std::max(bench.mget, 1u);
+  bench.buffers.resize(per_slot * bench.depth);
+  bench.slots.resize(bench.depth);
+  for (i = 0; i < bench.depth; ++i) {
+    bench.slots[i].bench = &bench;
+    for (j = 0; j < KV_MAX_MGET; ++j) {
+      bench.slots[i].buffers[j] =
+          bench.buffers.data() + i * per_slot +
+          ((j < std::max(bench.mget, 1u)) ? j * bench.value_size : 0);
+    }
+    bench.free_slots.push_back(&bench.slots[i]);
+  }
+
+  status = ucp_config_read(NULL, NULL, &config);
+  CHKERR_JUMP(status != UCS_OK, "ucp_config_read\n", err);
+
+  initialize_ucp_params(&ucp_params, "kv ycsb");
+  ucp_params.features = UCP_FEATURE_AM;
+  initialize_ucp_worker_params(&worker_params);
+
+  status = ucp_init(&ucp_params, config, &ucp_context);
+  ucp_config_release(config);
+  CHKERR_JUMP(status != UCS_OK, "ucp_init\n", err);
+
+  status = ucp_worker_create(ucp_context, &worker_params, &ucp_worker);
+  CHKERR_JUMP(status != UCS_OK, "ucp_worker_create\n", err_cleanup);
+
+  bench.client = new KvClient(ucp_worker);
+
+  oob_sock = connect_client(server, port, AF_INET);
+  CHKERR_JUMP(oob_sock < 0, "client_connect\n", err_client);
+
+  ret = ycsb_connect(&bench, oob_sock);
+  CHKERR_JUMP(ret != 0, "connect to kv server\n", err_sock);
+
+  ret = -1;
+  start_ns = get_time_ns();
+  status = ycsb_load(&bench);
+  CHKERR_JUMP(status != UCS_OK, "load records\n", err_sock);
+  load_ns = get_time_ns() - start_ns;
+
+  start_ns = get_time_ns();
+  status = ycsb_run(&bench);
+  CHKERR_JUMP(status != UCS_OK, "run workload\n", err_sock);
+  run_ns = get_time_ns() - start_ns;
+
+  status = bench.client->close();
+  CHKERR_JUMP(status != UCS_OK, "close kv client\n", err_sock);
+  ret = barrier(oob_sock, ycsb_progress, ucp_worker);
+
+  log_flush();
+  printf("\nworkload %c (%d%% reads, %d%% deletes), %ld records of %lu "
+         "bytes, %u shards, depth %u, zipf %.2f\n",
+         bench.workload, bench.read_pct, bench.delete_pct, bench.records,
+         bench.value_size, bench.client->nshards(), bench.depth, theta);
+  printf("load: %.0f ops/s\n", bench.records * 1e9 / load_ns);
+  printf("run:  %.0f ops/s, %lu misses, %lu errors\n",
+         bench.ops * 1e9 / run_ns, bench.misses, bench.errors);
+  printf("%-8s %10s %10s %10s %10s\n", "op", "count", "p50 us", "p99 us",
+         "p99.9 us");
+  for (i = 0; i <= KV_OP_MGET; ++i) {
+    if (bench.latency_ns[i].empty()) {
+      continue;
+    }
+    printf("%-8s %10lu %10.2f %10.2f %10.2f\n", op_names[i],
+           bench.latency_ns[i].size(),
+           percentile_us(bench.latency_ns[i], 0.5),
+           percentile_us(bench.latency_ns[i], 0.99),
+           percentile_us(bench.latency_ns[i], 0.999));
+  }
+
+err_sock:
+  close(oob_sock);
+err_client:
+  delete bench.client;
+  ucp_worker_destroy(ucp_worker);
+err_cleanup:
+  ucp_cleanup(ucp_context);
+err:
+  return ret;
+}
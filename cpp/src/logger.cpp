@@ -0,0 +1,238 @@
+#include "logger.h"
+#include "time_utils.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static const char *log_level_names[] = {"TRACE", "DEBUG", "INFO", "WARN",
+                                        "ERROR"};
+
+/* Head and tail live on separate cache lines so the producer and the formatter
+ * thread do not false-share */
+struct log_ring {
+  alignas(64) std::atomic<uint64_t> head{0};
+  alignas(64) std::atomic<uint64_t> tail{0};
+  alignas(64) struct log_record records[LOG_RING_SIZE];
+  uint64_t id; /* never reused, unlike the address */
+  std::atomic<bool> orphaned{false}; /* its thread has exited */
+};
+
+static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0,
+              "LOG_RING_SIZE must be a power of two");
+
+/* Intentionally leaked: rings must stay valid until the atexit() drain, after
+ * which static destructors may already have run. The ring of a thread that
+ * exits is freed by the formatter once it has been drained */
+static std::mutex *log_rings_lock = new std::mutex;
+static std::vector<struct log_ring *> *log_rings =
+    new std::vector<struct log_ring *>;
+static std::thread *log_thread = NULL;
+static std::atomic<bool> log_running{false};
+static cpu_set_t log_thread_cpus;
+static bool log_thread_cpus_set = false;
+static std::atomic<uint64_t> log_dropped{0};
+static thread_local struct log_ring *log_tls_ring = NULL;
+static pthread_key_t log_ring_key;
+static uint64_t log_next_ring_id = 0;
+
+uint64_t log_timestamp_ns() { return get_time_ns(); }
+
+static size_t log_drain_ring(struct log_ring *ring) {
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  uint64_t tail = ring->tail.load(std::memory_order_acquire);
+  size_t count = 0;
+
+  for (; head != tail; ++head, ++count) {
+    struct log_record *record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    FILE *stream = (record->level >= LOG_LEVEL_WARN) ? stderr : stdout;
+
+    fprintf(stream, "[%lu.%06lu] %-5s ",
+            (unsigned long)(record->timestamp_ns / 1000000000ull),
+            (unsigned long)(record->timestamp_ns % 1000000000ull) / 1000,
+            log_level_names[record->level]);
+    record->format(stream, record->fmt, record->args);
+  }
+
+  if (count > 0) {
+    ring->head.store(head, std::memory_order_release);
+  }
+
+  return count;
+}
+
+static size_t log_drain_all() {
+  std::lock_guard<std::mutex> guard(*log_rings_lock);
+  struct log_ring *ring;
+  size_t count = 0;
+  size_t i;
+
+  for (i = 0; i < log_rings->size();) {
+    ring = (*log_rings)[i];
+    count += log_drain_ring(ring);
+    /* Its thread is gone, so nothing can be committed after this check */
+    if (ring->orphaned.load(std::memory_order_acquire) &&
+        (ring->head.load(std::memory_order_relaxed) ==
+         ring->tail.load(std::memory_order_acquire))) {
+      (*log_rings)[i] = log_rings->back();
+      log_rings->pop_back();
+      delete ring;
+    } else {
+      ++i;
+    }
+  }
+
+  if (count > 0) {
+    fflush(stdout);
+    fflush(stderr);
+  }
+
+  return count;
+}
+
+static void log_thread_main() {
+  while (log_running.load(std::memory_order_acquire)) {
+    if (log_drain_all() == 0) {
+      usleep(1000);
+    }
+  }
+}
+
+/* Runs when a thread that has logged exits */
+static void log_release_ring(void *arg) {
+  struct log_ring *ring = static_cast<struct log_ring *>(arg);
+
+  /* Logging from a later thread-exit destructor registers a new ring */
+  log_tls_ring = NULL;
+  ring->orphaned.store(true, std::memory_order_release);
+}
+
+static struct log_ring *log_register_ring() {
+  static std::once_flag key_once;
+  struct log_ring *ring = new struct log_ring;
+
+  std::call_once(key_once, [] {
+    pthread_key_create(&log_ring_key, log_release_ring);
+  });
+  pthread_setspecific(log_ring_key, ring);
+
+  std::lock_guard<std::mutex> guard(*log_rings_lock);
+
+  ring->id = log_next_ring_id++;
+  log_rings->push_back(ring);
+  if (log_thread == NULL) {
+    log_running.store(true, std::memory_order_release);
+    log_thread = new std::thread(log_thread_main);
+    if (log_thread_cpus_set) {
+      pthread_setaffinity_np(log_thread->native_handle(),
+                             sizeof(log_thread_cpus), &log_thread_cpus);
+    }
+    atexit(log_shutdown);
+  }
+
+  return ring;
+}
+
+struct log_record *log_reserve() {
+  struct log_ring *ring = log_tls_ring;
+  uint64_t tail;
+
+  if (ring == NULL) {
+    ring = log_tls_ring = log_register_ring();
+  }
+
+  tail = ring->tail.load(std::memory_order_relaxed);
+  if (tail - ring->head.load(std::memory_order_acquire) == LOG_RING_SIZE) {
+    log_dropped.fetch_add(1, std::memory_order_relaxed);
+    return NULL;
+  }
+
+  return &ring->records[tail & (LOG_RING_SIZE - 1)];
+}
+
+void log_commit(struct log_record *record) {
+  (void)record;
+  log_tls_ring->tail.fetch_add(1, std::memory_order_release);
+}
+
+/* True while a ring in `targets` (by ID) still has records before its
+ * tail at the time of the snapshot; a ring that has been freed is done */
+static bool log_flush_pending(
+    const std::vector<std::pair<uint64_t, uint64_t>> &targets) {
+  std::lock_guard<std::mutex> guard(*log_rings_lock);
+
+  for (struct log_ring *ring : *log_rings) {
+    for (auto &target : targets) {
+      if ((target.first == ring->id) &&
+          (ring->head.load(std::memory_order_acquire) < target.second)) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+void log_flush() {
+  std::vector<std::pair<uint64_t, uint64_t>> targets;
+
+  {
+    std::lock_guard<std::mutex> guard(*log_rings_lock);
+    for (struct log_ring *ring : *log_rings) {
+      targets.emplace_back(ring->id,
+                           ring->tail.load(std::memory_order_acquire));
+    }
+  }
+
+  while (log_flush_pending(targets)) {
+    if (!log_running.load(std::memory_order_acquire)) {
+      log_drain_all();
+    } else {
+      usleep(100);
+    }
+  }
+}
+
+void log_shutdown() {
+  std::thread *thread;
+
+  {
+    std::lock_guard<std::mutex> guard(*log_rings_lock);
+    thread = log_thread;
+    log_thread = NULL;
+  }
+
+  if (thread == NULL) {
+    return;
+  }
+
+  log_running.store(false, std::memory_order_release);
+  thread->join();
+  delete thread;
+  log_drain_all();
+
+  if (log_dropped.load() > 0) {
+    fprintf(stderr, "logger: dropped %lu records\n",
+            (unsigned long)log_dropped.load());
+  }
+}
+
+void log_set_affinity(const cpu_set_t *cpus) {
+  std::lock_guard<std::mutex> guard(*log_rings_lock);
+
+  log_thread_cpus = *cpus;
+  log_thread_cpus_set = true;
+  if (log_thread != NULL) {
+    pthread_setaffinity_np(log_thread->native_handle(), sizeof(*cpus), cpus);
+  }
+}
+
+uint64_t log_dropped_count() {
+  return log_dropped.load(std::memory_order_relaxed);
+}
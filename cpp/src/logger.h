@@ -0,0 +1,191 @@
+#ifndef MYUCXPLAYGROUND_LOGGER_H
+#define MYUCXPLAYGROUND_LOGGER_H
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <new>
+#include <tuple>
+#include <type_traits>
+
+/**
+ * Asynchronous binary logger.
+ *
+ * The calling thread never formats: a log call copies the format string
+ * pointer, a timestamp and the raw argument values into a fixed-size record on
+ * a per-thread single-producer/single-consumer ring. A background thread drains
+ * every ring and does the actual printf-style formatting.
+ *
+ * Because formatting is deferred, every `const char *` argument must point to
+ * memory that outlives the record (string literals, `ucs_status_string()`).
+ * When a ring is full the record is dropped and counted rather than blocking
+ * the caller.
+ *
+ * Levels below LOG_COMPILE_LEVEL are compiled out, so their arguments are not
+ * even evaluated.
+ */
+
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_WARN 3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_OFF 5
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+
+/* Number of records in each per-thread ring, must be a power of two */
+#define LOG_RING_SIZE 4096
+/* Bytes available for the packed arguments of a single record */
+#define LOG_ARGS_SIZE 96
+
+typedef void (*log_format_fn_t)(FILE *stream, const char *fmt,
+                                 const void *args);
+
+struct log_record {
+  uint64_t timestamp_ns;
+  const char *fmt;
+  log_format_fn_t format;
+  int level;
+  alignas(8) unsigned char args[LOG_ARGS_SIZE];
+};
+
+/**
+ * @brief Returns a record slot on the calling thread's ring.
+ *
+ * Registers the ring and starts the background thread on first use.
+ *
+ * @return A slot to fill, or NULL if the ring is full (the record is counted
+ * as dropped).
+ */
+struct log_record *log_reserve();
+
+/**
+ * @brief Publishes the slot obtained from log_reserve() to the formatter.
+ */
+void log_commit(struct log_record *record);
+
+/**
+ * @brief Blocks until every record committed so far has been written out.
+ *
+ * Call it before terminating the process abnormally (e.g. raise(SIGKILL)) so
+ * that the preceding diagnostics are not lost.
+ */
+void log_flush();
+
+/**
+ * @brief Stops the background thread after draining all rings.
+ *
+ * Registered with atexit() when the logger starts, so calling it explicitly is
+ * only needed to shut down earlier than process exit.
+ */
+void log_shutdown();
+
+/**
+ * @brief Restricts the background formatter thread to `cpus`.
+ *
+ * Applies immediately if the thread is running and to any later start.
+ */
+void log_set_affinity(const cpu_set_t *cpus);
+
+/**
+ * @brief Number of records dropped because a ring was full.
+ */
+uint64_t log_dropped_count();
+
+uint64_t log_timestamp_ns();
+
+template <typename... Args>
+void log_format_record(FILE *stream, const char *fmt, const void *args) {
+  if constexpr (sizeof...(Args) == 0) {
+    fputs(fmt, stream);
+  } else {
+    const auto *values = static_cast<const std::tuple<Args...> *>(args);
+    std::apply(
+        [stream, fmt](Args... unpacked) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+          fprintf(stream, fmt, unpacked...);
+#pragma GCC diagnostic pop
+        },
+        *values);
+  }
+}
+
+template <typename... Args>
+void log_write(int level, const char *fmt, Args... args) {
+  using packed_t = std::tuple<std::decay_t<Args>...>;
+  static_assert(sizeof(packed_t) <= LOG_ARGS_SIZE,
+                "too many log arguments for one record");
+  static_assert((std::is_trivially_copyable_v<std::decay_t<Args>> && ...),
+                "log arguments must be trivially copyable");
+
+  struct log_record *record = log_reserve();
+  if (record == NULL) {
+    return;
+  }
+
+  record->timestamp_ns = log_timestamp_ns();
+  record->fmt = fmt;
+  record->format = log_format_record<std::decay_t<Args>...>;
+  record->level = level;
+  new (record->args) packed_t(args...);
+  log_commit(record);
+}
+
+/* Never called, only lets the compiler type-check the format string */
+static inline void log_check_format(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+static inline void log_check_format(const char *fmt, ...) { (void)fmt; }
+
+#define LOG_AT(_level, _fmt, ...)                                              \
+  do {                                                                         \
+    if (0) {                                                                   \
+      log_check_format(_fmt, ##__VA_ARGS__);                                   \
+    }                                                                          \
+    log_write(_level, _fmt, ##__VA_ARGS__);                                    \
+  } while (0)
+
+/* Disabled levels keep the format check but never evaluate the arguments */
+#define LOG_NOP(_fmt, ...)                                                     \
+  do {                                                                         \
+    if (0) {                                                                   \
+      log_check_format(_fmt, ##__VA_ARGS__);                                   \
+    }                                                                          \
+  } while (0)
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_TRACE
+#define LOG_TRACE(_fmt, ...) LOG_AT(LOG_LEVEL_TRACE, _fmt, ##__VA_ARGS__)
+#else
+#define LOG_TRACE(_fmt, ...) LOG_NOP(_fmt, ##__VA_ARGS__)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(_fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, _fmt, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(_fmt, ...) LOG_NOP(_fmt, ##__VA_ARGS__)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(_fmt, ...) LOG_AT(LOG_LEVEL_INFO, _fmt, ##__VA_ARGS__)
+#else
+#define LOG_INFO(_fmt, ...) LOG_NOP(_fmt, ##__VA_ARGS__)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(_fmt, ...) LOG_AT(LOG_LEVEL_WARN, _fmt, ##__VA_ARGS__)
+#else
+#define LOG_WARN(_fmt, ...) LOG_NOP(_fmt, ##__VA_ARGS__)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(_fmt, ...) LOG_AT(LOG_LEVEL_ERROR, _fmt, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(_fmt, ...) LOG_NOP(_fmt, ##__VA_ARGS__)
+#endif
+
+#endif // MYUCXPLAYGROUND_LOGGER_H
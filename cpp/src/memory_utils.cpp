@@ -3,13 +3,236 @@
 //
 
 #include "memory_utils.h"
+#include "logger.h"
+
+#include <linux/mempolicy.h> /* MPOL_BIND */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <mutex>
+#include <unordered_map>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+
+#define MEM_HUGE_2M_SIZE (2ul << 20)
+#define MEM_HUGE_1G_SIZE (1ul << 30)
+
+ucs_memory_type_t test_mem_type = UCS_MEMORY_TYPE_HOST;
+mem_alloc_policy_t test_mem_policy = MEM_POLICY_MALLOC;
+int test_mem_numa_node = -1;
+
+/* Mapping lengths of mmap-backed host buffers, needed to munmap() them */
+static std::mutex mem_mappings_lock;
+static std::unordered_map<void *, size_t> mem_mappings;
+
+static size_t mem_align_up(size_t length, size_t alignment) {
+  return (length + alignment - 1) & ~(alignment - 1);
+}
+
+int mem_current_numa_node() {
+  unsigned cpu, node;
+
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+    return -1;
+  }
+
+  return (int)node;
+}
+
+int mem_device_numa_node(const char *dev) {
+  const char *classes[] = {"net", "infiniband"};
+  char name[64];
+  char path[256];
+  char *port;
+  FILE *file;
+  int node = -1;
+
+  snprintf(name, sizeof(name), "%s", dev);
+  port = strchr(name, ':');
+  if (port != NULL) {
+    *port = '\0';
+  }
+
+  for (const char *cls : classes) {
+    snprintf(path, sizeof(path), "/sys/class/%s/%s/device/numa_node", cls,
+             name);
+    file = fopen(path, "r");
+    if (file == NULL) {
+      continue;
+    }
+
+    if (fscanf(file, "%d", &node) != 1) {
+      node = -1;
+    }
+    fclose(file);
+    break;
+  }
+
+  return node;
+}
+
+size_t mem_rss_bytes() {
+  unsigned long size, resident;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  int ret;
+
+  if (fp == NULL) {
+    return 0;
+  }
+
+  ret = fscanf(fp, "%lu %lu", &size, &resident);
+  fclose(fp);
+  return (ret == 2) ? resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+static int mem_target_numa_node() {
+  const char *devices;
+  int node;
+
+  if (test_mem_numa_node >= 0) {
+    return test_mem_numa_node;
+  }
+
+  devices = getenv("UCX_NET_DEVICES");
+  if ((devices != NULL) && (strchr(devices, ',') == NULL) &&
+      strcmp(devices, "all")) {
+    node = mem_device_numa_node(devices);
+    if (node >= 0) {
+      return node;
+    }
+  }
+
+  return mem_current_numa_node();
+}
+
+static int mem_bind_numa(void *ptr, size_t length, int node) {
+  unsigned long nodemask[16] = {0};
+  const unsigned long bits = 8 * sizeof(nodemask[0]);
+
+  if ((node < 0) || ((unsigned long)node >= bits * 16)) {
+    return -1;
+  }
+
+  nodemask[node / bits] = 1ul << (node % bits);
+  return (int)syscall(SYS_mbind, ptr, length, MPOL_BIND, nodemask,
+                      bits * 16 + 1, 0);
+}
+
+/* Anonymous mapping aligned to `alignment` so THP can back it with huge
+ * pages; the unaligned head and tail are trimmed off */
+static void *mem_mmap_aligned(size_t length, size_t alignment) {
+  size_t map_length = length + alignment;
+  uintptr_t start, aligned;
+  void *ptr;
+
+  ptr = mmap(NULL, map_length, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return NULL;
+  }
+
+  start = (uintptr_t)ptr;
+  aligned = (start + alignment - 1) & ~(uintptr_t)(alignment - 1);
+  if (aligned > start) {
+    munmap(ptr, aligned - start);
+  }
+  if (start + map_length > aligned + length) {
+    munmap((void *)(aligned + length), start + map_length - aligned - length);
+  }
+
+  return (void *)aligned;
+}
+
+static void *mem_host_mmap(size_t length, mem_alloc_policy_t policy) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t map_length = mem_align_up(length, page_size);
+  int node;
+  void *ptr = MAP_FAILED;
+
+  if (policy == MEM_POLICY_HUGE_1G) {
+    map_length = mem_align_up(length, MEM_HUGE_1G_SIZE);
+    ptr = mmap(NULL, map_length, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+    if (ptr == MAP_FAILED) {
+      LOG_WARN("no 1 GiB hugepages available, falling back to 2 MiB\n");
+      policy = MEM_POLICY_HUGE_2M;
+    }
+  }
+
+  if (policy == MEM_POLICY_HUGE_2M) {
+    map_length = mem_align_up(length, MEM_HUGE_2M_SIZE);
+    ptr = mmap(NULL, map_length, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (ptr == MAP_FAILED) {
+      LOG_WARN("no 2 MiB hugepages available, using transparent hugepages\n");
+      ptr = mem_mmap_aligned(map_length, MEM_HUGE_2M_SIZE);
+      if (ptr == NULL) {
+        return NULL;
+      }
+      madvise(ptr, map_length, MADV_HUGEPAGE);
+    }
+  }
+
+  if (policy == MEM_POLICY_NUMA) {
+    ptr = mmap(NULL, map_length, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (ptr == MAP_FAILED) {
+    return NULL;
+  }
+
+  /* Bind before the first touch so pages are faulted in on the right node */
+  if ((policy == MEM_POLICY_NUMA) || (test_mem_numa_node >= 0)) {
+    node = mem_target_numa_node();
+    if (mem_bind_numa(ptr, map_length, node) != 0) {
+      LOG_WARN("mbind to NUMA node %d failed\n", node);
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(mem_mappings_lock);
+    mem_mappings[ptr] = map_length;
+  }
+
+  return ptr;
+}
+
+static void mem_host_free(void *address) {
+  size_t map_length = 0;
+
+  {
+    std::lock_guard<std::mutex> guard(mem_mappings_lock);
+    auto it = mem_mappings.find(address);
+    if (it != mem_mappings.end()) {
+      map_length = it->second;
+      mem_mappings.erase(it);
+    }
+  }
+
+  if (map_length > 0) {
+    munmap(address, map_length);
+  } else {
+    free(address);
+  }
+}
 
 void *mem_type_malloc(size_t length) {
   void *ptr;
 
   switch (test_mem_type) {
   case UCS_MEMORY_TYPE_HOST:
-    ptr = malloc(length);
+    if ((test_mem_policy == MEM_POLICY_MALLOC) && (test_mem_numa_node < 0)) {
+      ptr = malloc(length);
+    } else if (test_mem_policy == MEM_POLICY_MALLOC) {
+      /* malloc() cannot be placed, so a forced node takes a bound mapping */
+      ptr = mem_host_mmap(length, MEM_POLICY_NUMA);
+    } else {
+      ptr = mem_host_mmap(length, test_mem_policy);
+    }
     break;
 #ifdef HAVE_CUDA
   case UCS_MEMORY_TYPE_CUDA:
@@ -31,7 +254,7 @@ void *mem_type_malloc(size_t length) {
 void mem_type_free(void *address) {
   switch (test_mem_type) {
   case UCS_MEMORY_TYPE_HOST:
-    free(address);
+    mem_host_free(address);
     break;
 #ifdef HAVE_CUDA
   case UCS_MEMORY_TYPE_CUDA:
@@ -103,8 +326,19 @@ int check_mem_type_support(ucs_memory_type_t mem_type) {
 }
 
 ucs_memory_type_t parse_mem_type(const char *opt_arg) {
+  test_mem_policy = MEM_POLICY_MALLOC;
+
   if (!strcmp(opt_arg, "host")) {
     return UCS_MEMORY_TYPE_HOST;
+  } else if (!strcmp(opt_arg, "host-huge2m")) {
+    test_mem_policy = MEM_POLICY_HUGE_2M;
+    return UCS_MEMORY_TYPE_HOST;
+  } else if (!strcmp(opt_arg, "host-huge1g")) {
+    test_mem_policy = MEM_POLICY_HUGE_1G;
+    return UCS_MEMORY_TYPE_HOST;
+  } else if (!strcmp(opt_arg, "host-numa")) {
+    test_mem_policy = MEM_POLICY_NUMA;
+    return UCS_MEMORY_TYPE_HOST;
   } else if (!strcmp(opt_arg, "cuda") &&
              check_mem_type_support(UCS_MEMORY_TYPE_CUDA)) {
     return UCS_MEMORY_TYPE_CUDA;
@@ -10,7 +10,28 @@
 #include <ucs/memory/memory_type.h>
 #include <unistd.h>
 
-static ucs_memory_type_t test_mem_type = UCS_MEMORY_TYPE_HOST;
+/**
+ * How host memory is obtained by mem_type_malloc(). Only meaningful when
+ * `test_mem_type` is UCS_MEMORY_TYPE_HOST.
+ */
+typedef enum {
+  MEM_POLICY_MALLOC,  /* plain malloc() */
+  MEM_POLICY_HUGE_2M, /* 2 MiB hugetlb pages, THP fallback */
+  MEM_POLICY_HUGE_1G, /* 1 GiB hugetlb pages, 2 MiB/THP fallback */
+  MEM_POLICY_NUMA     /* regular pages bound to a NUMA node with mbind() */
+} mem_alloc_policy_t;
+
+extern ucs_memory_type_t test_mem_type;
+extern mem_alloc_policy_t test_mem_policy;
+
+/**
+ * NUMA node that host buffers are bound to when set (-P sets it); with
+ * MEM_POLICY_MALLOC they then come from a bound mapping instead of malloc().
+ * -1 (the default) leaves malloc() alone, and mmap-based policies follow the
+ * NIC named by UCX_NET_DEVICES when it is a single device, otherwise the
+ * node of the allocating thread.
+ */
+extern int test_mem_numa_node;
 
 #define CUDA_FUNC(_func)                                                       \
   do {                                                                         \
@@ -63,6 +84,32 @@ void *mem_type_memset(void *dst, int value, size_t count);
 
 int check_mem_type_support(ucs_memory_type_t mem_type);
 
+/**
+ * @brief Parses a `-m` option value.
+ *
+ * Besides the UCS memory types, accepts the host allocation policies
+ * `host-huge2m`, `host-huge1g` and `host-numa`, which set `test_mem_policy`.
+ *
+ * @return The memory type, or UCS_MEMORY_TYPE_LAST if unsupported.
+ */
 ucs_memory_type_t parse_mem_type(const char *opt_arg);
 
+/**
+ * @brief Returns the NUMA node of the CPU the calling thread runs on, or -1.
+ */
+int mem_current_numa_node();
+
+/**
+ * @brief Returns the NUMA node a network device is attached to, or -1.
+ *
+ * @param dev A netdev (`eth0`) or RDMA device name, optionally with a UCX
+ * port suffix (`mlx5_0:1`).
+ */
+int mem_device_numa_node(const char *dev);
+
+/**
+ * @brief Returns the resident set size of this process in bytes, or 0.
+ */
+size_t mem_rss_bytes();
+
 #endif // MYUCXPLAYGROUND_MEMORY_UTILS_H
@@ -0,0 +1,91 @@
+#include "op_deadline.h"
+#include "logger.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+#include <stddef.h> /* offsetof */
+#include <stdio.h>
+
+OpDeadlines::OpDeadlines(ucp_worker_h ucp_worker, uint64_t tick_ns)
+    : ucp_worker_(ucp_worker), wheel_(tick_ns, get_time_ns()), stats_() {}
+
+OpDeadlines::~OpDeadlines() {
+  if (stats_.expired > 0) {
+    LOG_WARN("op deadlines: %lu of %lu operations timed out\n",
+             stats_.expired, stats_.armed);
+  }
+}
+
+void OpDeadlines::expire(struct wheel_timer *timer, void *arg) {
+  OpDeadlines *self = static_cast<OpDeadlines *>(arg);
+  struct ucx_context *request = reinterpret_cast<struct ucx_context *>(
+      reinterpret_cast<char *>(timer) - offsetof(struct ucx_context, timer));
+
+  ++self->stats_.expired;
+  request->timed_out = 1;
+  /* Completes the request with UCS_ERR_CANCELED through its callback */
+  ucp_request_cancel(self->ucp_worker_, request);
+}
+
+void OpDeadlines::arm(struct ucx_context *request, uint64_t timeout_ns) {
+  wheel_timer_init(&request->timer, expire, this);
+  wheel_.add(&request->timer, get_time_ns() + timeout_ns);
+  ++stats_.armed;
+}
+
+void OpDeadlines::disarm(struct ucx_context *request) {
+  wheel_.remove(&request->timer);
+}
+
+unsigned OpDeadlines::progress() {
+  unsigned count = ucp_worker_progress(ucp_worker_);
+
+  if (wheel_.pending() > 0) {
+    wheel_.advance(get_time_ns());
+  }
+  return count;
+}
+
+ucs_status_t OpDeadlines::wait(struct ucx_context *request,
+                               uint64_t timeout_ns, const char *op_str,
+                               const char *data_str, ucp_ep_h *ep_p) {
+  ucs_status_t status;
+  int timed_out;
+
+  if ((timeout_ns == 0) || !UCS_PTR_IS_PTR(request)) {
+    return ucx_wait(ucp_worker_, request, op_str, data_str);
+  }
+
+  /* progress() reads the clock, so the loop ends by the deadline even if
+   * the worker has nothing to do */
+  arm(request, timeout_ns);
+  while (!request->completed) {
+    progress();
+    if (request->timed_out && (ep_p != NULL) && (*ep_p != NULL)) {
+      /* The cancel left the send running; failing the endpoint completes it
+       * with an error */
+      LOG_WARN("%s %s: closing the endpoint\n", op_str, data_str);
+      ep_close(ucp_worker_, *ep_p, UCP_EP_CLOSE_FLAG_FORCE);
+      *ep_p = NULL;
+    }
+  }
+  disarm(request);
+
+  timed_out = request->timed_out;
+  request->timed_out = 0;
+  status = ucx_wait(ucp_worker_, request, op_str, data_str);
+
+  /* It may still have completed normally before the cancel took effect */
+  if (timed_out && (status != UCS_OK)) {
+    LOG_WARN("%s %s timed out after %.3f ms\n", op_str, data_str,
+             timeout_ns / 1e6);
+    status = UCS_ERR_TIMED_OUT;
+  }
+
+  return status;
+}
+
+void op_deadline_print(const char *name, const OpDeadlines::stats &stats) {
+  printf("%s: %lu operations with a deadline, %lu timed out\n", name,
+         stats.armed, stats.expired);
+}
@@ -0,0 +1,86 @@
+#ifndef MYUCXPLAYGROUND_OP_DEADLINE_H
+#define MYUCXPLAYGROUND_OP_DEADLINE_H
+
+#include <ucp/api/ucp.h>
+
+#include "timer_wheel.h"
+#include "ucx_config.h"
+
+/* Deadline resolution; operations time out up to one tick late */
+#define OP_DEADLINE_TICK_NS 1000000ull
+
+/**
+ * Per-operation deadlines for UCX requests on one worker.
+ *
+ * Each armed request carries a timer (in its ucx_context) on a TimerWheel
+ * that progress() advances alongside the worker. A request still running at
+ * its deadline is cancelled with ucp_request_cancel(), and wait() reports it
+ * as UCS_ERR_TIMED_OUT, so a hung peer costs one timeout instead of stalling
+ * the worker. UCX does not cancel sends, so wait() fails an overdue send by
+ * force-closing its endpoint instead.
+ *
+ * Not thread safe: use it from the thread that progresses `ucp_worker`.
+ */
+class OpDeadlines {
+
+public:
+  struct stats {
+    uint64_t armed;
+    uint64_t expired; /* deadlines hit, requests cancelled */
+  };
+
+  OpDeadlines(ucp_worker_h ucp_worker,
+              uint64_t tick_ns = OP_DEADLINE_TICK_NS);
+  ~OpDeadlines();
+
+  OpDeadlines(const OpDeadlines &) = delete;
+  OpDeadlines &operator=(const OpDeadlines &) = delete;
+
+  /**
+   * @brief Cancels `request` if it has not completed `timeout_ns` from now.
+   */
+  void arm(struct ucx_context *request, uint64_t timeout_ns);
+
+  /**
+   * @brief Drops the deadline of `request`; call it before freeing it.
+   */
+  void disarm(struct ucx_context *request);
+
+  /**
+   * @brief Progresses the worker and expires due deadlines.
+   *
+   * @return The ucp_worker_progress() result.
+   */
+  unsigned progress();
+
+  /**
+   * @brief ucx_wait() with a deadline.
+   *
+   * @param timeout_ns Time allowed for the request, 0 for no deadline.
+   * @param ep_p For a send, its endpoint. If the send is still running at
+   * the deadline the endpoint is closed in force mode, which fails it, and
+   * `*ep_p` is set to NULL.
+   * @return The request status, or UCS_ERR_TIMED_OUT if it was cancelled at
+   * its deadline.
+   */
+  ucs_status_t wait(struct ucx_context *request, uint64_t timeout_ns,
+                    const char *op_str, const char *data_str,
+                    ucp_ep_h *ep_p = NULL);
+
+  const struct stats &get_stats() const { return stats_; }
+
+private:
+  static void expire(struct wheel_timer *timer, void *arg);
+
+  ucp_worker_h ucp_worker_;
+  TimerWheel wheel_;
+  struct stats stats_;
+};
+
+/**
+ * @brief Prints how many operations of `name` had a deadline and how many
+ * ran out of time.
+ */
+void op_deadline_print(const char *name, const OpDeadlines::stats &stats);
+
+#endif // MYUCXPLAYGROUND_OP_DEADLINE_H
@@ -5,9 +5,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "logger.h"
 #include "memory_utils.h"
 #include "print_utils.h"
 #include "ucx_config.h"
+#include "ucx_utils.h"
 
 void print_common_help() {
   fprintf(stderr,
@@ -16,6 +18,12 @@ void print_common_help() {
   fprintf(stderr, "  -s <size>     Set test string length (default:16)\n");
   fprintf(stderr, "  -m <mem type> Memory type of messages\n");
   fprintf(stderr, "                host - system memory (default)\n");
+  fprintf(stderr, "                host-huge2m - 2 MiB hugepages "
+                  "(transparent hugepage fallback)\n");
+  fprintf(stderr, "                host-huge1g - 1 GiB hugepages "
+                  "(2 MiB fallback)\n");
+  fprintf(stderr, "                host-numa - bound to the NIC's or "
+                  "calling thread's NUMA node\n");
   if (check_mem_type_support(UCS_MEMORY_TYPE_CUDA)) {
     fprintf(stderr, "                cuda - NVIDIA GPU memory\n");
   }
@@ -42,20 +50,56 @@ void print_usage() {
   fprintf(stderr, "            keepalive - keepalive failure on client side "
                   "after communication completed\n");
   fprintf(stderr, "  -c      Print UCP configuration\n");
+  fprintf(stderr, "  -P <cpu>      Pin the worker-progress thread to <cpu>; "
+                  "host buffers follow its NUMA node\n");
+  fprintf(stderr, "  -A <cpulist>  CPUs for helper threads, e.g. 2-5,8 "
+                  "(default: all but the progress CPU)\n");
+  fprintf(stderr, "  -T            Print the CPU/NUMA topology\n");
+  fprintf(stderr, "  -v            Carry a CRC32C of the payload; the "
+                  "receiver verifies it\n");
+  fprintf(stderr, "  -i <count>    Number of conversations to run "
+                  "(default:1)\n");
+  fprintf(stderr, "  -E <size>     Reuse endpoints across conversations "
+                  "through an LRU cache of <size> entries\n");
+  fprintf(stderr, "  -w <mode>     How to wait for messages: probe (spin, "
+                  "default), wait or eventfd\n");
+  fprintf(stderr, "  -t <ms>       Fail operations that take longer than "
+                  "<ms> (default: no limit)\n");
+  fprintf(stderr, "  -f <path>     Transfer a file instead of the test "
+                  "string: the server sends <path>, the client writes it "
+                  "to <path>\n");
+  fprintf(stderr, "  -D <path>     Client: write received payloads to "
+                  "<path> through io_uring\n");
+  fprintf(stderr, "  -O            Open the -D file with O_DIRECT (payload "
+                  "size must be a multiple of 4096)\n");
   print_common_help();
   fprintf(stderr, "\n");
 }
 
-ucs_status_t parse_cmd(int argc, char *const argv[], char **server_name,
-                       err_handling *err_handling_opt, int print_config,
-                       uint16_t server_port, sa_family_t ai_family,
-                       long test_string_length) {
-  int c = 0, idx = 0;
+void init_cmd_opts(struct cmd_opts *opts) {
+  memset(opts, 0, sizeof(*opts));
+  opts->server_name = NULL;
+  opts->err_handling_opt.ucp_err_mode = UCP_ERR_HANDLING_MODE_NONE;
+  opts->err_handling_opt.failure_mode = FAILURE_MODE_NONE;
+  opts->server_port = DEFAULT_SERVER_PORT;
+  opts->ai_family = AF_INET;
+  opts->test_string_length = DEFAULT_TEST_STRING_LENGTH;
+  opts->progress_cpu = -1;
+  opts->app_cpus = NULL;
+  opts->iterations = 1;
+  opts->ep_cache_size = 0;
+  opts->test_mode = TEST_MODE_PROBE;
+  opts->op_timeout_ms = 0;
+  opts->file_path = NULL;
+  opts->sink_path = NULL;
+  opts->sink_direct = 0;
+}
 
-  (*err_handling_opt).ucp_err_mode = UCP_ERR_HANDLING_MODE_NONE;
-  (*err_handling_opt).failure_mode = FAILURE_MODE_NONE;
+ucs_status_t parse_cmd(int argc, char *const argv[], struct cmd_opts *opts) {
+  err_handling *err_handling_opt = &opts->err_handling_opt;
+  int c = 0, idx = 0;
 
-  while ((c = getopt(argc, argv, "6e:n:p:s:m:ch")) != -1) {
+  while ((c = getopt(argc, argv, "6e:n:p:s:m:P:A:Tvi:E:w:t:f:D:Och")) != -1) {
     switch (c) {
     case 'e':
       (*err_handling_opt).ucp_err_mode = UCP_ERR_HANDLING_MODE_PEER;
@@ -71,22 +115,22 @@ ucs_status_t parse_cmd(int argc, char *const argv[], char **server_name,
       }
       break;
     case 'n':
-      *server_name = optarg;
+      opts->server_name = optarg;
       break;
     case '6':
-      ai_family = AF_INET6;
+      opts->ai_family = AF_INET6;
       break;
     case 'p':
-      server_port = atoi(optarg);
-      if (server_port <= 0) {
-        fprintf(stderr, "Wrong server port number %d\n", server_port);
+      opts->server_port = atoi(optarg);
+      if (opts->server_port <= 0) {
+        fprintf(stderr, "Wrong server port number %d\n", opts->server_port);
         return UCS_ERR_UNSUPPORTED;
       }
       break;
     case 's':
-      test_string_length = atol(optarg);
-      if (test_string_length < 0) {
-        fprintf(stderr, "Wrong string size %ld\n", test_string_length);
+      opts->test_string_length = atol(optarg);
+      if (opts->test_string_length < 0) {
+        fprintf(stderr, "Wrong string size %ld\n", opts->test_string_length);
         return UCS_ERR_UNSUPPORTED;
       }
       break;
@@ -96,8 +140,51 @@ ucs_status_t parse_cmd(int argc, char *const argv[], char **server_name,
         return UCS_ERR_UNSUPPORTED;
       }
       break;
+    case 'P':
+      opts->progress_cpu = atoi(optarg);
+      if (opts->progress_cpu < 0) {
+        fprintf(stderr, "Wrong progress CPU %d\n", opts->progress_cpu);
+        return UCS_ERR_UNSUPPORTED;
+      }
+      break;
+    case 'A':
+      opts->app_cpus = optarg;
+      break;
+    case 'T':
+      opts->print_topology = 1;
+      break;
+    case 'v':
+      opts->verify_crc = 1;
+      break;
+    case 'i':
+      opts->iterations = atoi(optarg);
+      if (opts->iterations <= 0) {
+        fprintf(stderr, "Wrong iteration count %d\n", opts->iterations);
+        return UCS_ERR_UNSUPPORTED;
+      }
+      break;
+    case 'E':
+      opts->ep_cache_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'w':
+      if (parse_test_mode(optarg, &opts->test_mode) != 0) {
+        return UCS_ERR_UNSUPPORTED;
+      }
+      break;
+    case 't':
+      opts->op_timeout_ms = strtoul(optarg, NULL, 0);
+      break;
+    case 'f':
+      opts->file_path = optarg;
+      break;
+    case 'D':
+      opts->sink_path = optarg;
+      break;
+    case 'O':
+      opts->sink_direct = 1;
+      break;
     case 'c':
-      print_config = 1;
+      opts->print_config = 1;
       break;
     case 'h':
     default:
@@ -106,20 +193,23 @@ ucs_status_t parse_cmd(int argc, char *const argv[], char **server_name,
     }
   }
 
-  if (server_name != NULL) {
-    fprintf(stderr,
-            "INFO: UCP_HELLO_WORLD:CLIENT Connecting to server = %s port = %d, "
-            "pid = %d\n",
-            *server_name, server_port, getpid());
+  if ((opts->sink_path != NULL) && (test_mem_type != UCS_MEMORY_TYPE_HOST)) {
+    fprintf(stderr, "The disk sink (-D) needs host memory\n");
+    return UCS_ERR_UNSUPPORTED;
+  }
+
+  if (opts->server_name != NULL) {
+    LOG_INFO("UCP_HELLO_WORLD:CLIENT Connecting to server = %s port = %d, "
+             "pid = %d\n",
+             opts->server_name, opts->server_port, getpid());
   } else {
-    fprintf(stderr,
-            "INFO: UCP_HELLO_WORLD:Server Connecting to client port = %d, pid "
-            "= %d\n",
-            server_port, getpid());
+    LOG_INFO("UCP_HELLO_WORLD:Server Connecting to client port = %d, pid "
+             "= %d\n",
+             opts->server_port, getpid());
   }
 
   for (idx = optind; idx < argc; idx++) {
-    fprintf(stderr, "WARNING: Non-option argument %s\n", argv[idx]);
+    LOG_WARN("Non-option argument %s\n", argv[idx]);
   }
   return UCS_OK;
 }
@@ -11,9 +11,14 @@ void print_common_help();
 
 void print_usage();
 
-ucs_status_t parse_cmd(int argc, char *const argv[], char **server_name,
-                       err_handling *err_handling_opt, int print_config,
-                       uint16_t server_port, sa_family_t ai_family,
-                       long test_string_length);
+#define DEFAULT_SERVER_PORT 13337
+#define DEFAULT_TEST_STRING_LENGTH 4
+
+/**
+ * @brief Fills `opts` with the defaults used when an option is not given.
+ */
+void init_cmd_opts(struct cmd_opts *opts);
+
+ucs_status_t parse_cmd(int argc, char *const argv[], struct cmd_opts *opts);
 
 #endif // MYUCXPLAYGROUND_PRINT_UTILS_H
@@ -0,0 +1,258 @@
+#include "publisher.h"
+#include "common_utils.h"
+#include "logger.h"
+#include "tag_layout.h"
+#include "ucx_utils.h"
+
+#include <sys/mman.h>
+
+Publisher::Publisher(ucp_context_h ucp_context, ucp_worker_h ucp_worker,
+                     unsigned channel, size_t max_size, unsigned nbuffers,
+                     unsigned max_inflight, pub_policy_t policy)
+    : ucp_context_(ucp_context), ucp_worker_(ucp_worker), channel_(channel),
+      max_size_(max_size), nbuffers_(nbuffers), max_inflight_(max_inflight),
+      policy_(policy), pool_(NULL), memh_(NULL), seq_(0), inflight_(0),
+      stats_() {}
+
+Publisher::~Publisher() {
+  std::vector<ucp_ep_h> eps;
+
+  for (struct subscriber *sub : subs_) {
+    if (sub->ep != NULL) {
+      eps.push_back(sub->ep);
+      sub->ep = NULL;
+    }
+    if (sub->pending != NULL) {
+      release(sub->pending);
+      sub->pending = NULL;
+    }
+  }
+  /* Completes the sends still in flight, with an error */
+  if (!eps.empty()) {
+    ep_close_batch(ucp_worker_, eps.data(), eps.size(),
+                   UCP_EP_CLOSE_FLAG_FORCE);
+  }
+  while (inflight_ > 0) {
+    ucp_worker_progress(ucp_worker_);
+  }
+
+  for (struct subscriber *sub : subs_) {
+    delete sub;
+  }
+  if (memh_ != NULL) {
+    ucp_mem_unmap(ucp_context_, memh_);
+  }
+  if (pool_ != NULL) {
+    munmap(pool_, max_size_ * nbuffers_);
+    LOG_INFO("publisher: %lu published, %lu sends, %lu dropped, "
+             "%lu coalesced, %lu disconnects, %lu waits for a buffer, "
+             "%lu errors\n",
+             stats_.published, stats_.sends, stats_.drops, stats_.coalesced,
+             stats_.disconnects, stats_.buffer_waits, stats_.errors);
+  }
+}
+
+int Publisher::init() {
+  ucp_mem_map_params_t params;
+  ucs_status_t status;
+  unsigned i;
+
+  CHKERR_ACTION((max_size_ == 0) || (nbuffers_ == 0) || (max_inflight_ == 0),
+                "size the publisher\n", return -1);
+
+  pool_ = static_cast<char *>(mmap(NULL, max_size_ * nbuffers_,
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  CHKERR_ACTION(pool_ == MAP_FAILED, "allocate publisher buffers\n",
+                pool_ = NULL; return -1);
+
+  /* One registration for every message and every subscriber */
+  params.field_mask =
+      UCP_MEM_MAP_PARAM_FIELD_ADDRESS | UCP_MEM_MAP_PARAM_FIELD_LENGTH;
+  params.address = pool_;
+  params.length = max_size_ * nbuffers_;
+  status = ucp_mem_map(ucp_context_, &params, &memh_);
+  CHKERR_ACTION(status != UCS_OK, "register publisher buffers\n",
+                memh_ = NULL; return -1);
+
+  buffers_.resize(nbuffers_);
+  for (i = 0; i < nbuffers_; ++i) {
+    buffers_[i].data = pool_ + i * max_size_;
+    buffers_[i].length = 0;
+    buffers_[i].seq = 0;
+    buffers_[i].refs = 0;
+  }
+  for (i = nbuffers_; i > 0; --i) {
+    free_.push_back(&buffers_[i - 1]);
+  }
+
+  return 0;
+}
+
+int Publisher::add_subscriber(ucp_ep_h ep) {
+  struct subscriber *sub = new struct subscriber;
+  unsigned i;
+
+  sub->ep = ep;
+  sub->pending = NULL;
+  sub->ctxs.resize(max_inflight_);
+  for (i = 0; i < max_inflight_; ++i) {
+    sub->ctxs[i].publisher = this;
+    sub->ctxs[i].sub = sub;
+    sub->ctxs[i].buf = NULL;
+    sub->free_ctxs.push_back(&sub->ctxs[i]);
+  }
+  subs_.push_back(sub);
+
+  return static_cast<int>(subs_.size() - 1);
+}
+
+void *Publisher::acquire() {
+  struct buffer *buf;
+
+  if (free_.empty()) {
+    ++stats_.buffer_waits;
+    while (free_.empty()) {
+      ucp_worker_progress(ucp_worker_);
+    }
+  }
+
+  buf = free_.back();
+  free_.pop_back();
+  buf->refs = 1;
+  return buf->data;
+}
+
+void Publisher::release(struct buffer *buf) {
+  if (--buf->refs == 0) {
+    free_.push_back(buf);
+  }
+}
+
+void Publisher::send_done(void *request, ucs_status_t status,
+                          void *user_data) {
+  struct send_ctx *ctx = static_cast<struct send_ctx *>(user_data);
+
+  ucp_request_free(request);
+  ctx->publisher->complete(ctx, status);
+}
+
+void Publisher::send(struct subscriber *sub, struct buffer *buf) {
+  struct send_ctx *ctx = sub->free_ctxs.back();
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+
+  sub->free_ctxs.pop_back();
+  ctx->buf = buf;
+  ++buf->refs;
+  ++inflight_;
+  ++stats_.sends;
+
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_USER_DATA |
+                       UCP_OP_ATTR_FIELD_DATATYPE | UCP_OP_ATTR_FIELD_MEMH;
+  param.cb.send = send_done;
+  param.user_data = ctx;
+  param.datatype = ucp_dt_make_contig(1);
+  param.memh = memh_;
+
+  request = ucp_tag_send_nbx(sub->ep, buf->data, buf->length,
+                             tag_make(TAG_CLASS_DATA, channel_, 0, buf->seq),
+                             &param);
+  if (UCS_PTR_IS_PTR(request)) {
+    return;
+  }
+  complete(ctx, UCS_PTR_STATUS(request));
+}
+
+void Publisher::complete(struct send_ctx *ctx, ucs_status_t status) {
+  struct subscriber *sub = ctx->sub;
+  struct buffer *buf = ctx->buf;
+  struct buffer *next;
+
+  ctx->buf = NULL;
+  sub->free_ctxs.push_back(ctx);
+  --inflight_;
+
+  /* Sends to a closed subscriber fail on purpose */
+  if ((status != UCS_OK) && (sub->ep != NULL)) {
+    LOG_WARN("publisher: send of message %lu failed (%s)\n", buf->seq,
+             ucs_status_string(status));
+    ++stats_.errors;
+  }
+  release(buf);
+
+  if ((sub->ep != NULL) && (sub->pending != NULL)) {
+    next = sub->pending;
+    sub->pending = NULL;
+    send(sub, next);
+    release(next);
+  }
+}
+
+void Publisher::disconnect(struct subscriber *sub) {
+  ucp_ep_h ep = sub->ep;
+
+  sub->ep = NULL;
+  if (sub->pending != NULL) {
+    release(sub->pending);
+    sub->pending = NULL;
+  }
+  ++stats_.disconnects;
+  LOG_WARN("publisher: disconnecting a subscriber %u messages behind\n",
+           max_inflight_);
+
+  /* Progresses the worker, so other subscribers' sends complete in here */
+  ep_close(ucp_worker_, ep, UCP_EP_CLOSE_FLAG_FORCE);
+}
+
+ucs_status_t Publisher::publish(void *buffer, size_t length) {
+  struct buffer *buf =
+      &buffers_[(static_cast<char *>(buffer) - pool_) / max_size_];
+
+  if (length > max_size_) {
+    release(buf);
+    return UCS_ERR_INVALID_PARAM;
+  }
+
+  buf->length = length;
+  buf->seq = seq_++;
+  ++stats_.published;
+
+  for (struct subscriber *sub : subs_) {
+    if (sub->ep == NULL) {
+      continue;
+    }
+    if (!sub->free_ctxs.empty()) {
+      send(sub, buf);
+      continue;
+    }
+
+    switch (policy_) {
+    case PUB_POLICY_DROP:
+      ++stats_.drops;
+      break;
+    case PUB_POLICY_COALESCE:
+      if (sub->pending != NULL) {
+        release(sub->pending);
+        ++stats_.coalesced;
+      }
+      sub->pending = buf;
+      ++buf->refs;
+      break;
+    case PUB_POLICY_DISCONNECT:
+      disconnect(sub);
+      break;
+    }
+  }
+
+  /* Drop the reference acquire() took */
+  release(buf);
+  return UCS_OK;
+}
+
+void Publisher::flush() {
+  while (inflight_ > 0) {
+    ucp_worker_progress(ucp_worker_);
+  }
+}
@@ -0,0 +1,156 @@
+#ifndef MYUCXPLAYGROUND_PUBLISHER_H
+#define MYUCXPLAYGROUND_PUBLISHER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ucp/api/ucp.h>
+
+#include <vector>
+
+/* What to do with a subscriber that has max_inflight messages in flight */
+typedef enum {
+  PUB_POLICY_DROP,       /* skip it for this message */
+  PUB_POLICY_COALESCE,   /* keep only the newest message for it */
+  PUB_POLICY_DISCONNECT  /* close its endpoint */
+} pub_policy_t;
+
+/**
+ * Fans published messages out to many subscriber endpoints without copying
+ * them per subscriber.
+ *
+ * The publisher owns a pool of message buffers registered once with
+ * ucp_mem_map(). A message is written into a buffer from acquire() and
+ * publish() sends that same buffer to every subscriber, passing the memory
+ * handle so UCX does no registration per send. The buffer counts the sends
+ * still reading it and goes back to the pool when the last one completes.
+ *
+ * Each subscriber has at most `max_inflight` sends outstanding; when a
+ * message finds a subscriber at that limit the policy decides: drop the
+ * message for it, coalesce (keep a reference to the newest message and send
+ * it when a slot frees, replacing any older one waiting), or disconnect it.
+ * Messages go out as tags of class TAG_CLASS_DATA on `channel`, with the
+ * message sequence number in the tag, so a subscriber can receive them with
+ * a TagDispatcher and see what it missed.
+ *
+ * Not thread safe: use it from the thread that progresses `ucp_worker`.
+ */
+class Publisher {
+
+public:
+  struct stats {
+    uint64_t published;
+    uint64_t sends;
+    uint64_t drops;        /* messages skipped for a slow subscriber */
+    uint64_t coalesced;    /* messages replaced by a newer one */
+    uint64_t disconnects;
+    uint64_t buffer_waits; /* acquire() calls that found no free buffer */
+    uint64_t errors;
+  };
+
+  /**
+   * @param ucp_context Context the buffers are registered with.
+   * @param ucp_worker Worker the subscriber endpoints belong to.
+   * @param channel Tag channel of the messages.
+   * @param max_size Largest message.
+   * @param nbuffers Messages that can be in flight at once.
+   * @param max_inflight Sends outstanding per subscriber.
+   * @param policy What to do with a subscriber at `max_inflight`.
+   */
+  Publisher(ucp_context_h ucp_context, ucp_worker_h ucp_worker,
+            unsigned channel, size_t max_size, unsigned nbuffers,
+            unsigned max_inflight, pub_policy_t policy);
+
+  /**
+   * @brief Force-closes the subscriber endpoints and unregisters the pool.
+   */
+  ~Publisher();
+
+  Publisher(const Publisher &) = delete;
+  Publisher &operator=(const Publisher &) = delete;
+
+  /**
+   * @brief Allocates and registers the buffer pool.
+   *
+   * @return 0 on success, -1 on failure.
+   */
+  int init();
+
+  /**
+   * @brief Adds a subscriber; the publisher owns `ep` from now on.
+   *
+   * @return The subscriber's id.
+   */
+  int add_subscriber(ucp_ep_h ep);
+
+  /**
+   * @brief Returns a free buffer of `max_size` bytes to write a message in,
+   * progressing the worker until one is free.
+   */
+  void *acquire();
+
+  /**
+   * @brief Sends the first `length` bytes of a buffer from acquire() to every
+   * connected subscriber. The buffer must not be touched afterwards.
+   *
+   * @return UCS_OK, or UCS_ERR_INVALID_PARAM if `length` exceeds `max_size`.
+   */
+  ucs_status_t publish(void *buffer, size_t length);
+
+  /**
+   * @brief Progresses the worker until every send, coalesced ones included,
+   * has completed.
+   */
+  void flush();
+
+  bool connected(int id) const { return subs_[id]->ep != NULL; }
+
+  const struct stats &get_stats() const { return stats_; }
+
+private:
+  struct buffer {
+    char *data;
+    size_t length;
+    uint64_t seq;
+    unsigned refs; /* sends reading it, plus publish() while it runs */
+  };
+
+  struct subscriber;
+
+  struct send_ctx {
+    Publisher *publisher;
+    struct subscriber *sub;
+    struct buffer *buf;
+  };
+
+  struct subscriber {
+    ucp_ep_h ep; /* NULL once disconnected */
+    std::vector<struct send_ctx> ctxs;
+    std::vector<struct send_ctx *> free_ctxs;
+    struct buffer *pending; /* coalesced message waiting for a slot */
+  };
+
+  static void send_done(void *request, ucs_status_t status, void *user_data);
+
+  void send(struct subscriber *sub, struct buffer *buf);
+  void complete(struct send_ctx *ctx, ucs_status_t status);
+  void release(struct buffer *buf);
+  void disconnect(struct subscriber *sub);
+
+  ucp_context_h ucp_context_;
+  ucp_worker_h ucp_worker_;
+  unsigned channel_;
+  size_t max_size_;
+  unsigned nbuffers_;
+  unsigned max_inflight_;
+  pub_policy_t policy_;
+  char *pool_;
+  ucp_mem_h memh_;
+  std::vector<struct buffer> buffers_;
+  std::vector<struct buffer *> free_;
+  std::vector<struct subscriber *> subs_;
+  uint64_t seq_;
+  size_t inflight_; /* sends outstanding to all subscribers */
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_PUBLISHER_H
@@ -0,0 +1,473 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucp/api/ucp.h>
+#include <unistd.h> /* getopt */
+
+#include <atomic>
+#include <vector>
+
+#include "common_utils.h"
+#include "logger.h"
+#include "publisher.h"
+#include "tag_dispatcher.h"
+#include "tag_layout.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+/**
+ * Measures 1->N fan-out through a Publisher.
+ *
+ * One publisher worker sends every message to N subscriber workers, each
+ * with its own endpoint, spread over T threads that share a context per
+ * thread. The first S subscribers are slow: they are progressed only every
+ * -d microseconds, so the publisher's policy for slow subscribers kicks in.
+ *
+ * Fan-out latency is the time from publish until the last subscriber that
+ * got a message has handled it; delivery latency is per subscriber.
+ */
+
+#define PS_CHANNEL 1
+#define PS_DEPTH 8 /* receives posted per subscriber */
+#define PS_DEFAULT_SUBSCRIBERS 64
+#define PS_DEFAULT_THREADS 4
+#define PS_DEFAULT_COUNT 10000
+#define PS_DEFAULT_SIZE 64
+#define PS_DEFAULT_INFLIGHT 16
+#define PS_DEFAULT_BUFFERS 64
+#define PS_DEFAULT_SLOW_DELAY_US 1000
+
+struct ps_msg {
+  uint64_t seq;
+  uint64_t publish_ns;
+  uint32_t end; /* no more messages */
+  uint32_t reserved;
+};
+
+struct ps_bench;
+
+struct ps_sub {
+  struct ps_bench *bench;
+  int id;
+  bool slow;
+  ucp_worker_h ucp_worker;
+  ucp_worker_attr_t worker_attr;
+  TagDispatcher *dispatcher;
+  bool ended;
+  uint64_t next_seq;
+  uint64_t next_progress_ns;
+  /* results */
+  uint64_t received;
+  uint64_t missed; /* sequence numbers skipped */
+  std::vector<uint64_t> latency_ns;
+};
+
+struct ps_thread {
+  struct ps_bench *bench;
+  ucp_context_h ucp_context;
+  std::vector<struct ps_sub *> subs;
+  int ret;
+};
+
+struct ps_bench {
+  unsigned nsubs;
+  unsigned nthreads;
+  unsigned nslow;
+  unsigned slow_delay_us;
+  long count;
+  size_t size;
+  long rate; /* messages per second, 0 for as fast as possible */
+  unsigned max_inflight;
+  unsigned nbuffers;
+  pub_policy_t policy;
+  ucp_context_h ucp_context; /* publisher */
+  ucp_worker_h ucp_worker;
+  ucp_worker_attr_t worker_attr;
+  std::vector<struct ps_sub> subs;
+  std::vector<struct ps_thread> threads;
+  std::atomic<unsigned> ready;           /* subscriber threads receiving */
+  std::vector<std::atomic<bool>> cut;    /* subscriber was disconnected */
+  std::vector<std::atomic<uint64_t>> last_ns; /* last delivery per message */
+  std::vector<uint64_t> publish_ns;
+};
+
+static const char *ps_policy_names[] = {"drop", "coalesce", "disconnect"};
+
+static void print_ps_usage() {
+  fprintf(stderr, "Usage: run_pubsub [parameters]\n");
+  fprintf(stderr, "\nParameters are:\n");
+  fprintf(stderr, "  -N <count>    Subscribers (default:%d)\n",
+          PS_DEFAULT_SUBSCRIBERS);
+  fprintf(stderr, "  -T <count>    Subscriber threads (default:%d)\n",
+          PS_DEFAULT_THREADS);
+  fprintf(stderr, "  -n <count>    Messages (default:%d)\n",
+          PS_DEFAULT_COUNT);
+  fprintf(stderr, "  -s <size>     Message size (default:%d)\n",
+          PS_DEFAULT_SIZE);
+  fprintf(stderr, "  -r <rate>     Messages per second, 0 for unpaced "
+                  "(default:0)\n");
+  fprintf(stderr, "  -q <count>    Sends in flight per subscriber "
+                  "(default:%d)\n",
+          PS_DEFAULT_INFLIGHT);
+  fprintf(stderr, "  -b <count>    Publisher buffers (default:%d)\n",
+          PS_DEFAULT_BUFFERS);
+  fprintf(stderr, "  -p <policy>   Slow subscribers: drop, coalesce or "
+                  "disconnect (default:drop)\n");
+  fprintf(stderr, "  -S <count>    Slow subscribers (default:0)\n");
+  fprintf(stderr, "  -d <usec>     Progress interval of a slow subscriber "
+                  "(default:%d)\n",
+          PS_DEFAULT_SLOW_DELAY_US);
+}
+
+static void ps_handle(void *arg, ucp_tag_t tag, void *buffer, size_t length) {
+  struct ps_sub *sub = (struct ps_sub *)arg;
+  const struct ps_msg *msg = (const struct ps_msg *)buffer;
+  uint64_t now = get_time_ns();
+  std::atomic<uint64_t> *last;
+  uint64_t prev;
+
+  if (msg->end) {
+    sub->ended = true;
+    return;
+  }
+
+  if (msg->seq > sub->next_seq) {
+    sub->missed += msg->seq - sub->next_seq;
+  }
+  sub->next_seq = msg->seq + 1;
+  ++sub->received;
+  sub->latency_ns.push_back(now - msg->publish_ns);
+
+  last = &sub->bench->last_ns[msg->seq];
+  prev = last->load();
+  while ((prev < now) && !last->compare_exchange_weak(prev, now)) {
+  }
+}
+
+static bool ps_sub_done(struct ps_sub *sub) {
+  return sub->ended || sub->bench->cut[sub->id].load();
+}
+
+static void *ps_sub_thread(void *arg) {
+  struct ps_thread *thread = (struct ps_thread *)arg;
+  struct ps_bench *bench = thread->bench;
+  ucs_status_t status = UCS_OK;
+  size_t done = 0;
+  uint64_t now;
+
+  for (struct ps_sub *sub : thread->subs) {
+    sub->dispatcher = new TagDispatcher(sub->ucp_worker);
+    status = sub->dispatcher->add_channel(TAG_CLASS_DATA, PS_CHANNEL,
+                                          bench->size, PS_DEPTH, ps_handle,
+                                          sub);
+    if (status != UCS_OK) {
+      break;
+    }
+  }
+  /* The publisher waits for every thread, so report in even on failure */
+  bench->ready.fetch_add(1);
+
+  while ((status == UCS_OK) && (done < thread->subs.size())) {
+    done = 0;
+    now = get_time_ns();
+    for (struct ps_sub *sub : thread->subs) {
+      if (ps_sub_done(sub)) {
+        ++done;
+      } else if (!sub->slow) {
+        sub->dispatcher->progress();
+      } else if (now >= sub->next_progress_ns) {
+        sub->dispatcher->progress();
+        sub->next_progress_ns = now + bench->slow_delay_us * 1000ull;
+      }
+    }
+  }
+
+  for (struct ps_sub *sub : thread->subs) {
+    delete sub->dispatcher;
+    sub->dispatcher = NULL;
+  }
+  thread->ret = (status == UCS_OK) ? 0 : -1;
+  return NULL;
+}
+
+static void ps_publish(struct ps_bench *bench, Publisher *publisher,
+                       uint64_t seq, bool end) {
+  struct ps_msg *msg = (struct ps_msg *)publisher->acquire();
+
+  msg->seq = seq;
+  msg->end = end;
+  msg->reserved = 0;
+  msg->publish_ns = get_time_ns();
+  if (!end) {
+    bench->publish_ns[seq] = msg->publish_ns;
+  }
+  publisher->publish(msg, end ? sizeof(*msg) : bench->size);
+}
+
+static int ps_run_publisher(struct ps_bench *bench, uint64_t *elapsed_ns,
+                            struct Publisher::stats *stats) {
+  Publisher publisher(bench->ucp_context, bench->ucp_worker, PS_CHANNEL,
+                      bench->size, bench->nbuffers, bench->max_inflight,
+                      bench->policy);
+  ucp_ep_params_t ep_params;
+  uint64_t interval_ns = (bench->rate > 0) ? 1000000000ull / bench->rate : 0;
+  uint64_t start_ns, next_ns;
+  ucs_status_t status;
+  ucp_ep_h ep;
+  long seq;
+
+  CHKERR_ACTION(publisher.init() != 0, "initialize publisher\n", return -1);
+
+  for (struct ps_sub &sub : bench->subs) {
+    ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS;
+    ep_params.address = sub.worker_attr.address;
+    status = ucp_ep_create(bench->ucp_worker, &ep_params, &ep);
+    CHKERR_ACTION(status != UCS_OK, "connect subscriber\n", return -1);
+    publisher.add_subscriber(ep);
+  }
+
+  while (bench->ready.load() < bench->nthreads) {
+    ucp_worker_progress(bench->ucp_worker);
+  }
+
+  start_ns = next_ns = get_time_ns();
+  for (seq = 0; seq < bench->count; ++seq) {
+    while ((interval_ns > 0) && (get_time_ns() < next_ns)) {
+      ucp_worker_progress(bench->ucp_worker);
+    }
+    next_ns += interval_ns;
+    ps_publish(bench, &publisher, seq, false);
+    ucp_worker_progress(bench->ucp_worker);
+  }
+  publisher.flush();
+  *elapsed_ns = get_time_ns() - start_ns;
+
+  /* Nothing is in flight, so the end marker reaches everyone connected */
+  for (unsigned i = 0; i < bench->nsubs; ++i) {
+    if (!publisher.connected(i)) {
+      bench->cut[i].store(true);
+    }
+  }
+  ps_publish(bench, &publisher, seq, true);
+  publisher.flush();
+
+  *stats = publisher.get_stats();
+  return 0;
+}
+
+static void ps_report(struct ps_bench *bench, uint64_t elapsed_ns,
+                      const struct Publisher::stats *stats) {
+  std::vector<uint64_t> fanout_ns, delivery_ns;
+  uint64_t delivered = 0, missed = 0;
+  double seconds = elapsed_ns / 1e9;
+  long seq;
+
+  for (seq = 0; seq < bench->count; ++seq) {
+    if (bench->last_ns[seq].load() != 0) {
+      fanout_ns.push_back(bench->last_ns[seq].load() -
+                          bench->publish_ns[seq]);
+    }
+  }
+  for (struct ps_sub &sub : bench->subs) {
+    delivered += sub.received;
+    missed += sub.missed;
+    delivery_ns.insert(delivery_ns.end(), sub.latency_ns.begin(),
+                       sub.latency_ns.end());
+  }
+
+  log_flush();
+  printf("\n%u subscribers (%u slow) on %u threads, %ld messages of %lu "
+         "bytes, policy %s\n",
+         bench->nsubs, bench->nslow, bench->nthreads, bench->count,
+         bench->size, ps_policy_names[bench->policy]);
+  printf("published    %12.0f msg/s\n", bench->count / seconds);
+  printf("delivered    %12.0f msg/s %10.3f GB/s\n", delivered / seconds,
+         delivered * bench->size / seconds / 1e9);
+  printf("fan-out      p50 %10.2f  p99 %10.2f  p99.9 %10.2f us\n",
+         percentile_us(fanout_ns, 0.5), percentile_us(fanout_ns, 0.99),
+         percentile_us(fanout_ns, 0.999));
+  printf("delivery     p50 %10.2f  p99 %10.2f  p99.9 %10.2f us\n",
+         percentile_us(delivery_ns, 0.5), percentile_us(delivery_ns, 0.99),
+         percentile_us(delivery_ns, 0.999));
+  printf("slow         %lu dropped, %lu coalesced, %lu disconnected, "
+         "%lu missed by subscribers, %lu waits for a buffer\n",
+         stats->drops, stats->coalesced, stats->disconnects, missed,
+         stats->buffer_waits);
+}
+
+int main(int argc, char **argv) {
+  struct ps_bench bench;
+  struct Publisher::stats stats = {};
+  std::vector<pthread_t> threads;
+  uint64_t elapsed_ns = 0;
+  unsigned i, t, policy;
+  int ret = -1;
+  int c;
+
+  bench.nsubs = PS_DEFAULT_SUBSCRIBERS;
+  bench.nthreads = PS_DEFAULT_THREADS;
+  bench.nslow = 0;
+  bench.slow_delay_us = PS_DEFAULT_SLOW_DELAY_US;
+  bench.count = PS_DEFAULT_COUNT;
+  bench.size = PS_DEFAULT_SIZE;
+  bench.rate = 0;
+  bench.max_inflight = PS_DEFAULT_INFLIGHT;
+  bench.nbuffers = PS_DEFAULT_BUFFERS;
+  bench.policy = PUB_POLICY_DROP;
+
+  while ((c = getopt(argc, argv, "N:T:n:s:r:q:b:p:S:d:h")) != -1) {
+    switch (c) {
+    case 'N':
+      bench.nsubs = atoi(optarg);
+      break;
+    case 'T':
+      bench.nthreads = atoi(optarg);
+      break;
+    case 'n':
+      bench.count = atol(optarg);
+      break;
+    case 's':
+      bench.size = strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      bench.rate = atol(optarg);
+      break;
+    case 'q':
+      bench.max_inflight = atoi(optarg);
+      break;
+    case 'b':
+      bench.nbuffers = atoi(optarg);
+      break;
+    case 'p':
+      for (policy = 0; policy < 3; ++policy) {
+        if (!strcmp(optarg, ps_policy_names[policy])) {
+          break;
+        }
+      }
+      if (policy == 3) {
+        print_ps_usage();
+        return -1;
+      }
+      bench.policy = (pub_policy_t)policy;
+      break;
+    case 'S':
+      bench.nslow = atoi(optarg);
+      break;
+    case 'd':
+      bench.slow_delay_us = atoi(optarg);
+      break;
+    case 'h':
+    default:
+      print_ps_usage();
+      return -1;
+    }
+  }
+
+  if ((bench.nsubs == 0) || (bench.nthreads == 0) ||
+      (bench.nthreads > bench.nsubs) || (bench.nslow > bench.nsubs) ||
+      (bench.count <= 0) || (bench.count >= (long)TAG_SEQ.max()) ||
+      (bench.size < sizeof(struct ps_msg)) || (bench.rate < 0) ||
+      (bench.max_inflight == 0) || (bench.nbuffers == 0)) {
+    print_ps_usage();
+    return -1;
+  }
+
+  bench.ready.store(0);
+  bench.cut = std::vector<std::atomic<bool>>(bench.nsubs);
+  bench.last_ns = std::vector<std::atomic<uint64_t>>(bench.count);
+  bench.publish_ns.resize(bench.count);
+  bench.subs.resize(bench.nsubs);
+  bench.threads.resize(bench.nthreads);
+  threads.resize(bench.nthreads);
+  for (i = 0; i < bench.nsubs; ++i) {
+    bench.cut[i].store(false);
+  }
+
+  bench.ucp_worker = NULL;
+  for (t = 0; t < bench.nthreads; ++t) {
+    bench.threads[t].bench = &bench;
+    bench.threads[t].ucp_context = NULL;
+    bench.threads[t].ret = -1;
+  }
+
+  ret = bench_init_context(&bench.ucp_context, "pubsub publisher",
+                           UCP_FEATURE_TAG);
+  CHKERR_JUMP(ret != 0, "initialize publisher context\n", err);
+
+  ret = bench_init_worker(bench.ucp_context, &bench.ucp_worker,
+                          &bench.worker_attr);
+  CHKERR_ACTION(ret != 0, "initialize publisher worker\n",
+                bench.ucp_worker = NULL;
+                goto err_cleanup);
+
+  for (t = 0; t < bench.nthreads; ++t) {
+    ret = bench_init_context(&bench.threads[t].ucp_context,
+                             "pubsub subscribers", UCP_FEATURE_TAG);
+    CHKERR_JUMP(ret != 0, "initialize subscriber context\n", err_cleanup);
+  }
+
+  /* Slow subscribers are spread over the threads */
+  for (i = 0; i < bench.nsubs; ++i) {
+    struct ps_sub *sub = &bench.subs[i];
+    struct ps_thread *thread = &bench.threads[i % bench.nthreads];
+
+    sub->bench = &bench;
+    sub->id = i;
+    sub->slow = (i < bench.nslow);
+    sub->dispatcher = NULL;
+    sub->ended = false;
+    sub->next_seq = 0;
+    sub->next_progress_ns = 0;
+    sub->received = 0;
+    sub->missed = 0;
+    ret = bench_init_worker(thread->ucp_context, &sub->ucp_worker,
+                            &sub->worker_attr);
+    CHKERR_ACTION(ret != 0, "initialize subscriber\n",
+                  sub->ucp_worker = NULL;
+                  goto err_cleanup);
+    thread->subs.push_back(sub);
+  }
+
+  ret = -1;
+  for (t = 0; t < bench.nthreads; ++t) {
+    /* Started threads never return; leave them to process exit */
+    CHKERR_ACTION(pthread_create(&threads[t], NULL, ps_sub_thread,
+                                 &bench.threads[t]) != 0,
+                  "create subscriber thread\n", return -1);
+  }
+
+  ret = ps_run_publisher(&bench, &elapsed_ns, &stats);
+  if (ret != 0) {
+    for (i = 0; i < bench.nsubs; ++i) {
+      bench.cut[i].store(true);
+    }
+  }
+  for (t = 0; t < bench.nthreads; ++t) {
+    pthread_join(threads[t], NULL);
+    if (bench.threads[t].ret != 0) {
+      ret = -1;
+    }
+  }
+  if (ret == 0) {
+    ps_report(&bench, elapsed_ns, &stats);
+  }
+
+err_cleanup:
+  for (struct ps_sub &sub : bench.subs) {
+    if (sub.ucp_worker != NULL) {
+      bench_cleanup_worker(sub.ucp_worker, &sub.worker_attr);
+    }
+  }
+  for (struct ps_thread &thread : bench.threads) {
+    if (thread.ucp_context != NULL) {
+      ucp_cleanup(thread.ucp_context);
+    }
+  }
+  if (bench.ucp_worker != NULL) {
+    bench_cleanup_worker(bench.ucp_worker, &bench.worker_attr);
+  }
+  ucp_cleanup(bench.ucp_context);
+err:
+  return ret;
+}
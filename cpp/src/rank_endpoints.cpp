@@ -0,0 +1,153 @@
+#include "rank_endpoints.h"
+#include "logger.h"
+#include "memory_utils.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+RankEndpoints::RankEndpoints(ucp_worker_h ucp_worker, int rank,
+                             const struct bootstrap_table *table,
+                             err_handling err_handling_opt)
+    : ucp_worker_(ucp_worker), rank_(rank), table_(table),
+      err_handling_opt_(err_handling_opt), eps_(table->nranks, NULL),
+      ep_status_(table->nranks, UCS_OK), stats_() {}
+
+RankEndpoints::~RankEndpoints() {
+  close_all((err_handling_opt_.ucp_err_mode == UCP_ERR_HANDLING_MODE_PEER)
+                ? UCP_EP_CLOSE_FLAG_FORCE
+                : 0);
+}
+
+std::vector<ucp_ep_h> RankEndpoints::take_eps() {
+  std::vector<ucp_ep_h> eps;
+
+  for (size_t i = 0; i < eps_.size(); ++i) {
+    if (eps_[i] != NULL) {
+      eps.push_back(eps_[i]);
+      eps_[i] = NULL;
+    }
+  }
+
+  return eps;
+}
+
+void RankEndpoints::close_all(uint64_t flags) {
+  std::vector<ucp_ep_h> eps = take_eps();
+
+  ep_close_batch(ucp_worker_, eps.data(), eps.size(), flags);
+}
+
+ucs_status_t RankEndpoints::drain() {
+  std::vector<ucp_ep_h> eps = take_eps();
+
+  return worker_drain(ucp_worker_, eps.data(), eps.size());
+}
+
+ucs_status_t RankEndpoints::create_ep(int rank, bool wireup) {
+  ucp_ep_params_t ep_params;
+  uint64_t start_ns;
+  size_t rss;
+  ucs_status_t status;
+
+  ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS |
+                         UCP_EP_PARAM_FIELD_ERR_HANDLING_MODE |
+                         UCP_EP_PARAM_FIELD_ERR_HANDLER |
+                         UCP_EP_PARAM_FIELD_USER_DATA;
+  ep_params.address = table_->address(rank);
+  ep_params.err_mode = err_handling_opt_.ucp_err_mode;
+  ep_params.err_handler.cb = failure_handler;
+  ep_params.err_handler.arg = &ep_status_[rank];
+  ep_params.user_data = &ep_status_[rank];
+
+  rss = mem_rss_bytes();
+  start_ns = get_time_ns();
+  status = ucp_ep_create(ucp_worker_, &ep_params, &eps_[rank]);
+  if (status != UCS_OK) {
+    LOG_ERROR("rank %d: failed to create ep to rank %d (%s)\n", rank_, rank,
+              ucs_status_string(status));
+    eps_[rank] = NULL;
+    return status;
+  }
+
+  /* ucp_ep_create() only starts wireup; flushing waits for the lanes to
+   * connect so the first send does not pay for it */
+  if (wireup) {
+    status = flush_ep(ucp_worker_, eps_[rank]);
+  }
+
+  stats_.create_ns += get_time_ns() - start_ns;
+  stats_.rss_bytes += (int64_t)mem_rss_bytes() - (int64_t)rss;
+  ++stats_.created;
+
+  LOG_DEBUG("rank %d: connected to rank %d\n", rank_, rank);
+  return status;
+}
+
+ucs_status_t RankEndpoints::get_ep(int rank, ucp_ep_h *ep_p) {
+  ucs_status_t status;
+
+  if ((rank < 0) || (rank >= (int)eps_.size())) {
+    return UCS_ERR_INVALID_PARAM;
+  }
+
+  if (eps_[rank] == NULL) {
+    status = create_ep(rank, false);
+    if (status != UCS_OK) {
+      return status;
+    }
+  }
+
+  *ep_p = eps_[rank];
+  return ep_status_[rank];
+}
+
+ucs_status_t RankEndpoints::preconnect(const std::vector<int> &ranks) {
+  ucs_status_t status;
+
+  for (int rank : ranks) {
+    if ((rank < 0) || (rank >= (int)eps_.size())) {
+      return UCS_ERR_INVALID_PARAM;
+    }
+
+    if (eps_[rank] != NULL) {
+      continue;
+    }
+
+    status = create_ep(rank, true);
+    if (status != UCS_OK) {
+      return status;
+    }
+  }
+
+  return UCS_OK;
+}
+
+ucs_status_t RankEndpoints::send(int rank, const void *buffer, size_t length,
+                                 ucp_tag_t tag) {
+  ucp_request_param_t param;
+  struct ucx_context *request;
+  ucp_ep_h ep;
+  ucs_status_t status;
+
+  status = get_ep(rank, &ep);
+  if (status != UCS_OK) {
+    return status;
+  }
+
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_USER_DATA;
+  param.cb.send = send_handler;
+  param.user_data = (void *)"rank";
+  request = (struct ucx_context *)ucp_tag_send_nbx(ep, buffer, length, tag,
+                                                   &param);
+  return ucx_wait(ucp_worker_, request, "send", "rank message");
+}
+
+void RankEndpoints::report() const {
+  uint64_t created = (stats_.created > 0) ? stats_.created : 1;
+
+  LOG_INFO("rank %d/%d: %lu endpoints, %.1f us and %ld bytes RSS per "
+           "endpoint\n",
+           rank_, (int)eps_.size(), stats_.created,
+           stats_.create_ns / 1e3 / created,
+           stats_.rss_bytes / (int64_t)created);
+}
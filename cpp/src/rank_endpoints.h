@@ -0,0 +1,96 @@
+#ifndef MYUCXPLAYGROUND_RANK_ENDPOINTS_H
+#define MYUCXPLAYGROUND_RANK_ENDPOINTS_H
+
+#include <ucp/api/ucp.h>
+
+#include <vector>
+
+#include "bootstrap.h"
+#include "ucx_config.h"
+
+/**
+ * Rank-addressed endpoints on top of an all-gathered address table.
+ *
+ * No endpoint exists until a rank is first used: send() to a rank creates
+ * its endpoint and keeps it for later calls. preconnect() creates and wires
+ * up a known neighbor set ahead of time. Endpoint creation time and the
+ * resident memory it adds are accumulated in `stats`.
+ *
+ * Not thread safe: use it from the thread that progresses `ucp_worker`.
+ */
+class RankEndpoints {
+
+public:
+  struct stats {
+    uint64_t created;
+    uint64_t create_ns; /* time spent in ucp_ep_create() (+ wireup flush) */
+    int64_t rss_bytes;  /* resident set growth across endpoint creation */
+  };
+
+  RankEndpoints(ucp_worker_h ucp_worker, int rank,
+                const struct bootstrap_table *table,
+                err_handling err_handling_opt);
+  ~RankEndpoints();
+
+  RankEndpoints(const RankEndpoints &) = delete;
+  RankEndpoints &operator=(const RankEndpoints &) = delete;
+
+  /**
+   * @brief Returns the endpoint to `rank`, creating it on first use.
+   *
+   * @return UCS_OK, UCS_ERR_INVALID_PARAM for a bad rank, or the
+   * ucp_ep_create() error.
+   */
+  ucs_status_t get_ep(int rank, ucp_ep_h *ep_p);
+
+  /**
+   * @brief Creates endpoints to `ranks` and flushes them so wireup is done
+   * before the first send.
+   */
+  ucs_status_t preconnect(const std::vector<int> &ranks);
+
+  /**
+   * @brief Sends `length` bytes to `rank` with `tag` and waits for completion.
+   */
+  ucs_status_t send(int rank, const void *buffer, size_t length,
+                    ucp_tag_t tag);
+
+  /**
+   * @brief Closes every endpoint created so far, all at once, with
+   * ep_close() `flags`.
+   */
+  void close_all(uint64_t flags);
+
+  /**
+   * @brief Finishes in-flight operations, then closes every endpoint; see
+   * worker_drain().
+   */
+  ucs_status_t drain();
+
+  /**
+   * @brief Returns true if an endpoint to `rank` has been created.
+   */
+  bool connected(int rank) const { return eps_[rank] != NULL; }
+
+  int nranks() const { return (int)eps_.size(); }
+  const struct stats &get_stats() const { return stats_; }
+
+  /**
+   * @brief Logs endpoint count, mean creation time and memory per endpoint.
+   */
+  void report() const;
+
+private:
+  ucs_status_t create_ep(int rank, bool wireup);
+  std::vector<ucp_ep_h> take_eps();
+
+  ucp_worker_h ucp_worker_;
+  int rank_;
+  const struct bootstrap_table *table_;
+  err_handling err_handling_opt_;
+  std::vector<ucp_ep_h> eps_;
+  std::vector<ucs_status_t> ep_status_;
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_RANK_ENDPOINTS_H
@@ -0,0 +1,192 @@
+#include "relay.h"
+#include "common_utils.h"
+#include "logger.h"
+
+#include <string.h>
+
+Relay::Relay(ucp_context_h ucp_context, ucp_worker_h ucp_worker,
+             unsigned am_id, unsigned nbuffers, size_t chunk_size)
+    : ucp_worker_(ucp_worker), am_id_(am_id), handler_set_(false),
+      pool_(ucp_context, ucp_worker, nbuffers, chunk_size), inflight_(0),
+      stats_() {}
+
+Relay::~Relay() {
+  const struct AmBufferPool::stats &pool = pool_.get_stats();
+  ucp_am_handler_param_t param;
+
+  if (handler_set_) {
+    param.field_mask =
+        UCP_AM_HANDLER_PARAM_FIELD_ID | UCP_AM_HANDLER_PARAM_FIELD_CB;
+    param.id = am_id_;
+    param.cb = NULL;
+    ucp_worker_set_am_recv_handler(ucp_worker_, &param);
+  }
+
+  pool_.drop_waiting();
+  while (inflight_ > 0) {
+    ucp_worker_progress(ucp_worker_);
+  }
+
+  for (struct chunk *chunk : free_chunks_) {
+    delete chunk;
+  }
+  LOG_INFO("relay: %lu chunks (%lu bytes): %lu held, %lu copied, "
+           "%lu in place, %lu rendezvous (%lu waited), %lu dropped, "
+           "%lu overruns, %lu errors, %lu buffers at peak\n",
+           stats_.chunks, stats_.bytes, pool.held, pool.copied,
+           pool.in_place, pool.rndv, pool.rndv_waits, stats_.dropped,
+           stats_.overruns, stats_.errors, pool.peak_buffers);
+}
+
+int Relay::init() {
+  ucp_am_handler_param_t param;
+  ucs_status_t status;
+
+  if (pool_.init("relay") != 0) {
+    return -1;
+  }
+
+  param.field_mask = UCP_AM_HANDLER_PARAM_FIELD_ID |
+                     UCP_AM_HANDLER_PARAM_FIELD_FLAGS |
+                     UCP_AM_HANDLER_PARAM_FIELD_CB |
+                     UCP_AM_HANDLER_PARAM_FIELD_ARG;
+  param.id = am_id_;
+  param.flags = UCP_AM_FLAG_WHOLE_MSG | UCP_AM_FLAG_PERSISTENT_DATA;
+  param.cb = recv_cb;
+  param.arg = this;
+  status = ucp_worker_set_am_recv_handler(ucp_worker_, &param);
+  CHKERR_ACTION(status != UCS_OK, "set the relay handler\n", return -1);
+  handler_set_ = true;
+
+  return 0;
+}
+
+unsigned Relay::add_downstream(ucp_ep_h ep) {
+  downstream_.push_back(ep);
+  return downstream_.size() - 1;
+}
+
+struct Relay::chunk *Relay::get_chunk(const void *header,
+                                      size_t header_length) {
+  struct chunk *chunk;
+
+  if (free_chunks_.empty()) {
+    chunk = new struct chunk;
+    chunk->relay = this;
+    chunk->payload.cb = payload_ready;
+    chunk->payload.arg = chunk;
+  } else {
+    chunk = free_chunks_.back();
+    free_chunks_.pop_back();
+  }
+  chunk->dest = static_cast<const struct relay_hdr *>(header)->dest;
+  chunk->header_length = header_length;
+  memcpy(chunk->header, header, header_length);
+  return chunk;
+}
+
+void Relay::release(struct chunk *chunk) {
+  pool_.release(&chunk->payload);
+  free_chunks_.push_back(chunk);
+  --inflight_;
+}
+
+void Relay::forward_done(void *request, ucs_status_t status,
+                         void *user_data) {
+  struct chunk *chunk = static_cast<struct chunk *>(user_data);
+  Relay *relay = chunk->relay;
+
+  if (request != NULL) {
+    ucp_request_free(request);
+  }
+  if (status != UCS_OK) {
+    LOG_WARN("relay: forwarding a chunk to %u failed (%s)\n", chunk->dest,
+             ucs_status_string(status));
+    ++relay->stats_.errors;
+  }
+  relay->release(chunk);
+}
+
+void Relay::forward(struct chunk *chunk) {
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+
+  if (chunk->dest >= downstream_.size()) {
+    LOG_WARN("relay: dropping a chunk for unknown downstream %u\n",
+             chunk->dest);
+    ++stats_.dropped;
+    release(chunk);
+    return;
+  }
+
+  /* The header and data stay in the chunk until the forward completes */
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_USER_DATA;
+  param.cb.send = forward_done;
+  param.user_data = chunk;
+  if (chunk->payload.kind == AM_PAYLOAD_BUFFER) {
+    param.op_attr_mask |= UCP_OP_ATTR_FIELD_MEMH;
+    param.memh = pool_.memh();
+  } else if (chunk->payload.kind == AM_PAYLOAD_VOLATILE) {
+    /* The data is gone once the AM callback returns */
+    param.op_attr_mask |= UCP_OP_ATTR_FLAG_FORCE_IMM_CMPL;
+  }
+  request = ucp_am_send_nbx(downstream_[chunk->dest], am_id_, chunk->header,
+                            chunk->header_length, chunk->payload.data,
+                            chunk->payload.length, &param);
+  if (UCS_PTR_IS_PTR(request)) {
+    return;
+  }
+
+  if ((chunk->payload.kind == AM_PAYLOAD_VOLATILE) &&
+      (UCS_PTR_STATUS(request) == UCS_ERR_NO_RESOURCE)) {
+    LOG_WARN("relay: no buffer for a chunk to %u and the downstream is "
+             "busy, dropping it\n",
+             chunk->dest);
+    ++stats_.overruns;
+    release(chunk);
+    return;
+  }
+  forward_done(NULL, UCS_PTR_STATUS(request), chunk);
+}
+
+void Relay::payload_ready(struct am_payload *payload, ucs_status_t status) {
+  struct chunk *chunk = static_cast<struct chunk *>(payload->arg);
+  Relay *relay = chunk->relay;
+
+  if (status == UCS_OK) {
+    relay->forward(chunk);
+    return;
+  }
+
+  if (status == UCS_ERR_CANCELED) {
+    ++relay->stats_.dropped; /* waited for a buffer until shutdown */
+  } else {
+    LOG_WARN("relay: receiving a chunk failed (%s)\n",
+             ucs_status_string(status));
+    ++relay->stats_.errors;
+  }
+  relay->release(chunk);
+}
+
+ucs_status_t Relay::recv_cb(void *arg, const void *header,
+                            size_t header_length, void *data, size_t length,
+                            const ucp_am_recv_param_t *param) {
+  Relay *relay = static_cast<Relay *>(arg);
+  struct chunk *chunk;
+
+  if ((header_length < sizeof(struct relay_hdr)) ||
+      (header_length > RELAY_MAX_HEADER) ||
+      (length > relay->pool_.buffer_size())) {
+    LOG_WARN("relay: dropping a chunk of %zu header and %zu data bytes\n",
+             header_length, length);
+    ++relay->stats_.dropped;
+    return UCS_OK;
+  }
+
+  chunk = relay->get_chunk(header, header_length);
+  ++relay->inflight_;
+  ++relay->stats_.chunks;
+  relay->stats_.bytes += length;
+  return relay->pool_.take_in(&chunk->payload, data, length, param);
+}
@@ -0,0 +1,143 @@
+#ifndef MYUCXPLAYGROUND_RELAY_H
+#define MYUCXPLAYGROUND_RELAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ucp/api/ucp.h>
+
+#include <vector>
+
+#include "am_buffer_pool.h"
+
+#define RELAY_MAX_HEADER 64 /* bytes of AM header per chunk */
+
+/**
+ * Start of the AM header of every chunk sent through a Relay. What follows
+ * it, up to RELAY_MAX_HEADER bytes, is forwarded untouched.
+ */
+struct relay_hdr {
+  uint32_t dest; /* index of the downstream endpoint at the relay */
+  uint32_t reserved;
+};
+
+/**
+ * Forwards active messages from upstream endpoints to downstream ones,
+ * chunk by chunk.
+ *
+ * Senders split their messages into chunks of at most `chunk_size` bytes
+ * and send each as an active message whose header starts with struct
+ * relay_hdr. The relay sends every chunk on to downstream endpoint `dest`
+ * as soon as the chunk itself has arrived, without waiting for the rest of
+ * its message, so a message is in every hop at once (cut-through). The
+ * chunks of a message may overtake each other; receivers place them by an
+ * offset the sender puts after the relay_hdr.
+ *
+ * Chunks are taken in by an AmBufferPool of `nbuffers` buffers:
+ *
+ * - Eager chunks UCX lets us keep are forwarded from UCX's buffer and
+ *   released when the forward completes.
+ * - Rendezvous chunks are received into a pool buffer and forwarded from
+ *   there. When the pool is empty they wait, which holds back their
+ *   senders.
+ * - Other eager chunks are copied into a pool buffer. When the pool is
+ *   empty the relay tries to forward the chunk before the AM callback
+ *   returns; if the downstream cannot take it at once, the chunk is
+ *   dropped and counted as an overrun. Senders that cannot afford that
+ *   send with UCP_AM_SEND_FLAG_RNDV, so every chunk waits for a buffer.
+ *
+ * So the relay's buffers never go above `nbuffers` x `chunk_size`.
+ *
+ * Upstream and downstream endpoints belong to the relay's one worker.
+ *
+ * Not thread safe: use it from the thread that progresses `ucp_worker`.
+ */
+class Relay {
+
+public:
+  struct stats {
+    uint64_t chunks;
+    uint64_t bytes;
+    uint64_t dropped;  /* too large, bad header or unknown dest */
+    uint64_t overruns; /* eager chunks with no buffer the downstream refused */
+    uint64_t errors;   /* failed receives and forwards */
+  };
+
+  /**
+   * @param ucp_context Context created with UCP_FEATURE_AM.
+   * @param ucp_worker Worker of `ucp_context`.
+   * @param am_id Active message id of chunks, upstream and downstream.
+   * @param nbuffers Buffers in the pool.
+   * @param chunk_size Largest chunk.
+   */
+  Relay(ucp_context_h ucp_context, ucp_worker_h ucp_worker, unsigned am_id,
+        unsigned nbuffers, size_t chunk_size);
+
+  /**
+   * @brief Removes the handler, drops chunks still waiting for a buffer,
+   * waits for forwards in flight and frees the pool. The caller closes the
+   * endpoints afterwards.
+   */
+  ~Relay();
+
+  Relay(const Relay &) = delete;
+  Relay &operator=(const Relay &) = delete;
+
+  /**
+   * @brief Registers the pool and installs the handler.
+   *
+   * @return 0 on success, -1 on failure.
+   */
+  int init();
+
+  /**
+   * @brief Adds a downstream endpoint of the relay's worker.
+   *
+   * @return Its index, the `dest` of chunks that go to it.
+   */
+  unsigned add_downstream(ucp_ep_h ep);
+
+  unsigned progress() { return ucp_worker_progress(ucp_worker_); }
+
+  /**
+   * @return Chunks taken in and not forwarded yet.
+   */
+  size_t inflight() const { return inflight_; }
+
+  const struct stats &get_stats() const { return stats_; }
+
+  const struct AmBufferPool::stats &pool_stats() const {
+    return pool_.get_stats();
+  }
+
+private:
+  struct chunk {
+    Relay *relay;
+    struct am_payload payload;
+    uint32_t dest;
+    size_t header_length;
+    char header[RELAY_MAX_HEADER];
+  };
+
+  static ucs_status_t recv_cb(void *arg, const void *header,
+                              size_t header_length, void *data,
+                              size_t length,
+                              const ucp_am_recv_param_t *param);
+  static void payload_ready(struct am_payload *payload, ucs_status_t status);
+  static void forward_done(void *request, ucs_status_t status,
+                           void *user_data);
+
+  struct chunk *get_chunk(const void *header, size_t header_length);
+  void forward(struct chunk *chunk);
+  void release(struct chunk *chunk);
+
+  ucp_worker_h ucp_worker_;
+  unsigned am_id_;
+  bool handler_set_;
+  AmBufferPool pool_;
+  std::vector<struct chunk *> free_chunks_;
+  std::vector<ucp_ep_h> downstream_;
+  size_t inflight_;
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_RELAY_H
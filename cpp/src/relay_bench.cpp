@@ -0,0 +1,490 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucp/api/ucp.h>
+#include <unistd.h> /* getopt */
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "common_utils.h"
+#include "logger.h"
+#include "relay.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+/**
+ * Sends messages from a source thread to a sink thread, either through a
+ * Relay on a third thread or straight to the sink, and measures rate and
+ * one-way latency, from the first chunk sent until the last has landed at
+ * the sink. The difference between the two modes is what the relay hop
+ * costs; the relay's peak pool use is the memory it took.
+ *
+ * Messages are sent as chunks of -c bytes with -w chunks in flight. The
+ * sink puts each chunk in place by its offset and checks its bytes.
+ */
+
+#define RL_AM_ID 21
+#define RL_DEFAULT_COUNT 2000
+#define RL_DEFAULT_SIZE (1024 * 1024)
+#define RL_DEFAULT_CHUNK (64 * 1024)
+#define RL_DEFAULT_WINDOW 16
+#define RL_DEFAULT_BUFFERS 8
+
+typedef enum { RL_MODE_RELAY, RL_MODE_DIRECT } rl_mode_t;
+
+static const char *rl_mode_names[] = {"relay", "direct"};
+
+struct rl_hdr {
+  struct relay_hdr route;
+  uint64_t msg;
+  uint64_t offset; /* of the chunk in its message */
+  uint64_t send_ns;
+};
+
+struct rl_bench;
+
+struct rl_send_slot {
+  struct rl_bench *bench;
+  struct rl_hdr hdr;
+};
+
+struct rl_recv {
+  struct rl_bench *bench;
+  struct rl_hdr hdr;
+  size_t length;
+};
+
+struct rl_bench {
+  struct bench_side source; /* ep: to the relay */
+  struct bench_side relay;  /* ep: to the sink */
+  struct bench_side sink;
+  ucp_ep_h direct_ep;    /* source to sink */
+  rl_mode_t mode;
+  long count;
+  size_t size;
+  size_t chunk_size;
+  unsigned window;
+  unsigned nbuffers;
+  bool force_rndv;
+  int parties;
+  std::atomic<int> barrier_count;
+  std::vector<char> pattern; /* every message */
+  std::vector<struct rl_send_slot *> free_slots;
+  /* sink thread only */
+  std::vector<char> sink_buffer;
+  std::vector<size_t> arrived;
+  std::vector<uint64_t> latency_ns;
+  long delivered;
+  long corrupt;
+  std::atomic<bool> sink_done;
+  std::atomic<bool> relay_lost; /* a chunk will never reach the sink */
+  /* results */
+  uint64_t elapsed_ns;
+  struct Relay::stats stats;
+  struct AmBufferPool::stats pool_stats;
+  int ret[3];
+};
+
+static void print_rl_usage() {
+  fprintf(stderr, "Usage: run_relay [parameters]\n");
+  fprintf(stderr, "\nParameters are:\n");
+  fprintf(stderr, "  -m <mode>     relay: through a relay, direct: straight "
+                  "to the sink; repeat for several (default: both)\n");
+  fprintf(stderr, "  -n <count>    Messages (default:%d)\n",
+          RL_DEFAULT_COUNT);
+  fprintf(stderr, "  -s <size>     Message size (default:%d)\n",
+          RL_DEFAULT_SIZE);
+  fprintf(stderr, "  -c <size>     Chunk size (default:%d)\n",
+          RL_DEFAULT_CHUNK);
+  fprintf(stderr, "  -w <count>    Chunks in flight (default:%d)\n",
+          RL_DEFAULT_WINDOW);
+  fprintf(stderr, "  -b <count>    Relay buffers (default:%d)\n",
+          RL_DEFAULT_BUFFERS);
+  fprintf(stderr, "  -r            Force rendezvous\n");
+}
+
+/* Runs on the sink thread, for each chunk that has landed in sink_buffer */
+static void rl_arrived(struct rl_bench *bench, const struct rl_hdr *hdr,
+                       size_t length) {
+  if (memcmp(bench->sink_buffer.data() + hdr->offset,
+             bench->pattern.data() + hdr->offset, length)) {
+    ++bench->corrupt;
+  }
+  bench->arrived[hdr->msg] += length;
+  if (bench->arrived[hdr->msg] == bench->size) {
+    bench->latency_ns[hdr->msg] = get_time_ns() - hdr->send_ns;
+    ++bench->delivered;
+  }
+}
+
+static void rl_rndv_done(void *request, ucs_status_t status, size_t length,
+                         void *user_data) {
+  struct rl_recv *recv = (struct rl_recv *)user_data;
+
+  if (request != NULL) {
+    ucp_request_free(request);
+  }
+  if (status == UCS_OK) {
+    rl_arrived(recv->bench, &recv->hdr, recv->length);
+  } else {
+    LOG_ERROR("relay bench: receiving a chunk failed (%s)\n",
+              ucs_status_string(status));
+    ++recv->bench->corrupt;
+  }
+  delete recv;
+}
+
+static ucs_status_t rl_sink_cb(void *arg, const void *header,
+                               size_t header_length, void *data,
+                               size_t length,
+                               const ucp_am_recv_param_t *param) {
+  struct rl_bench *bench = (struct rl_bench *)arg;
+  const struct rl_hdr *hdr = (const struct rl_hdr *)header;
+  ucp_request_param_t recv_param;
+  ucs_status_ptr_t request;
+  struct rl_recv *recv;
+
+  if ((header_length != sizeof(*hdr)) ||
+      (hdr->msg >= (uint64_t)bench->count) ||
+      (hdr->offset + length > bench->size)) {
+    ++bench->corrupt;
+    return UCS_OK;
+  }
+
+  if (!(param->recv_attr & UCP_AM_RECV_ATTR_FLAG_RNDV)) {
+    memcpy(bench->sink_buffer.data() + hdr->offset, data, length);
+    rl_arrived(bench, hdr, length);
+    return UCS_OK;
+  }
+
+  recv = new struct rl_recv;
+  recv->bench = bench;
+  recv->hdr = *hdr;
+  recv->length = length;
+  recv_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                            UCP_OP_ATTR_FIELD_USER_DATA |
+                            UCP_OP_ATTR_FIELD_DATATYPE;
+  recv_param.cb.recv_am = rl_rndv_done;
+  recv_param.user_data = recv;
+  recv_param.datatype = ucp_dt_make_contig(1);
+  request = ucp_am_recv_data_nbx(bench->sink.ucp_worker, data,
+                                 bench->sink_buffer.data() + hdr->offset,
+                                 length, &recv_param);
+  if (!UCS_PTR_IS_PTR(request)) {
+    rl_rndv_done(NULL, UCS_PTR_STATUS(request), length, recv);
+  }
+  return UCS_INPROGRESS;
+}
+
+static void rl_send_done(void *request, ucs_status_t status,
+                         void *user_data) {
+  struct rl_send_slot *slot = (struct rl_send_slot *)user_data;
+
+  if (status != UCS_OK) {
+    LOG_ERROR("relay bench: send failed (%s)\n", ucs_status_string(status));
+  }
+  slot->bench->free_slots.push_back(slot);
+  ucp_request_free(request);
+}
+
+static void *rl_source_thread(void *arg) {
+  struct rl_bench *bench = (struct rl_bench *)arg;
+  ucp_worker_h ucp_worker = bench->source.ucp_worker;
+  ucp_ep_h ep = (bench->mode == RL_MODE_RELAY) ? bench->source.ep
+                                               : bench->direct_ep;
+  std::vector<struct rl_send_slot> slots(bench->window);
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+  struct rl_send_slot *slot;
+  ucs_status_t status = UCS_OK;
+  uint64_t send_ns;
+  size_t offset, length;
+  long msg;
+
+  bench->free_slots.clear();
+  for (struct rl_send_slot &s : slots) {
+    s.bench = bench;
+    s.hdr.route.dest = 0;
+    s.hdr.route.reserved = 0;
+    bench->free_slots.push_back(&s);
+  }
+
+  bench_barrier(&bench->barrier_count, bench->parties, 1, ucp_worker);
+
+  for (msg = 0; (msg < bench->count) && (status == UCS_OK); ++msg) {
+    send_ns = get_time_ns();
+    for (offset = 0; (offset < bench->size) && (status == UCS_OK);
+         offset += length) {
+      length = std::min(bench->chunk_size, bench->size - offset);
+      while (bench->free_slots.empty()) {
+        ucp_worker_progress(ucp_worker);
+      }
+      slot = bench->free_slots.back();
+      bench->free_slots.pop_back();
+      slot->hdr.msg = msg;
+      slot->hdr.offset = offset;
+      slot->hdr.send_ns = send_ns;
+
+      param.op_attr_mask = UCP_OP_ATTR_FIELD_FLAGS |
+                           UCP_OP_ATTR_FIELD_CALLBACK |
+                           UCP_OP_ATTR_FIELD_USER_DATA;
+      param.flags = bench->force_rndv ? UCP_AM_SEND_FLAG_RNDV : 0;
+      param.cb.send = rl_send_done;
+      param.user_data = slot;
+      request = ucp_am_send_nbx(ep, RL_AM_ID, &slot->hdr, sizeof(slot->hdr),
+                                bench->pattern.data() + offset, length,
+                                &param);
+      if (UCS_PTR_IS_PTR(request)) {
+        continue;
+      }
+      status = UCS_PTR_STATUS(request);
+      bench->free_slots.push_back(slot);
+    }
+  }
+
+  while (bench->free_slots.size() < slots.size()) {
+    ucp_worker_progress(ucp_worker);
+  }
+
+  bench_barrier(&bench->barrier_count, bench->parties, 2, ucp_worker);
+  bench->ret[0] = (status == UCS_OK) ? 0 : -1;
+  return NULL;
+}
+
+static void *rl_relay_thread(void *arg) {
+  struct rl_bench *bench = (struct rl_bench *)arg;
+  Relay relay(bench->relay.ucp_context, bench->relay.ucp_worker, RL_AM_ID,
+              bench->nbuffers, bench->chunk_size);
+  const struct Relay::stats &stats = relay.get_stats();
+  int ret;
+
+  ret = relay.init();
+  relay.add_downstream(bench->relay.ep);
+
+  bench_barrier(&bench->barrier_count, bench->parties, 1,
+                bench->relay.ucp_worker);
+
+  /* Stay until the sink has it all and every forward has completed */
+  while ((ret == 0) && (!bench->sink_done.load() || relay.inflight())) {
+    relay.progress();
+    if (stats.dropped + stats.overruns + stats.errors > 0) {
+      ret = -1;
+    }
+  }
+  if (ret != 0) {
+    bench->relay_lost.store(true);
+  }
+
+  bench_barrier(&bench->barrier_count, bench->parties, 2,
+                bench->relay.ucp_worker);
+  bench->stats = stats;
+  bench->pool_stats = relay.pool_stats();
+  bench->ret[2] = (ret == 0) ? 0 : -1;
+  return NULL;
+}
+
+static void *rl_sink_thread(void *arg) {
+  struct rl_bench *bench = (struct rl_bench *)arg;
+  ucp_worker_h ucp_worker = bench->sink.ucp_worker;
+  uint64_t start_ns;
+
+  bench_barrier(&bench->barrier_count, bench->parties, 1, ucp_worker);
+
+  start_ns = get_time_ns();
+  while ((bench->delivered < bench->count) && !bench->relay_lost.load()) {
+    ucp_worker_progress(ucp_worker);
+  }
+  bench->elapsed_ns = get_time_ns() - start_ns;
+  bench->sink_done.store(true);
+
+  bench_barrier(&bench->barrier_count, bench->parties, 2, ucp_worker);
+  bench->ret[1] = (bench->corrupt == 0) ? 0 : -1;
+  return NULL;
+}
+
+static int rl_run(struct rl_bench *bench, rl_mode_t mode) {
+  pthread_t source_thread, relay_thread, sink_thread;
+
+  bench->mode = mode;
+  bench->parties = (mode == RL_MODE_RELAY) ? 3 : 2;
+  bench->barrier_count.store(0);
+  bench->arrived.assign(bench->count, 0);
+  bench->latency_ns.assign(bench->count, 0);
+  bench->delivered = 0;
+  bench->corrupt = 0;
+  bench->sink_done.store(false);
+  bench->relay_lost.store(false);
+  memset(&bench->stats, 0, sizeof(bench->stats));
+  memset(&bench->pool_stats, 0, sizeof(bench->pool_stats));
+  bench->ret[0] = bench->ret[1] = -1;
+  bench->ret[2] = (mode == RL_MODE_RELAY) ? -1 : 0;
+
+  CHKERR_ACTION(pthread_create(&sink_thread, NULL, rl_sink_thread,
+                               bench) != 0,
+                "create sink thread\n", return -1);
+  /* Started threads never return; leave them to process exit */
+  if (mode == RL_MODE_RELAY) {
+    CHKERR_ACTION(pthread_create(&relay_thread, NULL, rl_relay_thread,
+                                 bench) != 0,
+                  "create relay thread\n", return -1);
+  }
+  CHKERR_ACTION(pthread_create(&source_thread, NULL, rl_source_thread,
+                               bench) != 0,
+                "create source thread\n", return -1);
+
+  pthread_join(source_thread, NULL);
+  pthread_join(sink_thread, NULL);
+  if (mode == RL_MODE_RELAY) {
+    pthread_join(relay_thread, NULL);
+  }
+  if ((bench->ret[0] != 0) || (bench->ret[1] != 0) || (bench->ret[2] != 0)) {
+    return -1;
+  }
+
+  log_flush();
+  printf("%-6s %10.0f %10.2f %10.2f %10.2f %10.2f %10lu %10lu %10lu\n",
+         rl_mode_names[mode], bench->count / (bench->elapsed_ns / 1e9),
+         bench->count * bench->size / (double)bench->elapsed_ns,
+         percentile_us(bench->latency_ns, 0.5),
+         percentile_us(bench->latency_ns, 0.99),
+         percentile_us(bench->latency_ns, 0.999),
+         bench->pool_stats.peak_buffers * bench->chunk_size / 1024,
+         bench->stats.overruns, bench->pool_stats.rndv_waits);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  struct rl_bench bench;
+  std::vector<rl_mode_t> modes;
+  ucp_am_handler_param_t am_param;
+  ucs_status_t status;
+  unsigned mode;
+  size_t i;
+  int ret = -1;
+  int c;
+
+  bench.count = RL_DEFAULT_COUNT;
+  bench.size = RL_DEFAULT_SIZE;
+  bench.chunk_size = RL_DEFAULT_CHUNK;
+  bench.window = RL_DEFAULT_WINDOW;
+  bench.nbuffers = RL_DEFAULT_BUFFERS;
+  bench.force_rndv = false;
+
+  while ((c = getopt(argc, argv, "m:n:s:c:w:b:rh")) != -1) {
+    switch (c) {
+    case 'm':
+      for (mode = 0; mode < 2; ++mode) {
+        if (!strcmp(optarg, rl_mode_names[mode])) {
+          break;
+        }
+      }
+      if (mode == 2) {
+        print_rl_usage();
+        return -1;
+      }
+      modes.push_back((rl_mode_t)mode);
+      break;
+    case 'n':
+      bench.count = atol(optarg);
+      break;
+    case 's':
+      bench.size = strtoul(optarg, NULL, 0);
+      break;
+    case 'c':
+      bench.chunk_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'w':
+      bench.window = atoi(optarg);
+      break;
+    case 'b':
+      bench.nbuffers = atoi(optarg);
+      break;
+    case 'r':
+      bench.force_rndv = true;
+      break;
+    case 'h':
+    default:
+      print_rl_usage();
+      return -1;
+    }
+  }
+
+  if ((bench.count <= 0) || (bench.size == 0) || (bench.chunk_size == 0) ||
+      (bench.window == 0) || (bench.nbuffers == 0)) {
+    print_rl_usage();
+    return -1;
+  }
+
+  if (modes.empty()) {
+    modes = {RL_MODE_RELAY, RL_MODE_DIRECT};
+  }
+  bench.pattern.resize(bench.size);
+  for (i = 0; i < bench.size; ++i) {
+    bench.pattern[i] = (char)(i * 7);
+  }
+  bench.sink_buffer.resize(bench.size);
+
+  ret = bench_init_side(&bench.source, "relay bench source",
+                        UCP_FEATURE_AM);
+  CHKERR_JUMP(ret != 0, "initialize source\n", err);
+
+  ret = bench_init_side(&bench.relay, "relay bench relay",
+                        UCP_FEATURE_AM);
+  CHKERR_JUMP(ret != 0, "initialize relay\n", err_source);
+
+  ret = bench_init_side(&bench.sink, "relay bench sink",
+                        UCP_FEATURE_AM);
+  CHKERR_JUMP(ret != 0, "initialize sink\n", err_relay);
+
+  ret = -1;
+  am_param.field_mask = UCP_AM_HANDLER_PARAM_FIELD_ID |
+                        UCP_AM_HANDLER_PARAM_FIELD_FLAGS |
+                        UCP_AM_HANDLER_PARAM_FIELD_CB |
+                        UCP_AM_HANDLER_PARAM_FIELD_ARG;
+  am_param.id = RL_AM_ID;
+  am_param.flags = UCP_AM_FLAG_WHOLE_MSG;
+  am_param.cb = rl_sink_cb;
+  am_param.arg = &bench;
+  status = ucp_worker_set_am_recv_handler(bench.sink.ucp_worker, &am_param);
+  CHKERR_JUMP(status != UCS_OK, "set the sink handler\n", err_sink);
+
+  status = bench_connect(&bench.source, &bench.relay, &bench.source.ep);
+  CHKERR_JUMP(status != UCS_OK, "connect source to relay\n", err_sink);
+
+  status = bench_connect(&bench.relay, &bench.sink, &bench.relay.ep);
+  CHKERR_JUMP(status != UCS_OK, "connect relay to sink\n", err_source_ep);
+
+  status = bench_connect(&bench.source, &bench.sink, &bench.direct_ep);
+  CHKERR_JUMP(status != UCS_OK, "connect source to sink\n", err_relay_ep);
+
+  log_flush();
+  printf("\n%ld messages of %lu bytes in %lu byte chunks, %u in flight, "
+         "%u relay buffers; latencies in us\n",
+         bench.count, bench.size, bench.chunk_size, bench.window,
+         bench.nbuffers);
+  printf("%-6s %10s %10s %10s %10s %10s %10s %10s %10s\n", "mode", "msg/s",
+         "GB/s", "p50", "p99", "p99.9", "peak KiB", "overruns", "waited");
+  for (rl_mode_t run_mode : modes) {
+    ret = rl_run(&bench, run_mode);
+    if (ret != 0) {
+      break;
+    }
+  }
+
+  ep_close(bench.source.ucp_worker, bench.direct_ep, UCP_EP_CLOSE_FLAG_FORCE);
+err_relay_ep:
+  ep_close(bench.relay.ucp_worker, bench.relay.ep, UCP_EP_CLOSE_FLAG_FORCE);
+err_source_ep:
+  ep_close(bench.source.ucp_worker, bench.source.ep, UCP_EP_CLOSE_FLAG_FORCE);
+err_sink:
+  bench_cleanup_side(&bench.sink);
+err_relay:
+  bench_cleanup_side(&bench.relay);
+err_source:
+  bench_cleanup_side(&bench.source);
+err:
+  return ret;
+}
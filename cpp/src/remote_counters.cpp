@@ -0,0 +1,282 @@
+#include "remote_counters.h"
+#include "common_utils.h"
+#include "logger.h"
+#include "ucx_utils.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+CounterRegion::CounterRegion(ucp_context_h ucp_context, unsigned count)
+    : ucp_context_(ucp_context), count_(count), counters_(NULL),
+      length_(count * sizeof(uint64_t)), memh_(NULL) {}
+
+CounterRegion::~CounterRegion() {
+  if (memh_ != NULL) {
+    ucp_mem_unmap(ucp_context_, memh_);
+  }
+  if (counters_ != NULL) {
+    munmap((void *)counters_, length_);
+  }
+}
+
+int CounterRegion::init() {
+  struct counter_region_desc *desc;
+  ucp_mem_map_params_t params;
+  void *rkey_buffer;
+  size_t rkey_len;
+  ucs_status_t status;
+
+  CHKERR_ACTION(count_ == 0, "size the counter region\n", return -1);
+
+  /* Anonymous memory starts zeroed */
+  counters_ = static_cast<uint64_t *>(mmap(NULL, length_,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                                           0));
+  CHKERR_ACTION(counters_ == MAP_FAILED, "allocate counters\n",
+                counters_ = NULL; return -1);
+
+  params.field_mask =
+      UCP_MEM_MAP_PARAM_FIELD_ADDRESS | UCP_MEM_MAP_PARAM_FIELD_LENGTH;
+  params.address = (void *)counters_;
+  params.length = length_;
+  status = ucp_mem_map(ucp_context_, &params, &memh_);
+  CHKERR_ACTION(status != UCS_OK, "register counters\n",
+                memh_ = NULL; return -1);
+
+  status = ucp_rkey_pack(ucp_context_, memh_, &rkey_buffer, &rkey_len);
+  CHKERR_ACTION(status != UCS_OK, "pack the counters' rkey\n", return -1);
+
+  desc_.resize(sizeof(*desc) + rkey_len);
+  desc = reinterpret_cast<struct counter_region_desc *>(desc_.data());
+  desc->address = (uint64_t)counters_;
+  desc->count = count_;
+  desc->rkey_len = rkey_len;
+  memcpy(desc + 1, rkey_buffer, rkey_len);
+  ucp_rkey_buffer_release(rkey_buffer);
+
+  return 0;
+}
+
+CounterClient::CounterClient(ucp_worker_h ucp_worker)
+    : ucp_worker_(ucp_worker), ep_(NULL), rkey_(NULL), address_(0),
+      count_(0), ops_(COUNTER_CLIENT_MAX_OPS), pending_(0), stats_() {
+  size_t i;
+
+  free_ops_.reserve(ops_.size());
+  for (i = ops_.size(); i > 0; --i) {
+    ops_[i - 1].client = this;
+    free_ops_.push_back(&ops_[i - 1]);
+  }
+}
+
+CounterClient::~CounterClient() {
+  if (rkey_ != NULL) {
+    ucp_rkey_destroy(rkey_);
+  }
+  if (ep_ != NULL) {
+    ep_close(ucp_worker_, ep_, UCP_EP_CLOSE_FLAG_FORCE);
+  }
+  LOG_INFO("counter client: %lu atomics, %lu errors\n", stats_.ops,
+           stats_.errors);
+}
+
+ucs_status_t CounterClient::connect(const ucp_address_t *address,
+                                    const void *desc, size_t desc_len) {
+  const struct counter_region_desc *hdr =
+      static_cast<const struct counter_region_desc *>(desc);
+  ucp_ep_params_t ep_params;
+  ucs_status_t status;
+
+  if ((desc_len < sizeof(*hdr)) ||
+      (desc_len != sizeof(*hdr) + hdr->rkey_len)) {
+    return UCS_ERR_INVALID_PARAM;
+  }
+
+  ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS;
+  ep_params.address = address;
+  status = ucp_ep_create(ucp_worker_, &ep_params, &ep_);
+  CHKERR_ACTION(status != UCS_OK, "ucp_ep_create\n",
+                ep_ = NULL; return status);
+
+  status = ucp_ep_rkey_unpack(ep_, hdr + 1, &rkey_);
+  CHKERR_ACTION(status != UCS_OK, "unpack the counters' rkey\n",
+                rkey_ = NULL; return status);
+
+  address_ = hdr->address;
+  count_ = hdr->count;
+  return UCS_OK;
+}
+
+ucs_status_t CounterClient::close() {
+  ucs_status_t status;
+
+  while (pending_ > 0) {
+    ucp_worker_progress(ucp_worker_);
+  }
+
+  if (rkey_ != NULL) {
+    ucp_rkey_destroy(rkey_);
+    rkey_ = NULL;
+  }
+  if (ep_ == NULL) {
+    return UCS_OK;
+  }
+  status = worker_drain(ucp_worker_, &ep_, 1);
+  ep_ = NULL;
+  return status;
+}
+
+void CounterClient::op_done(struct op *op, ucs_status_t status) {
+  counter_done_cb_t cb = op->cb;
+  void *arg = op->arg;
+  uint64_t value = op->result;
+
+  if (status != UCS_OK) {
+    LOG_WARN("counter client: atomic failed (%s)\n",
+             ucs_status_string(status));
+    ++stats_.errors;
+  }
+
+  /* The callback may start a new operation in this slot */
+  free_ops_.push_back(op);
+  --pending_;
+  cb(arg, status, value);
+}
+
+void CounterClient::atomic_done(void *request, ucs_status_t status,
+                                void *user_data) {
+  struct op *op = static_cast<struct op *>(user_data);
+
+  ucp_request_free(request);
+  op->client->op_done(op, status);
+}
+
+ucs_status_t CounterClient::post(ucp_atomic_op_t opcode, unsigned index,
+                                 uint64_t operand, uint64_t result,
+                                 counter_done_cb_t cb, void *arg) {
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+  struct op *op;
+
+  if ((rkey_ == NULL) || (index >= count_)) {
+    return UCS_ERR_INVALID_PARAM;
+  }
+  if (free_ops_.empty()) {
+    return UCS_ERR_NO_RESOURCE;
+  }
+
+  op = free_ops_.back();
+  free_ops_.pop_back();
+  op->cb = cb;
+  op->arg = arg;
+  op->operand = operand;
+  op->result = result;
+  ++pending_;
+  ++stats_.ops;
+
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_USER_DATA |
+                       UCP_OP_ATTR_FIELD_DATATYPE |
+                       UCP_OP_ATTR_FIELD_REPLY_BUFFER;
+  param.cb.send = atomic_done;
+  param.user_data = op;
+  param.datatype = ucp_dt_make_contig(sizeof(uint64_t));
+  param.reply_buffer = &op->result;
+
+  request = ucp_atomic_op_nbx(ep_, opcode, &op->operand, 1,
+                              address_ + index * sizeof(uint64_t), rkey_,
+                              &param);
+  if (!UCS_PTR_IS_PTR(request)) {
+    op_done(op, UCS_PTR_STATUS(request));
+  }
+  return UCS_OK;
+}
+
+ucs_status_t CounterClient::fetch_add(unsigned index, uint64_t value,
+                                      counter_done_cb_t cb, void *arg) {
+  return post(UCP_ATOMIC_OP_ADD, index, value, 0, cb, arg);
+}
+
+ucs_status_t CounterClient::swap(unsigned index, uint64_t value,
+                                 counter_done_cb_t cb, void *arg) {
+  return post(UCP_ATOMIC_OP_SWAP, index, value, 0, cb, arg);
+}
+
+ucs_status_t CounterClient::compare_swap(unsigned index, uint64_t expected,
+                                         uint64_t desired,
+                                         counter_done_cb_t cb, void *arg) {
+  return post(UCP_ATOMIC_OP_CSWAP, index, expected, desired, cb, arg);
+}
+
+IdAllocator::IdAllocator(CounterClient *client, unsigned index,
+                         uint64_t block)
+    : client_(client), index_(index), block_(block), next_(0), end_(0),
+      spare_(0), have_spare_(false), fetching_(false), fetch_status_(UCS_OK),
+      stats_() {}
+
+IdAllocator::~IdAllocator() {
+  while (fetching_) {
+    client_->progress();
+  }
+  LOG_INFO("id allocator: %lu ids from %lu blocks, %lu waits for a block\n",
+           stats_.ids, stats_.blocks, stats_.waits);
+}
+
+void IdAllocator::reserved(void *arg, ucs_status_t status, uint64_t value) {
+  IdAllocator *ids = static_cast<IdAllocator *>(arg);
+
+  ids->fetching_ = false;
+  ids->fetch_status_ = status;
+  if (status == UCS_OK) {
+    ids->spare_ = value;
+    ids->have_spare_ = true;
+  }
+}
+
+ucs_status_t IdAllocator::fetch() {
+  ucs_status_t status;
+
+  fetching_ = true;
+  status = client_->fetch_add(index_, block_, reserved, this);
+  if (status != UCS_OK) {
+    fetching_ = false;
+    return status;
+  }
+  ++stats_.blocks;
+  return UCS_OK;
+}
+
+ucs_status_t IdAllocator::next(uint64_t *id) {
+  ucs_status_t status;
+
+  if (next_ == end_) {
+    if (!have_spare_ && !fetching_) {
+      status = fetch();
+      if (status != UCS_OK) {
+        return status;
+      }
+    }
+    if (fetching_) {
+      ++stats_.waits;
+      while (fetching_) {
+        client_->progress();
+      }
+    }
+    if (!have_spare_) {
+      return fetch_status_;
+    }
+    next_ = spare_;
+    end_ = spare_ + block_;
+    have_spare_ = false;
+  }
+
+  *id = next_++;
+  ++stats_.ids;
+
+  /* Reserve the next block while this one lasts */
+  if (!have_spare_ && !fetching_ && ((end_ - next_) <= block_ / 2)) {
+    fetch();
+  }
+  return UCS_OK;
+}
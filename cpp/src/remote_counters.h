@@ -0,0 +1,240 @@
+#ifndef MYUCXPLAYGROUND_REMOTE_COUNTERS_H
+#define MYUCXPLAYGROUND_REMOTE_COUNTERS_H
+
+#include <stdint.h>
+#include <ucp/api/ucp.h>
+
+#include <vector>
+
+#define COUNTER_CLIENT_MAX_OPS 256 /* outstanding atomics per client */
+
+/**
+ * Header of the descriptor a CounterRegion hands to its clients out of band,
+ * followed by `rkey_len` bytes of packed remote key.
+ */
+struct counter_region_desc {
+  uint64_t address;
+  uint32_t count;
+  uint32_t rkey_len;
+};
+
+/**
+ * An array of 64-bit counters registered for remote atomics.
+ *
+ * Clients update the counters with CounterClient, which uses
+ * ucp_atomic_op_nbx(); over shared memory and RDMA transports the owner's
+ * CPU takes no part. Transports without atomics (TCP) emulate them in
+ * software, and then the owner's worker has to be progressed.
+ *
+ * Local reads see the counters' values; local writes race with the remote
+ * atomics and must not be made while clients are using the region.
+ */
+class CounterRegion {
+
+public:
+  /**
+   * @param ucp_context Context created with UCP_FEATURE_AMO64.
+   * @param count Number of counters, all starting at 0.
+   */
+  CounterRegion(ucp_context_h ucp_context, unsigned count);
+
+  /**
+   * @brief Unregisters and frees the counters.
+   */
+  ~CounterRegion();
+
+  CounterRegion(const CounterRegion &) = delete;
+  CounterRegion &operator=(const CounterRegion &) = delete;
+
+  /**
+   * @brief Allocates and registers the counters and packs their descriptor.
+   *
+   * @return 0 on success, -1 on failure.
+   */
+  int init();
+
+  /**
+   * @brief The counter_region_desc and rkey to send to clients.
+   */
+  const std::vector<char> &desc() const { return desc_; }
+
+  volatile uint64_t *counters() const { return counters_; }
+  unsigned count() const { return count_; }
+
+private:
+  ucp_context_h ucp_context_;
+  unsigned count_;
+  volatile uint64_t *counters_;
+  size_t length_;
+  ucp_mem_h memh_;
+  std::vector<char> desc_;
+};
+
+/**
+ * @brief Called once per operation with the counter's value before it.
+ */
+typedef void (*counter_done_cb_t)(void *arg, ucs_status_t status,
+                                  uint64_t value);
+
+/**
+ * Asynchronous atomics on the counters of a remote CounterRegion.
+ *
+ * Operations complete through their callback while the worker is
+ * progressed; once an operation is accepted its callback is always called,
+ * possibly before the call returns.
+ *
+ * Not thread safe: use it from the thread that progresses `ucp_worker`.
+ */
+class CounterClient {
+
+public:
+  struct stats {
+    uint64_t ops;
+    uint64_t errors;
+  };
+
+  /**
+   * @param ucp_worker Worker of a context created with UCP_FEATURE_AMO64.
+   */
+  explicit CounterClient(ucp_worker_h ucp_worker);
+  ~CounterClient();
+
+  CounterClient(const CounterClient &) = delete;
+  CounterClient &operator=(const CounterClient &) = delete;
+
+  /**
+   * @brief Connects to the region's worker and unpacks its remote key.
+   *
+   * @param address Worker address of the region's owner.
+   * @param desc Descriptor from CounterRegion::desc().
+   * @param desc_len Its length.
+   *
+   * @return UCS_OK, UCS_ERR_INVALID_PARAM for a malformed descriptor, or the
+   * error of connecting.
+   */
+  ucs_status_t connect(const ucp_address_t *address, const void *desc,
+                       size_t desc_len);
+
+  /**
+   * @brief Adds `value` to counter `index`.
+   *
+   * @return UCS_OK if the operation was accepted, UCS_ERR_NO_RESOURCE if
+   * COUNTER_CLIENT_MAX_OPS are outstanding, UCS_ERR_INVALID_PARAM for an
+   * index out of range.
+   */
+  ucs_status_t fetch_add(unsigned index, uint64_t value, counter_done_cb_t cb,
+                         void *arg);
+
+  /**
+   * @brief Sets counter `index` to `value`.
+   */
+  ucs_status_t swap(unsigned index, uint64_t value, counter_done_cb_t cb,
+                    void *arg);
+
+  /**
+   * @brief Sets counter `index` to `desired` if it holds `expected`; it did
+   * if the callback's value is `expected`.
+   */
+  ucs_status_t compare_swap(unsigned index, uint64_t expected,
+                            uint64_t desired, counter_done_cb_t cb,
+                            void *arg);
+
+  unsigned progress() { return ucp_worker_progress(ucp_worker_); }
+
+  /**
+   * @return Operations not completed yet.
+   */
+  unsigned pending() const { return pending_; }
+
+  /**
+   * @brief Waits for outstanding operations, then releases the remote key
+   * and closes the endpoint; see worker_drain().
+   */
+  ucs_status_t close();
+
+  unsigned count() const { return count_; }
+  const struct stats &get_stats() const { return stats_; }
+
+private:
+  struct op {
+    CounterClient *client;
+    counter_done_cb_t cb;
+    void *arg;
+    uint64_t operand;
+    uint64_t result; /* CSWAP: the value to swap in, then the old value */
+  };
+
+  static void atomic_done(void *request, ucs_status_t status,
+                          void *user_data);
+
+  ucs_status_t post(ucp_atomic_op_t opcode, unsigned index, uint64_t operand,
+                    uint64_t result, counter_done_cb_t cb, void *arg);
+  void op_done(struct op *op, ucs_status_t status);
+
+  ucp_worker_h ucp_worker_;
+  ucp_ep_h ep_;
+  ucp_rkey_h rkey_;
+  uint64_t address_;
+  unsigned count_;
+  std::vector<struct op> ops_;
+  std::vector<struct op *> free_ops_;
+  unsigned pending_;
+  struct stats stats_;
+};
+
+/**
+ * Hands out unique 64-bit IDs from one remote counter.
+ *
+ * Each fetch-add reserves a block of `block` IDs, and the next block is
+ * requested when half of the current one is used, so most next() calls are
+ * local and the counter sees one atomic per block. IDs are unique across
+ * all allocators sharing the counter but only increase per allocator.
+ *
+ * Not thread safe: use it from the thread that progresses the client.
+ */
+class IdAllocator {
+
+public:
+  struct stats {
+    uint64_t ids;
+    uint64_t blocks;
+    uint64_t waits; /* next() calls that waited for a block */
+  };
+
+  IdAllocator(CounterClient *client, unsigned index, uint64_t block);
+
+  /**
+   * @brief Waits for a block reservation still outstanding.
+   */
+  ~IdAllocator();
+
+  IdAllocator(const IdAllocator &) = delete;
+  IdAllocator &operator=(const IdAllocator &) = delete;
+
+  /**
+   * @brief Returns the next ID, waiting for a block if none is left.
+   *
+   * @return UCS_OK, or the error of reserving a block.
+   */
+  ucs_status_t next(uint64_t *id);
+
+  const struct stats &get_stats() const { return stats_; }
+
+private:
+  static void reserved(void *arg, ucs_status_t status, uint64_t value);
+
+  ucs_status_t fetch();
+
+  CounterClient *client_;
+  unsigned index_;
+  uint64_t block_;
+  uint64_t next_;  /* current block */
+  uint64_t end_;
+  uint64_t spare_; /* start of the block reserved ahead */
+  bool have_spare_;
+  bool fetching_;
+  ucs_status_t fetch_status_;
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_REMOTE_COUNTERS_H
@@ -0,0 +1,366 @@
+#include "rma_ring.h"
+#include "common_utils.h"
+#include "logger.h"
+#include "ucx_utils.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <atomic>
+
+#define RMA_RING_ALIGN 64
+
+RmaRingConsumer::RmaRingConsumer(ucp_context_h ucp_context,
+                                 unsigned capacity, size_t max_entry)
+    : ucp_context_(ucp_context), capacity_(capacity),
+      slot_size_((sizeof(struct rma_ring_entry) + max_entry +
+                  RMA_RING_ALIGN - 1) &
+                 ~(size_t)(RMA_RING_ALIGN - 1)),
+      length_(sizeof(struct rma_ring_header) + capacity * slot_size_),
+      ring_(NULL), header_(NULL), memh_(NULL), head_(0), tail_(0) {}
+
+RmaRingConsumer::~RmaRingConsumer() {
+  /* Frees the ring too; UCX allocated it */
+  if (memh_ != NULL) {
+    ucp_mem_unmap(ucp_context_, memh_);
+  }
+}
+
+int RmaRingConsumer::init() {
+  struct rma_ring_desc *desc;
+  ucp_mem_map_params_t params;
+  ucp_mem_attr_t attr;
+  void *rkey_buffer;
+  size_t rkey_len;
+  ucs_status_t status;
+
+  CHKERR_ACTION(capacity_ == 0, "size the ring\n", return -1);
+
+  /* Letting UCX allocate the ring puts it in shared memory when it can, so
+   * a producer on this host can map it with ucp_rkey_ptr() */
+  params.field_mask = UCP_MEM_MAP_PARAM_FIELD_ADDRESS |
+                      UCP_MEM_MAP_PARAM_FIELD_LENGTH |
+                      UCP_MEM_MAP_PARAM_FIELD_FLAGS;
+  params.address = NULL;
+  params.length = length_;
+  params.flags = UCP_MEM_MAP_ALLOCATE;
+  status = ucp_mem_map(ucp_context_, &params, &memh_);
+  CHKERR_ACTION(status != UCS_OK, "allocate the ring\n",
+                memh_ = NULL; return -1);
+
+  attr.field_mask = UCP_MEM_ATTR_FIELD_ADDRESS;
+  status = ucp_mem_query(memh_, &attr);
+  CHKERR_ACTION(status != UCS_OK, "ucp_mem_query\n", return -1);
+  header_ = static_cast<struct rma_ring_header *>(attr.address);
+  ring_ = reinterpret_cast<char *>(header_ + 1);
+  memset(header_, 0, sizeof(*header_));
+
+  status = ucp_rkey_pack(ucp_context_, memh_, &rkey_buffer, &rkey_len);
+  CHKERR_ACTION(status != UCS_OK, "pack the ring's rkey\n", return -1);
+
+  desc_.resize(sizeof(*desc) + rkey_len);
+  desc = reinterpret_cast<struct rma_ring_desc *>(desc_.data());
+  desc->address = (uint64_t)header_;
+  desc->capacity = capacity_;
+  desc->slot_size = slot_size_;
+  desc->rkey_len = rkey_len;
+  desc->reserved = 0;
+  memcpy(desc + 1, rkey_buffer, rkey_len);
+  ucp_rkey_buffer_release(rkey_buffer);
+
+  return 0;
+}
+
+const void *RmaRingConsumer::peek(size_t *length) {
+  const struct rma_ring_entry *entry;
+
+  if (head_ == tail_) {
+    tail_ = *static_cast<volatile uint64_t *>(&header_->tail);
+    if (head_ == tail_) {
+      return NULL;
+    }
+    /* The producer fenced the entries before the tail */
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }
+
+  entry = reinterpret_cast<const struct rma_ring_entry *>(
+      ring_ + (head_ % capacity_) * slot_size_);
+  *length = entry->length;
+  return entry + 1;
+}
+
+void RmaRingConsumer::release() {
+  ++head_;
+  std::atomic_thread_fence(std::memory_order_release);
+  *static_cast<volatile uint64_t *>(&header_->head) = head_;
+}
+
+RmaRingProducer::RmaRingProducer(ucp_context_h ucp_context,
+                                 ucp_worker_h ucp_worker)
+    : ucp_context_(ucp_context), ucp_worker_(ucp_worker), ep_(NULL),
+      rkey_(NULL), address_(0), capacity_(0), slot_size_(0), staging_(NULL),
+      staging_len_(0), memh_(NULL), direct_(NULL), tail_(0), head_(0),
+      head_buffer_(0), head_pending_(false), head_status_(UCS_OK),
+      inflight_(0), stats_() {}
+
+RmaRingProducer::~RmaRingProducer() {
+  flush();
+  if (rkey_ != NULL) {
+    ucp_rkey_destroy(rkey_);
+  }
+  if (ep_ != NULL) {
+    ep_close(ucp_worker_, ep_, 0);
+  }
+  if (memh_ != NULL) {
+    ucp_mem_unmap(ucp_context_, memh_);
+  }
+  if (staging_ != NULL) {
+    munmap(staging_, staging_len_);
+  }
+  LOG_INFO("rma ring producer: %lu pushed, %lu head reads, %lu full, "
+           "%lu errors\n",
+           stats_.pushed, stats_.head_reads, stats_.full, stats_.errors);
+}
+
+ucs_status_t RmaRingProducer::connect(const ucp_address_t *address,
+                                      const void *desc, size_t desc_len) {
+  const struct rma_ring_desc *hdr =
+      static_cast<const struct rma_ring_desc *>(desc);
+  ucp_mem_map_params_t params;
+  ucp_ep_params_t ep_params;
+  ucs_status_t status;
+  unsigned i;
+
+  if ((desc_len < sizeof(*hdr)) ||
+      (desc_len != sizeof(*hdr) + hdr->rkey_len) || (hdr->capacity == 0) ||
+      (hdr->slot_size <= sizeof(struct rma_ring_entry))) {
+    return UCS_ERR_INVALID_PARAM;
+  }
+
+  address_ = hdr->address;
+  capacity_ = hdr->capacity;
+  slot_size_ = hdr->slot_size;
+
+  staging_len_ = capacity_ * (slot_size_ + sizeof(uint64_t));
+  staging_ = static_cast<char *>(mmap(NULL, staging_len_,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  CHKERR_ACTION(staging_ == MAP_FAILED, "allocate the staging ring\n",
+                staging_ = NULL;
+                return UCS_ERR_NO_MEMORY);
+
+  params.field_mask =
+      UCP_MEM_MAP_PARAM_FIELD_ADDRESS | UCP_MEM_MAP_PARAM_FIELD_LENGTH;
+  params.address = staging_;
+  params.length = staging_len_;
+  status = ucp_mem_map(ucp_context_, &params, &memh_);
+  CHKERR_ACTION(status != UCS_OK, "register the staging ring\n",
+                memh_ = NULL; return status);
+
+  slots_.resize(capacity_);
+  for (i = 0; i < capacity_; ++i) {
+    slots_[i].producer = this;
+    slots_[i].inflight = 0;
+  }
+
+  ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS;
+  ep_params.address = address;
+  status = ucp_ep_create(ucp_worker_, &ep_params, &ep_);
+  CHKERR_ACTION(status != UCS_OK, "ucp_ep_create\n",
+                ep_ = NULL; return status);
+
+  status = ucp_ep_rkey_unpack(ep_, hdr + 1, &rkey_);
+  CHKERR_ACTION(status != UCS_OK, "unpack the ring's rkey\n",
+                rkey_ = NULL; return status);
+
+  return UCS_OK;
+}
+
+ucs_status_t RmaRingProducer::map() {
+  void *ptr;
+  ucs_status_t status;
+
+  if (rkey_ == NULL) {
+    return UCS_ERR_INVALID_PARAM;
+  }
+
+  status = ucp_rkey_ptr(rkey_, address_, &ptr);
+  if (status != UCS_OK) {
+    return status;
+  }
+
+  flush();
+  direct_ = static_cast<struct rma_ring_header *>(ptr);
+  return UCS_OK;
+}
+
+ucs_status_t RmaRingProducer::push_direct(const void *data, size_t length) {
+  struct rma_ring_entry *entry;
+
+  if (tail_ - head_ == capacity_) {
+    head_ = *static_cast<volatile uint64_t *>(&direct_->head);
+    if (tail_ - head_ == capacity_) {
+      ++stats_.full;
+      return UCS_ERR_NO_RESOURCE;
+    }
+    /* The consumer is done reading the slots it released */
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }
+
+  entry = reinterpret_cast<struct rma_ring_entry *>(
+      reinterpret_cast<char *>(direct_ + 1) +
+      (tail_ % capacity_) * slot_size_);
+  entry->length = length;
+  entry->reserved = 0;
+  memcpy(entry + 1, data, length);
+
+  ++tail_;
+  std::atomic_thread_fence(std::memory_order_release);
+  *static_cast<volatile uint64_t *>(&direct_->tail) = tail_;
+  ++stats_.pushed;
+  return UCS_OK;
+}
+
+void RmaRingProducer::put_done(void *request, ucs_status_t status,
+                               void *user_data) {
+  struct slot *slot = static_cast<struct slot *>(user_data);
+  RmaRingProducer *producer = slot->producer;
+
+  if (status != UCS_OK) {
+    LOG_WARN("rma ring producer: put failed (%s)\n",
+             ucs_status_string(status));
+    ++producer->stats_.errors;
+  }
+  --slot->inflight;
+  --producer->inflight_;
+  ucp_request_free(request);
+}
+
+void RmaRingProducer::get_done(void *request, ucs_status_t status,
+                               void *user_data) {
+  RmaRingProducer *producer = static_cast<RmaRingProducer *>(user_data);
+
+  producer->head_status_ = status;
+  producer->head_pending_ = false;
+  ucp_request_free(request);
+}
+
+ucs_status_t RmaRingProducer::put(struct slot *slot, const void *buffer,
+                                  size_t length, uint64_t remote_addr) {
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_USER_DATA | UCP_OP_ATTR_FIELD_MEMH;
+  param.cb.send = put_done;
+  param.user_data = slot;
+  param.memh = memh_;
+
+  request = ucp_put_nbx(ep_, buffer, length, remote_addr, rkey_, &param);
+  if (UCS_PTR_IS_PTR(request)) {
+    ++slot->inflight;
+    ++inflight_;
+    return UCS_OK;
+  }
+  return UCS_PTR_STATUS(request);
+}
+
+ucs_status_t RmaRingProducer::read_head() {
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_USER_DATA;
+  param.cb.send = get_done;
+  param.user_data = this;
+
+  ++stats_.head_reads;
+  head_pending_ = true;
+  head_status_ = UCS_OK;
+  request = ucp_get_nbx(ep_, &head_buffer_, sizeof(head_buffer_),
+                        address_ + offsetof(struct rma_ring_header, head),
+                        rkey_, &param);
+  if (UCS_PTR_IS_PTR(request)) {
+    while (head_pending_) {
+      ucp_worker_progress(ucp_worker_);
+    }
+  } else {
+    head_pending_ = false;
+    head_status_ = UCS_PTR_STATUS(request);
+  }
+
+  if (head_status_ == UCS_OK) {
+    head_ = head_buffer_;
+  }
+  return head_status_;
+}
+
+ucs_status_t RmaRingProducer::push(const void *data, size_t length) {
+  struct rma_ring_entry *entry;
+  struct slot *slot;
+  ucs_status_t status;
+  unsigned index;
+  char *stage;
+
+  if ((rkey_ == NULL) || (length > slot_size_ - sizeof(*entry))) {
+    return UCS_ERR_INVALID_PARAM;
+  }
+  if (direct_ != NULL) {
+    return push_direct(data, length);
+  }
+
+  if (tail_ - head_ == capacity_) {
+    status = read_head();
+    if (status != UCS_OK) {
+      ++stats_.errors;
+      return status;
+    }
+    if (tail_ - head_ == capacity_) {
+      ++stats_.full;
+      return UCS_ERR_NO_RESOURCE;
+    }
+  }
+
+  /* The consumer is done with the slot; wait until our last puts are too */
+  index = tail_ % capacity_;
+  slot = &slots_[index];
+  while (slot->inflight > 0) {
+    ucp_worker_progress(ucp_worker_);
+  }
+
+  stage = staging_ + index * (slot_size_ + sizeof(uint64_t));
+  entry = reinterpret_cast<struct rma_ring_entry *>(stage);
+  entry->length = length;
+  entry->reserved = 0;
+  memcpy(entry + 1, data, length);
+  *reinterpret_cast<uint64_t *>(stage + slot_size_) = tail_ + 1;
+
+  status = put(slot, stage, sizeof(*entry) + length,
+               address_ + sizeof(struct rma_ring_header) +
+                   index * slot_size_);
+  if (status == UCS_OK) {
+    /* The entry must land before the tail that exposes it */
+    status = ucp_worker_fence(ucp_worker_);
+  }
+  if (status == UCS_OK) {
+    status = put(slot, stage + slot_size_, sizeof(uint64_t),
+                 address_ + offsetof(struct rma_ring_header, tail));
+  }
+  if (status != UCS_OK) {
+    LOG_WARN("rma ring producer: push failed (%s)\n",
+             ucs_status_string(status));
+    ++stats_.errors;
+    return status;
+  }
+
+  ++tail_;
+  ++stats_.pushed;
+  return UCS_OK;
+}
+
+void RmaRingProducer::flush() {
+  while (inflight_ > 0) {
+    ucp_worker_progress(ucp_worker_);
+  }
+}
@@ -0,0 +1,226 @@
+#ifndef MYUCXPLAYGROUND_RMA_RING_H
+#define MYUCXPLAYGROUND_RMA_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ucp/api/ucp.h>
+
+#include <vector>
+
+/**
+ * Header of the descriptor an RmaRingConsumer hands to its producer out of
+ * band, followed by `rkey_len` bytes of packed remote key.
+ */
+struct rma_ring_desc {
+  uint64_t address;
+  uint32_t capacity; /* entries */
+  uint32_t slot_size;
+  uint32_t rkey_len;
+  uint32_t reserved;
+};
+
+/**
+ * Layout of a ring in the consumer's memory: the producer writes `tail`,
+ * the consumer `head`, each on its own cache line, then `capacity` slots
+ * of `slot_size` bytes, each an rma_ring_entry and its payload.
+ */
+struct rma_ring_header {
+  uint64_t tail; /* entries pushed */
+  char pad0[56];
+  uint64_t head; /* entries released */
+  char pad1[56];
+};
+
+struct rma_ring_entry {
+  uint32_t length;
+  uint32_t reserved;
+};
+
+/**
+ * Receiving end of a single-producer, single-consumer queue written with
+ * one-sided RMA.
+ *
+ * The ring lives in memory UCX allocates and registers for the consumer.
+ * The producer puts entries into it and then, after a fence, the new tail;
+ * the consumer only reads and writes its own memory, so taking an entry
+ * makes no UCX call. Transports without RMA (TCP) emulate it in software,
+ * and then the consumer's worker has to be progressed for entries to
+ * arrive.
+ */
+class RmaRingConsumer {
+
+public:
+  /**
+   * @param ucp_context Context created with UCP_FEATURE_RMA.
+   * @param capacity Entries the ring holds.
+   * @param max_entry Largest entry.
+   */
+  RmaRingConsumer(ucp_context_h ucp_context, unsigned capacity,
+                  size_t max_entry);
+
+  /**
+   * @brief Unregisters and frees the ring.
+   */
+  ~RmaRingConsumer();
+
+  RmaRingConsumer(const RmaRingConsumer &) = delete;
+  RmaRingConsumer &operator=(const RmaRingConsumer &) = delete;
+
+  /**
+   * @brief Allocates and registers the ring, in shared memory when UCX
+   * can, and packs its descriptor.
+   *
+   * @return 0 on success, -1 on failure.
+   */
+  int init();
+
+  /**
+   * @brief The rma_ring_desc and rkey to send to the producer.
+   */
+  const std::vector<char> &desc() const { return desc_; }
+
+  /**
+   * @brief Returns the oldest entry, which stays in the ring until
+   * release(), or NULL if the ring is empty.
+   */
+  const void *peek(size_t *length);
+
+  /**
+   * @brief Frees the entry returned by peek() for the producer.
+   */
+  void release();
+
+private:
+  ucp_context_h ucp_context_;
+  unsigned capacity_;
+  size_t slot_size_;
+  size_t length_;
+  char *ring_;
+  struct rma_ring_header *header_;
+  ucp_mem_h memh_;
+  uint64_t head_;
+  uint64_t tail_; /* last tail read */
+  std::vector<char> desc_;
+};
+
+/**
+ * Sending end of an RmaRingConsumer's queue.
+ *
+ * Entries are staged in a registered mirror of the remote ring, so a push
+ * copies the caller's data once and never waits for a put to complete. The
+ * producer keeps the last head it read and reads it again with a get only
+ * when the ring looks full.
+ *
+ * On the consumer's host map() can replace the puts and gets with plain
+ * loads and stores to the ring, making it a shared-memory queue in which
+ * neither side calls UCX.
+ *
+ * Not thread safe: use it from the thread that progresses `ucp_worker`.
+ */
+class RmaRingProducer {
+
+public:
+  struct stats {
+    uint64_t pushed;
+    uint64_t head_reads; /* gets of the consumer's head */
+    uint64_t full;       /* pushes refused because the ring was full */
+    uint64_t errors;
+  };
+
+  /**
+   * @param ucp_context Context created with UCP_FEATURE_RMA.
+   * @param ucp_worker Worker of `ucp_context`.
+   */
+  RmaRingProducer(ucp_context_h ucp_context, ucp_worker_h ucp_worker);
+
+  /**
+   * @brief Waits for outstanding puts, then closes the endpoint.
+   */
+  ~RmaRingProducer();
+
+  RmaRingProducer(const RmaRingProducer &) = delete;
+  RmaRingProducer &operator=(const RmaRingProducer &) = delete;
+
+  /**
+   * @brief Connects to the consumer's worker, unpacks the ring's remote key
+   * and registers the staging mirror.
+   *
+   * @param address Worker address of the consumer.
+   * @param desc Descriptor from RmaRingConsumer::desc().
+   * @param desc_len Its length.
+   *
+   * @return UCS_OK, UCS_ERR_INVALID_PARAM for a malformed descriptor, or the
+   * error of connecting or registering.
+   */
+  ucs_status_t connect(const ucp_address_t *address, const void *desc,
+                       size_t desc_len);
+
+  /**
+   * @brief Accesses the ring through a pointer from ucp_rkey_ptr() from now
+   * on. Call it after connect(), before pushing.
+   *
+   * @return UCS_OK, or the error of ucp_rkey_ptr(), UCS_ERR_UNREACHABLE
+   * when the ring is not in memory this process can map.
+   */
+  ucs_status_t map();
+
+  /**
+   * @return True once map() succeeded.
+   */
+  bool mapped() const { return direct_ != NULL; }
+
+  /**
+   * @brief Appends an entry.
+   *
+   * @return UCS_OK, UCS_ERR_NO_RESOURCE if the ring is full (retry later),
+   * UCS_ERR_INVALID_PARAM if `length` exceeds the ring's largest entry, or
+   * the error of a put.
+   */
+  ucs_status_t push(const void *data, size_t length);
+
+  unsigned progress() { return ucp_worker_progress(ucp_worker_); }
+
+  /**
+   * @brief Progresses the worker until every put has completed locally.
+   */
+  void flush();
+
+  const struct stats &get_stats() const { return stats_; }
+
+private:
+  struct slot {
+    RmaRingProducer *producer;
+    unsigned inflight; /* puts still reading this slot */
+  };
+
+  static void put_done(void *request, ucs_status_t status, void *user_data);
+  static void get_done(void *request, ucs_status_t status, void *user_data);
+
+  ucs_status_t put(struct slot *slot, const void *buffer, size_t length,
+                   uint64_t remote_addr);
+  ucs_status_t read_head();
+  ucs_status_t push_direct(const void *data, size_t length);
+
+  ucp_context_h ucp_context_;
+  ucp_worker_h ucp_worker_;
+  ucp_ep_h ep_;
+  ucp_rkey_h rkey_;
+  uint64_t address_;
+  unsigned capacity_;
+  size_t slot_size_;
+  /* staging: a copy of each slot followed by the tail value put after it */
+  char *staging_;
+  size_t staging_len_;
+  ucp_mem_h memh_;
+  struct rma_ring_header *direct_; /* the ring, once mapped */
+  std::vector<struct slot> slots_;
+  uint64_t tail_;
+  uint64_t head_; /* last head read */
+  uint64_t head_buffer_;
+  bool head_pending_;
+  ucs_status_t head_status_;
+  size_t inflight_;
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_RMA_RING_H
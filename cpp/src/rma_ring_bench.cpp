@@ -0,0 +1,408 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucp/api/ucp.h>
+#include <unistd.h> /* getopt */
+
+#include <atomic>
+#include <vector>
+
+#include "common_utils.h"
+#include "logger.h"
+#include "rma_ring.h"
+#include "tag_dispatcher.h"
+#include "tag_layout.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+/**
+ * Hands small messages from a producer thread to a consumer thread and
+ * measures one-way latency and rate.
+ *
+ * With -m rma the producer puts messages into an RmaRingConsumer's ring
+ * and the consumer polls its own memory, without calling UCX. With -m shm
+ * the producer maps the same ring with ucp_rkey_ptr() and stores into it
+ * directly, so neither side calls UCX. With -m tag the producer sends
+ * tagged messages, at most -q in flight, and the consumer keeps -q receives
+ * posted with a TagDispatcher.
+ */
+
+#define RR_CHANNEL 2
+#define RR_DEFAULT_COUNT 1000000
+#define RR_DEFAULT_SIZE 64
+#define RR_DEFAULT_CAPACITY 256
+
+typedef enum { RR_MODE_RMA, RR_MODE_SHM, RR_MODE_TAG } rr_mode_t;
+
+static const char *rr_mode_names[] = {"rma", "shm", "tag"};
+
+struct rr_msg {
+  uint64_t seq;
+  uint64_t send_ns;
+};
+
+struct rr_bench;
+
+struct rr_send_slot {
+  struct rr_bench *bench;
+  std::vector<char> buffer;
+  struct rr_send_slot *next;
+};
+
+struct rr_bench {
+  struct bench_side producer;
+  struct bench_side consumer;
+  rr_mode_t mode;
+  long count;
+  size_t size;
+  unsigned capacity;
+  long rate; /* messages per second, 0 for as fast as possible */
+  bool progress_consumer;
+  RmaRingConsumer *ring;
+  std::atomic<int> barrier_count;
+  struct rr_send_slot *free_slots; /* tag sends not in flight */
+  /* results */
+  long received;
+  uint64_t waits; /* producer found the ring or window full */
+  uint64_t elapsed_ns;
+  std::vector<uint64_t> latency_ns;
+  int ret[2];
+};
+
+static void print_rr_usage() {
+  fprintf(stderr, "Usage: run_rma_ring [parameters]\n");
+  fprintf(stderr, "\nParameters are:\n");
+  fprintf(stderr, "  -m <mode>     rma: one-sided ring, shm: the ring "
+                  "mapped with rkey_ptr, tag: tagged messages "
+                  "(default: all)\n");
+  fprintf(stderr, "  -n <count>    Messages (default:%d)\n",
+          RR_DEFAULT_COUNT);
+  fprintf(stderr, "  -s <size>     Message size (default:%d)\n",
+          RR_DEFAULT_SIZE);
+  fprintf(stderr, "  -q <count>    Ring entries, or tag messages in flight "
+                  "(default:%d)\n",
+          RR_DEFAULT_CAPACITY);
+  fprintf(stderr, "  -r <rate>     Messages per second, 0 for unpaced "
+                  "(default:0)\n");
+  fprintf(stderr, "  -p            Progress the consumer's worker in rma "
+                  "mode, for transports that emulate RMA\n");
+}
+
+static void rr_send_done(void *request, ucs_status_t status,
+                         void *user_data) {
+  struct rr_send_slot *slot = (struct rr_send_slot *)user_data;
+
+  if (status != UCS_OK) {
+    LOG_ERROR("rma ring: send failed (%s)\n", ucs_status_string(status));
+  }
+  slot->next = slot->bench->free_slots;
+  slot->bench->free_slots = slot;
+  ucp_request_free(request);
+}
+
+static ucs_status_t rr_send_tag(struct rr_bench *bench, uint64_t seq) {
+  ucp_worker_h ucp_worker = bench->producer.ucp_worker;
+  ucp_request_param_t param;
+  struct rr_send_slot *slot;
+  struct rr_msg *msg;
+  ucs_status_ptr_t request;
+
+  if (bench->free_slots == NULL) {
+    ++bench->waits;
+    while (bench->free_slots == NULL) {
+      ucp_worker_progress(ucp_worker);
+    }
+  }
+  slot = bench->free_slots;
+  bench->free_slots = slot->next;
+
+  msg = (struct rr_msg *)slot->buffer.data();
+  msg->seq = seq;
+  msg->send_ns = get_time_ns();
+
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_USER_DATA;
+  param.cb.send = rr_send_done;
+  param.user_data = slot;
+  request = ucp_tag_send_nbx(bench->producer.ep, msg, bench->size,
+                             tag_make(TAG_CLASS_DATA, RR_CHANNEL, 0, seq),
+                             &param);
+  if (UCS_PTR_IS_PTR(request)) {
+    return UCS_OK;
+  }
+
+  slot->next = bench->free_slots;
+  bench->free_slots = slot;
+  return UCS_PTR_STATUS(request);
+}
+
+static ucs_status_t rr_push(struct rr_bench *bench,
+                            RmaRingProducer *producer, char *buffer,
+                            uint64_t seq) {
+  struct rr_msg *msg = (struct rr_msg *)buffer;
+  ucs_status_t status;
+  bool waited = false;
+
+  msg->seq = seq;
+  msg->send_ns = get_time_ns();
+  while ((status = producer->push(msg, bench->size)) ==
+         UCS_ERR_NO_RESOURCE) {
+    if (!waited) {
+      ++bench->waits;
+      waited = true;
+    }
+    producer->progress();
+  }
+  return status;
+}
+
+static void *rr_producer_thread(void *arg) {
+  struct rr_bench *bench = (struct rr_bench *)arg;
+  ucp_worker_h ucp_worker = bench->producer.ucp_worker;
+  std::vector<struct rr_send_slot> slots;
+  RmaRingProducer *producer = NULL;
+  std::vector<char> buffer(bench->size);
+  uint64_t interval_ns = (bench->rate > 0) ? 1000000000ull / bench->rate : 0;
+  ucs_status_t status = UCS_OK;
+  uint64_t next_ns;
+  size_t i;
+
+  if (bench->mode != RR_MODE_TAG) {
+    const std::vector<char> &desc = bench->ring->desc();
+
+    producer = new RmaRingProducer(bench->producer.ucp_context, ucp_worker);
+    status = producer->connect(bench->consumer.worker_attr.address,
+                               desc.data(), desc.size());
+    if ((status == UCS_OK) && (bench->mode == RR_MODE_SHM)) {
+      status = producer->map();
+      if (status != UCS_OK) {
+        LOG_ERROR("rma ring: cannot map the ring (%s)\n",
+                  ucs_status_string(status));
+      }
+    }
+  } else {
+    slots.resize(bench->capacity);
+    bench->free_slots = NULL;
+    for (i = 0; i < slots.size(); ++i) {
+      slots[i].bench = bench;
+      slots[i].buffer.resize(bench->size);
+      slots[i].next = bench->free_slots;
+      bench->free_slots = &slots[i];
+    }
+  }
+
+  bench_barrier(&bench->barrier_count, 2, 1, ucp_worker);
+
+  next_ns = get_time_ns();
+  for (long seq = 0; (seq < bench->count) && (status == UCS_OK); ++seq) {
+    while ((interval_ns > 0) && (get_time_ns() < next_ns)) {
+      ucp_worker_progress(ucp_worker);
+    }
+    next_ns += interval_ns;
+    if (producer != NULL) {
+      status = rr_push(bench, producer, buffer.data(), seq);
+    } else {
+      status = rr_send_tag(bench, seq);
+    }
+  }
+
+  if (producer != NULL) {
+    delete producer;
+  } else {
+    /* All slots back means all sends completed */
+    for (i = 0; i < slots.size(); ++i) {
+      while (bench->free_slots == NULL) {
+        ucp_worker_progress(ucp_worker);
+      }
+      bench->free_slots = bench->free_slots->next;
+    }
+  }
+
+  bench_barrier(&bench->barrier_count, 2, 2, ucp_worker);
+  bench->ret[0] = (status == UCS_OK) ? 0 : -1;
+  return NULL;
+}
+
+static void rr_handle(void *arg, ucp_tag_t tag, void *buffer, size_t length) {
+  struct rr_bench *bench = (struct rr_bench *)arg;
+  const struct rr_msg *msg = (const struct rr_msg *)buffer;
+
+  bench->latency_ns.push_back(get_time_ns() - msg->send_ns);
+  ++bench->received;
+}
+
+static void *rr_consumer_thread(void *arg) {
+  struct rr_bench *bench = (struct rr_bench *)arg;
+  ucp_worker_h ucp_worker = bench->consumer.ucp_worker;
+  TagDispatcher *dispatcher = NULL;
+  ucs_status_t status = UCS_OK;
+  const void *entry;
+  uint64_t start_ns;
+  size_t length;
+
+  if (bench->mode == RR_MODE_TAG) {
+    dispatcher = new TagDispatcher(ucp_worker);
+    status = dispatcher->add_channel(TAG_CLASS_DATA, RR_CHANNEL, bench->size,
+                                     bench->capacity, rr_handle, bench);
+  }
+
+  bench_barrier(&bench->barrier_count, 2, 1, ucp_worker);
+
+  start_ns = get_time_ns();
+  while ((bench->received < bench->count) && (status == UCS_OK)) {
+    if (dispatcher != NULL) {
+      dispatcher->progress();
+      continue;
+    }
+    entry = bench->ring->peek(&length);
+    if (entry != NULL) {
+      rr_handle(bench, 0, (void *)entry, length);
+      bench->ring->release();
+    } else if (bench->progress_consumer) {
+      ucp_worker_progress(ucp_worker);
+    }
+  }
+  bench->elapsed_ns = get_time_ns() - start_ns;
+
+  bench_barrier(&bench->barrier_count, 2, 2, ucp_worker);
+  delete dispatcher;
+  bench->ret[1] = (status == UCS_OK) ? 0 : -1;
+  return NULL;
+}
+
+static int rr_run(struct rr_bench *bench, rr_mode_t mode) {
+  pthread_t producer_thread, consumer_thread;
+  RmaRingConsumer ring(bench->consumer.ucp_context, bench->capacity,
+                       bench->size);
+
+  if (mode != RR_MODE_TAG) {
+    CHKERR_ACTION(ring.init() != 0, "initialize the ring\n", return -1);
+  }
+
+  bench->mode = mode;
+  bench->ring = &ring;
+  bench->barrier_count.store(0);
+  bench->received = 0;
+  bench->waits = 0;
+  bench->latency_ns.clear();
+  bench->ret[0] = bench->ret[1] = -1;
+
+  CHKERR_ACTION(pthread_create(&consumer_thread, NULL, rr_consumer_thread,
+                               bench) != 0,
+                "create consumer thread\n", return -1);
+  /* Without a producer the consumer never returns; leave it to exit */
+  CHKERR_ACTION(pthread_create(&producer_thread, NULL, rr_producer_thread,
+                               bench) != 0,
+                "create producer thread\n", return -1);
+
+  pthread_join(producer_thread, NULL);
+  pthread_join(consumer_thread, NULL);
+  if ((bench->ret[0] != 0) || (bench->ret[1] != 0)) {
+    return -1;
+  }
+
+  log_flush();
+  printf("%-5s %12.0f %10.2f %10.2f %10.2f %10lu\n", rr_mode_names[mode],
+         bench->received / (bench->elapsed_ns / 1e9),
+         percentile_us(bench->latency_ns, 0.5),
+         percentile_us(bench->latency_ns, 0.99),
+         percentile_us(bench->latency_ns, 0.999), bench->waits);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  struct rr_bench bench;
+  std::vector<rr_mode_t> modes;
+  ucs_status_t status;
+  unsigned mode;
+  int ret = -1;
+  int c;
+
+  bench.count = RR_DEFAULT_COUNT;
+  bench.size = RR_DEFAULT_SIZE;
+  bench.capacity = RR_DEFAULT_CAPACITY;
+  bench.rate = 0;
+  bench.progress_consumer = false;
+
+  while ((c = getopt(argc, argv, "m:n:s:q:r:ph")) != -1) {
+    switch (c) {
+    case 'm':
+      for (mode = 0; mode < 3; ++mode) {
+        if (!strcmp(optarg, rr_mode_names[mode])) {
+          break;
+        }
+      }
+      if (mode == 3) {
+        print_rr_usage();
+        return -1;
+      }
+      modes.push_back((rr_mode_t)mode);
+      break;
+    case 'n':
+      bench.count = atol(optarg);
+      break;
+    case 's':
+      bench.size = strtoul(optarg, NULL, 0);
+      break;
+    case 'q':
+      bench.capacity = atoi(optarg);
+      break;
+    case 'r':
+      bench.rate = atol(optarg);
+      break;
+    case 'p':
+      bench.progress_consumer = true;
+      break;
+    case 'h':
+    default:
+      print_rr_usage();
+      return -1;
+    }
+  }
+
+  if ((bench.count <= 0) || (bench.size < sizeof(struct rr_msg)) ||
+      (bench.capacity == 0) || (bench.rate < 0)) {
+    print_rr_usage();
+    return -1;
+  }
+
+  if (modes.empty()) {
+    modes = {RR_MODE_RMA, RR_MODE_SHM, RR_MODE_TAG};
+  }
+  bench.latency_ns.reserve(bench.count);
+
+  ret = bench_init_side(&bench.producer, "rma ring producer",
+                        UCP_FEATURE_TAG | UCP_FEATURE_RMA);
+  CHKERR_JUMP(ret != 0, "initialize producer\n", err);
+
+  ret = bench_init_side(&bench.consumer, "rma ring consumer",
+                        UCP_FEATURE_TAG | UCP_FEATURE_RMA);
+  CHKERR_JUMP(ret != 0, "initialize consumer\n", err_producer);
+
+  ret = -1;
+  status = bench_connect(&bench.producer, &bench.consumer,
+                         &bench.producer.ep);
+  CHKERR_JUMP(status != UCS_OK, "connect producer\n", err_consumer);
+
+  log_flush();
+  printf("\n%ld messages of %lu bytes, %u entries; latencies in us\n",
+         bench.count, bench.size, bench.capacity);
+  printf("%-5s %12s %10s %10s %10s %10s\n", "mode", "msg/s", "p50", "p99",
+         "p99.9", "full");
+  for (rr_mode_t run_mode : modes) {
+    ret = rr_run(&bench, run_mode);
+    if (ret != 0) {
+      break;
+    }
+  }
+
+  ep_close(bench.producer.ucp_worker, bench.producer.ep,
+           UCP_EP_CLOSE_FLAG_FORCE);
+err_consumer:
+  bench_cleanup_side(&bench.consumer);
+err_producer:
+  bench_cleanup_side(&bench.producer);
+err:
+  return ret;
+}
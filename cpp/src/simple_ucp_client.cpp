@@ -5,21 +5,20 @@
 #include <ucp/api/ucp.h>
 
 #include "common_utils.h"
+#include "disk_sink.h"
+#include "logger.h"
+#include "ep_cache.h"
+#include "file_transfer.h"
 #include "print_utils.h"
+#include "topology.h"
 #include "ucp_client.h"
 #include "ucx_config.h"
 #include "ucx_utils.h"
 
-static uint16_t server_port = 13337;
-static sa_family_t ai_family =
-    AF_INET; // AF_INET is a constant that represents the Internet Protocol v4
-             // address family
-static long test_string_length = 4;
 static const ucp_tag_t tag = 0x1337a880u;
 static const ucp_tag_t tag_mask = UINT64_MAX;
 static const char *addr_msg_str = "UCX address message";
 static const char *data_msg_str = "UCX data message";
-static int print_config = 0;
 
 struct ucp_client_info {
   ucp_worker_h ucp_worker;
@@ -48,30 +47,43 @@ int main(int argc, char **argv) {
   ucp_address_t *local_addr = NULL;
   uint64_t peer_addr_len = 0;
   ucp_address_t *peer_addr = NULL;
-  char *client_target_name = NULL;
   int oob_sock = -1;
   int ret = -1;
 
-  struct err_handling err_handling_opt;
+  struct cmd_opts opts;
+  EpCache *ep_cache = NULL;
+  DiskSink *sink = NULL;
+  struct cpu_topology topo;
 
   /* Parse the command line */
-  status = parse_cmd(argc, argv, &client_target_name, &err_handling_opt,
-                     print_config, server_port, ai_family, test_string_length);
+  init_cmd_opts(&opts);
+  status = parse_cmd(argc, argv, &opts);
   CHKERR_JUMP(status != UCS_OK, "parse_cmd\n", err);
 
-  printf("Initializing Client: %s \n", client_target_name);
+  if (opts.print_topology && (topology_discover(&topo) == 0)) {
+    topology_print(&topo, stdout);
+  }
+  ret = topology_apply_affinity(opts.progress_cpu, opts.app_cpus);
+  CHKERR_JUMP(ret != 0, "apply CPU affinity\n", err);
+  ret = -1;
+
+  LOG_INFO("Initializing Client: %s \n", opts.server_name);
 
   /* UCP initialization */
   status = ucp_config_read(NULL, NULL, &config);
   CHKERR_JUMP(status != UCS_OK, "ucp_config_read\n", err);
 
   initialize_ucp_params(&ucp_params, "hello world client");
+  if (opts.test_mode != TEST_MODE_PROBE) {
+    ucp_params.features |= UCP_FEATURE_WAKEUP;
+  }
   initialize_ucp_worker_attr(&worker_attr);
   initialize_ucp_worker_params(&worker_params);
+  topology_set_worker_cpu(&worker_params, opts.progress_cpu);
 
   status = ucp_init(&ucp_params, config, &ucp_context);
 
-  if (print_config) {
+  if (opts.print_config) {
     ucp_config_print(config, stdout, NULL, UCS_CONFIG_PRINT_CONFIG);
   }
 
@@ -82,22 +94,23 @@ int main(int argc, char **argv) {
   CHKERR_JUMP(status != UCS_OK, "ucp_worker_create\n", err_cleanup);
 
   status = ucp_worker_query(ucp_worker, &worker_attr);
-  if (print_config) {
+  if (opts.print_config) {
     ucp_worker_print_info(ucp_worker, stdout);
   }
   CHKERR_JUMP(status != UCS_OK, "ucp_worker_query\n", err_worker);
   local_addr_len = worker_attr.address_length;
   local_addr = worker_attr.address;
 
-  printf("[0x%x] local address length: %lu\n", (unsigned int)pthread_self(),
-         local_addr_len);
+  LOG_INFO("[0x%x] local address length: %lu\n", (unsigned int)pthread_self(),
+           local_addr_len);
 
-  printf("Ready to run UCX Client\n");
-  if (client_target_name != NULL) {
-    oob_sock = connect_client(client_target_name, server_port, ai_family);
+  LOG_INFO("Ready to run UCX Client\n");
+  if (opts.server_name != NULL) {
+    oob_sock = connect_client(opts.server_name, opts.server_port,
+                              opts.ai_family);
     CHKERR_JUMP(oob_sock < 0, "client_connect\n", err_addr);
 
-    printf("Client: Receiving Address length\n");
+    LOG_INFO("Client: Receiving Address length\n");
     ret = recv(oob_sock, &peer_addr_len, sizeof(peer_addr_len), MSG_WAITALL);
     CHKERR_JUMP_RETVAL(ret != (int)sizeof(peer_addr_len),
                        "receive address length\n", err_addr, ret);
@@ -105,18 +118,66 @@ int main(int argc, char **argv) {
     peer_addr = static_cast<ucp_address_t *>(malloc(peer_addr_len));
     CHKERR_JUMP(!peer_addr, "allocate memory\n", err_addr);
 
-    printf("Client: Receiving Address\n");
+    LOG_INFO("Client: Receiving Address\n");
     ret = recv(oob_sock, peer_addr, peer_addr_len, MSG_WAITALL);
     CHKERR_JUMP_RETVAL(ret != (int)peer_addr_len, "receive address\n",
                        err_peer_addr, ret);
-    UcpClient ucpClient(ucp_worker, local_addr, local_addr_len, peer_addr);
-    ret = ucpClient.runUcxClient(data_msg_str, addr_msg_str, test_string_length,
-                                 tag, tag_mask, err_handling_opt);
+    if (opts.file_path != NULL) {
+      struct file_xfer_stats xfer_stats;
+
+      ret = file_recv(ucp_context, ucp_worker, local_addr, local_addr_len,
+                      peer_addr, opts.file_path, opts.err_handling_opt,
+                      &xfer_stats);
+      if (ret == 0) {
+        log_flush();
+        file_xfer_print("receive", opts.file_path, &xfer_stats);
+      }
+    } else {
+      UcpClient ucpClient(ucp_worker, local_addr, local_addr_len, peer_addr,
+                          peer_addr_len);
+      ucpClient.set_test_mode(opts.test_mode);
+      ucpClient.set_op_timeout(opts.op_timeout_ms * 1000000ull);
+      if (opts.ep_cache_size > 0) {
+        ep_cache = new EpCache(ucp_worker, opts.ep_cache_size,
+                               opts.err_handling_opt);
+        ucpClient.set_ep_cache(ep_cache);
+      }
+      ret = 0;
+      if (opts.sink_path != NULL) {
+        sink = new DiskSink(ucp_context, opts.sink_path,
+                            opts.test_string_length, sizeof(struct msg),
+                            opts.sink_direct);
+        ret = sink->init();
+        ucpClient.set_sink(sink);
+      }
+      for (int i = 0; (ret == 0) && (i < opts.iterations); ++i) {
+        ret = ucpClient.runUcxClient(data_msg_str, addr_msg_str,
+                                     opts.test_string_length, tag, tag_mask,
+                                     opts.err_handling_opt);
+      }
+      if (opts.op_timeout_ms > 0) {
+        log_flush();
+        op_deadline_print("client", ucpClient.get_deadline_stats());
+      }
+      if (sink != NULL) {
+        if ((sink->flush() == 0) && (ret == 0)) {
+          log_flush();
+          sink->report();
+        } else {
+          ret = -1;
+        }
+        delete sink;
+        sink = NULL;
+      }
+      /* Cached endpoints must be closed while the server is still there */
+      delete ep_cache;
+      ep_cache = NULL;
+    }
   } else {
-    CHKERR_JUMP(client_target_name == NULL, "Server name not provided", err);
+    CHKERR_JUMP(opts.server_name == NULL, "Server name not provided", err);
   }
 
-  if (!ret && (err_handling_opt.failure_mode == FAILURE_MODE_NONE)) {
+  if (!ret && (opts.err_handling_opt.failure_mode == FAILURE_MODE_NONE)) {
     /* Make sure remote is disconnected before destroying local worker */
     ret = barrier(oob_sock, progress_worker, ucp_worker);
   }
@@ -5,21 +5,19 @@
 #include <ucp/api/ucp.h>
 
 #include "common_utils.h"
+#include "logger.h"
+#include "ep_cache.h"
+#include "file_transfer.h"
 #include "print_utils.h"
+#include "topology.h"
 #include "ucp_server.h"
 #include "ucx_config.h"
 #include "ucx_utils.h"
 
-static uint16_t server_port = 13337;
-static sa_family_t ai_family =
-    AF_INET; // AF_INET is a constant that represents the Internet Protocol v4
-             // address family
-static long test_string_length = 4;
 static const ucp_tag_t tag = 0x1337a880u;
 static const ucp_tag_t tag_mask = UINT64_MAX;
 static const char *addr_msg_str = "UCX address message";
 static const char *data_msg_str = "UCX data message";
-static int print_config = 0;
 
 void progress_worker(void *arg) { ucp_worker_progress((ucp_worker_h)arg); }
 
@@ -44,26 +42,37 @@ int main(int argc, char **argv) {
   int oob_sock = -1;
   int ret = -1;
 
-  struct err_handling err_handling_opt;
-
-  UcpServer ucpServer = NULL;
+  struct cmd_opts opts;
+  EpCache *ep_cache = NULL;
+  struct cpu_topology topo;
 
   /* Parse the command line */
-  status = parse_cmd(argc, argv, NULL, &err_handling_opt, print_config,
-                     server_port, ai_family, test_string_length);
+  init_cmd_opts(&opts);
+  status = parse_cmd(argc, argv, &opts);
   CHKERR_JUMP(status != UCS_OK, "parse_cmd\n", err);
 
+  if (opts.print_topology && (topology_discover(&topo) == 0)) {
+    topology_print(&topo, stdout);
+  }
+  ret = topology_apply_affinity(opts.progress_cpu, opts.app_cpus);
+  CHKERR_JUMP(ret != 0, "apply CPU affinity\n", err);
+  ret = -1;
+
   /* UCP initialization */
   status = ucp_config_read(NULL, NULL, &config);
   CHKERR_JUMP(status != UCS_OK, "ucp_config_read\n", err);
 
   initialize_ucp_params(&ucp_params, "hello world server");
+  if (opts.test_mode != TEST_MODE_PROBE) {
+    ucp_params.features |= UCP_FEATURE_WAKEUP;
+  }
   initialize_ucp_worker_attr(&worker_attr);
   initialize_ucp_worker_params(&worker_params);
+  topology_set_worker_cpu(&worker_params, opts.progress_cpu);
 
   status = ucp_init(&ucp_params, config, &ucp_context);
 
-  if (print_config) {
+  if (opts.print_config) {
     ucp_config_print(config, stdout, NULL, UCS_CONFIG_PRINT_CONFIG);
   }
 
@@ -74,34 +83,67 @@ int main(int argc, char **argv) {
   CHKERR_JUMP(status != UCS_OK, "ucp_worker_create\n", err_cleanup);
 
   status = ucp_worker_query(ucp_worker, &worker_attr);
-  if (print_config) {
+  if (opts.print_config) {
     ucp_worker_print_info(ucp_worker, stdout);
   }
   CHKERR_JUMP(status != UCS_OK, "ucp_worker_query\n", err_worker);
   local_addr_len = worker_attr.address_length;
   local_addr = worker_attr.address;
 
-  printf("[0x%x] local address length: %lu\n", (unsigned int)pthread_self(),
-         local_addr_len);
+  LOG_INFO("[0x%x] local address length: %lu\n", (unsigned int)pthread_self(),
+           local_addr_len);
 
-  printf("Ready to run UCX Client\n");
+  LOG_INFO("Ready to run UCX Client\n");
 
-  oob_sock = connect_server(server_port, ai_family);
+  oob_sock = connect_server(opts.server_port, opts.ai_family);
   CHKERR_JUMP(oob_sock < 0, "server_connect\n", err_peer_addr);
-  printf("Server: Sending Address length\n");
+  LOG_INFO("Server: Sending Address length\n");
   ret = send(oob_sock, &local_addr_len, sizeof(local_addr_len), 0);
   CHKERR_JUMP_RETVAL(ret != (int)sizeof(local_addr_len),
                      "send address length\n", err_peer_addr, ret);
 
-  printf("Server: Sending Address\n");
+  LOG_INFO("Server: Sending Address\n");
   ret = send(oob_sock, local_addr, local_addr_len, 0);
   CHKERR_JUMP_RETVAL(ret != (int)local_addr_len, "send address\n",
                      err_peer_addr, ret);
-  ucpServer = UcpServer(ucp_worker);
-  ret = ucpServer.runServer(data_msg_str, addr_msg_str, tag, tag_mask,
-                            test_string_length, err_handling_opt);
+  if (opts.file_path != NULL) {
+    struct file_xfer_stats xfer_stats;
+
+    ret = file_send(ucp_context, ucp_worker, opts.file_path, opts.verify_crc,
+                    opts.err_handling_opt, opts.test_mode,
+                    opts.op_timeout_ms * 1000000ull, &xfer_stats);
+    if (ret == 0) {
+      log_flush();
+      file_xfer_print("send", opts.file_path, &xfer_stats);
+    }
+  } else {
+    UcpServer ucpServer(ucp_worker);
+    ucpServer.set_verify_crc(opts.verify_crc);
+    ucpServer.set_test_mode(opts.test_mode);
+    ucpServer.set_op_timeout(opts.op_timeout_ms * 1000000ull);
+    if (opts.ep_cache_size > 0) {
+      ep_cache =
+          new EpCache(ucp_worker, opts.ep_cache_size, opts.err_handling_opt);
+      ucpServer.set_ep_cache(ep_cache);
+    }
+    for (int i = 0; i < opts.iterations; ++i) {
+      ret = ucpServer.runServer(data_msg_str, addr_msg_str, tag, tag_mask,
+                                opts.test_string_length,
+                                opts.err_handling_opt);
+      if (ret != 0) {
+        break;
+      }
+    }
+    if (opts.op_timeout_ms > 0) {
+      log_flush();
+      op_deadline_print("server", ucpServer.get_deadline_stats());
+    }
+  }
+  /* Cached endpoints must be closed while the client is still there */
+  delete ep_cache;
+  ep_cache = NULL;
 
-  if (!ret && (err_handling_opt.failure_mode == FAILURE_MODE_NONE)) {
+  if (!ret && (opts.err_handling_opt.failure_mode == FAILURE_MODE_NONE)) {
     /* Make sure remote is disconnected before destroying local worker */
     ret = barrier(oob_sock, progress_worker, ucp_worker);
   }
@@ -0,0 +1,385 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucp/api/ucp.h>
+#include <unistd.h> /* getopt */
+
+#include <atomic>
+#include <vector>
+
+#include "common_utils.h"
+#include "logger.h"
+#include "tag_dispatcher.h"
+#include "tag_layout.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+/**
+ * Multiplexes a bulk stream and several small control streams over one
+ * endpoint and measures how long the control messages take.
+ *
+ * With -m single every message uses one constant tag and the receiver takes
+ * them one at a time in arrival order, as UcpClient does; a control message
+ * waits until the bulk message before it has been fully received. With
+ * -m channels every stream is a channel of tag_layout.h and a TagDispatcher
+ * keeps receives posted per channel, so control messages complete while
+ * bulk data is still moving.
+ */
+
+#define TC_SINGLE_TAG 0x1337a8c0u
+#define TC_BULK_CHANNEL 0
+#define TC_CONTROL_SIZE 64
+#define TC_WINDOW 16 /* sends in flight */
+#define TC_DEFAULT_CHANNELS 4
+#define TC_DEFAULT_COUNT 1000
+#define TC_DEFAULT_BULK_SIZE (1 << 20)
+
+struct tc_msg {
+  uint32_t channel;
+  uint32_t reserved;
+  uint64_t seq;
+  uint64_t send_ns;
+};
+
+struct tc_bench;
+
+struct tc_send_slot {
+  struct tc_bench *bench;
+  std::vector<char> buffer;
+  struct tc_send_slot *next;
+};
+
+struct tc_bench {
+  struct bench_side sender;
+  struct bench_side receiver;
+  bool use_channels;
+  unsigned channels; /* bulk channel included */
+  long count;        /* messages per channel */
+  size_t bulk_size;
+  std::atomic<int> barrier_count;
+  struct tc_send_slot *free_slots; /* sender buffers not in flight */
+  /* results */
+  long received;
+  uint64_t bulk_bytes;
+  uint64_t elapsed_ns;
+  std::vector<uint64_t> control_ns;
+  std::vector<uint64_t> bulk_ns;
+  int ret[2];
+};
+
+static void print_tc_usage() {
+  fprintf(stderr, "Usage: run_tag_channels [parameters]\n");
+  fprintf(stderr, "\nParameters are:\n");
+  fprintf(stderr, "  -m <mode>     single: one tag for all streams, "
+                  "channels: a tag channel per stream (default: both)\n");
+  fprintf(stderr, "  -k <count>    Streams, the first one bulk "
+                  "(default:%d)\n",
+          TC_DEFAULT_CHANNELS);
+  fprintf(stderr, "  -n <count>    Messages per stream (default:%d)\n",
+          TC_DEFAULT_COUNT);
+  fprintf(stderr, "  -s <size>     Bulk message size (default:%d)\n",
+          TC_DEFAULT_BULK_SIZE);
+}
+
+static void tc_send_done(void *request, ucs_status_t status,
+                         void *user_data) {
+  struct tc_send_slot *slot = (struct tc_send_slot *)user_data;
+
+  if (status != UCS_OK) {
+    LOG_ERROR("tag channels: send failed (%s)\n", ucs_status_string(status));
+  }
+  slot->next = slot->bench->free_slots;
+  slot->bench->free_slots = slot;
+  ucp_request_free(request);
+}
+
+static ucs_status_t tc_send(struct tc_bench *bench, unsigned channel,
+                            uint64_t seq) {
+  ucp_worker_h ucp_worker = bench->sender.ucp_worker;
+  size_t length =
+      (channel == TC_BULK_CHANNEL) ? bench->bulk_size : TC_CONTROL_SIZE;
+  ucp_request_param_t param;
+  struct tc_send_slot *slot;
+  struct tc_msg *msg;
+  ucs_status_ptr_t request;
+  ucp_tag_t tag;
+
+  while (bench->free_slots == NULL) {
+    ucp_worker_progress(ucp_worker);
+  }
+  slot = bench->free_slots;
+  bench->free_slots = slot->next;
+
+  msg = (struct tc_msg *)slot->buffer.data();
+  msg->channel = channel;
+  msg->seq = seq;
+  msg->send_ns = get_time_ns();
+
+  if (!bench->use_channels) {
+    tag = TC_SINGLE_TAG;
+  } else if (channel == TC_BULK_CHANNEL) {
+    tag = tag_make(TAG_CLASS_DATA, channel, 0, seq);
+  } else {
+    tag = tag_make(TAG_CLASS_CONTROL, channel, 0, seq);
+  }
+
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_USER_DATA;
+  param.cb.send = tc_send_done;
+  param.user_data = slot;
+  request = ucp_tag_send_nbx(bench->sender.ep, msg, length, tag, &param);
+  if (UCS_PTR_IS_PTR(request)) {
+    return UCS_OK;
+  }
+
+  slot->next = bench->free_slots;
+  bench->free_slots = slot;
+  return UCS_PTR_STATUS(request);
+}
+
+static void *tc_sender_thread(void *arg) {
+  struct tc_bench *bench = (struct tc_bench *)arg;
+  std::vector<struct tc_send_slot> slots(TC_WINDOW);
+  ucs_status_t status = UCS_OK;
+  unsigned channel;
+  size_t i;
+
+  bench->free_slots = NULL;
+  for (i = 0; i < slots.size(); ++i) {
+    slots[i].bench = bench;
+    slots[i].buffer.resize(bench->bulk_size);
+    slots[i].next = bench->free_slots;
+    bench->free_slots = &slots[i];
+  }
+
+  for (long seq = 0; (seq < bench->count) && (status == UCS_OK); ++seq) {
+    for (channel = 0; (channel < bench->channels) && (status == UCS_OK);
+         ++channel) {
+      status = tc_send(bench, channel, seq);
+    }
+  }
+
+  /* All slots back means all sends completed */
+  for (i = 0; i < slots.size(); ++i) {
+    while (bench->free_slots == NULL) {
+      ucp_worker_progress(bench->sender.ucp_worker);
+    }
+    bench->free_slots = bench->free_slots->next;
+  }
+
+  bench_barrier(&bench->barrier_count, 2, 1, bench->sender.ucp_worker);
+  bench->ret[0] = (status == UCS_OK) ? 0 : -1;
+  return NULL;
+}
+
+static void tc_handle(void *arg, ucp_tag_t tag, void *buffer, size_t length) {
+  struct tc_bench *bench = (struct tc_bench *)arg;
+  const struct tc_msg *msg = (const struct tc_msg *)buffer;
+  uint64_t latency_ns = get_time_ns() - msg->send_ns;
+
+  if (msg->channel == TC_BULK_CHANNEL) {
+    bench->bulk_ns.push_back(latency_ns);
+    bench->bulk_bytes += length;
+  } else {
+    bench->control_ns.push_back(latency_ns);
+  }
+  ++bench->received;
+}
+
+/* One receive at a time, in arrival order, as UcpClient does */
+static ucs_status_t tc_recv_single(struct tc_bench *bench, void *buffer) {
+  ucp_worker_h ucp_worker = bench->receiver.ucp_worker;
+  ucp_request_param_t param;
+  ucp_tag_recv_info_t info_tag;
+  ucp_tag_message_h msg_tag;
+  struct ucx_context *request;
+  ucs_status_t status;
+
+  msg_tag = probe_wait(ucp_worker, TC_SINGLE_TAG, UINT64_MAX,
+                       TEST_MODE_PROBE, NULL, &info_tag);
+  if (msg_tag == NULL) {
+    return UCS_ERR_IO_ERROR;
+  }
+
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_DATATYPE |
+                       UCP_OP_ATTR_FLAG_NO_IMM_CMPL;
+  param.datatype = ucp_dt_make_contig(1);
+  param.cb.recv = recv_handler;
+  request = (struct ucx_context *)ucp_tag_msg_recv_nbx(
+      ucp_worker, buffer, info_tag.length, msg_tag, &param);
+  status = ucx_wait(ucp_worker, request, "receive", "stream");
+  if (status == UCS_OK) {
+    tc_handle(bench, info_tag.sender_tag, buffer, info_tag.length);
+  }
+  return status;
+}
+
+static void *tc_receiver_thread(void *arg) {
+  struct tc_bench *bench = (struct tc_bench *)arg;
+  ucp_worker_h ucp_worker = bench->receiver.ucp_worker;
+  long total = bench->count * bench->channels;
+  std::vector<char> buffer;
+  TagDispatcher *dispatcher = NULL;
+  ucs_status_t status = UCS_OK;
+  uint64_t start_ns;
+  unsigned channel;
+
+  if (bench->use_channels) {
+    dispatcher = new TagDispatcher(ucp_worker);
+    status = dispatcher->add_channel(TAG_CLASS_DATA, TC_BULK_CHANNEL,
+                                     bench->bulk_size, TC_WINDOW / 4,
+                                     tc_handle, bench);
+    for (channel = 1; (channel < bench->channels) && (status == UCS_OK);
+         ++channel) {
+      status = dispatcher->add_channel(TAG_CLASS_CONTROL, channel,
+                                       TC_CONTROL_SIZE, TC_WINDOW, tc_handle,
+                                       bench);
+    }
+  } else {
+    buffer.resize(bench->bulk_size);
+  }
+
+  start_ns = get_time_ns();
+  while ((bench->received < total) && (status == UCS_OK)) {
+    if (dispatcher != NULL) {
+      dispatcher->progress();
+    } else {
+      status = tc_recv_single(bench, buffer.data());
+    }
+  }
+  bench->elapsed_ns = get_time_ns() - start_ns;
+
+  bench_barrier(&bench->barrier_count, 2, 1, ucp_worker);
+  delete dispatcher;
+  bench->ret[1] = (status == UCS_OK) ? 0 : -1;
+  return NULL;
+}
+
+static int tc_run(struct tc_bench *bench, bool use_channels) {
+  pthread_t sender_thread, receiver_thread;
+
+  bench->use_channels = use_channels;
+  bench->barrier_count.store(0);
+  bench->received = 0;
+  bench->bulk_bytes = 0;
+  bench->control_ns.clear();
+  bench->bulk_ns.clear();
+  bench->ret[0] = bench->ret[1] = -1;
+
+  CHKERR_ACTION(pthread_create(&receiver_thread, NULL, tc_receiver_thread,
+                               bench) != 0,
+                "create receiver thread\n", return -1);
+  /* Without a sender the receiver never returns; leave it to process exit */
+  CHKERR_ACTION(pthread_create(&sender_thread, NULL, tc_sender_thread,
+                               bench) != 0,
+                "create sender thread\n", return -1);
+
+  pthread_join(sender_thread, NULL);
+  pthread_join(receiver_thread, NULL);
+  if ((bench->ret[0] != 0) || (bench->ret[1] != 0)) {
+    return -1;
+  }
+
+  log_flush();
+  printf("%-9s %10.2f %10.2f %10.2f %10.2f %10.1f\n",
+         use_channels ? "channels" : "single",
+         percentile_us(bench->control_ns, 0.5),
+         percentile_us(bench->control_ns, 0.99),
+         percentile_us(bench->control_ns, 0.999),
+         percentile_us(bench->bulk_ns, 0.5),
+         bench->bulk_bytes / (bench->elapsed_ns / 1e9) / 1e6);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  struct tc_bench bench;
+  std::vector<bool> modes;
+  ucs_status_t status;
+  int ret = -1;
+  int c;
+
+  bench.channels = TC_DEFAULT_CHANNELS;
+  bench.count = TC_DEFAULT_COUNT;
+  bench.bulk_size = TC_DEFAULT_BULK_SIZE;
+
+  while ((c = getopt(argc, argv, "m:k:n:s:h")) != -1) {
+    switch (c) {
+    case 'm':
+      if (!strcmp(optarg, "single")) {
+        modes.push_back(false);
+      } else if (!strcmp(optarg, "channels")) {
+        modes.push_back(true);
+      } else {
+        print_tc_usage();
+        return -1;
+      }
+      break;
+    case 'k':
+      bench.channels = atoi(optarg);
+      break;
+    case 'n':
+      bench.count = atol(optarg);
+      break;
+    case 's':
+      bench.bulk_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'h':
+    default:
+      print_tc_usage();
+      return -1;
+    }
+  }
+
+  if ((bench.channels < 2) || (bench.channels > TAG_CHANNEL.max() + 1) ||
+      (bench.count <= 0) || (bench.bulk_size < sizeof(struct tc_msg))) {
+    print_tc_usage();
+    return -1;
+  }
+
+  if (modes.empty()) {
+    modes = {false, true};
+  }
+  bench.control_ns.reserve(bench.count * (bench.channels - 1));
+  bench.bulk_ns.reserve(bench.count);
+
+  ret = bench_init_side(&bench.sender, "tag channels sender",
+                        UCP_FEATURE_TAG);
+  CHKERR_JUMP(ret != 0, "initialize sender\n", err);
+
+  ret = bench_init_side(&bench.receiver, "tag channels receiver",
+                        UCP_FEATURE_TAG);
+  CHKERR_JUMP(ret != 0, "initialize receiver\n", err_sender);
+
+  ret = -1;
+  status = bench_connect(&bench.sender, &bench.receiver, &bench.sender.ep);
+  CHKERR_JUMP(status != UCS_OK, "connect sender\n", err_receiver);
+
+  status = bench_connect(&bench.receiver, &bench.sender, &bench.receiver.ep);
+  CHKERR_JUMP(status != UCS_OK, "connect receiver\n", err_sender_ep);
+
+  log_flush();
+  printf("\n1 bulk stream of %lu bytes and %u control streams of %d "
+         "bytes, %ld messages each; latencies in us\n",
+         bench.bulk_size, bench.channels - 1, TC_CONTROL_SIZE, bench.count);
+  printf("%-9s %10s %10s %10s %10s %10s\n", "mode", "ctrl p50", "ctrl p99",
+         "ctrl p99.9", "bulk p50", "bulk MB/s");
+  for (bool use_channels : modes) {
+    ret = tc_run(&bench, use_channels);
+    if (ret != 0) {
+      break;
+    }
+  }
+
+  ep_close(bench.receiver.ucp_worker, bench.receiver.ep,
+           UCP_EP_CLOSE_FLAG_FORCE);
+err_sender_ep:
+  ep_close(bench.sender.ucp_worker, bench.sender.ep, UCP_EP_CLOSE_FLAG_FORCE);
+err_receiver:
+  bench_cleanup_side(&bench.receiver);
+err_sender:
+  bench_cleanup_side(&bench.sender);
+err:
+  return ret;
+}
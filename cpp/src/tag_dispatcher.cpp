@@ -0,0 +1,150 @@
+#include "tag_dispatcher.h"
+#include "logger.h"
+
+TagDispatcher::TagDispatcher(ucp_worker_h ucp_worker)
+    : ucp_worker_(ucp_worker), posted_(0), stats_() {}
+
+TagDispatcher::~TagDispatcher() {
+  for (struct channel *channel : channels_) {
+    for (struct slot &slot : channel->slots) {
+      if (slot.request != NULL) {
+        ucp_request_cancel(ucp_worker_, slot.request);
+      }
+    }
+  }
+  while (posted_ > 0) {
+    ucp_worker_progress(ucp_worker_);
+  }
+
+  for (struct channel *channel : channels_) {
+    delete channel;
+  }
+  LOG_INFO("tag dispatcher: %lu received, %lu truncated, %lu errors\n",
+           stats_.received, stats_.truncated, stats_.errors);
+}
+
+void TagDispatcher::recv_done(void *request, ucs_status_t status,
+                              const ucp_tag_recv_info_t *info,
+                              void *user_data) {
+  struct slot *slot = static_cast<struct slot *>(user_data);
+  TagDispatcher *dispatcher = slot->dispatcher;
+
+  slot->request = NULL;
+  slot->status = status;
+  slot->sender_tag = (status == UCS_OK) ? info->sender_tag : 0;
+  slot->length = (status == UCS_OK) ? info->length : 0;
+  ucp_request_free(request);
+
+  --dispatcher->posted_;
+  dispatcher->completed_.push_back(slot);
+}
+
+ucs_status_t TagDispatcher::post(struct slot *slot) {
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_USER_DATA |
+                       UCP_OP_ATTR_FIELD_DATATYPE |
+                       UCP_OP_ATTR_FLAG_NO_IMM_CMPL;
+  param.cb.recv = recv_done;
+  param.user_data = slot;
+  param.datatype = ucp_dt_make_contig(1);
+
+  request = ucp_tag_recv_nbx(ucp_worker_, slot->buffer,
+                             slot->channel->max_size, slot->channel->tag,
+                             TAG_CHANNEL_MASK, &param);
+  if (UCS_PTR_IS_ERR(request)) {
+    return UCS_PTR_STATUS(request);
+  }
+
+  slot->request = request;
+  ++posted_;
+  return UCS_OK;
+}
+
+ucs_status_t TagDispatcher::add_channel(unsigned msg_class, unsigned channel,
+                                        size_t max_size, unsigned depth,
+                                        tag_handler_t handler, void *arg) {
+  ucp_tag_t tag = tag_make(msg_class, channel, 0, 0);
+  struct channel *ch;
+  ucs_status_t status;
+  unsigned i;
+
+  if ((msg_class > TAG_CLASS.max()) || (channel > TAG_CHANNEL.max()) ||
+      (depth == 0)) {
+    return UCS_ERR_INVALID_PARAM;
+  }
+  if ((msg_class == TAG_CLASS_FIXED) || (msg_class == TAG_CLASS_FILE)) {
+    /* Their tags belong to hello-world and the file transfer */
+    LOG_ERROR("tag dispatcher: class %u is reserved\n", msg_class);
+    return UCS_ERR_INVALID_PARAM;
+  }
+  for (struct channel *other : channels_) {
+    if (other->tag == tag) {
+      return UCS_ERR_ALREADY_EXISTS;
+    }
+  }
+
+  ch = new struct channel;
+  ch->tag = tag;
+  ch->max_size = max_size;
+  ch->handler = handler;
+  ch->arg = arg;
+  ch->buffers.resize(max_size * depth);
+  ch->slots.resize(depth);
+  channels_.push_back(ch);
+
+  for (i = 0; i < depth; ++i) {
+    ch->slots[i].channel = ch;
+    ch->slots[i].dispatcher = this;
+    ch->slots[i].request = NULL;
+    ch->slots[i].buffer = ch->buffers.data() + i * max_size;
+    status = post(&ch->slots[i]);
+    if (status != UCS_OK) {
+      LOG_ERROR("tag dispatcher: posting a receive on channel %u failed "
+                "(%s)\n",
+                channel, ucs_status_string(status));
+      return status;
+    }
+  }
+
+  return UCS_OK;
+}
+
+unsigned TagDispatcher::progress() {
+  unsigned count = ucp_worker_progress(ucp_worker_);
+  struct channel *ch;
+  ucs_status_t status;
+
+  /* Slots completing while handlers run wait for the next call */
+  handling_.swap(completed_);
+  for (struct slot *slot : handling_) {
+    ch = slot->channel;
+    if (slot->status == UCS_ERR_CANCELED) {
+      continue;
+    } else if (slot->status == UCS_OK) {
+      ++stats_.received;
+      ch->handler(ch->arg, slot->sender_tag, slot->buffer, slot->length);
+    } else if (slot->status == UCS_ERR_MESSAGE_TRUNCATED) {
+      LOG_WARN("tag dispatcher: message on channel %lu exceeds %lu bytes\n",
+               TAG_CHANNEL.get(ch->tag), ch->max_size);
+      ++stats_.truncated;
+    } else {
+      LOG_WARN("tag dispatcher: receive failed (%s)\n",
+               ucs_status_string(slot->status));
+      ++stats_.errors;
+    }
+
+    status = post(slot);
+    if (status != UCS_OK) {
+      LOG_ERROR("tag dispatcher: posting a receive failed (%s)\n",
+                ucs_status_string(status));
+      ++stats_.errors;
+    }
+    ++count;
+  }
+  handling_.clear();
+
+  return count;
+}
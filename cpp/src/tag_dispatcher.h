@@ -0,0 +1,110 @@
+#ifndef MYUCXPLAYGROUND_TAG_DISPATCHER_H
+#define MYUCXPLAYGROUND_TAG_DISPATCHER_H
+
+#include <ucp/api/ucp.h>
+
+#include <vector>
+
+#include "tag_layout.h"
+
+/**
+ * @brief Called with each message received on a channel. `buffer` is only
+ * valid during the call.
+ */
+typedef void (*tag_handler_t)(void *arg, ucp_tag_t tag, void *buffer,
+                              size_t length);
+
+/**
+ * Routes tagged messages to per-channel handlers.
+ *
+ * Every channel (a class and channel number of tag_layout.h) keeps its own
+ * receives posted, matching with TAG_CHANNEL_MASK so messages from any rank
+ * and sequence land on it. Channels multiplexed over one endpoint therefore
+ * complete independently: a small control message does not wait for a bulk
+ * message sent before it on another channel to be received, and each
+ * channel's buffers are sized for its own traffic.
+ *
+ * Handlers run from progress(), outside UCX callbacks, so they may send.
+ * Within a channel receives match in posting order; with more than one
+ * posted, large (rendezvous) messages can complete out of order, which the
+ * tag's sequence field lets a handler detect.
+ *
+ * Not thread safe: use it from the thread that progresses `ucp_worker`.
+ */
+class TagDispatcher {
+
+public:
+  struct stats {
+    uint64_t received;
+    uint64_t truncated; /* messages larger than their channel's buffers */
+    uint64_t errors;
+  };
+
+  explicit TagDispatcher(ucp_worker_h ucp_worker);
+
+  /**
+   * @brief Cancels the receives still posted.
+   */
+  ~TagDispatcher();
+
+  TagDispatcher(const TagDispatcher &) = delete;
+  TagDispatcher &operator=(const TagDispatcher &) = delete;
+
+  /**
+   * @brief Posts `depth` receives of `max_size` bytes for a channel.
+   *
+   * @return UCS_OK, UCS_ERR_ALREADY_EXISTS if the channel has a handler,
+   * UCS_ERR_INVALID_PARAM if `msg_class` or `channel` do not fit their tag
+   * field or `msg_class` is TAG_CLASS_FIXED or TAG_CLASS_FILE, or the error
+   * of posting a receive.
+   */
+  ucs_status_t add_channel(unsigned msg_class, unsigned channel,
+                           size_t max_size, unsigned depth,
+                           tag_handler_t handler, void *arg);
+
+  /**
+   * @brief Progresses the worker, then runs the handlers of the messages
+   * that completed and posts their receives again.
+   *
+   * @return Number of messages handled plus the worker progress count.
+   */
+  unsigned progress();
+
+  const struct stats &get_stats() const { return stats_; }
+
+private:
+  struct channel;
+
+  struct slot {
+    struct channel *channel;
+    TagDispatcher *dispatcher;
+    void *request; /* posted receive, NULL once completed */
+    ucs_status_t status;
+    ucp_tag_t sender_tag;
+    size_t length;
+    char *buffer;
+  };
+
+  struct channel {
+    ucp_tag_t tag;
+    size_t max_size;
+    tag_handler_t handler;
+    void *arg;
+    std::vector<char> buffers;
+    std::vector<struct slot> slots;
+  };
+
+  static void recv_done(void *request, ucs_status_t status,
+                        const ucp_tag_recv_info_t *info, void *user_data);
+
+  ucs_status_t post(struct slot *slot);
+
+  ucp_worker_h ucp_worker_;
+  std::vector<struct channel *> channels_;
+  std::vector<struct slot *> completed_; /* awaiting their handler */
+  std::vector<struct slot *> handling_;  /* being handled by progress() */
+  size_t posted_;
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_TAG_DISPATCHER_H
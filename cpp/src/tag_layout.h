@@ -0,0 +1,84 @@
+#ifndef MYUCXPLAYGROUND_TAG_LAYOUT_H
+#define MYUCXPLAYGROUND_TAG_LAYOUT_H
+
+#include <stdint.h>
+#include <ucp/api/ucp.h>
+
+/**
+ * Structured 64-bit tags.
+ *
+ * A tag is split into fields, so one endpoint can carry many independent
+ * streams and a receive can match on some fields and ignore the others
+ * (partial tag_mask matching):
+ *
+ *   63   60 59        48 47                  28 27                     0
+ *  +-------+------------+----------------------+------------------------+
+ *  | class |  channel   |     source rank      |        sequence        |
+ *  +-------+------------+----------------------+------------------------+
+ *
+ * The hand-picked constants used so far (0x1337a880 and friends) all have
+ * class 0, and the file transfer chunk tags (0xf11e << 48) class 15, so
+ * structured traffic uses the classes in between and never matches them.
+ */
+
+struct tag_field {
+  unsigned shift;
+  unsigned bits;
+
+  constexpr uint64_t mask() const { return ((1ull << bits) - 1) << shift; }
+
+  constexpr uint64_t max() const { return (1ull << bits) - 1; }
+
+  /** @brief Places `value` in this field; higher bits are dropped. */
+  constexpr ucp_tag_t make(uint64_t value) const {
+    return (value << shift) & mask();
+  }
+
+  constexpr uint64_t get(ucp_tag_t tag) const {
+    return (tag & mask()) >> shift;
+  }
+};
+
+constexpr struct tag_field TAG_SEQ = {0, 28};
+constexpr struct tag_field TAG_RANK = {28, 20};
+constexpr struct tag_field TAG_CHANNEL = {48, 12};
+constexpr struct tag_field TAG_CLASS = {60, 4};
+
+static_assert((TAG_SEQ.mask() + TAG_RANK.mask() + TAG_CHANNEL.mask() +
+               TAG_CLASS.mask()) == UINT64_MAX,
+              "tag fields must cover the tag without overlapping");
+
+typedef enum {
+  TAG_CLASS_FIXED = 0,   /* the constant tags, not structured */
+  TAG_CLASS_DATA = 1,    /* application payload */
+  TAG_CLASS_CONTROL = 2, /* small messages that must not wait behind data */
+  TAG_CLASS_FILE = 15    /* file transfer chunk tags */
+} tag_class_t;
+
+/**
+ * @brief Builds a tag from its fields.
+ */
+constexpr ucp_tag_t tag_make(unsigned msg_class, unsigned channel,
+                             unsigned rank, uint64_t seq) {
+  return TAG_CLASS.make(msg_class) | TAG_CHANNEL.make(channel) |
+         TAG_RANK.make(rank) | TAG_SEQ.make(seq);
+}
+
+/**
+ * @brief Mask that matches a class and channel from any rank and sequence.
+ */
+constexpr ucp_tag_t TAG_CHANNEL_MASK = TAG_CLASS.mask() | TAG_CHANNEL.mask();
+
+/**
+ * @brief Mask that matches a class, channel and source rank.
+ */
+constexpr ucp_tag_t TAG_SOURCE_MASK = TAG_CHANNEL_MASK | TAG_RANK.mask();
+
+static_assert(TAG_CLASS.get(0x1337a880u) == TAG_CLASS_FIXED,
+              "the constant tags must stay in the fixed class");
+static_assert(TAG_CLASS.get(0xf11eull << 48) == TAG_CLASS_FILE,
+              "file transfer tags must stay in their class");
+static_assert(TAG_CHANNEL.get(tag_make(1, 7, 3, 42)) == 7,
+              "fields must round-trip");
+
+#endif // MYUCXPLAYGROUND_TAG_LAYOUT_H
@@ -0,0 +1,759 @@
+#include "tcp_gateway.h"
+#include "common_utils.h"
+#include "logger.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> /* TCP_NODELAY */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#define GATEWAY_MAX_EVENTS 256
+#define GATEWAY_READ_SIZE 4096 /* initial read buffer per connection */
+/* Unwritten reply bytes at which a connection is no longer read from */
+#define GATEWAY_MAX_WBUF (256 * 1024)
+
+#define GATEWAY_SLOT(_id) ((uint32_t)(_id))
+#define GATEWAY_PAD(_len) (((_len) + 7) & ~(size_t)7)
+
+TcpGateway::TcpGateway(ucp_worker_h ucp_worker, size_t batch_bytes)
+    : ucp_worker_(ucp_worker), batch_bytes_(batch_bytes),
+      handler_set_(false), listen_fd_(-1), epoll_fd_(-1), inflight_(0),
+      stats_() {}
+
+TcpGateway::~TcpGateway() {
+  ucp_am_handler_param_t param;
+  std::vector<ucp_ep_h> eps;
+
+  /* Replies still on their way are dropped */
+  if (handler_set_) {
+    param.field_mask =
+        UCP_AM_HANDLER_PARAM_FIELD_ID | UCP_AM_HANDLER_PARAM_FIELD_CB;
+    param.id = GATEWAY_AM_REPLY;
+    param.cb = NULL;
+    ucp_worker_set_am_recv_handler(ucp_worker_, &param);
+  }
+  while (inflight_ > 0) {
+    ucp_worker_progress(ucp_worker_);
+  }
+
+  for (struct conn *conn : conns_) {
+    if (conn->fd >= 0) {
+      close_conn(conn);
+    }
+    delete conn;
+  }
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+  }
+  if (epoll_fd_ >= 0) {
+    close(epoll_fd_);
+  }
+
+  for (struct backend &backend : backends_) {
+    delete backend.open;
+    eps.push_back(backend.ep);
+  }
+  ep_close_batch(ucp_worker_, eps.data(), eps.size(),
+                 UCP_EP_CLOSE_FLAG_FORCE);
+  for (struct batch *batch : free_batches_) {
+    delete batch;
+  }
+  LOG_INFO("tcp gateway: %lu accepted, %lu closed, %lu frames (%lu bytes) "
+           "in %lu batches, %lu replies (%lu bytes), %lu orphaned, "
+           "%lu read pauses, %lu errors\n",
+           stats_.accepted, stats_.closed, stats_.frames, stats_.bytes_in,
+           stats_.batches, stats_.replies, stats_.bytes_out,
+           stats_.orphaned, stats_.read_pauses, stats_.errors);
+}
+
+int TcpGateway::listen(uint16_t port) {
+  ucp_am_handler_param_t param;
+  struct epoll_event ev;
+  ucs_status_t status;
+  int ret;
+
+  param.field_mask = UCP_AM_HANDLER_PARAM_FIELD_ID |
+                     UCP_AM_HANDLER_PARAM_FIELD_FLAGS |
+                     UCP_AM_HANDLER_PARAM_FIELD_CB |
+                     UCP_AM_HANDLER_PARAM_FIELD_ARG;
+  param.id = GATEWAY_AM_REPLY;
+  param.flags = UCP_AM_FLAG_WHOLE_MSG;
+  param.cb = reply_cb;
+  param.arg = this;
+  status = ucp_worker_set_am_recv_handler(ucp_worker_, &param);
+  CHKERR_ACTION(status != UCS_OK, "set the gateway reply handler\n",
+                return -1);
+  handler_set_ = true;
+
+  epoll_fd_ = epoll_create1(0);
+  CHKERR_ACTION(epoll_fd_ < 0, "create gateway epoll\n", return -1);
+
+  listen_fd_ = listen_nonblock(port);
+  if (listen_fd_ < 0) {
+    return -1;
+  }
+
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = NULL; /* NULL marks the listening socket */
+  ret = epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+  CHKERR_ACTION(ret < 0, "add gateway socket to epoll\n", return -1);
+
+  LOG_INFO("tcp gateway: listening on TCP port %u\n", (unsigned)port);
+  return 0;
+}
+
+ucs_status_t TcpGateway::connect(const ucp_address_t *address) {
+  ucp_ep_params_t ep_params;
+  struct backend backend;
+  ucs_status_t status;
+
+  ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS;
+  ep_params.address = address;
+  status = ucp_ep_create(ucp_worker_, &ep_params, &backend.ep);
+  CHKERR_ACTION(status != UCS_OK, "connect to a gateway backend\n",
+                return status);
+
+  backend.open = NULL;
+  backends_.push_back(backend);
+  return UCS_OK;
+}
+
+unsigned TcpGateway::progress() {
+  struct epoll_event events[GATEWAY_MAX_EVENTS];
+  unsigned count = ucp_worker_progress(ucp_worker_);
+  struct conn *conn;
+  int n, i;
+
+  n = epoll_wait(epoll_fd_, events, GATEWAY_MAX_EVENTS, 0);
+  for (i = 0; i < n; ++i) {
+    conn = static_cast<struct conn *>(events[i].data.ptr);
+    if (conn == NULL) {
+      accept_all();
+      continue;
+    }
+    /* Edge triggered: each side is served until it would block */
+    if ((events[i].events & (EPOLLHUP | EPOLLERR)) ||
+        ((events[i].events & EPOLLIN) && !conn->paused)) {
+      read_conn(conn);
+    }
+    if ((conn->fd >= 0) && (events[i].events & EPOLLOUT)) {
+      write_conn(conn);
+    }
+  }
+
+  /* What arrived together leaves together */
+  for (struct backend &backend : backends_) {
+    if (backend.open != NULL) {
+      send_batch(&backend);
+    }
+  }
+  return count + ((n > 0) ? n : 0);
+}
+
+void TcpGateway::accept_all() {
+  struct epoll_event ev;
+  struct conn *conn;
+  int optval = 1;
+  uint32_t slot;
+  int fd;
+
+  while ((fd = accept(listen_fd_, NULL, NULL)) >= 0) {
+    set_nonblock(fd);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+    if (free_slots_.empty()) {
+      slot = conns_.size();
+      conn = new struct conn;
+      conn->id = slot;
+      conns_.push_back(conn);
+    } else {
+      slot = free_slots_.back();
+      free_slots_.pop_back();
+      conn = conns_[slot];
+    }
+    conn->fd = fd;
+    conn->rbuf.resize(GATEWAY_READ_SIZE);
+    conn->rlen = 0;
+    conn->woff = 0;
+    conn->queued = 0;
+    conn->written = 0;
+    conn->paused = false;
+    conn->touched = false;
+    ++stats_.accepted;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      LOG_WARN("tcp gateway: cannot poll a connection (%s)\n",
+               strerror(errno));
+      close_conn(conn);
+    }
+  }
+
+  if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+    LOG_WARN("tcp gateway: accept failed (%s)\n", strerror(errno));
+  }
+}
+
+void TcpGateway::close_conn(struct conn *conn) {
+  close(conn->fd);
+  conn->fd = -1;
+  /* Replies still coming for this connection no longer match */
+  conn->id += 1ull << 32;
+  conn->rbuf.clear();
+  conn->rbuf.shrink_to_fit();
+  conn->wbuf.clear();
+  conn->wbuf.shrink_to_fit();
+  conn->pending.clear();
+  free_slots_.push_back(GATEWAY_SLOT(conn->id));
+  ++stats_.closed;
+}
+
+void TcpGateway::read_conn(struct conn *conn) {
+  struct gateway_frame frame;
+  size_t pos;
+  uint64_t now;
+  ssize_t n;
+
+  for (;;) {
+    /* A partial frame fills the buffer: make room for the rest */
+    if (conn->rlen == conn->rbuf.size()) {
+      conn->rbuf.resize(std::min(2 * conn->rbuf.size(),
+                                 sizeof(frame) + GATEWAY_MAX_FRAME));
+    }
+
+    n = recv(conn->fd, conn->rbuf.data() + conn->rlen,
+             conn->rbuf.size() - conn->rlen, 0);
+    if (n == 0) {
+      close_conn(conn);
+      return;
+    } else if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        close_conn(conn);
+      }
+      return;
+    }
+    conn->rlen += n;
+    stats_.bytes_in += n;
+
+    now = get_time_ns();
+    for (pos = 0; conn->rlen - pos >= sizeof(frame);
+         pos += sizeof(frame) + frame.length) {
+      memcpy(&frame, conn->rbuf.data() + pos, sizeof(frame));
+      if (frame.length > GATEWAY_MAX_FRAME) {
+        LOG_WARN("tcp gateway: closing a connection that sent a %u byte "
+                 "frame\n",
+                 frame.length);
+        ++stats_.errors;
+        close_conn(conn);
+        return;
+      }
+      if (conn->rlen - pos - sizeof(frame) < frame.length) {
+        break;
+      }
+      add_frame(conn, conn->rbuf.data() + pos + sizeof(frame), frame.length,
+                now);
+    }
+    memmove(conn->rbuf.data(), conn->rbuf.data() + pos, conn->rlen - pos);
+    conn->rlen -= pos;
+  }
+}
+
+void TcpGateway::write_conn(struct conn *conn) {
+  uint64_t now;
+  ssize_t n;
+
+  while (conn->woff < conn->wbuf.size()) {
+    n = send(conn->fd, conn->wbuf.data() + conn->woff,
+             conn->wbuf.size() - conn->woff, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        close_conn(conn);
+        return;
+      }
+      break; /* EPOLLOUT says when to go on */
+    }
+    conn->woff += n;
+    conn->written += n;
+    stats_.bytes_out += n;
+  }
+
+  if (!conn->pending.empty() &&
+      (conn->pending.front().first <= conn->written)) {
+    now = get_time_ns();
+    do {
+      stats_.egress_ns += now - conn->pending.front().second;
+      conn->pending.pop_front();
+    } while (!conn->pending.empty() &&
+             (conn->pending.front().first <= conn->written));
+  }
+  if (conn->woff == conn->wbuf.size()) {
+    conn->wbuf.clear();
+    conn->woff = 0;
+    if (conn->paused) {
+      set_reading(conn, true);
+    }
+  }
+}
+
+void TcpGateway::set_reading(struct conn *conn, bool on) {
+  struct epoll_event ev;
+
+  /* Modifying the registration re-checks readiness, so data that came in
+   * while paused is reported */
+  ev.events = EPOLLOUT | EPOLLET;
+  if (on) {
+    ev.events |= EPOLLIN;
+  }
+  ev.data.ptr = conn;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+    LOG_WARN("tcp gateway: cannot poll a connection (%s)\n",
+             strerror(errno));
+    close_conn(conn);
+    return;
+  }
+  conn->paused = !on;
+  if (!on) {
+    ++stats_.read_pauses;
+  }
+}
+
+void TcpGateway::add_frame(struct conn *conn, const char *data,
+                           uint32_t length, uint64_t now) {
+  static const char padding[8] = {0};
+  struct gateway_record record;
+  struct backend *backend;
+  struct batch *batch;
+  size_t record_len = sizeof(record) + GATEWAY_PAD(length);
+
+  if (backends_.empty()) {
+    ++stats_.errors;
+    return;
+  }
+
+  /* A connection always goes to the same backend, so its replies stay in
+   * order */
+  backend = &backends_[GATEWAY_SLOT(conn->id) % backends_.size()];
+  if ((backend->open != NULL) &&
+      (backend->open->data.size() + record_len > batch_bytes_)) {
+    send_batch(backend);
+  }
+  if (backend->open == NULL) {
+    if (free_batches_.empty()) {
+      batch = new struct batch;
+      batch->gateway = this;
+    } else {
+      batch = free_batches_.back();
+      free_batches_.pop_back();
+    }
+    batch->hdr.count = 0;
+    batch->hdr.reserved = 0;
+    batch->hdr.service_ns = 0;
+    batch->data.clear();
+    backend->open = batch;
+  }
+  batch = backend->open;
+
+  record.conn_id = conn->id;
+  record.recv_ns = now;
+  record.length = length;
+  record.reserved = 0;
+  batch->data.insert(batch->data.end(), reinterpret_cast<char *>(&record),
+                     reinterpret_cast<char *>(&record) + sizeof(record));
+  batch->data.insert(batch->data.end(), data, data + length);
+  batch->data.insert(batch->data.end(), padding,
+                     padding + GATEWAY_PAD(length) - length);
+  ++batch->hdr.count;
+  ++stats_.frames;
+}
+
+void TcpGateway::batch_done(void *request, ucs_status_t status,
+                            void *user_data) {
+  struct batch *batch = static_cast<struct batch *>(user_data);
+  TcpGateway *gateway = batch->gateway;
+
+  if (request != NULL) {
+    ucp_request_free(request);
+  }
+  if (status != UCS_OK) {
+    LOG_WARN("tcp gateway: sending a batch failed (%s)\n",
+             ucs_status_string(status));
+    ++gateway->stats_.errors;
+  }
+  gateway->free_batches_.push_back(batch);
+  --gateway->inflight_;
+}
+
+void TcpGateway::send_batch(struct backend *backend) {
+  struct batch *batch = backend->open;
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+
+  backend->open = NULL;
+  batch->hdr.send_ns = get_time_ns();
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_FLAGS | UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_USER_DATA;
+  param.flags = UCP_AM_SEND_FLAG_REPLY;
+  param.cb.send = batch_done;
+  param.user_data = batch;
+  ++inflight_;
+  ++stats_.batches;
+  request = ucp_am_send_nbx(backend->ep, GATEWAY_AM_REQUEST, &batch->hdr,
+                            sizeof(batch->hdr), batch->data.data(),
+                            batch->data.size(), &param);
+  if (!UCS_PTR_IS_PTR(request)) {
+    batch_done(NULL, UCS_PTR_STATUS(request), batch);
+  }
+}
+
+void TcpGateway::handle_replies(const struct gateway_batch_hdr *hdr,
+                                const char *data, size_t length) {
+  struct gateway_frame frame;
+  struct gateway_record record;
+  std::vector<struct conn *> touched;
+  uint64_t now = get_time_ns();
+  uint64_t rtt = now - hdr->send_ns;
+  struct conn *conn;
+  size_t pos = 0;
+  uint32_t i;
+
+  for (i = 0; i < hdr->count; ++i) {
+    if (length - pos < sizeof(record)) {
+      ++stats_.errors;
+      break;
+    }
+    memcpy(&record, data + pos, sizeof(record));
+    pos += sizeof(record);
+    if ((record.length > GATEWAY_MAX_FRAME) ||
+        (length - pos < record.length)) {
+      ++stats_.errors;
+      break;
+    }
+
+    conn = (GATEWAY_SLOT(record.conn_id) < conns_.size())
+               ? conns_[GATEWAY_SLOT(record.conn_id)]
+               : NULL;
+    if ((conn == NULL) || (conn->id != record.conn_id)) {
+      ++stats_.orphaned;
+    } else {
+      frame.length = record.length;
+      conn->wbuf.insert(conn->wbuf.end(), reinterpret_cast<char *>(&frame),
+                        reinterpret_cast<char *>(&frame) + sizeof(frame));
+      conn->wbuf.insert(conn->wbuf.end(), data + pos,
+                        data + pos + record.length);
+      conn->queued += sizeof(frame) + record.length;
+      conn->pending.emplace_back(conn->queued, now);
+      if (!conn->touched) {
+        conn->touched = true;
+        touched.push_back(conn);
+      }
+
+      ++stats_.replies;
+      stats_.queue_ns += hdr->send_ns - record.recv_ns;
+      stats_.ucx_ns += (rtt > hdr->service_ns) ? rtt - hdr->service_ns : 0;
+      stats_.service_ns += hdr->service_ns;
+    }
+    pos += std::min(GATEWAY_PAD(record.length), length - pos);
+  }
+
+  /* One write per connection for all its replies in the batch. A client
+   * that does not keep up is not read from until its replies are out, so
+   * it cannot make the gateway queue without bound */
+  for (struct conn *c : touched) {
+    c->touched = false;
+    if (c->fd >= 0) {
+      write_conn(c);
+    }
+    if ((c->fd >= 0) && !c->paused &&
+        (c->wbuf.size() - c->woff > GATEWAY_MAX_WBUF)) {
+      set_reading(c, false);
+    }
+  }
+}
+
+struct gateway_reply_recv {
+  TcpGateway *gateway;
+  struct gateway_batch_hdr hdr;
+  std::vector<char> data;
+};
+
+void TcpGateway::reply_rndv_done(void *request, ucs_status_t status,
+                                 size_t length, void *user_data) {
+  struct gateway_reply_recv *recv =
+      static_cast<struct gateway_reply_recv *>(user_data);
+  TcpGateway *gateway = recv->gateway;
+
+  if (request != NULL) {
+    ucp_request_free(request);
+  }
+  if (status == UCS_OK) {
+    gateway->handle_replies(&recv->hdr, recv->data.data(), length);
+  } else {
+    LOG_WARN("tcp gateway: receiving replies failed (%s)\n",
+             ucs_status_string(status));
+    ++gateway->stats_.errors;
+  }
+  --gateway->inflight_;
+  delete recv;
+}
+
+ucs_status_t TcpGateway::reply_cb(void *arg, const void *header,
+                                  size_t header_length, void *data,
+                                  size_t length,
+                                  const ucp_am_recv_param_t *param) {
+  TcpGateway *gateway = static_cast<TcpGateway *>(arg);
+  struct gateway_reply_recv *recv;
+  ucp_request_param_t recv_param;
+  ucs_status_ptr_t request;
+
+  if (header_length != sizeof(struct gateway_batch_hdr)) {
+    ++gateway->stats_.errors;
+    return UCS_OK;
+  }
+
+  if (!(param->recv_attr & UCP_AM_RECV_ATTR_FLAG_RNDV)) {
+    gateway->handle_replies(
+        static_cast<const struct gateway_batch_hdr *>(header),
+        static_cast<const char *>(data), length);
+    return UCS_OK;
+  }
+
+  recv = new struct gateway_reply_recv;
+  recv->gateway = gateway;
+  memcpy(&recv->hdr, header, sizeof(recv->hdr));
+  recv->data.resize(length);
+  ++gateway->inflight_;
+
+  recv_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                            UCP_OP_ATTR_FIELD_USER_DATA |
+                            UCP_OP_ATTR_FIELD_DATATYPE;
+  recv_param.cb.recv_am = reply_rndv_done;
+  recv_param.user_data = recv;
+  recv_param.datatype = ucp_dt_make_contig(1);
+  request = ucp_am_recv_data_nbx(gateway->ucp_worker_, data,
+                                 recv->data.data(), length, &recv_param);
+  if (!UCS_PTR_IS_PTR(request)) {
+    reply_rndv_done(NULL, UCS_PTR_STATUS(request), length, recv);
+  }
+  return UCS_INPROGRESS;
+}
+
+GatewayBackend::GatewayBackend(ucp_worker_h ucp_worker,
+                               gateway_handler_t handler, void *arg)
+    : ucp_worker_(ucp_worker), handler_(handler), arg_(arg),
+      handler_set_(false), inflight_(0), stats_() {}
+
+GatewayBackend::~GatewayBackend() {
+  ucp_am_handler_param_t param;
+
+  if (handler_set_) {
+    param.field_mask =
+        UCP_AM_HANDLER_PARAM_FIELD_ID | UCP_AM_HANDLER_PARAM_FIELD_CB;
+    param.id = GATEWAY_AM_REQUEST;
+    param.cb = NULL;
+    ucp_worker_set_am_recv_handler(ucp_worker_, &param);
+  }
+  while (inflight_ > 0) {
+    ucp_worker_progress(ucp_worker_);
+  }
+
+  for (struct reply_ctx *ctx : free_ctxs_) {
+    free(ctx->out);
+    delete ctx;
+  }
+  LOG_INFO("gateway backend: %lu batches, %lu requests, %lu errors\n",
+           stats_.batches, stats_.requests, stats_.errors);
+}
+
+ucs_status_t GatewayBackend::start() {
+  ucp_am_handler_param_t param;
+  ucs_status_t status;
+
+  param.field_mask = UCP_AM_HANDLER_PARAM_FIELD_ID |
+                     UCP_AM_HANDLER_PARAM_FIELD_FLAGS |
+                     UCP_AM_HANDLER_PARAM_FIELD_CB |
+                     UCP_AM_HANDLER_PARAM_FIELD_ARG;
+  param.id = GATEWAY_AM_REQUEST;
+  param.flags = UCP_AM_FLAG_WHOLE_MSG;
+  param.cb = request_cb;
+  param.arg = this;
+  status = ucp_worker_set_am_recv_handler(ucp_worker_, &param);
+  CHKERR_ACTION(status != UCS_OK, "set the gateway request handler\n",
+                return status);
+  handler_set_ = true;
+  return UCS_OK;
+}
+
+struct GatewayBackend::reply_ctx *GatewayBackend::get_ctx() {
+  struct reply_ctx *ctx;
+
+  if (free_ctxs_.empty()) {
+    ctx = new struct reply_ctx;
+    ctx->backend = this;
+    ctx->out = NULL;
+    ctx->out_cap = 0;
+  } else {
+    ctx = free_ctxs_.back();
+    free_ctxs_.pop_back();
+  }
+  ++inflight_;
+  return ctx;
+}
+
+void GatewayBackend::put_ctx(struct reply_ctx *ctx) {
+  ctx->in.clear();
+  free_ctxs_.push_back(ctx);
+  --inflight_;
+}
+
+void GatewayBackend::reply_done(void *request, ucs_status_t status,
+                                void *user_data) {
+  struct reply_ctx *ctx = static_cast<struct reply_ctx *>(user_data);
+  GatewayBackend *backend = ctx->backend;
+
+  if (request != NULL) {
+    ucp_request_free(request);
+  }
+  if (status != UCS_OK) {
+    LOG_WARN("gateway backend: sending replies failed (%s)\n",
+             ucs_status_string(status));
+    ++backend->stats_.errors;
+  }
+  backend->put_ctx(ctx);
+}
+
+void GatewayBackend::serve(struct reply_ctx *ctx, const char *data,
+                           size_t length) {
+  struct gateway_record record;
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+  size_t pos = 0, out_len = 0, need, reply_len, request_len;
+  uint32_t count = 0;
+  char *out;
+
+  while ((count < ctx->hdr.count) && (length - pos >= sizeof(record))) {
+    memcpy(&record, data + pos, sizeof(record));
+    pos += sizeof(record);
+    if ((record.length > GATEWAY_MAX_FRAME) ||
+        (length - pos < record.length)) {
+      break;
+    }
+
+    /* Room for the largest reply; the buffer is kept with the context */
+    need = out_len + sizeof(record) + GATEWAY_MAX_FRAME;
+    if (need > ctx->out_cap) {
+      out = static_cast<char *>(realloc(ctx->out, 2 * need));
+      if (out == NULL) {
+        break;
+      }
+      ctx->out = out;
+      ctx->out_cap = 2 * need;
+    }
+
+    request_len = record.length;
+    reply_len = handler_(arg_, data + pos, request_len,
+                         ctx->out + out_len + sizeof(record),
+                         GATEWAY_MAX_FRAME);
+    record.length = std::min(reply_len, (size_t)GATEWAY_MAX_FRAME);
+    memcpy(ctx->out + out_len, &record, sizeof(record));
+    out_len += sizeof(record) + record.length;
+    memset(ctx->out + out_len, 0, GATEWAY_PAD(record.length) - record.length);
+    out_len += GATEWAY_PAD(record.length) - record.length;
+
+    pos += std::min(GATEWAY_PAD(request_len), length - pos);
+    ++count;
+  }
+
+  if (count < ctx->hdr.count) {
+    LOG_WARN("gateway backend: answering %u of %u requests of a batch\n",
+             count, ctx->hdr.count);
+    ++stats_.errors;
+  }
+  stats_.requests += count;
+
+  ctx->hdr.count = count;
+  ctx->hdr.service_ns = get_time_ns() - ctx->recv_ns;
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_USER_DATA;
+  param.cb.send = reply_done;
+  param.user_data = ctx;
+  request = ucp_am_send_nbx(ctx->reply_ep, GATEWAY_AM_REPLY, &ctx->hdr,
+                            sizeof(ctx->hdr), ctx->out, out_len, &param);
+  if (!UCS_PTR_IS_PTR(request)) {
+    reply_done(NULL, UCS_PTR_STATUS(request), ctx);
+  }
+}
+
+void GatewayBackend::request_rndv_done(void *request, ucs_status_t status,
+                                       size_t length, void *user_data) {
+  struct reply_ctx *ctx = static_cast<struct reply_ctx *>(user_data);
+  GatewayBackend *backend = ctx->backend;
+
+  if (request != NULL) {
+    ucp_request_free(request);
+  }
+  if (status == UCS_OK) {
+    backend->serve(ctx, ctx->in.data(), length);
+    return;
+  }
+
+  LOG_WARN("gateway backend: receiving a batch failed (%s)\n",
+           ucs_status_string(status));
+  ++backend->stats_.errors;
+  backend->put_ctx(ctx);
+}
+
+ucs_status_t GatewayBackend::request_cb(void *arg, const void *header,
+                                        size_t header_length, void *data,
+                                        size_t length,
+                                        const ucp_am_recv_param_t *param) {
+  GatewayBackend *backend = static_cast<GatewayBackend *>(arg);
+  ucp_request_param_t recv_param;
+  ucs_status_ptr_t request;
+  struct reply_ctx *ctx;
+
+  if ((header_length != sizeof(struct gateway_batch_hdr)) ||
+      !(param->recv_attr & UCP_AM_RECV_ATTR_FIELD_REPLY_EP)) {
+    ++backend->stats_.errors;
+    return UCS_OK;
+  }
+
+  ctx = backend->get_ctx();
+  ctx->reply_ep = param->reply_ep;
+  memcpy(&ctx->hdr, header, sizeof(ctx->hdr));
+  ctx->recv_ns = get_time_ns();
+  ++backend->stats_.batches;
+
+  if (!(param->recv_attr & UCP_AM_RECV_ATTR_FLAG_RNDV)) {
+    backend->serve(ctx, static_cast<const char *>(data), length);
+    return UCS_OK;
+  }
+
+  ctx->in.resize(length);
+  recv_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                            UCP_OP_ATTR_FIELD_USER_DATA |
+                            UCP_OP_ATTR_FIELD_DATATYPE;
+  recv_param.cb.recv_am = request_rndv_done;
+  recv_param.user_data = ctx;
+  recv_param.datatype = ucp_dt_make_contig(1);
+  request = ucp_am_recv_data_nbx(backend->ucp_worker_, data, ctx->in.data(),
+                                 length, &recv_param);
+  if (!UCS_PTR_IS_PTR(request)) {
+    request_rndv_done(NULL, UCS_PTR_STATUS(request), length, ctx);
+  }
+  return UCS_INPROGRESS;
+}
@@ -0,0 +1,280 @@
+#ifndef MYUCXPLAYGROUND_TCP_GATEWAY_H
+#define MYUCXPLAYGROUND_TCP_GATEWAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ucp/api/ucp.h>
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+/**
+ * Wire format of the TCP gateway (TcpGateway / GatewayBackend).
+ *
+ * TCP clients send and receive frames: a struct gateway_frame and `length`
+ * bytes. The gateway packs the frames of many connections into batches,
+ * one active message on GATEWAY_AM_REQUEST per backend: a struct
+ * gateway_batch_hdr header, and as data `count` records, each a struct
+ * gateway_record, its bytes and padding to 8 bytes. The backend answers
+ * with a batch of the same shape on GATEWAY_AM_REPLY, one record per
+ * request and with the request's conn_id, which routes it back.
+ */
+
+#define GATEWAY_AM_REQUEST 22
+#define GATEWAY_AM_REPLY 23
+
+#define GATEWAY_DEFAULT_PORT 13339
+#define GATEWAY_MAX_FRAME (64 * 1024)     /* bytes per frame, both ways */
+#define GATEWAY_DEFAULT_BATCH (16 * 1024) /* bytes per request batch */
+
+struct gateway_frame {
+  uint32_t length; /* bytes that follow */
+};
+
+struct gateway_batch_hdr {
+  uint32_t count;
+  uint32_t reserved;
+  uint64_t send_ns;    /* gateway clock; echoed in the reply */
+  uint64_t service_ns; /* reply only: time the backend held the batch */
+};
+
+struct gateway_record {
+  uint64_t conn_id;
+  uint64_t recv_ns; /* gateway clock, when the frame was read; echoed */
+  uint32_t length;
+  uint32_t reserved;
+};
+
+/**
+ * @brief Answers one request. Writes at most `max_length` bytes to `reply`.
+ *
+ * @return The length of the reply.
+ */
+typedef size_t (*gateway_handler_t)(void *arg, const void *request,
+                                    size_t length, void *reply,
+                                    size_t max_length);
+
+/**
+ * Accepts plain TCP clients and carries their requests to UCX backends.
+ *
+ * One edge-triggered epoll loop serves every client socket, so one thread
+ * holds thousands of connections. Frames read from any connection are
+ * appended to the batch of the connection's backend; a batch is sent when
+ * it reaches `batch_bytes`, and otherwise at the end of each progress()
+ * call, so what arrived together leaves together. Replies are matched to
+ * connections by a connection ID, which also tells replies for a closed
+ * connection from those for a newer one on the same slot.
+ *
+ * A client that sends faster than it reads its replies is not read from
+ * while more than a bounded amount of replies waits to be written to it.
+ *
+ * Time is measured per hop for every reply: waiting in a batch, the UCX
+ * round trip without the backend's share, the backend's service time and
+ * writing back to the client.
+ *
+ * Not thread safe: use it from the thread that progresses `ucp_worker`.
+ */
+class TcpGateway {
+
+public:
+  struct stats {
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t frames;
+    uint64_t bytes_in;
+    uint64_t batches;
+    uint64_t replies;
+    uint64_t bytes_out;
+    uint64_t orphaned;    /* replies for connections that had closed */
+    uint64_t read_pauses; /* clients left unread until replies were out */
+    uint64_t errors;      /* bad frames and replies, failed sends */
+    uint64_t queue_ns;    /* sums over replies, frame read to batch sent */
+    uint64_t ucx_ns;      /* batch sent to reply back, less service */
+    uint64_t service_ns;  /* the backend's share */
+    uint64_t egress_ns;   /* reply back to written to the socket */
+  };
+
+  /**
+   * @param ucp_worker Worker created with UCP_FEATURE_AM.
+   * @param batch_bytes Largest request batch; a larger frame goes in a
+   * batch of its own.
+   */
+  TcpGateway(ucp_worker_h ucp_worker, size_t batch_bytes);
+
+  /**
+   * @brief Waits for batches in flight, then closes every client and the
+   * backend endpoints.
+   */
+  ~TcpGateway();
+
+  TcpGateway(const TcpGateway &) = delete;
+  TcpGateway &operator=(const TcpGateway &) = delete;
+
+  /**
+   * @brief Installs the reply handler and starts accepting clients.
+   *
+   * @return 0 on success, -1 on failure.
+   */
+  int listen(uint16_t port);
+
+  /**
+   * @brief Adds a backend. Connections are spread over backends by slot.
+   */
+  ucs_status_t connect(const ucp_address_t *address);
+
+  /**
+   * @brief Progresses the worker, serves the sockets that are ready and
+   * sends the batches that filled. Does not block.
+   */
+  unsigned progress();
+
+  size_t connections() const { return conns_.size() - free_slots_.size(); }
+
+  /**
+   * @return Request batches sent, and reply batches being received, that
+   * have not completed yet.
+   */
+  size_t inflight() const { return inflight_; }
+
+  const struct stats &get_stats() const { return stats_; }
+
+private:
+  struct conn {
+    int fd;
+    uint64_t id; /* generation << 32 | slot */
+    std::vector<char> rbuf;
+    size_t rlen;
+    std::vector<char> wbuf;
+    size_t woff;
+    uint64_t queued;  /* bytes ever put in wbuf */
+    uint64_t written; /* bytes ever written */
+    bool paused;      /* not read from until wbuf is written */
+    bool touched;     /* got replies from the batch being handled */
+    /* end of each reply in the stream and when it came back */
+    std::deque<std::pair<uint64_t, uint64_t>> pending;
+  };
+
+  struct batch {
+    TcpGateway *gateway;
+    struct gateway_batch_hdr hdr;
+    std::vector<char> data;
+  };
+
+  struct backend {
+    ucp_ep_h ep;
+    struct batch *open; /* being filled, or NULL */
+  };
+
+  static ucs_status_t reply_cb(void *arg, const void *header,
+                               size_t header_length, void *data,
+                               size_t length,
+                               const ucp_am_recv_param_t *param);
+  static void reply_rndv_done(void *request, ucs_status_t status,
+                              size_t length, void *user_data);
+  static void batch_done(void *request, ucs_status_t status,
+                         void *user_data);
+
+  void accept_all();
+  void read_conn(struct conn *conn);
+  void write_conn(struct conn *conn);
+  void set_reading(struct conn *conn, bool on);
+  void close_conn(struct conn *conn);
+  void add_frame(struct conn *conn, const char *data, uint32_t length,
+                 uint64_t now);
+  void send_batch(struct backend *backend);
+  void handle_replies(const struct gateway_batch_hdr *hdr,
+                      const char *data, size_t length);
+
+  ucp_worker_h ucp_worker_;
+  size_t batch_bytes_;
+  bool handler_set_;
+  int listen_fd_;
+  int epoll_fd_;
+  std::vector<struct conn *> conns_; /* by slot */
+  std::vector<uint32_t> free_slots_;
+  std::vector<struct backend> backends_;
+  std::vector<struct batch *> free_batches_;
+  size_t inflight_;
+  struct stats stats_;
+};
+
+/**
+ * Serves request batches from a TcpGateway with a handler.
+ *
+ * Batches are answered inside the AM callback, or when the data of a
+ * rendezvous batch has arrived. Not thread safe: use it from the thread
+ * that progresses `ucp_worker`.
+ */
+class GatewayBackend {
+
+public:
+  struct stats {
+    uint64_t batches;
+    uint64_t requests;
+    uint64_t errors; /* malformed batches and failed replies */
+  };
+
+  /**
+   * @param ucp_worker Worker created with UCP_FEATURE_AM.
+   * @param handler Called for each request.
+   */
+  GatewayBackend(ucp_worker_h ucp_worker, gateway_handler_t handler,
+                 void *arg);
+
+  /**
+   * @brief Removes the handler and waits for replies in flight.
+   */
+  ~GatewayBackend();
+
+  GatewayBackend(const GatewayBackend &) = delete;
+  GatewayBackend &operator=(const GatewayBackend &) = delete;
+
+  /**
+   * @brief Installs the request handler on the worker.
+   *
+   * @return UCS_OK on success.
+   */
+  ucs_status_t start();
+
+  /**
+   * @return Batches received or replied to and not completed yet.
+   */
+  size_t inflight() const { return inflight_; }
+
+  const struct stats &get_stats() const { return stats_; }
+
+private:
+  struct reply_ctx {
+    GatewayBackend *backend;
+    ucp_ep_h reply_ep;
+    struct gateway_batch_hdr hdr;
+    uint64_t recv_ns;
+    std::vector<char> in; /* rendezvous request data */
+    char *out;            /* reply data, kept with the context */
+    size_t out_cap;
+  };
+
+  static ucs_status_t request_cb(void *arg, const void *header,
+                                 size_t header_length, void *data,
+                                 size_t length,
+                                 const ucp_am_recv_param_t *param);
+  static void request_rndv_done(void *request, ucs_status_t status,
+                                size_t length, void *user_data);
+  static void reply_done(void *request, ucs_status_t status,
+                         void *user_data);
+
+  struct reply_ctx *get_ctx();
+  void put_ctx(struct reply_ctx *ctx);
+  void serve(struct reply_ctx *ctx, const char *data, size_t length);
+
+  ucp_worker_h ucp_worker_;
+  gateway_handler_t handler_;
+  void *arg_;
+  bool handler_set_;
+  std::vector<struct reply_ctx *> free_ctxs_;
+  size_t inflight_;
+  struct stats stats_;
+};
+
+#endif // MYUCXPLAYGROUND_TCP_GATEWAY_H
@@ -0,0 +1,17 @@
+#ifndef MYUCXPLAYGROUND_TIME_UTILS_H
+#define MYUCXPLAYGROUND_TIME_UTILS_H
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ */
+static inline uint64_t get_time_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#endif // MYUCXPLAYGROUND_TIME_UTILS_H
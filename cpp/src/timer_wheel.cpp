@@ -0,0 +1,155 @@
+#include "timer_wheel.h"
+
+#include <string.h>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/* Ticks covered by levels [0, level) */
+#define TIMER_WHEEL_SPAN(_level) (1ull << (TIMER_WHEEL_BITS * (_level)))
+
+TimerWheel::TimerWheel(uint64_t tick_ns, uint64_t now_ns)
+    : tick_ns_((tick_ns > 0) ? tick_ns : 1), now_tick_(now_ns / tick_ns_),
+      pending_(0) {
+  memset(slots_, 0, sizeof(slots_));
+}
+
+void TimerWheel::insert(struct wheel_timer *timer) {
+  struct wheel_timer **head;
+  uint64_t delta;
+  int level;
+
+  /* Slot now_tick_ has already been run, the earliest one left is next */
+  if (timer->expires <= now_tick_) {
+    timer->expires = now_tick_ + 1;
+  }
+
+  delta = timer->expires - now_tick_;
+  if (delta >= TIMER_WHEEL_SPAN(TIMER_WHEEL_LEVELS)) {
+    /* Out of range: park it where it is re-hashed before it is due */
+    delta = TIMER_WHEEL_SPAN(TIMER_WHEEL_LEVELS) - 1;
+  }
+
+  for (level = 0; level < TIMER_WHEEL_LEVELS - 1; ++level) {
+    if (delta < TIMER_WHEEL_SPAN(level + 1)) {
+      break;
+    }
+  }
+
+  head = &slots_[level][((now_tick_ + delta) >> (TIMER_WHEEL_BITS * level)) &
+                        TIMER_WHEEL_MASK];
+  timer->next = *head;
+  if (timer->next != NULL) {
+    timer->next->pprev = &timer->next;
+  }
+  timer->pprev = head;
+  *head = timer;
+}
+
+void TimerWheel::add(struct wheel_timer *timer, uint64_t deadline_ns) {
+  remove(timer);
+  timer->expires = (deadline_ns + tick_ns_ - 1) / tick_ns_;
+  insert(timer);
+  ++pending_;
+}
+
+void TimerWheel::remove(struct wheel_timer *timer) {
+  if (!wheel_timer_armed(timer)) {
+    return;
+  }
+
+  *timer->pprev = timer->next;
+  if (timer->next != NULL) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+  --pending_;
+}
+
+void TimerWheel::cascade(int level, unsigned index) {
+  struct wheel_timer *timer = slots_[level][index];
+  struct wheel_timer *next;
+
+  slots_[level][index] = NULL;
+  for (; timer != NULL; timer = next) {
+    next = timer->next;
+    insert(timer);
+  }
+}
+
+bool TimerWheel::level_empty(int level) const {
+  for (unsigned index = 0; index < TIMER_WHEEL_SLOTS; ++index) {
+    if (slots_[level][index] != NULL) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* First tick in (now_tick_, target] with a slot to run or cascade, or
+ * `target` if there is none, so that an idle stretch is crossed in a few
+ * steps per level instead of one tick at a time */
+uint64_t TimerWheel::next_tick(uint64_t target) const {
+  uint64_t tick, end;
+  int level;
+
+  for (level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+    /* The levels below are empty, so only this level's slot boundaries up
+     * to the next boundary of the level above can have work */
+    tick = (now_tick_ | (TIMER_WHEEL_SPAN(level) - 1)) + 1;
+    end = (level < TIMER_WHEEL_LEVELS - 1)
+              ? (now_tick_ | (TIMER_WHEEL_SPAN(level + 1) - 1)) + 1
+              : UINT64_MAX;
+    for (; (tick < end) && (tick <= target);
+         tick += TIMER_WHEEL_SPAN(level)) {
+      if (slots_[level][(tick >> (TIMER_WHEEL_BITS * level)) &
+                        TIMER_WHEEL_MASK] != NULL) {
+        return tick;
+      }
+    }
+
+    if (tick > target) {
+      break;
+    } else if (!level_empty(level)) {
+      /* Timers of a later round of this level: cascade the level above */
+      return end;
+    }
+  }
+
+  return target;
+}
+
+size_t TimerWheel::advance(uint64_t now_ns) {
+  uint64_t target = now_ns / tick_ns_;
+  struct wheel_timer *timer;
+  size_t fired = 0;
+  int level;
+
+  while (now_tick_ < target) {
+    if (pending_ == 0) {
+      now_tick_ = target;
+      break;
+    }
+
+    now_tick_ = next_tick(target);
+
+    /* When a level wraps, spread the next slot of the level above over it */
+    for (level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+      if (now_tick_ & (TIMER_WHEEL_SPAN(level) - 1)) {
+        break;
+      }
+      cascade(level, (now_tick_ >> (TIMER_WHEEL_BITS * level)) &
+                         TIMER_WHEEL_MASK);
+    }
+
+    /* Unlink one at a time: a callback may remove or re-add other timers */
+    while ((timer = slots_[0][now_tick_ & TIMER_WHEEL_MASK]) != NULL) {
+      remove(timer);
+      ++fired;
+      timer->cb(timer, timer->arg);
+    }
+  }
+
+  return fired;
+}
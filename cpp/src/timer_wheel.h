@@ -0,0 +1,103 @@
+#ifndef MYUCXPLAYGROUND_TIMER_WHEEL_H
+#define MYUCXPLAYGROUND_TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Hierarchical timer wheel.
+ *
+ * Four levels of 64 slots; a slot of level L spans 64^L ticks. A timer is
+ * hashed into the lowest level whose span covers its remaining time and
+ * moves down a level each time the level below wraps, so adding, removing
+ * and expiring timers are all O(1) no matter how many are pending. Timers
+ * further out than 64^4 ticks are parked in the last slot and re-hashed when
+ * they come round.
+ *
+ * The wheel does not keep time by itself: the owner calls advance() from its
+ * progress loop. Not thread safe.
+ */
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct wheel_timer;
+
+typedef void (*wheel_timer_cb_t)(struct wheel_timer *timer, void *arg);
+
+/**
+ * Caller-owned timer, linked into the wheel while armed. Must not move or be
+ * freed while armed.
+ */
+struct wheel_timer {
+  struct wheel_timer *next;
+  struct wheel_timer **pprev; /* NULL while not armed */
+  uint64_t expires;           /* in ticks */
+  wheel_timer_cb_t cb;
+  void *arg;
+};
+
+/**
+ * @brief Prepares a timer for use; it starts disarmed.
+ */
+static inline void wheel_timer_init(struct wheel_timer *timer,
+                                    wheel_timer_cb_t cb, void *arg) {
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->expires = 0;
+  timer->cb = cb;
+  timer->arg = arg;
+}
+
+static inline bool wheel_timer_armed(const struct wheel_timer *timer) {
+  return timer->pprev != NULL;
+}
+
+class TimerWheel {
+
+public:
+  /**
+   * @param tick_ns Resolution of the wheel.
+   * @param now_ns Current time, in the same clock later passed to advance().
+   */
+  TimerWheel(uint64_t tick_ns, uint64_t now_ns);
+
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+
+  /**
+   * @brief Arms `timer` to fire at `deadline_ns`, rounded up to a tick.
+   *
+   * A timer that is already armed is re-armed.
+   */
+  void add(struct wheel_timer *timer, uint64_t deadline_ns);
+
+  /**
+   * @brief Disarms `timer`; does nothing if it is not armed.
+   */
+  void remove(struct wheel_timer *timer);
+
+  /**
+   * @brief Moves the wheel to `now_ns` and runs the callbacks of every
+   * timer that expired on the way. Callbacks may add or remove timers.
+   *
+   * @return The number of timers fired.
+   */
+  size_t advance(uint64_t now_ns);
+
+  size_t pending() const { return pending_; }
+
+private:
+  void insert(struct wheel_timer *timer);
+  void cascade(int level, unsigned index);
+  bool level_empty(int level) const;
+  uint64_t next_tick(uint64_t target) const;
+
+  uint64_t tick_ns_;
+  uint64_t now_tick_;
+  size_t pending_;
+  struct wheel_timer *slots_[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+#endif // MYUCXPLAYGROUND_TIMER_WHEEL_H
@@ -0,0 +1,245 @@
+#include "topology.h"
+#include "logger.h"
+#include "memory_utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TOPOLOGY_SYSFS_CPU "/sys/devices/system/cpu"
+#define TOPOLOGY_SYSFS_NODE "/sys/devices/system/node"
+
+static int topology_read_line(const char *path, char *buf, size_t size) {
+  FILE *file = fopen(path, "r");
+  int ret = -1;
+
+  if (file == NULL) {
+    return -1;
+  }
+
+  if (fgets(buf, size, file) != NULL) {
+    buf[strcspn(buf, "\n")] = '\0';
+    ret = 0;
+  }
+
+  fclose(file);
+  return ret;
+}
+
+static int topology_read_int(const char *path) {
+  char buf[32];
+
+  if (topology_read_line(path, buf, sizeof(buf)) != 0) {
+    return -1;
+  }
+
+  return atoi(buf);
+}
+
+int topology_parse_cpulist(const char *str, std::vector<int> *cpus) {
+  const char *p = str;
+  char *end;
+  long first, last;
+
+  cpus->clear();
+  while (*p != '\0') {
+    first = strtol(p, &end, 10);
+    if ((end == p) || (first < 0)) {
+      return -1;
+    }
+
+    last = first;
+    p = end;
+    if (*p == '-') {
+      ++p;
+      last = strtol(p, &end, 10);
+      if ((end == p) || (last < first)) {
+        return -1;
+      }
+      p = end;
+    }
+
+    for (long cpu = first; cpu <= last; ++cpu) {
+      cpus->push_back((int)cpu);
+    }
+
+    if (*p == ',') {
+      ++p;
+    } else if (*p != '\0') {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int topology_discover(struct cpu_topology *topo) {
+  char path[256];
+  char buf[4096];
+  std::vector<int> online, node_cpus;
+
+  if ((topology_read_line(TOPOLOGY_SYSFS_CPU "/online", buf, sizeof(buf)) !=
+       0) ||
+      (topology_parse_cpulist(buf, &online) != 0) || online.empty()) {
+    fprintf(stderr, "Failed to read " TOPOLOGY_SYSFS_CPU "/online\n");
+    return -1;
+  }
+
+  topo->num_cpus = online.back() + 1;
+  topo->cpu_node.assign(topo->num_cpus, -1);
+  topo->cpu_package.assign(topo->num_cpus, -1);
+  topo->cpu_core.assign(topo->num_cpus, -1);
+  topo->node_cpus.clear();
+
+  for (int cpu : online) {
+    snprintf(path, sizeof(path),
+             TOPOLOGY_SYSFS_CPU "/cpu%d/topology/physical_package_id", cpu);
+    topo->cpu_package[cpu] = topology_read_int(path);
+    snprintf(path, sizeof(path), TOPOLOGY_SYSFS_CPU "/cpu%d/topology/core_id",
+             cpu);
+    topo->cpu_core[cpu] = topology_read_int(path);
+  }
+
+  for (int node = 0;; ++node) {
+    snprintf(path, sizeof(path), TOPOLOGY_SYSFS_NODE "/node%d/cpulist", node);
+    if (topology_read_line(path, buf, sizeof(buf)) != 0) {
+      break;
+    }
+
+    /* A memory-only node has an empty cpulist */
+    if (topology_parse_cpulist(buf, &node_cpus) != 0) {
+      node_cpus.clear();
+    }
+
+    for (int cpu : node_cpus) {
+      if (cpu < topo->num_cpus) {
+        topo->cpu_node[cpu] = node;
+      }
+    }
+    topo->node_cpus.push_back(node_cpus);
+  }
+
+  if (topo->node_cpus.empty()) {
+    topo->node_cpus.push_back(online);
+    for (int cpu : online) {
+      topo->cpu_node[cpu] = 0;
+    }
+  }
+
+  topo->num_nodes = (int)topo->node_cpus.size();
+  return 0;
+}
+
+void topology_print(const struct cpu_topology *topo, FILE *stream) {
+  fprintf(stream, "%d CPUs, %d NUMA nodes\n", topo->num_cpus,
+          topo->num_nodes);
+  for (size_t node = 0; node < topo->node_cpus.size(); ++node) {
+    fprintf(stream, "  node %zu:", node);
+    for (int cpu : topo->node_cpus[node]) {
+      /* A node may list CPUs above the highest online one */
+      if ((cpu < 0) || ((size_t)cpu >= topo->cpu_package.size()) ||
+          ((size_t)cpu >= topo->cpu_core.size())) {
+        fprintf(stream, " %d(offline)", cpu);
+        continue;
+      }
+      fprintf(stream, " %d(pkg %d core %d)", cpu, topo->cpu_package[cpu],
+              topo->cpu_core[cpu]);
+    }
+    fprintf(stream, "\n");
+  }
+}
+
+int topology_cpu_node(const struct cpu_topology *topo, int cpu) {
+  if ((cpu < 0) || (cpu >= topo->num_cpus)) {
+    return -1;
+  }
+
+  return topo->cpu_node[cpu];
+}
+
+int topology_pin_self(int cpu) {
+  cpu_set_t cpus;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+int topology_apply_affinity(int progress_cpu, const char *app_cpus) {
+  struct cpu_topology topo;
+  std::vector<int> cpus;
+  cpu_set_t app_set;
+  int node;
+  int ret;
+
+  if ((progress_cpu < 0) && (app_cpus == NULL)) {
+    return 0;
+  }
+
+  if (topology_discover(&topo) != 0) {
+    return -1;
+  }
+
+  CPU_ZERO(&app_set);
+  if (app_cpus != NULL) {
+    if (topology_parse_cpulist(app_cpus, &cpus) != 0) {
+      fprintf(stderr, "Invalid application CPU list \"%s\"\n", app_cpus);
+      return -1;
+    }
+  } else {
+    /* Keep helper threads off the progress core by default */
+    for (int cpu = 0; cpu < topo.num_cpus; ++cpu) {
+      if ((cpu != progress_cpu) && (topo.cpu_node[cpu] >= 0)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+
+  for (int cpu : cpus) {
+    if (topology_cpu_node(&topo, cpu) < 0) {
+      fprintf(stderr, "CPU %d is not online\n", cpu);
+      return -1;
+    }
+    CPU_SET(cpu, &app_set);
+  }
+  if (!cpus.empty()) {
+    log_set_affinity(&app_set);
+  }
+
+  if (progress_cpu >= 0) {
+    node = topology_cpu_node(&topo, progress_cpu);
+    if (node < 0) {
+      fprintf(stderr, "Progress CPU %d is not online\n", progress_cpu);
+      return -1;
+    }
+
+    ret = topology_pin_self(progress_cpu);
+    if (ret != 0) {
+      fprintf(stderr, "Failed to pin progress thread to CPU %d: %s\n",
+              progress_cpu, strerror(ret));
+      return -1;
+    }
+
+    /* Buffers follow the progress thread unless a node was forced */
+    if (test_mem_numa_node < 0) {
+      test_mem_numa_node = node;
+    }
+
+    LOG_INFO("progress thread pinned to CPU %d (NUMA node %d)\n",
+             progress_cpu, node);
+  }
+
+  return 0;
+}
+
+void topology_set_worker_cpu(ucp_worker_params_t *worker_params, int cpu) {
+  if (cpu < 0) {
+    return;
+  }
+
+  worker_params->field_mask |= UCP_WORKER_PARAM_FIELD_CPU_MASK;
+  UCS_CPU_ZERO(&worker_params->cpu_mask);
+  UCS_CPU_SET(cpu, &worker_params->cpu_mask);
+}
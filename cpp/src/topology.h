@@ -0,0 +1,74 @@
+#ifndef MYUCXPLAYGROUND_TOPOLOGY_H
+#define MYUCXPLAYGROUND_TOPOLOGY_H
+
+#include <sched.h>
+#include <ucp/api/ucp.h>
+
+#include <vector>
+
+/**
+ * CPU and NUMA layout of the host, as reported by /sys/devices/system/cpu and
+ * /sys/devices/system/node. Vectors are indexed by logical CPU id; entries of
+ * offline CPUs are -1.
+ */
+struct cpu_topology {
+  int num_cpus;
+  int num_nodes;
+  std::vector<int> cpu_node;
+  std::vector<int> cpu_package;
+  std::vector<int> cpu_core;
+  std::vector<std::vector<int>> node_cpus;
+};
+
+/**
+ * @brief Reads the host topology from sysfs.
+ *
+ * Hosts without /sys/devices/system/node are reported as a single node that
+ * holds every online CPU.
+ *
+ * @param topo The structure to fill.
+ * @return 0 on success, -1 if the online CPU list cannot be read.
+ */
+int topology_discover(struct cpu_topology *topo);
+
+void topology_print(const struct cpu_topology *topo, FILE *stream);
+
+/**
+ * @brief Parses a sysfs style CPU list such as "0-3,8,10-11".
+ *
+ * @return 0 on success, -1 on a malformed list.
+ */
+int topology_parse_cpulist(const char *str, std::vector<int> *cpus);
+
+/**
+ * @brief Returns the NUMA node of a logical CPU, or -1 if unknown.
+ */
+int topology_cpu_node(const struct cpu_topology *topo, int cpu);
+
+/**
+ * @brief Pins the calling thread to a single CPU.
+ *
+ * @return 0 on success, an errno value otherwise.
+ */
+int topology_pin_self(int cpu);
+
+/**
+ * @brief Applies the placement requested on the command line.
+ *
+ * Pins the calling (worker-progress) thread to `progress_cpu`, binds later
+ * host buffer allocations to that CPU's NUMA node, and moves the logger
+ * thread onto `app_cpus`.
+ * A negative `progress_cpu` or NULL `app_cpus` leaves that part untouched.
+ *
+ * @return 0 on success, -1 on invalid CPU numbers.
+ */
+int topology_apply_affinity(int progress_cpu, const char *app_cpus);
+
+/**
+ * @brief Restricts a UCP worker's resources to `cpu` via its CPU mask.
+ *
+ * Does nothing when `cpu` is negative.
+ */
+void topology_set_worker_cpu(ucp_worker_params_t *worker_params, int cpu);
+
+#endif // MYUCXPLAYGROUND_TOPOLOGY_H
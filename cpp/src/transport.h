@@ -0,0 +1,185 @@
+#ifndef MYUCXPLAYGROUND_TRANSPORT_H
+#define MYUCXPLAYGROUND_TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ucp/api/ucp.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+class UcpClient;
+class UcpServer;
+
+/**
+ * @brief Completion of a send or receive. `length` is the size of the
+ * message received, or sent.
+ */
+typedef void (*transport_cb_t)(void *arg, ucs_status_t status,
+                               size_t length);
+
+/**
+ * A connection between two peers that carries messages both ways, in
+ * order, so the same exchange can run over UCX and over plain sockets.
+ *
+ * send() and recv() never block. When they return UCS_OK their callback
+ * is called exactly once, possibly before they return, and until then the
+ * buffer belongs to the transport; progress() completes what they could
+ * not. Receives take messages in the order they were posted, and a
+ * message larger than its buffer completes with UCS_ERR_MESSAGE_TRUNCATED.
+ *
+ * Not thread safe: use a transport from one thread.
+ */
+class Transport {
+
+public:
+  virtual ~Transport() {}
+
+  virtual const char *name() const = 0;
+
+  /**
+   * @brief Connects to the peer: accepts one on `port` when `server` is
+   * NULL, and connects to `server` otherwise. Blocks until connected.
+   *
+   * @return 0 on success, -1 on failure.
+   */
+  virtual int connect(const char *server, uint16_t port) = 0;
+
+  virtual ucs_status_t send(const void *buffer, size_t length,
+                            transport_cb_t cb, void *arg) = 0;
+
+  virtual ucs_status_t recv(void *buffer, size_t length, transport_cb_t cb,
+                            void *arg) = 0;
+
+  virtual unsigned progress() = 0;
+
+  /**
+   * @brief Cancels the receives posted, waits for the sends in flight and
+   * for the peer to close too, then disconnects.
+   *
+   * @return 0 on success, -1 on failure.
+   */
+  virtual int close() = 0;
+};
+
+/**
+ * Transport over UCP tag matching on one tag, on top of UcpClient and
+ * UcpServer: the accepting side sends its worker address over a socket
+ * from connect_server(), as run_ucp_server does, and UcpServer::accept()
+ * takes the client's address message from UcpClient::connect(). Both then
+ * exchange messages on the endpoint that wire-up left them with, and close
+ * it through the class that opened it. The socket is kept for close().
+ */
+class UcpTagTransport : public Transport {
+
+public:
+  /**
+   * @param ucp_worker Worker of a context from initialize_ucp_params(),
+   * with UCP_FEATURE_TAG; only this transport may receive tagged messages
+   * on it.
+   */
+  explicit UcpTagTransport(ucp_worker_h ucp_worker);
+  ~UcpTagTransport() override;
+
+  UcpTagTransport(const UcpTagTransport &) = delete;
+  UcpTagTransport &operator=(const UcpTagTransport &) = delete;
+
+  const char *name() const override { return "ucp"; }
+  int connect(const char *server, uint16_t port) override;
+  ucs_status_t send(const void *buffer, size_t length, transport_cb_t cb,
+                    void *arg) override;
+  ucs_status_t recv(void *buffer, size_t length, transport_cb_t cb,
+                    void *arg) override;
+  unsigned progress() override { return ucp_worker_progress(ucp_worker_); }
+  int close() override;
+
+private:
+  struct op {
+    UcpTagTransport *transport;
+    transport_cb_t cb;
+    void *arg;
+    size_t length;
+    void *request;
+  };
+
+  static void send_done(void *request, ucs_status_t status, void *user_data);
+  static void recv_done(void *request, ucs_status_t status,
+                        const ucp_tag_recv_info_t *info, void *user_data);
+
+  struct op *get_op(transport_cb_t cb, void *arg, size_t length);
+  void put_op(struct op *op);
+  void cancel_recvs();
+  void disconnect(bool failed);
+
+  ucp_worker_h ucp_worker_;
+  UcpClient *client_; /* the connecting side, or NULL */
+  UcpServer *server_; /* the accepting side, or NULL */
+  ucp_ep_h ep_;       /* theirs, while connected */
+  ucp_address_t *local_addr_;
+  ucp_address_t *peer_addr_;
+  int oob_sock_;
+  std::deque<struct op *> recvs_; /* posted, in order */
+  std::vector<struct op *> free_ops_;
+  size_t pending_; /* sends and receives */
+};
+
+/**
+ * Transport over a non-blocking stream socket driven by epoll: TCP from
+ * connect_server() / connect_client(), or a Unix-domain socket when a path
+ * is given. Each message is a uint64_t length and its bytes. Queued
+ * messages go out together in one writev(); small ones come in together
+ * through a staging buffer, and large ones straight into the posted buffer.
+ */
+class SocketTransport : public Transport {
+
+public:
+  /**
+   * @param unix_path Socket path for a Unix-domain socket, NULL for TCP.
+   */
+  explicit SocketTransport(const char *unix_path);
+  ~SocketTransport() override;
+
+  SocketTransport(const SocketTransport &) = delete;
+  SocketTransport &operator=(const SocketTransport &) = delete;
+
+  const char *name() const override {
+    return unix_path_.empty() ? "tcp" : "unix";
+  }
+  int connect(const char *server, uint16_t port) override;
+  ucs_status_t send(const void *buffer, size_t length, transport_cb_t cb,
+                    void *arg) override;
+  ucs_status_t recv(void *buffer, size_t length, transport_cb_t cb,
+                    void *arg) override;
+  unsigned progress() override;
+  int close() override;
+
+private:
+  struct op {
+    transport_cb_t cb;
+    void *arg;
+    char *buffer;
+    size_t length; /* of the buffer */
+    uint64_t hdr;  /* message length on the wire */
+    size_t done;   /* bytes of header and message moved so far */
+  };
+
+  unsigned write_some();
+  unsigned read_some();
+  void fail(ucs_status_t status);
+
+  std::string unix_path_;
+  int fd_;
+  int epoll_fd_;
+  bool readable_;
+  bool writable_;
+  bool busy_;   /* writing or reading; callbacks only queue */
+  bool failed_; /* the connection broke, or close() was called */
+  std::deque<struct op> sends_;
+  std::deque<struct op> recvs_;
+  std::vector<char> rbuf_;
+  size_t rpos_;
+  size_t rend_;
+};
+
+#endif // MYUCXPLAYGROUND_TRANSPORT_H
@@ -0,0 +1,447 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucp/api/ucp.h>
+#include <unistd.h> /* getopt */
+
+#include <algorithm>
+#include <vector>
+
+#include "common_utils.h"
+#include "logger.h"
+#include "time_utils.h"
+#include "transport.h"
+#include "ucx_utils.h"
+
+/**
+ * Runs the same workloads over each Transport backend, between a server
+ * and a client thread, and prints the results side by side: UCP tag
+ * matching, and the non-blocking socket baseline over TCP and over a
+ * Unix-domain socket. Where a socket backend wins, UCX is not earning its
+ * keep for that size.
+ *
+ * For each message size:
+ *   pingpong  the client sends a message and the server echoes it back,
+ *             -n times; round trip p50 and p99.
+ *   stream    the client sends -n messages with -w in flight and the
+ *             server acknowledges the last with one byte; rate and
+ *             bandwidth.
+ */
+
+#define TP_DEFAULT_COUNT 10000
+#define TP_DEFAULT_WINDOW 32
+#define TP_DEFAULT_PORT 13340
+#define TP_DEFAULT_UNIX_PATH "/tmp/run_transport.sock"
+#define TP_WARMUP 100           /* pingpongs before measuring each size */
+#define TP_CONNECT_TRIES 500    /* client waits for the server to listen */
+#define TP_CONNECT_DELAY_US 10000
+
+typedef enum { TP_BACKEND_UCP, TP_BACKEND_TCP, TP_BACKEND_UNIX } tp_backend_t;
+
+static const char *tp_backend_names[] = {"ucp", "tcp", "unix"};
+
+/* One end of a run; the callbacks count into it */
+struct tp_peer {
+  Transport *transport;
+  std::vector<char> buffer;
+  long completed;
+  long errors;
+  size_t last_length;
+};
+
+struct tp_result {
+  tp_backend_t backend;
+  size_t size;
+  double p50_us;
+  double p99_us;
+  double msg_rate;
+  double gbps;
+};
+
+struct tp_bench {
+  struct bench_side server_side;
+  struct bench_side client_side;
+  bool ucx_ready;
+  tp_backend_t backend;
+  std::vector<size_t> sizes;
+  long count;
+  unsigned window;
+  uint16_t port;
+  const char *unix_path;
+  std::vector<struct tp_result> results;
+  int ret[2]; /* server, client */
+};
+
+static void print_tp_usage() {
+  fprintf(stderr, "Usage: run_transport [parameters]\n");
+  fprintf(stderr, "\nParameters are:\n");
+  fprintf(stderr, "  -m <backend>  ucp, tcp or unix; repeat for several "
+                  "(default: all)\n");
+  fprintf(stderr, "  -s <size>     Message size; repeat for several "
+                  "(default: 8, 4096, 65536, 1048576)\n");
+  fprintf(stderr, "  -n <count>    Messages per workload (default:%d)\n",
+          TP_DEFAULT_COUNT);
+  fprintf(stderr, "  -w <count>    Stream messages in flight (default:%d)\n",
+          TP_DEFAULT_WINDOW);
+  fprintf(stderr, "  -p <port>     Port (default:%d)\n", TP_DEFAULT_PORT);
+  fprintf(stderr, "  -u <path>     Unix-domain socket path (default:%s)\n",
+          TP_DEFAULT_UNIX_PATH);
+}
+
+static Transport *tp_create(struct tp_bench *bench, struct bench_side *side) {
+  switch (bench->backend) {
+  case TP_BACKEND_UCP:
+    return new UcpTagTransport(side->ucp_worker);
+  case TP_BACKEND_TCP:
+    return new SocketTransport(NULL);
+  default:
+    return new SocketTransport(bench->unix_path);
+  }
+}
+
+static void tp_done(void *arg, ucs_status_t status, size_t length) {
+  struct tp_peer *peer = (struct tp_peer *)arg;
+
+  if (status != UCS_OK) {
+    LOG_ERROR("transport bench: %s operation failed (%s)\n",
+              peer->transport->name(), ucs_status_string(status));
+    ++peer->errors;
+  }
+  peer->last_length = length;
+  ++peer->completed;
+}
+
+/* Progresses until `target` operations have completed, or one failed */
+static int tp_wait(struct tp_peer *peer, long target) {
+  while ((peer->completed < target) && (peer->errors == 0)) {
+    peer->transport->progress();
+  }
+
+  return (peer->errors == 0) ? 0 : -1;
+}
+
+/* Posts one operation and waits for it */
+static int tp_send(struct tp_peer *peer, const void *buffer, size_t length) {
+  long target = peer->completed + 1; /* it may complete right away */
+
+  if (peer->transport->send(buffer, length, tp_done, peer) != UCS_OK) {
+    return -1;
+  }
+
+  return tp_wait(peer, target);
+}
+
+static int tp_recv(struct tp_peer *peer, void *buffer, size_t length) {
+  long target = peer->completed + 1;
+
+  if (peer->transport->recv(buffer, length, tp_done, peer) != UCS_OK) {
+    return -1;
+  }
+
+  return tp_wait(peer, target);
+}
+
+static int tp_serve_size(struct tp_bench *bench, struct tp_peer *peer,
+                         size_t size) {
+  std::vector<char> slots((size_t)bench->window * size);
+  long i, posted, base;
+  char ack = 1;
+
+  for (i = 0; i < TP_WARMUP + bench->count; ++i) {
+    if ((tp_recv(peer, peer->buffer.data(), size) != 0) ||
+        (tp_send(peer, peer->buffer.data(), peer->last_length) != 0)) {
+      return -1;
+    }
+  }
+
+  /* Keep a window of receives posted, in turn over the slots */
+  base = peer->completed;
+  posted = 0;
+  while (peer->completed - base < bench->count) {
+    while ((posted < bench->count) &&
+           (posted - (peer->completed - base) < (long)bench->window)) {
+      if (peer->transport->recv(slots.data() + (posted % bench->window) *
+                                                   size,
+                                size, tp_done, peer) != UCS_OK) {
+        return -1;
+      }
+      ++posted;
+    }
+    if (peer->errors != 0) {
+      return -1;
+    }
+    peer->transport->progress();
+  }
+
+  return tp_send(peer, &ack, sizeof(ack));
+}
+
+static int tp_run_size(struct tp_bench *bench, struct tp_peer *peer,
+                       size_t size) {
+  std::vector<uint64_t> rtt_ns(bench->count);
+  struct tp_result result;
+  uint64_t start_ns, elapsed_ns;
+  long i, posted, base;
+  char ack;
+
+  for (i = 0; i < TP_WARMUP + bench->count; ++i) {
+    start_ns = get_time_ns();
+    if ((tp_send(peer, peer->buffer.data(), size) != 0) ||
+        (tp_recv(peer, peer->buffer.data(), size) != 0)) {
+      return -1;
+    }
+    if (peer->last_length != size) {
+      LOG_ERROR("transport bench: echoed %lu bytes, not %lu\n",
+                peer->last_length, size);
+      return -1;
+    }
+    if (i >= TP_WARMUP) {
+      rtt_ns[i - TP_WARMUP] = get_time_ns() - start_ns;
+    }
+  }
+
+  start_ns = get_time_ns();
+  base = peer->completed;
+  posted = 0;
+  while (peer->completed - base < bench->count) {
+    while ((posted < bench->count) &&
+           (posted - (peer->completed - base) < (long)bench->window)) {
+      if (peer->transport->send(peer->buffer.data(), size, tp_done, peer) !=
+          UCS_OK) {
+        return -1;
+      }
+      ++posted;
+    }
+    if (peer->errors != 0) {
+      return -1;
+    }
+    peer->transport->progress();
+  }
+  if (tp_recv(peer, &ack, sizeof(ack)) != 0) {
+    return -1;
+  }
+  elapsed_ns = get_time_ns() - start_ns;
+
+  std::sort(rtt_ns.begin(), rtt_ns.end());
+  result.backend = bench->backend;
+  result.size = size;
+  result.p50_us = rtt_ns[(size_t)(0.5 * (rtt_ns.size() - 1))] / 1e3;
+  result.p99_us = rtt_ns[(size_t)(0.99 * (rtt_ns.size() - 1))] / 1e3;
+  result.msg_rate = bench->count / (elapsed_ns / 1e9);
+  result.gbps = bench->count * size / (double)elapsed_ns;
+  bench->results.push_back(result);
+  return 0;
+}
+
+static void *tp_server_thread(void *arg) {
+  struct tp_bench *bench = (struct tp_bench *)arg;
+  struct tp_peer peer;
+  int ret;
+
+  peer.transport = tp_create(bench, &bench->server_side);
+  peer.buffer.resize(*std::max_element(bench->sizes.begin(),
+                                       bench->sizes.end()));
+  peer.completed = 0;
+  peer.errors = 0;
+  peer.last_length = 0;
+
+  ret = peer.transport->connect(NULL, bench->port);
+  for (size_t size : bench->sizes) {
+    if (ret == 0) {
+      ret = tp_serve_size(bench, &peer, size);
+    }
+  }
+  if ((peer.transport->close() != 0) && (ret == 0)) {
+    ret = -1;
+  }
+
+  delete peer.transport;
+  bench->ret[0] = ret;
+  return NULL;
+}
+
+static void *tp_client_thread(void *arg) {
+  struct tp_bench *bench = (struct tp_bench *)arg;
+  struct tp_peer peer;
+  int tries = 0;
+  int ret;
+
+  peer.transport = tp_create(bench, &bench->client_side);
+  peer.buffer.resize(*std::max_element(bench->sizes.begin(),
+                                       bench->sizes.end()));
+  memset(peer.buffer.data(), 0xab, peer.buffer.size());
+  peer.completed = 0;
+  peer.errors = 0;
+  peer.last_length = 0;
+
+  /* The server thread may not be listening yet */
+  while (((ret = peer.transport->connect("127.0.0.1", bench->port)) != 0) &&
+         (++tries < TP_CONNECT_TRIES)) {
+    usleep(TP_CONNECT_DELAY_US);
+  }
+  for (size_t size : bench->sizes) {
+    if (ret == 0) {
+      ret = tp_run_size(bench, &peer, size);
+    }
+  }
+  if ((peer.transport->close() != 0) && (ret == 0)) {
+    ret = -1;
+  }
+
+  delete peer.transport;
+  bench->ret[1] = ret;
+  return NULL;
+}
+
+static int tp_run(struct tp_bench *bench, tp_backend_t backend) {
+  pthread_t server_thread, client_thread;
+
+  bench->backend = backend;
+  bench->ret[0] = bench->ret[1] = -1;
+
+  CHKERR_ACTION(pthread_create(&server_thread, NULL, tp_server_thread,
+                               bench) != 0,
+                "create server thread\n", return -1);
+  /* Started threads never return; leave them to process exit */
+  CHKERR_ACTION(pthread_create(&client_thread, NULL, tp_client_thread,
+                               bench) != 0,
+                "create client thread\n", return -1);
+
+  pthread_join(client_thread, NULL);
+  pthread_join(server_thread, NULL);
+  if ((bench->ret[0] != 0) || (bench->ret[1] != 0)) {
+    LOG_ERROR("transport bench: %s run failed\n", tp_backend_names[backend]);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Prints the backends next to each other for every size, with each one's
+ * rate and latency against ucp's */
+static void tp_print(struct tp_bench *bench) {
+  const struct tp_result *ucp;
+
+  log_flush();
+  printf("\n%ld messages per workload, %u in flight when streaming; "
+         "latencies in us\n",
+         bench->count, bench->window);
+  printf("%-6s %10s %10s %10s %12s %10s %10s %10s\n", "backend", "size",
+         "rtt p50", "rtt p99", "msg/s", "GB/s", "p50/ucp", "rate/ucp");
+  for (size_t size : bench->sizes) {
+    ucp = NULL;
+    for (const struct tp_result &result : bench->results) {
+      if ((result.size == size) && (result.backend == TP_BACKEND_UCP)) {
+        ucp = &result;
+      }
+    }
+    for (const struct tp_result &result : bench->results) {
+      if (result.size != size) {
+        continue;
+      }
+      printf("%-6s %10lu %10.2f %10.2f %12.0f %10.2f",
+             tp_backend_names[result.backend], result.size, result.p50_us,
+             result.p99_us, result.msg_rate, result.gbps);
+      if ((ucp != NULL) && (&result != ucp)) {
+        printf(" %10.2f %10.2f", result.p50_us / ucp->p50_us,
+               result.msg_rate / ucp->msg_rate);
+      }
+      printf("\n");
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  struct tp_bench bench;
+  std::vector<tp_backend_t> backends;
+  unsigned backend;
+  int ret = 0;
+  int c;
+
+  bench.count = TP_DEFAULT_COUNT;
+  bench.window = TP_DEFAULT_WINDOW;
+  bench.port = TP_DEFAULT_PORT;
+  bench.unix_path = TP_DEFAULT_UNIX_PATH;
+  bench.ucx_ready = false;
+
+  while ((c = getopt(argc, argv, "m:s:n:w:p:u:h")) != -1) {
+    switch (c) {
+    case 'm':
+      for (backend = 0; backend < 3; ++backend) {
+        if (!strcmp(optarg, tp_backend_names[backend])) {
+          break;
+        }
+      }
+      if (backend == 3) {
+        print_tp_usage();
+        return -1;
+      }
+      backends.push_back((tp_backend_t)backend);
+      break;
+    case 's':
+      bench.sizes.push_back(strtoul(optarg, NULL, 0));
+      break;
+    case 'n':
+      bench.count = atol(optarg);
+      break;
+    case 'w':
+      bench.window = atoi(optarg);
+      break;
+    case 'p':
+      bench.port = atoi(optarg);
+      break;
+    case 'u':
+      bench.unix_path = optarg;
+      break;
+    case 'h':
+    default:
+      print_tp_usage();
+      return -1;
+    }
+  }
+
+  if ((bench.count <= 0) || (bench.window == 0) ||
+      std::count(bench.sizes.begin(), bench.sizes.end(), (size_t)0)) {
+    print_tp_usage();
+    return -1;
+  }
+
+  if (backends.empty()) {
+    backends = {TP_BACKEND_UCP, TP_BACKEND_TCP, TP_BACKEND_UNIX};
+  }
+  if (bench.sizes.empty()) {
+    bench.sizes = {8, 4096, 65536, 1048576};
+  }
+
+  if (std::count(backends.begin(), backends.end(), TP_BACKEND_UCP)) {
+    ret = bench_init_side(&bench.server_side, "transport bench server",
+                          UCP_FEATURE_TAG);
+    CHKERR_JUMP(ret != 0, "initialize server\n", out);
+
+    ret = bench_init_side(&bench.client_side, "transport bench client",
+                          UCP_FEATURE_TAG);
+    if (ret != 0) {
+      bench_cleanup_side(&bench.server_side);
+    }
+    CHKERR_JUMP(ret != 0, "initialize client\n", out);
+    bench.ucx_ready = true;
+  }
+
+  for (tp_backend_t run_backend : backends) {
+    ret = tp_run(&bench, run_backend);
+    if (ret != 0) {
+      break;
+    }
+  }
+  if (ret == 0) {
+    tp_print(&bench);
+  }
+
+  if (bench.ucx_ready) {
+    bench_cleanup_side(&bench.client_side);
+    bench_cleanup_side(&bench.server_side);
+  }
+out:
+  return ret;
+}
@@ -4,85 +4,75 @@
 
 #include "ucp_client.h"
 #include "common_utils.h"
+#include "crc32c.h"
+#include "logger.h"
 #include "memory_utils.h"
 #include "ucx_utils.h"
 
-#include <errno.h>  /* errno */
 #include <signal.h> /* raise */
 #include <stdlib.h>
-#include <sys/epoll.h>
 
-ucs_status_t UcpClient::test_poll_wait(ucp_worker_h ucp_worker) {
-  int err = 0;
-  ucs_status_t ret = UCS_ERR_NO_MESSAGE;
-  int epoll_fd_local = 0;
-  int epoll_fd = 0;
-  ucs_status_t status;
-  struct epoll_event ev;
-  ev.data.u64 = 0;
-
-  status = ucp_worker_get_efd(ucp_worker, &epoll_fd);
-  CHKERR_JUMP(UCS_OK != status, "ucp_worker_get_efd", err);
-
-  /* It is recommended to copy original fd */
-  epoll_fd_local = epoll_create(1);
+/* Checks the payload of a received message, which may be in device memory;
+ * that is copied to the host first */
+static int client_verify_crc(const void *data, size_t length,
+                             uint32_t expected) {
+  void *host = NULL;
+  uint32_t crc;
 
-  ev.data.fd = epoll_fd;
-  ev.events = EPOLLIN;
-  err = epoll_ctl(epoll_fd_local, EPOLL_CTL_ADD, epoll_fd, &ev);
-  CHKERR_JUMP(err < 0, "add original socket to the new epoll\n", err_fd);
-
-  /* Need to prepare ucp_worker before epoll_wait */
-  status = ucp_worker_arm(ucp_worker);
-  if (status == UCS_ERR_BUSY) { /* some events are arrived already */
-    ret = UCS_OK;
-    goto err_fd;
+  if (test_mem_type != UCS_MEMORY_TYPE_HOST) {
+    host = malloc(length);
+    CHKERR_ACTION(host == NULL, "allocate CRC staging buffer\n", return -1);
+    mem_type_memcpy(host, data, length);
+    data = host;
   }
-  CHKERR_JUMP(status != UCS_OK, "ucp_worker_arm\n", err_fd);
-
-  do {
-    err = epoll_wait(epoll_fd_local, &ev, 1, -1);
-  } while ((err == -1) && (errno == EINTR));
 
-  ret = UCS_OK;
-
-err_fd:
-  close(epoll_fd_local);
+  crc = crc32c(0, data, length);
+  free(host);
+  if (crc != expected) {
+    LOG_ERROR("CRC32C mismatch: received 0x%08x, expected 0x%08x\n", crc,
+              expected);
+    return -1;
+  }
 
-err:
-  return ret;
+  LOG_INFO("CRC32C verified over %lu bytes\n", length);
+  return 0;
 }
 
-int UcpClient::runUcxClient(const char *data_msg_str, const char *addr_msg_str,
-                            long send_msg_length, const ucp_tag_t tag,
-                            const ucp_tag_t tag_mask,
-                            err_handling err_handling_opt) {
-  ucs_status_t ep_status = UCS_OK;
+int UcpClient::connect(const char *addr_msg_str, const ucp_tag_t tag,
+                       err_handling err_handling_opt) {
   struct msg *msg = NULL;
   size_t msg_len = 0;
-  int ret = -1;
-  ucp_request_param_t send_param, recv_param;
-  ucp_tag_recv_info_t info_tag;
-  ucp_tag_message_h msg_tag;
+  ucp_request_param_t send_param;
   ucs_status_t status;
-  ucp_ep_h server_ep;
   ucp_ep_params_t ep_params;
   struct ucx_context *request;
-  char *str;
-  ucp_test_mode_t ucp_test_mode = TEST_MODE_PROBE;
+
+  err_handling_opt_ = err_handling_opt;
+  ep_status_ = UCS_OK;
+  ep_status_p_ = &ep_status_;
 
   /* Send client UCX address to server */
-  ep_params.field_mask =
-      UCP_EP_PARAM_FIELD_REMOTE_ADDRESS | UCP_EP_PARAM_FIELD_ERR_HANDLING_MODE |
-      UCP_EP_PARAM_FIELD_ERR_HANDLER | UCP_EP_PARAM_FIELD_USER_DATA;
-  ep_params.address = peer_addr_;
-  ep_params.err_mode = err_handling_opt.ucp_err_mode;
-  ep_params.err_handler.cb = failure_handler;
-  ep_params.err_handler.arg = NULL;
-  ep_params.user_data = &ep_status;
-
-  status = ucp_ep_create(ucp_worker_, &ep_params, &server_ep);
-  CHKERR_JUMP(status != UCS_OK, "ucp_ep_create\n", err);
+  if (ep_cache_ != NULL) {
+    ep_cache_->evict_idle(EP_CACHE_IDLE_NS);
+    status = ep_cache_->get(peer_addr_, peer_addr_len_, &server_ep_,
+                            &ep_status_p_);
+    CHKERR_ACTION(status != UCS_OK, "get cached endpoint\n",
+                  server_ep_ = NULL; return -1);
+  } else {
+    ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS |
+                           UCP_EP_PARAM_FIELD_ERR_HANDLING_MODE |
+                           UCP_EP_PARAM_FIELD_ERR_HANDLER |
+                           UCP_EP_PARAM_FIELD_USER_DATA;
+    ep_params.address = peer_addr_;
+    ep_params.err_mode = err_handling_opt.ucp_err_mode;
+    ep_params.err_handler.cb = failure_handler;
+    ep_params.err_handler.arg = &ep_status_;
+    ep_params.user_data = &ep_status_;
+
+    status = ucp_ep_create(ucp_worker_, &ep_params, &server_ep_);
+    CHKERR_ACTION(status != UCS_OK, "ucp_ep_create\n", server_ep_ = NULL;
+                  return -1);
+  }
 
   msg_len = sizeof(*msg) + local_addr_len_;
   // msg     = malloc(msg_len);
@@ -100,73 +90,142 @@ int UcpClient::runUcxClient(const char *data_msg_str, const char *addr_msg_str,
   //    request                 = ucp_tag_send_nbx(server_ep, msg, msg_len, tag,
   //                                               &send_param);
   request = static_cast<ucx_context *>(
-      ucp_tag_send_nbx(server_ep, msg, msg_len, tag, &send_param));
+      ucp_tag_send_nbx(server_ep_, msg, msg_len, tag, &send_param));
 
-  status = ucx_wait(ucp_worker_, request, "send", addr_msg_str);
+  cached_ep_ = server_ep_;
+  status = deadlines_.wait(request, op_timeout_ns_, "send", addr_msg_str,
+                           &server_ep_);
+  free(msg);
   if (status != UCS_OK) {
-    free(msg);
     goto err_ep;
   }
 
-  free(msg);
+  return 0;
+
+err_ep:
+  disconnect(true);
+  return -1;
+}
+
+void UcpClient::disconnect(bool failed) {
+  if (server_ep_ == NULL) {
+    /* Closed by the deadline of the address send */
+    if ((ep_cache_ != NULL) && (cached_ep_ != NULL)) {
+      ep_cache_->forget(cached_ep_);
+    }
+  } else if (ep_cache_ == NULL) {
+    ep_close_err_mode(ucp_worker_, server_ep_, err_handling_opt_);
+  } else if (failed) {
+    ep_cache_->invalidate(server_ep_);
+  }
+  server_ep_ = NULL;
+  cached_ep_ = NULL;
+}
+
+/* A message probed with remove=1 is off the unexpected queue and only goes
+ * away once received: take it into a scratch buffer when it cannot be
+ * received where it was meant to */
+void UcpClient::drop_msg(ucp_tag_message_h msg_tag, size_t length) {
+  ucp_request_param_t param;
+  struct ucx_context *request;
+  void *scratch;
+
+  scratch = malloc(length);
+  CHKERR_ACTION(scratch == NULL, "allocate scratch buffer\n", return);
+
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_DATATYPE |
+                       UCP_OP_ATTR_FLAG_NO_IMM_CMPL;
+  param.datatype = ucp_dt_make_contig(1);
+  param.cb.recv = recv_handler;
+  request = static_cast<ucx_context *>(
+      ucp_tag_msg_recv_nbx(ucp_worker_, scratch, length, msg_tag, &param));
+  deadlines_.wait(request, op_timeout_ns_, "receive", "dropped message");
+  free(scratch);
+}
+
+int UcpClient::runUcxClient(const char *data_msg_str, const char *addr_msg_str,
+                            long send_msg_length, const ucp_tag_t tag,
+                            const ucp_tag_t tag_mask,
+                            err_handling err_handling_opt) {
+  struct msg *msg = NULL;
+  struct msg hdr;
+  int ret = -1;
+  ucp_request_param_t recv_param;
+  ucp_tag_recv_info_t info_tag;
+  ucp_tag_message_h msg_tag;
+  ucs_status_t status;
+  struct ucx_context *request;
+  char *str;
+
+  if (connect(addr_msg_str, tag, err_handling_opt) != 0) {
+    return -1;
+  }
 
   if (err_handling_opt.failure_mode == FAILURE_MODE_RECV) {
-    fprintf(stderr,
-            "Emulating failure before receive operation on client side\n");
+    LOG_WARN("Emulating failure before receive operation on client side\n");
+    log_flush();
     raise(SIGKILL);
   }
 
   /* Receive test string from server */
-  for (;;) {
-    CHKERR_JUMP(ep_status != UCS_OK, "receive data: EP disconnected\n", err_ep);
-    /* Probing incoming events in non-block mode */
-    /* note that the `tag` and `tag_mask` are predefined in the var
-     * initialization */
-    msg_tag = ucp_tag_probe_nb(ucp_worker_, tag, tag_mask, 1, &info_tag);
-    if (msg_tag != NULL) {
-      /* Message arrived */
-      break;
-    } else if (ucp_worker_progress(ucp_worker_)) {
-      /* Some events were polled; try again without going to sleep */
-      continue;
-    }
-
-    /* If we got here, ucp_worker_progress() returned 0, so we can sleep.
-     * Following blocked methods used to polling internal file descriptor
-     * to make CPU idle and don't spin loop
-     */
-    if (ucp_test_mode == TEST_MODE_WAIT) {
-      /* Polling incoming events*/
-      status = ucp_worker_wait(ucp_worker_);
-      CHKERR_JUMP(status != UCS_OK, "ucp_worker_wait\n", err_ep);
-    } else if (ucp_test_mode == TEST_MODE_EVENTFD) {
-      status = test_poll_wait(ucp_worker_);
-      CHKERR_JUMP(status != UCS_OK, "test_poll_wait\n", err_ep);
-    }
-  }
+  msg_tag = probe_wait(ucp_worker_, tag, tag_mask, test_mode_, ep_status_p_,
+                       &info_tag, op_timeout_ns_, stop_);
+  CHKERR_JUMP(msg_tag == NULL, "receive data\n", err_ep);
 
   if (err_handling_opt.failure_mode == FAILURE_MODE_KEEPALIVE) {
-    fprintf(stderr, "Emulating unexpected failure after receive completion "
-                    "on client side, server should detect error by "
-                    "keepalive mechanism\n");
+    LOG_WARN("Emulating unexpected failure after receive completion "
+             "on client side, server should detect error by "
+             "keepalive mechanism\n");
+    log_flush();
     raise(SIGKILL);
   }
 
-  msg = static_cast<struct msg *>(mem_type_malloc(info_tag.length));
-  CHKERR_JUMP(msg == NULL, "allocate memory\n", err_ep);
-
   recv_param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
                             UCP_OP_ATTR_FIELD_DATATYPE |
                             UCP_OP_ATTR_FLAG_NO_IMM_CMPL;
   recv_param.datatype = ucp_dt_make_contig(1);
   recv_param.cb.recv = recv_handler;
 
+  if (sink_ != NULL) {
+    /* Receive straight into a registered buffer the sink writes out from */
+    CHKERR_JUMP(info_tag.length > sink_->recv_capacity(),
+                "fit the message in a sink buffer\n", err_drop);
+    msg = static_cast<struct msg *>(sink_->acquire(&recv_param.memh));
+    CHKERR_JUMP(msg == NULL, "acquire a sink buffer\n", err_drop);
+    recv_param.op_attr_mask |= UCP_OP_ATTR_FIELD_MEMH;
+  } else {
+    msg = static_cast<struct msg *>(mem_type_malloc(info_tag.length));
+    CHKERR_JUMP(msg == NULL, "allocate memory\n", err_drop);
+  }
+
   request = static_cast<ucx_context *>(ucp_tag_msg_recv_nbx(
       ucp_worker_, msg, info_tag.length, msg_tag, &recv_param));
 
-  status = ucx_wait(ucp_worker_, request, "receive", data_msg_str);
+  status = deadlines_.wait(request, op_timeout_ns_, "receive", data_msg_str);
   if (status != UCS_OK) {
-    mem_type_free(msg);
+    goto err_msg;
+  }
+
+  /* The buffer may be device memory: only touch it from the host through
+   * mem_type_memcpy() */
+  CHKERR_ACTION(info_tag.length < sizeof(hdr), "validate message length\n",
+                ret = -1; goto err_msg);
+  mem_type_memcpy(&hdr, msg, sizeof(hdr));
+  if (hdr.flags & MSG_FLAG_CRC32C) {
+    CHKERR_ACTION(hdr.data_len > info_tag.length - sizeof(hdr),
+                  "validate message length\n", ret = -1; goto err_msg);
+    ret = client_verify_crc(msg + 1, hdr.data_len, hdr.crc);
+    if (ret != 0) {
+      goto err_msg;
+    }
+  }
+
+  if (sink_ != NULL) {
+    CHKERR_ACTION(hdr.data_len > info_tag.length - sizeof(hdr),
+                  "validate message length\n", ret = -1; goto err_msg);
+    /* The sink takes the buffer back once the write completes */
+    ret = sink_->commit(msg, hdr.data_len);
     goto err_ep;
   }
 
@@ -174,12 +233,13 @@ int UcpClient::runUcxClient(const char *data_msg_str, const char *addr_msg_str,
   // to client.
   str = static_cast<char *>(calloc(1, send_msg_length));
   if (str == NULL) {
-    fprintf(stderr, "Memory allocation failed\n");
+    LOG_ERROR("Memory allocation failed\n");
     ret = -1;
     goto err_msg;
   }
 
   mem_type_memcpy(str, msg + 1, send_msg_length);
+  log_flush();
   printf("\n\n----- UCP TEST SUCCESS ----\n\n");
   printf("%s", str);
   printf("\n\n---------------------------\n\n");
@@ -187,9 +247,15 @@ int UcpClient::runUcxClient(const char *data_msg_str, const char *addr_msg_str,
   ret = 0;
 
 err_msg:
-  mem_type_free(msg);
+  if (sink_ != NULL) {
+    sink_->release(msg);
+  } else {
+    mem_type_free(msg);
+  }
+  goto err_ep;
+err_drop:
+  drop_msg(msg_tag, info_tag.length);
 err_ep:
-  ep_close_err_mode(ucp_worker_, server_ep, err_handling_opt);
-err:
+  disconnect(ret != 0);
   return ret;
 }
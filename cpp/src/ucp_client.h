@@ -7,37 +7,109 @@
 
 #include <ucp/api/ucp.h>
 
+#include <atomic>
+
+#include "disk_sink.h"
+#include "ep_cache.h"
+#include "op_deadline.h"
 #include "ucx_config.h"
 
 class UcpClient {
 
 public:
   UcpClient(ucp_worker_h ucp_worker, ucp_address_t *local_addr,
-            size_t local_addr_len, ucp_address_t *peer_addr)
+            size_t local_addr_len, ucp_address_t *peer_addr,
+            size_t peer_addr_len = 0)
       : ucp_worker_(ucp_worker), local_addr_(local_addr),
-        local_addr_len_(local_addr_len), peer_addr_(peer_addr) {}
+        local_addr_len_(local_addr_len), peer_addr_(peer_addr),
+        peer_addr_len_(peer_addr_len), ep_cache_(NULL), sink_(NULL),
+        test_mode_(TEST_MODE_PROBE), deadlines_(ucp_worker),
+        op_timeout_ns_(0), stop_(NULL), server_ep_(NULL), cached_ep_(NULL),
+        ep_status_(UCS_OK), ep_status_p_(&ep_status_) {}
+
+  UcpClient(const UcpClient &) = delete;
+  UcpClient &operator=(const UcpClient &) = delete;
 
   /**
-   * @brief Waits for events on a UCP worker.
-   *
-   * This function creates an epoll instance and adds the event file descriptor
-   * of the UCP worker to it. It then waits for events on this epoll instance.
-   *
-   * @param ucp_worker The UCP worker on which to wait for events.
-   *
-   * @return UCS_OK if successful, an error code otherwise.
+   * @brief Takes the server endpoint from `ep_cache` instead of creating and
+   * closing one per run. Requires `peer_addr_len` to have been given.
+   */
+  void set_ep_cache(EpCache *ep_cache) { ep_cache_ = ep_cache; }
+
+  /**
+   * @brief Receives the server's payload into `sink` buffers and appends it
+   * to the sink's file instead of printing it. The write runs in the
+   * background while the next run receives. Host memory only.
    */
-  ucs_status_t test_poll_wait(ucp_worker_h ucp_worker);
+  void set_sink(DiskSink *sink) { sink_ = sink; }
+
+  /**
+   * @brief Selects how the client waits for the server's reply: spin
+   * (TEST_MODE_PROBE, the default), ucp_worker_wait() or the worker event fd.
+   * The latter two need a context created with UCP_FEATURE_WAKEUP.
+   */
+  void set_test_mode(ucp_test_mode_t test_mode) { test_mode_ = test_mode; }
+
+  /**
+   * @brief Fails sends, receives and the wait for the server's reply that
+   * take longer than `timeout_ns` (0, the default, waits forever).
+   */
+  void set_op_timeout(uint64_t timeout_ns) { op_timeout_ns_ = timeout_ns; }
+
+  /**
+   * @brief Gives up waiting for the server's reply once another thread sets
+   * `stop` and signals the worker, e.g. because the peer failed.
+   */
+  void set_stop(const std::atomic<bool> *stop) { stop_ = stop; }
+
+  const OpDeadlines::stats &get_deadline_stats() const {
+    return deadlines_.get_stats();
+  }
 
   int runUcxClient(const char *data_msg_str, const char *addr_msg_str,
                    long send_msg_length, const ucp_tag_t tag,
                    const ucp_tag_t tag_mask, err_handling err_handling_opt);
 
+  /**
+   * @brief Gets an endpoint to the server and sends it this worker's address
+   * on `tag`, which the server answers to: how runUcxClient() starts.
+   *
+   * @return 0 on success, -1 on failure, with the endpoint given back.
+   */
+  int connect(const char *addr_msg_str, const ucp_tag_t tag,
+              err_handling err_handling_opt);
+
+  /**
+   * @brief Closes the endpoint from connect(), or leaves it in the endpoint
+   * cache; with `failed`, it is dropped from the cache instead.
+   */
+  void disconnect(bool failed);
+
+  /**
+   * @return The endpoint to the server while connected, otherwise NULL.
+   */
+  ucp_ep_h ep() const { return server_ep_; }
+
 private:
+  void drop_msg(ucp_tag_message_h msg_tag, size_t length);
+
   ucp_worker_h ucp_worker_;
   ucp_address_t *local_addr_;
   size_t local_addr_len_;
   ucp_address_t *peer_addr_;
+  size_t peer_addr_len_;
+  EpCache *ep_cache_;
+  DiskSink *sink_;
+  ucp_test_mode_t test_mode_;
+  OpDeadlines deadlines_;
+  uint64_t op_timeout_ns_;
+  const std::atomic<bool> *stop_;
+  /* Between connect() and disconnect() */
+  ucp_ep_h server_ep_; /* NULL once a deadline closed it */
+  ucp_ep_h cached_ep_;
+  err_handling err_handling_opt_;
+  ucs_status_t ep_status_;
+  const ucs_status_t *ep_status_p_; /* the cache's, for a cached endpoint */
 };
 
 #endif // MYUCXPLAYGROUND_UCP_CLIENT_H
@@ -0,0 +1,217 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucp/api/ucp.h>
+
+#include <atomic>
+
+#include "common_utils.h"
+#include "disk_sink.h"
+#include "ep_cache.h"
+#include "logger.h"
+#include "print_utils.h"
+#include "ucp_client.h"
+#include "ucp_server.h"
+#include "ucx_config.h"
+#include "ucx_utils.h"
+
+/**
+ * Runs UcpServer and UcpClient in one process, each on its own thread with
+ * its own context and worker. The server address is handed to the client in
+ * memory instead of over the OOB socket; everything after that goes through
+ * the same runServer()/runUcxClient() code as the two-process binaries.
+ */
+
+static const ucp_tag_t tag = 0x1337a880u;
+static const ucp_tag_t tag_mask = UINT64_MAX;
+static const char *addr_msg_str = "UCX address message";
+static const char *data_msg_str = "UCX data message";
+
+#define LOOPBACK_SIDES 2
+
+struct loopback_args {
+  struct cmd_opts *opts;
+  struct bench_side *server;
+  struct bench_side *client;
+  std::atomic<int> barrier_count;
+  std::atomic<bool> stop; /* a side failed; the other stops waiting on it */
+  int ret[LOOPBACK_SIDES];
+};
+
+/* Wakes a peer that may be sleeping on its worker for a message the failed
+ * side will never send */
+static void loopback_stop(struct loopback_args *args, ucp_worker_h peer) {
+  args->stop.store(true);
+  if (args->opts->test_mode != TEST_MODE_PROBE) {
+    ucp_worker_signal(peer);
+  }
+}
+
+static void *loopback_server_thread(void *arg) {
+  struct loopback_args *args = (struct loopback_args *)arg;
+  struct cmd_opts *opts = args->opts;
+  ucp_worker_h ucp_worker = args->server->ucp_worker;
+  UcpServer ucpServer(ucp_worker);
+  EpCache *ep_cache = NULL;
+  int ret = 0;
+
+  ucpServer.set_verify_crc(opts->verify_crc);
+  ucpServer.set_test_mode(opts->test_mode);
+  ucpServer.set_op_timeout(opts->op_timeout_ms * 1000000ull);
+  ucpServer.set_stop(&args->stop);
+  if (opts->ep_cache_size > 0) {
+    ep_cache =
+        new EpCache(ucp_worker, opts->ep_cache_size, opts->err_handling_opt);
+    ucpServer.set_ep_cache(ep_cache);
+  }
+
+  for (int i = 0; i < opts->iterations; ++i) {
+    ret = ucpServer.runServer(data_msg_str, addr_msg_str, tag, tag_mask,
+                              opts->test_string_length,
+                              opts->err_handling_opt);
+    if (ret != 0) {
+      loopback_stop(args, args->client->ucp_worker);
+      break;
+    }
+  }
+  if (opts->op_timeout_ms > 0) {
+    log_flush();
+    op_deadline_print("server", ucpServer.get_deadline_stats());
+  }
+
+  delete ep_cache;
+  bench_barrier(&args->barrier_count, LOOPBACK_SIDES, 1, ucp_worker);
+  args->ret[0] = ret;
+  return NULL;
+}
+
+static void *loopback_client_thread(void *arg) {
+  struct loopback_args *args = (struct loopback_args *)arg;
+  struct cmd_opts *opts = args->opts;
+  ucp_worker_h ucp_worker = args->client->ucp_worker;
+  UcpClient ucpClient(ucp_worker, args->client->worker_attr.address,
+                      args->client->worker_attr.address_length,
+                      args->server->worker_attr.address,
+                      args->server->worker_attr.address_length);
+  EpCache *ep_cache = NULL;
+  DiskSink *sink = NULL;
+  int ret = 0;
+
+  ucpClient.set_test_mode(opts->test_mode);
+  ucpClient.set_op_timeout(opts->op_timeout_ms * 1000000ull);
+  ucpClient.set_stop(&args->stop);
+  if (opts->ep_cache_size > 0) {
+    ep_cache =
+        new EpCache(ucp_worker, opts->ep_cache_size, opts->err_handling_opt);
+    ucpClient.set_ep_cache(ep_cache);
+  }
+  if (opts->sink_path != NULL) {
+    sink = new DiskSink(args->client->ucp_context, opts->sink_path,
+                        opts->test_string_length, sizeof(struct msg),
+                        opts->sink_direct);
+    ret = sink->init();
+    ucpClient.set_sink(sink);
+  }
+
+  for (int i = 0; (ret == 0) && (i < opts->iterations); ++i) {
+    ret = ucpClient.runUcxClient(data_msg_str, addr_msg_str,
+                                 opts->test_string_length, tag, tag_mask,
+                                 opts->err_handling_opt);
+  }
+  if (opts->op_timeout_ms > 0) {
+    log_flush();
+    op_deadline_print("client", ucpClient.get_deadline_stats());
+  }
+
+  if (sink != NULL) {
+    if ((sink->flush() == 0) && (ret == 0)) {
+      log_flush();
+      sink->report();
+    } else {
+      ret = -1;
+    }
+    delete sink;
+  }
+  if (ret != 0) {
+    loopback_stop(args, args->server->ucp_worker);
+  }
+  delete ep_cache;
+  bench_barrier(&args->barrier_count, LOOPBACK_SIDES, 1, ucp_worker);
+  args->ret[1] = ret;
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  struct bench_side server, client;
+  struct loopback_args args;
+  struct cmd_opts opts;
+  pthread_t server_thread, client_thread;
+  uint64_t features;
+  ucs_status_t status;
+  int ret = -1;
+
+  init_cmd_opts(&opts);
+  status = parse_cmd(argc, argv, &opts);
+  CHKERR_JUMP(status != UCS_OK, "parse_cmd\n", err);
+
+  /* A killed peer would take the whole process down with it */
+  if (opts.err_handling_opt.failure_mode != FAILURE_MODE_NONE) {
+    fprintf(stderr, "Failure emulation (-e) needs separate processes\n");
+    goto err;
+  }
+  if (opts.file_path != NULL) {
+    fprintf(stderr, "File transfer (-f) needs separate processes\n");
+    goto err;
+  }
+
+  /* The wait modes other than probe sleep on the worker */
+  features = UCP_FEATURE_TAG;
+  if (opts.test_mode != TEST_MODE_PROBE) {
+    features |= UCP_FEATURE_WAKEUP;
+  }
+
+  ret = bench_init_side(&server, "loopback server", features,
+                        opts.print_config);
+  CHKERR_JUMP(ret != 0, "initialize server side\n", err);
+
+  ret = bench_init_side(&client, "loopback client", features,
+                        opts.print_config);
+  CHKERR_JUMP(ret != 0, "initialize client side\n", err_server);
+
+  args.opts = &opts;
+  args.server = &server;
+  args.client = &client;
+  args.barrier_count.store(0);
+  args.stop.store(false);
+  args.ret[0] = args.ret[1] = -1;
+
+  ret = pthread_create(&server_thread, NULL, loopback_server_thread, &args);
+  CHKERR_JUMP(ret != 0, "create server thread\n", err_client);
+
+  ret = pthread_create(&client_thread, NULL, loopback_client_thread, &args);
+  if (ret != 0) {
+    fprintf(stderr, "Failed to create client thread\n");
+    /* Stop the server waiting for a client, and stand in for the client at
+     * the barrier */
+    loopback_stop(&args, server.ucp_worker);
+    args.barrier_count.fetch_add(1);
+    pthread_join(server_thread, NULL);
+    ret = -1;
+    goto err_client;
+  }
+
+  pthread_join(client_thread, NULL);
+  pthread_join(server_thread, NULL);
+
+  ret = (args.ret[0] != 0) ? args.ret[0] : args.ret[1];
+  LOG_INFO("loopback finished: server %d, client %d\n", args.ret[0],
+           args.ret[1]);
+
+err_client:
+  bench_cleanup_side(&client);
+err_server:
+  bench_cleanup_side(&server);
+err:
+  return ret;
+}
@@ -5,53 +5,53 @@
 #include "ucp_server.h"
 
 #include "common_utils.h"
+#include "crc32c.h"
 #include "data_util.h"
+#include "logger.h"
 #include "memory_utils.h"
+#include "time_utils.h"
 #include "ucx_config.h"
 #include "ucx_utils.h"
 
 #include <signal.h> /* raise */
 
+/* Upper bound on waiting for a killed client to be detected */
+#define FAILURE_DETECT_TIMEOUT_NS (10 * 1000000000ull)
+
 void UcpServer::set_msg_data_len(struct msg *msg, uint64_t data_len) {
   mem_type_memcpy(&msg->data_len, &data_len, sizeof(data_len));
 }
 
-int UcpServer::runServer(const char *data_msg_str, const char *addr_msg_str,
-                         const ucp_tag_t tag, const ucp_tag_t tag_mask,
-                         long send_msg_length, err_handling err_handling_opt) {
+void UcpServer::set_msg_crc(struct msg *msg, uint32_t crc) {
+  uint32_t flags = MSG_FLAG_CRC32C;
+
+  mem_type_memcpy(&msg->flags, &flags, sizeof(flags));
+  mem_type_memcpy(&msg->crc, &crc, sizeof(crc));
+}
+
+int UcpServer::recv_client_address(const char *addr_msg_str,
+                                   const ucp_tag_t tag,
+                                   const ucp_tag_t tag_mask,
+                                   ucp_address_t **peer_addr_p,
+                                   size_t *peer_addr_len_p) {
   struct msg *msg = NULL;
   struct ucx_context *request = NULL;
-  size_t msg_len = 0;
-  ucp_request_param_t send_param, recv_param;
+  ucp_request_param_t recv_param;
   ucp_tag_recv_info_t info_tag;
   ucp_tag_message_h msg_tag;
   ucs_status_t status;
-  ucp_ep_h client_ep; // handle to an endpoint
-  ucp_ep_params_t
-      ep_params; // The structure defines the parameters that are used for the
-                 // UCP endpoint tuning during the UCP ep creation.
   ucp_address_t *peer_addr;
   size_t peer_addr_len;
 
-  ucs_status_t ep_status = UCS_OK;
-
-  int ret;
-
   /* Receive client UCX address */
-  do {
-    /* Progressing before probe to update the state */
-    ucp_worker_progress(ucp_worker_);
+  msg_tag = probe_wait(ucp_worker_, tag, tag_mask, test_mode_, NULL,
+                       &info_tag, 0, stop_);
+  CHKERR_ACTION(msg_tag == NULL, "receive client address\n", return -1);
 
-    /* Probing incoming events in non-block mode */
-    /* note that the `tag` and `tag_mask` are predefined in the var
-     * initialization */
-    msg_tag = ucp_tag_probe_nb(ucp_worker_, tag, tag_mask, 1, &info_tag);
-  } while (msg_tag == NULL);
-
-  printf("Allocating memory for message: %lu\n", info_tag.length);
+  LOG_DEBUG("Allocating memory for message: %lu\n", info_tag.length);
   msg = static_cast<struct msg *>(malloc(info_tag.length));
 
-  CHKERR_ACTION(msg == NULL, "allocate memory\n", ret = -1; goto err);
+  CHKERR_ACTION(msg == NULL, "allocate memory\n", return -1);
 
   /*
   UCP_OP_ATTR_FIELD_CALLBACK flag indicates that a callback function is
@@ -72,16 +72,16 @@ int UcpServer::runServer(const char *data_msg_str, const char *addr_msg_str,
   request = static_cast<struct ucx_context *>(ucp_tag_msg_recv_nbx(
       ucp_worker_, msg, info_tag.length, msg_tag, &recv_param));
 
-  status = ucx_wait(ucp_worker_, request, "receive", addr_msg_str);
+  status = deadlines_.wait(request, op_timeout_ns_, "receive", addr_msg_str);
   if (status != UCS_OK) {
     free(msg);
-    ret = -1;
-    goto err;
+    return -1;
   }
 
-  if (err_handling_opt.failure_mode == FAILURE_MODE_SEND) {
-    fprintf(stderr, "Emulating unexpected failure on server side, client "
-                    "should detect error by keepalive mechanism\n");
+  if (err_handling_opt_.failure_mode == FAILURE_MODE_SEND) {
+    LOG_WARN("Emulating unexpected failure on server side, client "
+             "should detect error by keepalive mechanism\n");
+    log_flush();
     free(msg);
     raise(SIGKILL);
     exit(1);
@@ -90,35 +90,118 @@ int UcpServer::runServer(const char *data_msg_str, const char *addr_msg_str,
   peer_addr_len = msg->data_len;
   peer_addr = static_cast<ucp_address_t *>(malloc(peer_addr_len));
   if (peer_addr == NULL) {
-    fprintf(stderr, "unable to allocate memory for peer address\n");
+    LOG_ERROR("unable to allocate memory for peer address\n");
     free(msg);
-    ret = -1;
-    goto err;
+    return -1;
   }
 
   // msg + 1 syntax is pointer arithmetic that gets a pointer to the memory
   // location immediately after the msg structure, which is where the address
   // data is presumably store
-  printf("Copying peer address from message length: %lu\n", msg->data_len);
+  LOG_DEBUG("Copying peer address from message length: %lu\n", msg->data_len);
   memcpy(peer_addr, msg + 1, peer_addr_len);
 
   free(msg);
+  *peer_addr_p = peer_addr;
+  *peer_addr_len_p = peer_addr_len;
+  return 0;
+}
+
+ucs_status_t UcpServer::create_ep(const ucp_address_t *peer_addr,
+                                  size_t peer_addr_len) {
+  ucp_ep_params_t
+      ep_params; // The structure defines the parameters that are used for the
+                 // UCP endpoint tuning during the UCP ep creation.
+  ucs_status_t status;
+
+  ep_status_ = UCS_OK;
+  ep_status_p_ = &ep_status_;
+  cached_ep_ = NULL;
+
+  if (ep_cache_ != NULL) {
+    ep_cache_->evict_idle(EP_CACHE_IDLE_NS);
+    status = ep_cache_->get(peer_addr, peer_addr_len, &client_ep_,
+                            &ep_status_p_);
+  } else {
+    ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS |
+                           UCP_EP_PARAM_FIELD_ERR_HANDLING_MODE |
+                           UCP_EP_PARAM_FIELD_ERR_HANDLER |
+                           UCP_EP_PARAM_FIELD_USER_DATA;
+    ep_params.address = peer_addr;
+    ep_params.err_mode = err_handling_opt_.ucp_err_mode;
+    ep_params.err_handler.cb = failure_handler;
+    ep_params.err_handler.arg = &ep_status_;
+    ep_params.user_data = &ep_status_;
+
+    status = ucp_ep_create(ucp_worker_, &ep_params, &client_ep_);
+  }
+  if (status != UCS_OK) {
+    client_ep_ = NULL;
+  }
+  return status;
+}
+
+int UcpServer::accept(const char *addr_msg_str, const ucp_tag_t tag,
+                      const ucp_tag_t tag_mask,
+                      err_handling err_handling_opt) {
+  ucp_address_t *peer_addr;
+  size_t peer_addr_len;
+  ucs_status_t status;
+
+  err_handling_opt_ = err_handling_opt;
+  if (recv_client_address(addr_msg_str, tag, tag_mask, &peer_addr,
+                          &peer_addr_len) != 0) {
+    return -1;
+  }
+
+  status = create_ep(peer_addr, peer_addr_len);
+  free(peer_addr);
+  CHKERR_ACTION(status != UCS_OK, "ucp_ep_create\n", return -1);
+  return 0;
+}
+
+void UcpServer::disconnect(bool failed) {
+  if (client_ep_ == NULL) {
+    /* Closed by the deadline of the send */
+    if ((ep_cache_ != NULL) && (cached_ep_ != NULL)) {
+      ep_cache_->forget(cached_ep_);
+    }
+  } else if (ep_cache_ == NULL) {
+    ep_close_err_mode(ucp_worker_, client_ep_, err_handling_opt_);
+  } else if (failed || (*ep_status_p_ != UCS_OK)) {
+    ep_cache_->invalidate(client_ep_);
+  }
+  client_ep_ = NULL;
+  cached_ep_ = NULL;
+}
+
+int UcpServer::runServer(const char *data_msg_str, const char *addr_msg_str,
+                         const ucp_tag_t tag, const ucp_tag_t tag_mask,
+                         long send_msg_length, err_handling err_handling_opt) {
+  struct msg *msg = NULL;
+  struct ucx_context *request = NULL;
+  size_t msg_len = 0;
+  ucp_request_param_t send_param;
+  ucs_status_t status;
+  ucp_address_t *peer_addr;
+  size_t peer_addr_len;
+
+  int ret;
+
+  err_handling_opt_ = err_handling_opt;
+  if (recv_client_address(addr_msg_str, tag, tag_mask, &peer_addr,
+                          &peer_addr_len) != 0) {
+    return -1;
+  }
 
   /* Send test string to client */
-  ep_params.field_mask =
-      UCP_EP_PARAM_FIELD_REMOTE_ADDRESS | UCP_EP_PARAM_FIELD_ERR_HANDLING_MODE |
-      UCP_EP_PARAM_FIELD_ERR_HANDLER | UCP_EP_PARAM_FIELD_USER_DATA;
-  ep_params.address = peer_addr;
-  ep_params.err_mode = err_handling_opt.ucp_err_mode;
-  ep_params.err_handler.cb = failure_handler;
-  ep_params.err_handler.arg = NULL;
-  ep_params.user_data = &ep_status;
-
-  status = ucp_ep_create(ucp_worker_, &ep_params, &client_ep);
+  status = create_ep(peer_addr, peer_addr_len);
+  /* The endpoint (and the cache key) no longer need the packed address */
+  free(peer_addr);
   /* If peer failure testing was requested, it could be possible that UCP EP
    * couldn't be created; in this case set `ret = 0` to report success */
   ret = (err_handling_opt.failure_mode != FAILURE_MODE_NONE) ? 0 : -1;
-  CHKERR_ACTION(status != UCS_OK, "ucp_ep_create\n", goto err);
+  CHKERR_ACTION(status != UCS_OK, "ucp_ep_create\n", return ret);
 
   // FIXME: we should decide this in the server, that's fine, but this must also
   //    be communicated to the client program via a message.
@@ -131,14 +214,26 @@ int UcpServer::runServer(const char *data_msg_str, const char *addr_msg_str,
   ret = generate_test_string((char *)(msg + 1), send_msg_length);
   CHKERR_JUMP(ret < 0, "generate test string", err_free_mem_type_msg);
 
-  printf("Test String to be sent: %s\n", (char *)(msg + 1));
+  if (verify_crc_) {
+    if (test_mem_type == UCS_MEMORY_TYPE_HOST) {
+      set_msg_crc(msg, crc32c(0, msg + 1, send_msg_length));
+    } else {
+      LOG_WARN("CRC32C is only computed for host memory, not sending it\n");
+    }
+  }
+
+  /* The payload itself is not logged: it may be huge and would have to be
+   * formatted on the data path */
+  LOG_DEBUG("Test String to be sent: %ld bytes\n", send_msg_length);
 
   if (err_handling_opt.failure_mode == FAILURE_MODE_RECV) {
-    // FIXME: This is not a better way to handle this. Probably we should
-    // busy loop here and check.
-    /* Sleep for small amount of time to ensure that client was killed
-     * and peer failure handling is covered */
-    sleep(10);
+    /* The client kills itself before receiving. Progress until the error
+     * handler reports it, so peer failure handling is covered, but no longer
+     * than FAILURE_DETECT_TIMEOUT_NS in case it never does */
+    uint64_t deadline_ns = get_time_ns() + FAILURE_DETECT_TIMEOUT_NS;
+    while ((*ep_status_p_ == UCS_OK) && (get_time_ns() < deadline_ns)) {
+      ucp_worker_progress(ucp_worker_);
+    }
   }
 
   // This is typically done in a loop to ensure that all pending communications
@@ -152,9 +247,15 @@ int UcpServer::runServer(const char *data_msg_str, const char *addr_msg_str,
   send_param.user_data = (void *)data_msg_str;
   send_param.memory_type = test_mem_type;
   request = static_cast<ucx_context *>(
-      ucp_tag_send_nbx(client_ep, msg, msg_len, tag, &send_param));
-  status = ucx_wait(ucp_worker_, request, "send", data_msg_str);
-  if (status != UCS_OK) {
+      ucp_tag_send_nbx(client_ep_, msg, msg_len, tag, &send_param));
+  cached_ep_ = client_ep_;
+  status = deadlines_.wait(request, op_timeout_ns_, "send", data_msg_str,
+                           &client_ep_);
+  if (client_ep_ == NULL) {
+    /* The send ran out of time and its endpoint was closed */
+    ret = -1;
+    goto err_free_mem_type_msg;
+  } else if (status != UCS_OK) {
     if (err_handling_opt.failure_mode != FAILURE_MODE_NONE) {
       ret = -1;
     } else {
@@ -163,7 +264,7 @@ int UcpServer::runServer(const char *data_msg_str, const char *addr_msg_str,
       ret = 0;
 
       /* Make sure that failure_handler was called */
-      while (ep_status == UCS_OK) {
+      while (*ep_status_p_ == UCS_OK) {
         ucp_worker_progress(ucp_worker_);
       }
     }
@@ -171,22 +272,21 @@ int UcpServer::runServer(const char *data_msg_str, const char *addr_msg_str,
   }
 
   if (err_handling_opt.failure_mode == FAILURE_MODE_KEEPALIVE) {
-    fprintf(stderr, "Waiting for client is terminated\n");
-    while (ep_status == UCS_OK) {
+    LOG_INFO("Waiting for client is terminated\n");
+    while (*ep_status_p_ == UCS_OK) {
       ucp_worker_progress(ucp_worker_);
     }
   }
 
-  status = flush_ep(ucp_worker_, client_ep);
-  printf("flush_ep completed with status %d (%s)\n", status,
-         ucs_status_string(status));
+  status = flush_ep(ucp_worker_, client_ep_);
+  LOG_DEBUG("flush_ep completed with status %d (%s)\n", status,
+            ucs_status_string(status));
 
   ret = 0;
 
 err_free_mem_type_msg:
   mem_type_free(msg);
 err_ep:
-  ep_close_err_mode(ucp_worker_, client_ep, err_handling_opt);
-err:
+  disconnect(ret != 0);
   return ret;
 }
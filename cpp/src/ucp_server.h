@@ -5,21 +5,106 @@
 #ifndef MYUCXPLAYGROUND_UCP_SERVER_H
 #define MYUCXPLAYGROUND_UCP_SERVER_H
 
+#include "ep_cache.h"
+#include "op_deadline.h"
 #include "ucx_config.h"
 #include <ucp/api/ucp.h>
 
+#include <atomic>
+
 class UcpServer {
 
 public:
-  UcpServer(ucp_worker_h ucp_worker) : ucp_worker_(ucp_worker) {}
+  UcpServer(ucp_worker_h ucp_worker)
+      : ucp_worker_(ucp_worker), verify_crc_(false), ep_cache_(NULL),
+        test_mode_(TEST_MODE_PROBE), deadlines_(ucp_worker),
+        op_timeout_ns_(0), stop_(NULL), client_ep_(NULL), cached_ep_(NULL),
+        ep_status_(UCS_OK), ep_status_p_(&ep_status_) {}
+
+  UcpServer(const UcpServer &) = delete;
+  UcpServer &operator=(const UcpServer &) = delete;
+
+  /**
+   * @brief Enables sending a CRC32C of the payload for the client to verify.
+   */
+  void set_verify_crc(bool verify_crc) { verify_crc_ = verify_crc; }
+
+  /**
+   * @brief Reuses client endpoints from `ep_cache` across runs instead of
+   * creating and closing one per run.
+   */
+  void set_ep_cache(EpCache *ep_cache) { ep_cache_ = ep_cache; }
+
+  /**
+   * @brief Selects how the server waits for a client's address message, as
+   * UcpClient::set_test_mode().
+   */
+  void set_test_mode(ucp_test_mode_t test_mode) { test_mode_ = test_mode; }
+
+  /**
+   * @brief Fails sends and receives that take longer than `timeout_ns` (0,
+   * the default, waits forever). Waiting for a client to show up is not
+   * bounded.
+   */
+  void set_op_timeout(uint64_t timeout_ns) { op_timeout_ns_ = timeout_ns; }
+
+  /**
+   * @brief Gives up waiting for the client's address once another thread sets
+   * `stop` and signals the worker, e.g. because the peer failed.
+   */
+  void set_stop(const std::atomic<bool> *stop) { stop_ = stop; }
+
+  const OpDeadlines::stats &get_deadline_stats() const {
+    return deadlines_.get_stats();
+  }
 
   int runServer(const char *data_msg_str, const char *addr_msg_str,
                 const ucp_tag_t tag, const ucp_tag_t tag_mask,
                 long send_msg_length, err_handling err_handling_opt);
 
+  /**
+   * @brief Waits for a client's address message on `tag` and gets an
+   * endpoint back to the client: how runServer() starts.
+   *
+   * @return 0 on success, -1 on failure.
+   */
+  int accept(const char *addr_msg_str, const ucp_tag_t tag,
+             const ucp_tag_t tag_mask, err_handling err_handling_opt);
+
+  /**
+   * @brief Closes the endpoint from accept(), or leaves it in the endpoint
+   * cache; with `failed`, or once the client failed, it is dropped from the
+   * cache instead.
+   */
+  void disconnect(bool failed);
+
+  /**
+   * @return The endpoint to the client while connected, otherwise NULL.
+   */
+  ucp_ep_h ep() const { return client_ep_; }
+
 private:
   void set_msg_data_len(struct msg *msg, uint64_t data_len);
+  void set_msg_crc(struct msg *msg, uint32_t crc);
+  int recv_client_address(const char *addr_msg_str, const ucp_tag_t tag,
+                          const ucp_tag_t tag_mask,
+                          ucp_address_t **peer_addr_p,
+                          size_t *peer_addr_len_p);
+  ucs_status_t create_ep(const ucp_address_t *peer_addr,
+                         size_t peer_addr_len);
   ucp_worker_h ucp_worker_;
+  bool verify_crc_;
+  EpCache *ep_cache_;
+  ucp_test_mode_t test_mode_;
+  OpDeadlines deadlines_;
+  uint64_t op_timeout_ns_;
+  const std::atomic<bool> *stop_;
+  /* Between accept() and disconnect() */
+  ucp_ep_h client_ep_; /* NULL once a deadline closed it */
+  ucp_ep_h cached_ep_;
+  err_handling err_handling_opt_;
+  ucs_status_t ep_status_;
+  const ucs_status_t *ep_status_p_; /* the cache's, for a cached endpoint */
 };
 
 #endif // MYUCXPLAYGROUND_UCP_SERVER_H
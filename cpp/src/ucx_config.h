@@ -6,12 +6,21 @@
 #ifndef MYUCXPLAYGROUND_UCX_CONFIG_H
 #define MYUCXPLAYGROUND_UCX_CONFIG_H
 
+#include "timer_wheel.h"
+
+/* msg.flags: `crc` holds the CRC32C of the `data_len` bytes after the header */
+#define MSG_FLAG_CRC32C 0x1u
+
 struct msg {
   uint64_t data_len;
+  uint32_t flags;
+  uint32_t crc;
 };
 
 struct ucx_context {
   int completed;
+  int timed_out;            /* cancelled by OpDeadlines */
+  struct wheel_timer timer; /* deadline, armed by OpDeadlines */
 };
 
 enum ucp_test_mode_t { TEST_MODE_PROBE, TEST_MODE_WAIT, TEST_MODE_EVENTFD };
@@ -28,4 +37,25 @@ struct err_handling {
   failure_mode_t failure_mode;
 };
 
+/* Command line options shared by the client and server binaries */
+struct cmd_opts {
+  char *server_name;
+  struct err_handling err_handling_opt;
+  int print_config;
+  uint16_t server_port;
+  sa_family_t ai_family;
+  long test_string_length;
+  int progress_cpu;     /* -1 leaves the progress thread unpinned */
+  const char *app_cpus; /* CPU list for helper threads, NULL for any */
+  int print_topology;
+  int verify_crc; /* send a CRC32C of the payload for end-to-end checking */
+  int iterations; /* client/server conversations per run */
+  size_t ep_cache_size; /* 0 creates and closes an endpoint per iteration */
+  ucp_test_mode_t test_mode; /* how to wait for incoming messages */
+  unsigned long op_timeout_ms; /* 0 waits for operations forever */
+  const char *file_path; /* file to send (server) or receive into (client) */
+  const char *sink_path; /* client: append received payloads to this file */
+  int sink_direct;       /* open `sink_path` with O_DIRECT */
+};
+
 #endif // MYUCXPLAYGROUND_UCX_CONFIG_H
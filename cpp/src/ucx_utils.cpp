@@ -1,5 +1,15 @@
 #include "ucx_utils.h"
 #include "common_utils.h"
+#include "logger.h"
+
+#include "time_utils.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <algorithm>
+#include <vector>
 
 int connect_common(const char *server, uint16_t server_port, sa_family_t af) {
   int sockfd = -1;
@@ -24,7 +34,7 @@ int connect_common(const char *server, uint16_t server_port, sa_family_t af) {
   int socked_estb_counter = 0;
   CHKERR_JUMP(ret < 0, "getaddrinfo() failed", out);
   for (t = res; t != NULL; t = t->ai_next) {
-    printf("Socket Established: %d\n", socked_estb_counter++);
+    LOG_DEBUG("Socket Established: %d\n", socked_estb_counter++);
     /**
     calling the socket function to create a new socket with the specified
     address family, socket type, and protocol. The socket file descriptor for
@@ -36,13 +46,13 @@ int connect_common(const char *server, uint16_t server_port, sa_family_t af) {
     }
 
     if (server != NULL) {
-      printf("Server Name: %s\n", server);
-      printf("Attempting to connect as a Client\n");
+      LOG_DEBUG("Server Name: %s\n", server);
+      LOG_DEBUG("Attempting to connect as a Client\n");
       if (connect(sockfd, t->ai_addr, t->ai_addrlen) == 0) {
         break;
       }
     } else {
-      printf("Attempting to Connect as a Server\n");
+      LOG_DEBUG("Attempting to Connect as a Server\n");
       /*
       set the SO_REUSEADDR option for the socket referred to by sockfd. This
       allows the socket to reuse its local address, which can help avoid
@@ -53,12 +63,12 @@ int connect_common(const char *server, uint16_t server_port, sa_family_t af) {
       CHKERR_JUMP(ret < 0, "server setsockopt()", err_close_sockfd);
 
       if (bind(sockfd, t->ai_addr, t->ai_addrlen) == 0) {
-        printf("Bind Successful\n");
+        LOG_DEBUG("Bind Successful\n");
         ret = listen(sockfd, 0);
         CHKERR_JUMP(ret < 0, "listen server", err_close_sockfd);
 
         /* Accept next connection */
-        fprintf(stdout, "Waiting for connection...\n");
+        LOG_INFO("Waiting for connection...\n");
         listenfd = sockfd;
         /* program blocks here until a connection is accepted*/
         /*
@@ -68,7 +78,7 @@ int connect_common(const char *server, uint16_t server_port, sa_family_t af) {
            This new socket is used for communication with the client.
         */
         sockfd = accept(listenfd, NULL, NULL);
-        printf("Accepting a connection: %d\n", listenfd);
+        LOG_INFO("Accepting a connection: %d\n", listenfd);
         /*closes the listening socket. After a connection has been accepted, the
          * listening socket is no longer needed.*/
         close(listenfd);
@@ -117,20 +127,20 @@ int connect_server(uint16_t server_port, sa_family_t af) {
       continue;
     }
 
-    printf("Attempting to Connect as a Server\n");
+    LOG_DEBUG("Attempting to Connect as a Server\n");
     ret = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
     CHKERR_JUMP(ret < 0, "server setsockopt()", err_close_sockfd);
 
     if (bind(sockfd, t->ai_addr, t->ai_addrlen) == 0) {
-      printf("Bind Successful\n");
+      LOG_DEBUG("Bind Successful\n");
       ret = listen(sockfd, 0);
       CHKERR_JUMP(ret < 0, "listen server", err_close_sockfd);
 
       /* Accept next connection */
-      fprintf(stdout, "Waiting for connection...\n");
+      LOG_INFO("Waiting for connection...\n");
       listenfd = sockfd;
       sockfd = accept(listenfd, NULL, NULL);
-      printf("Accepting a connection: %d\n", listenfd);
+      LOG_INFO("Accepting a connection: %d\n", listenfd);
       close(listenfd);
       break;
     }
@@ -172,8 +182,8 @@ int connect_client(const char *server, uint16_t server_port, sa_family_t af) {
       continue;
     }
 
-    printf("Server Name: %s\n", server);
-    printf("Attempting to connect as a Client\n");
+    LOG_DEBUG("Server Name: %s\n", server);
+    LOG_DEBUG("Attempting to connect as a Client\n");
     if (connect(sockfd, t->ai_addr, t->ai_addrlen) == 0) {
       break;
     }
@@ -188,6 +198,45 @@ out:
   return sockfd;
 }
 
+int set_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+
+  if (flags < 0) {
+    return -1;
+  }
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int listen_nonblock(uint16_t port) {
+  struct sockaddr_in in_addr;
+  int optval = 1;
+  int fd;
+  int ret;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  CHKERR_ACTION(fd < 0, "create listening socket", return -1);
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+  memset(&in_addr, 0, sizeof(in_addr));
+  in_addr.sin_family = AF_INET;
+  in_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  in_addr.sin_port = htons(port);
+  ret = bind(fd, (struct sockaddr *)&in_addr, sizeof(in_addr));
+  CHKERR_JUMP(ret < 0, "bind listening socket", err_close);
+
+  ret = listen(fd, SOMAXCONN);
+  CHKERR_JUMP(ret < 0, "listen on socket", err_close);
+
+  ret = set_nonblock(fd);
+  CHKERR_JUMP(ret < 0, "make listening socket non-blocking", err_close);
+
+  return fd;
+
+err_close:
+  close(fd);
+  return -1;
+}
+
 int barrier(int oob_sock, void (*progress_cb)(void *arg), void *arg) {
   struct pollfd pfd;
   int dummy = 0;
@@ -213,33 +262,72 @@ int barrier(int oob_sock, void (*progress_cb)(void *arg), void *arg) {
 }
 
 void ep_close(ucp_worker_h ucp_worker, ucp_ep_h ep, uint64_t flags) {
+  ep_close_batch(ucp_worker, &ep, 1, flags);
+}
+
+struct ep_close_state {
+  size_t pending;
+  size_t failed;
+};
+
+static void ep_close_handler(void *request, ucs_status_t status,
+                             void *user_data) {
+  struct ep_close_state *state = (struct ep_close_state *)user_data;
+
+  if (status != UCS_OK) {
+    LOG_ERROR("failed to close ep: %s\n", ucs_status_string(status));
+    ++state->failed;
+  }
+  --state->pending;
+}
+
+size_t ep_close_batch(ucp_worker_h ucp_worker, ucp_ep_h *eps, size_t count,
+                      uint64_t flags) {
+  struct ep_close_state state = {0, 0};
+  std::vector<void *> requests;
   ucp_request_param_t param;
   ucs_status_t status;
   void *close_req;
 
-  param.op_attr_mask = UCP_OP_ATTR_FIELD_FLAGS;
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_FLAGS | UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_USER_DATA;
   param.flags = flags;
-  close_req = ucp_ep_close_nbx(ep, &param);
-  if (UCS_PTR_IS_PTR(close_req)) {
-    do {
-      ucp_worker_progress(ucp_worker);
-      status = ucp_request_check_status(close_req);
-    } while (status == UCS_INPROGRESS);
-    ucp_request_free(close_req);
-  } else {
-    status = UCS_PTR_STATUS(close_req);
+  param.cb.send = ep_close_handler;
+  param.user_data = &state;
+
+  requests.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    close_req = ucp_ep_close_nbx(eps[i], &param);
+    if (UCS_PTR_IS_PTR(close_req)) {
+      ++state.pending;
+      requests.push_back(close_req);
+    } else {
+      status = UCS_PTR_STATUS(close_req);
+      if (status != UCS_OK) {
+        LOG_ERROR("failed to close ep %p: %s\n", (void *)eps[i],
+                  ucs_status_string(status));
+        ++state.failed;
+      }
+    }
   }
 
-  if (status != UCS_OK) {
-    fprintf(stderr, "failed to close ep %p: %s\n", (void *)ep,
-            ucs_status_string(status));
+  while (state.pending > 0) {
+    ucp_worker_progress(ucp_worker);
   }
+
+  for (void *request : requests) {
+    ucp_request_free(request);
+  }
+
+  return state.failed;
 }
 
 void request_init(void *request) {
   struct ucx_context *context = (struct ucx_context *)request;
 
   context->completed = 0;
+  context->timed_out = 0;
+  wheel_timer_init(&context->timer, NULL, NULL);
 }
 
 void send_handler(void *request, ucs_status_t status, void *ctx) {
@@ -248,15 +336,16 @@ void send_handler(void *request, ucs_status_t status, void *ctx) {
 
   context->completed = 1;
 
-  printf("[0x%x] send handler called for \"%s\" with status %d (%s)\n",
-         (unsigned int)pthread_self(), str, status, ucs_status_string(status));
+  LOG_DEBUG("[0x%x] send handler called for \"%s\" with status %d (%s)\n",
+            (unsigned int)pthread_self(), str, status,
+            ucs_status_string(status));
 }
 
 void failure_handler(void *arg, ucp_ep_h ep, ucs_status_t status) {
   ucs_status_t *arg_status = (ucs_status_t *)arg;
 
-  printf("[0x%x] failure handler called with status %d (%s)\n",
-         (unsigned int)pthread_self(), status, ucs_status_string(status));
+  LOG_WARN("[0x%x] failure handler called with status %d (%s)\n",
+           (unsigned int)pthread_self(), status, ucs_status_string(status));
 
   *arg_status = status;
 }
@@ -267,9 +356,9 @@ void recv_handler(void *request, ucs_status_t status,
 
   context->completed = 1;
 
-  printf("[0x%x] receive handler called with status %d (%s), length %lu\n",
-         (unsigned int)pthread_self(), status, ucs_status_string(status),
-         info->length);
+  LOG_DEBUG("[0x%x] receive handler called with status %d (%s), length %lu\n",
+            (unsigned int)pthread_self(), status, ucs_status_string(status),
+            info->length);
 }
 
 ucs_status_t ucx_wait(ucp_worker_h ucp_worker, struct ucx_context *request,
@@ -291,10 +380,10 @@ ucs_status_t ucx_wait(ucp_worker_h ucp_worker, struct ucx_context *request,
   }
 
   if (status != UCS_OK) {
-    fprintf(stderr, "unable to %s %s (%s)\n", op_str, data_str,
-            ucs_status_string(status));
+    LOG_ERROR("unable to %s %s (%s)\n", op_str, data_str,
+              ucs_status_string(status));
   } else {
-    printf("finish to %s %s\n", op_str, data_str);
+    LOG_DEBUG("finish to %s %s\n", op_str, data_str);
   }
 
   return status;
@@ -333,6 +422,156 @@ ucs_status_t flush_ep(ucp_worker_h worker, ucp_ep_h ep) {
   }
 }
 
+ucs_status_t worker_poll_wait(ucp_worker_h ucp_worker, int timeout_ms) {
+  struct pollfd pfd;
+  ucs_status_t status;
+  int efd;
+  int ret;
+
+  status = ucp_worker_get_efd(ucp_worker, &efd);
+  if (status != UCS_OK) {
+    return status;
+  }
+
+  /* Need to prepare ucp_worker before polling */
+  status = ucp_worker_arm(ucp_worker);
+  if (status == UCS_ERR_BUSY) { /* some events are arrived already */
+    return UCS_OK;
+  } else if (status != UCS_OK) {
+    return status;
+  }
+
+  pfd.fd = efd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  do {
+    ret = poll(&pfd, 1, timeout_ms);
+  } while ((ret == -1) && (errno == EINTR));
+
+  return (ret < 0) ? UCS_ERR_IO_ERROR : UCS_OK;
+}
+
+ucp_tag_message_h probe_wait(ucp_worker_h ucp_worker, ucp_tag_t tag,
+                             ucp_tag_t tag_mask, ucp_test_mode_t mode,
+                             const ucs_status_t *ep_status,
+                             ucp_tag_recv_info_t *info_tag,
+                             uint64_t timeout_ns,
+                             const std::atomic<bool> *stop) {
+  uint64_t deadline_ns = (timeout_ns > 0) ? get_time_ns() + timeout_ns : 0;
+  ucp_tag_message_h msg_tag;
+  ucs_status_t status = UCS_OK;
+  uint64_t now_ns = 0;
+
+  for (;;) {
+    if ((ep_status != NULL) && (*ep_status != UCS_OK)) {
+      LOG_ERROR("probe: EP disconnected (%s)\n",
+                ucs_status_string(*ep_status));
+      return NULL;
+    }
+
+    if ((stop != NULL) && stop->load()) {
+      LOG_WARN("probe: stopped\n");
+      return NULL;
+    }
+
+    /* Probing incoming events in non-block mode */
+    msg_tag = ucp_tag_probe_nb(ucp_worker, tag, tag_mask, 1, info_tag);
+    if (msg_tag != NULL) {
+      /* Message arrived */
+      return msg_tag;
+    } else if (ucp_worker_progress(ucp_worker)) {
+      /* Some events were polled; try again without going to sleep */
+      continue;
+    }
+
+    if (deadline_ns != 0) {
+      now_ns = get_time_ns();
+      if (now_ns >= deadline_ns) {
+        LOG_WARN("probe: no message after %.3f ms\n", timeout_ns / 1e6);
+        return NULL;
+      }
+    }
+
+    /* If we got here, ucp_worker_progress() returned 0, so we can sleep.
+     * Following blocked methods used to polling internal file descriptor
+     * to make CPU idle and don't spin loop
+     */
+    if ((mode == TEST_MODE_WAIT) && (deadline_ns == 0)) {
+      status = ucp_worker_wait(ucp_worker);
+    } else if (mode != TEST_MODE_PROBE) {
+      status = worker_poll_wait(
+          ucp_worker, (deadline_ns == 0)
+                          ? -1
+                          : (int)((deadline_ns - now_ns + 999999) / 1000000));
+    }
+
+    if (status != UCS_OK) {
+      LOG_ERROR("probe: wait for events failed (%s)\n",
+                ucs_status_string(status));
+      return NULL;
+    }
+  }
+}
+
+int parse_test_mode(const char *opt_arg, ucp_test_mode_t *mode) {
+  if (!strcmp(opt_arg, "probe")) {
+    *mode = TEST_MODE_PROBE;
+  } else if (!strcmp(opt_arg, "wait")) {
+    *mode = TEST_MODE_WAIT;
+  } else if (!strcmp(opt_arg, "eventfd")) {
+    *mode = TEST_MODE_EVENTFD;
+  } else {
+    fprintf(stderr, "Unsupported wait mode: \"%s\".\n", opt_arg);
+    return -1;
+  }
+
+  return 0;
+}
+
+ucs_status_t flush_worker(ucp_worker_h worker) {
+  ucp_request_param_t param;
+  ucs_status_t status;
+  void *request;
+
+  param.op_attr_mask = 0;
+  request = ucp_worker_flush_nbx(worker, &param);
+  if (request == NULL) {
+    return UCS_OK;
+  } else if (UCS_PTR_IS_ERR(request)) {
+    return UCS_PTR_STATUS(request);
+  }
+
+  do {
+    ucp_worker_progress(worker);
+    status = ucp_request_check_status(request);
+  } while (status == UCS_INPROGRESS);
+  ucp_request_free(request);
+  return status;
+}
+
+ucs_status_t worker_drain(ucp_worker_h ucp_worker, ucp_ep_h *eps,
+                          size_t count) {
+  uint64_t start_ns = get_time_ns();
+  ucs_status_t status;
+  size_t failed;
+
+  status = flush_worker(ucp_worker);
+  if (status != UCS_OK) {
+    LOG_WARN("worker flush failed (%s), force-closing %lu endpoints\n",
+             ucs_status_string(status), count);
+  }
+
+  failed = ep_close_batch(ucp_worker, eps, count,
+                          (status == UCS_OK) ? 0 : UCP_EP_CLOSE_FLAG_FORCE);
+  LOG_INFO("drained %lu endpoints in %.3f ms, %lu failed\n", count,
+           (get_time_ns() - start_ns) / 1e6, failed);
+
+  if ((status == UCS_OK) && (failed > 0)) {
+    status = UCS_ERR_IO_ERROR;
+  }
+  return status;
+}
+
 void initialize_ucp_params(ucp_params_t *ucp_params, const char *name) {
   memset(ucp_params, 0, sizeof(*ucp_params));
   ucp_params->field_mask = UCP_PARAM_FIELD_FEATURES |
@@ -355,3 +594,106 @@ void initialize_ucp_worker_params(ucp_worker_params_t *ucp_worker_params) {
   ucp_worker_params->field_mask = UCP_WORKER_PARAM_FIELD_THREAD_MODE;
   ucp_worker_params->thread_mode = UCS_THREAD_MODE_SINGLE;
 }
+
+int bench_init_context(ucp_context_h *ucp_context, const char *name,
+                       uint64_t features, bool print_config) {
+  ucp_params_t ucp_params;
+  ucp_config_t *config;
+  ucs_status_t status;
+
+  status = ucp_config_read(NULL, NULL, &config);
+  CHKERR_ACTION(status != UCS_OK, "ucp_config_read\n", return -1);
+
+  initialize_ucp_params(&ucp_params, name);
+  ucp_params.features = features;
+
+  status = ucp_init(&ucp_params, config, ucp_context);
+  if (print_config) {
+    ucp_config_print(config, stdout, NULL, UCS_CONFIG_PRINT_CONFIG);
+  }
+  ucp_config_release(config);
+  CHKERR_ACTION(status != UCS_OK, "ucp_init\n", return -1);
+
+  return 0;
+}
+
+int bench_init_worker(ucp_context_h ucp_context, ucp_worker_h *ucp_worker,
+                      ucp_worker_attr_t *worker_attr) {
+  ucp_worker_params_t worker_params;
+  ucs_status_t status;
+
+  initialize_ucp_worker_attr(worker_attr);
+  initialize_ucp_worker_params(&worker_params);
+
+  status = ucp_worker_create(ucp_context, &worker_params, ucp_worker);
+  CHKERR_ACTION(status != UCS_OK, "ucp_worker_create\n", return -1);
+
+  status = ucp_worker_query(*ucp_worker, worker_attr);
+  CHKERR_ACTION(status != UCS_OK, "ucp_worker_query\n",
+                ucp_worker_destroy(*ucp_worker);
+                return -1);
+
+  LOG_DEBUG("local address length: %lu\n", worker_attr->address_length);
+  return 0;
+}
+
+void bench_cleanup_worker(ucp_worker_h ucp_worker,
+                          ucp_worker_attr_t *worker_attr) {
+  ucp_worker_release_address(ucp_worker, worker_attr->address);
+  ucp_worker_destroy(ucp_worker);
+}
+
+int bench_init_side(struct bench_side *side, const char *name,
+                    uint64_t features, bool print_config) {
+  if (bench_init_context(&side->ucp_context, name, features, print_config) !=
+      0) {
+    return -1;
+  }
+
+  if (bench_init_worker(side->ucp_context, &side->ucp_worker,
+                        &side->worker_attr) != 0) {
+    ucp_cleanup(side->ucp_context);
+    return -1;
+  }
+
+  side->ep = NULL;
+  return 0;
+}
+
+void bench_cleanup_side(struct bench_side *side) {
+  bench_cleanup_worker(side->ucp_worker, &side->worker_attr);
+  ucp_cleanup(side->ucp_context);
+}
+
+ucs_status_t bench_connect(const struct bench_side *from,
+                           const struct bench_side *to, ucp_ep_h *ep) {
+  ucp_ep_params_t ep_params;
+
+  ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS;
+  ep_params.address = to->worker_attr.address;
+  return ucp_ep_create(from->ucp_worker, &ep_params, ep);
+}
+
+void bench_barrier(std::atomic<int> *count, int parties, int round,
+                   ucp_worker_h ucp_worker) {
+  count->fetch_add(1);
+  while (count->load() < parties * round) {
+    ucp_worker_progress(ucp_worker);
+  }
+}
+
+double percentile_us(std::vector<uint64_t> &values, double pct) {
+  if (values.empty()) {
+    return 0;
+  }
+
+  std::sort(values.begin(), values.end());
+  return values[(size_t)(pct * (values.size() - 1))] / 1e3;
+}
+
+uint64_t bench_rand(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dull;
+}
@@ -23,6 +23,9 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <vector>
+
 #ifdef HAVE_CUDA
 #include <cuda_runtime.h>
 #endif
@@ -78,6 +81,21 @@ int connect_client(const char *server, uint16_t server_port, sa_family_t af);
  */
 int connect_server(uint16_t server_port, sa_family_t af);
 
+/**
+ * @brief Makes `fd` non-blocking.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int set_nonblock(int fd);
+
+/**
+ * @brief Opens a non-blocking TCP socket listening on `port` on every IPv4
+ * address, to accept clients from an event loop.
+ *
+ * @return The socket file descriptor on success, or -1 on failure.
+ */
+int listen_nonblock(uint16_t port);
+
 int barrier(int oob_sock, void (*progress_cb)(void *arg), void *arg);
 
 /**
@@ -126,6 +144,90 @@ void ep_close_err_mode(ucp_worker_h ucp_worker, ucp_ep_h ucp_ep,
  */
 ucs_status_t flush_ep(ucp_worker_h worker, ucp_ep_h ep);
 
+/**
+ * @brief Sleeps until the worker's event fd signals activity.
+ *
+ * Arms the worker first; returns at once if events are already pending.
+ * The context must have been created with UCP_FEATURE_WAKEUP.
+ *
+ * @param ucp_worker The UCP worker on which to wait for events.
+ * @param timeout_ms Longest time to sleep, -1 for no limit.
+ * @return UCS_OK if successful, an error code otherwise.
+ */
+ucs_status_t worker_poll_wait(ucp_worker_h ucp_worker, int timeout_ms = -1);
+
+/**
+ * @brief Probes for a message matching `tag`/`tag_mask`, progressing the
+ * worker in between.
+ *
+ * When nothing is left to progress, TEST_MODE_PROBE spins,
+ * TEST_MODE_WAIT sleeps in ucp_worker_wait() and TEST_MODE_EVENTFD sleeps
+ * in worker_poll_wait().
+ *
+ * @param ucp_worker The UCP worker to probe.
+ * @param tag Tag to match.
+ * @param tag_mask Bits of `tag` that must match.
+ * @param mode How to wait when no events are pending.
+ * @param ep_status If not NULL, probing stops once it is no longer UCS_OK.
+ * @param info_tag Filled with the tag and length of the message.
+ * @param timeout_ns Give up after this long, 0 to wait forever. With a
+ * timeout, TEST_MODE_WAIT sleeps on the event fd, which can be bounded.
+ * @param stop If not NULL, probing stops once another thread sets it; that
+ * thread must ucp_worker_signal() the worker to wake a sleeping probe.
+ * @return The message handle, or NULL on error, timeout or stop.
+ */
+ucp_tag_message_h probe_wait(ucp_worker_h ucp_worker, ucp_tag_t tag,
+                             ucp_tag_t tag_mask, ucp_test_mode_t mode,
+                             const ucs_status_t *ep_status,
+                             ucp_tag_recv_info_t *info_tag,
+                             uint64_t timeout_ns = 0,
+                             const std::atomic<bool> *stop = NULL);
+
+/**
+ * @brief Parses a `-w` option value: probe, wait or eventfd.
+ *
+ * @return 0 on success, -1 if the mode is unknown.
+ */
+int parse_test_mode(const char *opt_arg, ucp_test_mode_t *mode);
+
+/**
+ * @brief Flushes every endpoint of the worker.
+ *
+ * Issues one ucp_worker_flush_nbx() and progresses until it completes, so
+ * all operations in flight on the worker finish together.
+ *
+ * @param worker The UCP worker handle.
+ * @return The status of the flush operation.
+ */
+ucs_status_t flush_worker(ucp_worker_h worker);
+
+/**
+ * @brief Closes `count` endpoints concurrently.
+ *
+ * All close requests are issued before any is waited on, so closing N
+ * endpoints costs about one round trip instead of N.
+ *
+ * @param ucp_worker Worker the endpoints belong to.
+ * @param eps Endpoints to close; the handles are invalid afterwards.
+ * @param count Number of endpoints in `eps`.
+ * @param flags Close mode, see @a ucp_ep_close_flags_t.
+ * @return The number of endpoints that did not close cleanly.
+ */
+size_t ep_close_batch(ucp_worker_h ucp_worker, ucp_ep_h *eps, size_t count,
+                      uint64_t flags);
+
+/**
+ * @brief Gracefully drains a worker before shutdown.
+ *
+ * Lets in-flight operations finish with flush_worker(), then closes the
+ * endpoints with ep_close_batch() in flush mode. If the worker flush fails
+ * some peer is gone, and the endpoints are force-closed instead.
+ *
+ * @return UCS_OK if everything was flushed and closed cleanly.
+ */
+ucs_status_t worker_drain(ucp_worker_h ucp_worker, ucp_ep_h *eps,
+                          size_t count);
+
 /**
  * @brief Initializes ucp_params_t.
  *
@@ -148,4 +250,88 @@ void initialize_ucp_worker_attr(ucp_worker_attr_t *worker_attr);
  * */
 void initialize_ucp_worker_params(ucp_worker_params_t *ucp_worker_params);
 
+/**
+ * One peer of a benchmark that runs its peers as threads of one process:
+ * each has a context and worker of its own, and the worker addresses are
+ * handed over in memory instead of over a socket.
+ */
+struct bench_side {
+  ucp_context_h ucp_context;
+  ucp_worker_h ucp_worker;
+  ucp_worker_attr_t worker_attr;
+  ucp_ep_h ep; /* to the peer, NULL until bench_connect() */
+};
+
+/**
+ * @brief Reads the UCX configuration and creates a context with `features`,
+ * for benchmarks whose threads share a context.
+ *
+ * @param print_config Prints the UCX configuration the context was read
+ * with.
+ * @return 0 on success, -1 on failure.
+ */
+int bench_init_context(ucp_context_h *ucp_context, const char *name,
+                       uint64_t features, bool print_config = false);
+
+/**
+ * @brief Creates a single threaded worker on `ucp_context` and queries its
+ * address into `worker_attr`.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int bench_init_worker(ucp_context_h ucp_context, ucp_worker_h *ucp_worker,
+                      ucp_worker_attr_t *worker_attr);
+
+/**
+ * @brief Releases the address and destroys a worker from bench_init_worker().
+ */
+void bench_cleanup_worker(ucp_worker_h ucp_worker,
+                          ucp_worker_attr_t *worker_attr);
+
+/**
+ * @brief Creates the context and worker of `side` and queries its address.
+ *
+ * @param features UCP features of the context, replacing UCP_FEATURE_TAG.
+ * @param print_config Prints the UCX configuration the context was read
+ * with.
+ * @return 0 on success, -1 on failure.
+ */
+int bench_init_side(struct bench_side *side, const char *name,
+                    uint64_t features, bool print_config = false);
+
+/**
+ * @brief Releases what bench_init_side() created. The endpoints on the
+ * worker must be closed first.
+ */
+void bench_cleanup_side(struct bench_side *side);
+
+/**
+ * @brief Creates an endpoint from the worker of `from` to the one of `to`.
+ */
+ucs_status_t bench_connect(const struct bench_side *from,
+                           const struct bench_side *to, ucp_ep_h *ep);
+
+/**
+ * @brief In-memory barrier between the `parties` threads of a benchmark.
+ *
+ * Each thread keeps progressing its own worker until all have arrived, so
+ * none is left waiting on a peer that stopped progressing, e.g. to close an
+ * endpoint. `count` starts at 0 and is shared by every round: round `round`
+ * (from 1) completes once it reaches `parties * round`.
+ */
+void bench_barrier(std::atomic<int> *count, int parties, int round,
+                   ucp_worker_h ucp_worker);
+
+/**
+ * @brief Sorts `values` (nanoseconds) and returns their `pct` percentile in
+ * microseconds, or 0 when empty.
+ */
+double percentile_us(std::vector<uint64_t> &values, double pct);
+
+/**
+ * @brief Steps the xorshift64* generator in `state`, which must start
+ * non-zero, and returns the next pseudo-random number.
+ */
+uint64_t bench_rand(uint64_t *state);
+
 #endif /* UCX_HELLO_WORLD_H */
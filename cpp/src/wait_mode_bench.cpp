@@ -0,0 +1,350 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h> /* getrusage */
+#include <ucp/api/ucp.h>
+#include <unistd.h> /* getopt */
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "common_utils.h"
+#include "logger.h"
+#include "time_utils.h"
+#include "ucx_utils.h"
+
+/**
+ * Compares the ways a worker can wait for messages (spin on progress,
+ * ucp_worker_wait() and the worker event fd).
+ *
+ * A pinger and a responder run on two threads with their own contexts and
+ * workers. The pinger sends at a fixed rate and spins for each reply; the
+ * responder waits for pings in the mode under test. For every mode and rate
+ * the benchmark reports round-trip time, the time from send to the
+ * responder waking up with the ping in hand, and the responder's CPU time
+ * per wall-clock second.
+ */
+
+#define WAIT_PING_TAG 0x1337a890u
+#define WAIT_PONG_TAG 0x1337a891u
+#define WAIT_DEFAULT_RATES "1000,10000,100000"
+#define WAIT_DEFAULT_COUNT 10000
+
+struct wait_ping {
+  uint64_t seq;
+  uint64_t send_ns;
+};
+
+struct wait_round {
+  ucp_test_mode_t mode;
+  long rate; /* pings per second */
+  std::vector<uint64_t> rtt_ns;
+  std::vector<uint64_t> wakeup_ns;
+  uint64_t wall_ns;    /* responder wall time for the round */
+  uint64_t cpu_ns;     /* responder user + system time for the round */
+  uint64_t elapsed_ns; /* pinger time for the round */
+};
+
+struct wait_bench {
+  struct bench_side pinger;
+  struct bench_side responder;
+  std::vector<struct wait_round> rounds;
+  long count;
+  size_t msg_size;
+  std::atomic<int> barrier_count;
+  std::atomic<bool> stop; /* a side failed; the other stops waiting on it */
+  int ret[2];
+};
+
+static const char *mode_names[] = {"probe", "wait", "eventfd"};
+
+/* Wakes a peer that may be sleeping on its worker for a message the failed
+ * side will never send */
+static void wait_stop(struct wait_bench *bench, ucp_worker_h peer) {
+  bench->stop.store(true);
+  ucp_worker_signal(peer);
+}
+
+static void print_wait_usage() {
+  fprintf(stderr, "Usage: run_wait_bench [parameters]\n");
+  fprintf(stderr, "\nParameters are:\n");
+  fprintf(stderr, "  -w <mode>     Responder wait mode: probe, wait or "
+                  "eventfd (default: all)\n");
+  fprintf(stderr, "  -r <rates>    Comma separated ping rates per second "
+                  "(default:%s)\n",
+          WAIT_DEFAULT_RATES);
+  fprintf(stderr, "  -n <count>    Pings per mode and rate (default:%d)\n",
+          WAIT_DEFAULT_COUNT);
+  fprintf(stderr, "  -s <size>     Ping size in bytes (default:%lu)\n",
+          sizeof(struct wait_ping));
+}
+
+static uint64_t thread_cpu_ns() {
+  struct rusage usage;
+
+  getrusage(RUSAGE_THREAD, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ull +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ull;
+}
+
+static ucs_status_t wait_send(struct bench_side *side, void *buffer,
+                              size_t length, ucp_tag_t tag) {
+  ucp_request_param_t param;
+  struct ucx_context *request;
+
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_USER_DATA;
+  param.cb.send = send_handler;
+  param.user_data = (void *)"ping";
+  request = (struct ucx_context *)ucp_tag_send_nbx(side->ep, buffer, length,
+                                                   tag, &param);
+  return ucx_wait(side->ucp_worker, request, "send", "ping");
+}
+
+static ucs_status_t wait_recv(struct wait_bench *bench,
+                              struct bench_side *side, void *buffer,
+                              size_t length, ucp_tag_t tag,
+                              ucp_test_mode_t mode, uint64_t *wakeup_ns) {
+  ucp_request_param_t param;
+  ucp_tag_recv_info_t info_tag;
+  ucp_tag_message_h msg_tag;
+  struct ucx_context *request;
+
+  msg_tag = probe_wait(side->ucp_worker, tag, UINT64_MAX, mode, NULL,
+                       &info_tag, 0, &bench->stop);
+  if (msg_tag == NULL) {
+    return UCS_ERR_IO_ERROR;
+  }
+
+  *wakeup_ns = get_time_ns();
+
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK |
+                       UCP_OP_ATTR_FIELD_DATATYPE |
+                       UCP_OP_ATTR_FLAG_NO_IMM_CMPL;
+  param.datatype = ucp_dt_make_contig(1);
+  param.cb.recv = recv_handler;
+  request = (struct ucx_context *)ucp_tag_msg_recv_nbx(
+      side->ucp_worker, buffer, length, msg_tag, &param);
+  return ucx_wait(side->ucp_worker, request, "receive", "ping");
+}
+
+static void *wait_pinger_thread(void *arg) {
+  struct wait_bench *bench = (struct wait_bench *)arg;
+  struct bench_side *side = &bench->pinger;
+  std::vector<char> buffer(bench->msg_size);
+  struct wait_ping *ping = (struct wait_ping *)buffer.data();
+  uint64_t seq = 0;
+  uint64_t interval_ns, next_ns, start_ns, wakeup_ns;
+  ucs_status_t status = UCS_OK;
+
+  for (struct wait_round &round : bench->rounds) {
+    interval_ns = 1000000000ull / round.rate;
+    start_ns = next_ns = get_time_ns();
+    for (long i = 0; (i < bench->count) && (status == UCS_OK); ++i) {
+      /* Keep the worker progressed while pacing, as an application would */
+      while (get_time_ns() < next_ns) {
+        ucp_worker_progress(side->ucp_worker);
+      }
+
+      ping->seq = seq++;
+      ping->send_ns = get_time_ns();
+      status = wait_send(side, buffer.data(), buffer.size(), WAIT_PING_TAG);
+      if (status == UCS_OK) {
+        status = wait_recv(bench, side, buffer.data(), buffer.size(),
+                           WAIT_PONG_TAG, TEST_MODE_PROBE, &wakeup_ns);
+      }
+      if (status == UCS_OK) {
+        /* The responder echoes the ping, send_ns included */
+        round.rtt_ns.push_back(wakeup_ns - ping->send_ns);
+      }
+
+      /* Fall back to closed loop when the round trip exceeds the interval */
+      next_ns = std::max(next_ns + interval_ns, get_time_ns());
+    }
+    round.elapsed_ns = get_time_ns() - start_ns;
+  }
+
+  if (status != UCS_OK) {
+    wait_stop(bench, bench->responder.ucp_worker);
+  }
+
+  bench_barrier(&bench->barrier_count, 2, 1, side->ucp_worker);
+  bench->ret[0] = (status == UCS_OK) ? 0 : -1;
+  return NULL;
+}
+
+static void *wait_responder_thread(void *arg) {
+  struct wait_bench *bench = (struct wait_bench *)arg;
+  struct bench_side *side = &bench->responder;
+  std::vector<char> buffer(bench->msg_size);
+  struct wait_ping *ping = (struct wait_ping *)buffer.data();
+  uint64_t start_ns, start_cpu_ns, wakeup_ns;
+  ucs_status_t status = UCS_OK;
+
+  for (struct wait_round &round : bench->rounds) {
+    start_ns = get_time_ns();
+    start_cpu_ns = thread_cpu_ns();
+    for (long i = 0; (i < bench->count) && (status == UCS_OK); ++i) {
+      status = wait_recv(bench, side, buffer.data(), buffer.size(),
+                         WAIT_PING_TAG, round.mode, &wakeup_ns);
+      if (status == UCS_OK) {
+        round.wakeup_ns.push_back(wakeup_ns - ping->send_ns);
+        status = wait_send(side, buffer.data(), buffer.size(), WAIT_PONG_TAG);
+      }
+    }
+    round.wall_ns = get_time_ns() - start_ns;
+    round.cpu_ns = thread_cpu_ns() - start_cpu_ns;
+  }
+
+  if (status != UCS_OK) {
+    wait_stop(bench, bench->pinger.ucp_worker);
+  }
+
+  bench_barrier(&bench->barrier_count, 2, 1, side->ucp_worker);
+  bench->ret[1] = (status == UCS_OK) ? 0 : -1;
+  return NULL;
+}
+
+static void print_round(struct wait_round *round) {
+  double achieved = (round->elapsed_ns > 0)
+                        ? round->rtt_ns.size() * 1e9 / round->elapsed_ns
+                        : 0;
+  double cpu = (round->wall_ns > 0) ? 100.0 * round->cpu_ns / round->wall_ns
+                                    : 0;
+
+  printf("%-8s %9ld %10.0f %9.2f %9.2f %9.2f %9.2f %7.1f%%\n",
+         mode_names[round->mode], round->rate, achieved,
+         percentile_us(round->rtt_ns, 0.5), percentile_us(round->rtt_ns, 0.99),
+         percentile_us(round->wakeup_ns, 0.5),
+         percentile_us(round->wakeup_ns, 0.99), cpu);
+}
+
+int main(int argc, char **argv) {
+  struct wait_bench bench;
+  std::vector<ucp_test_mode_t> modes;
+  ucp_test_mode_t mode;
+  char *rates = NULL;
+  char *rate_str, *saveptr;
+  pthread_t pinger_thread, responder_thread;
+  ucs_status_t status;
+  int ret = -1;
+  int c;
+
+  bench.count = WAIT_DEFAULT_COUNT;
+  bench.msg_size = sizeof(struct wait_ping);
+  bench.barrier_count.store(0);
+  bench.stop.store(false);
+  bench.ret[0] = bench.ret[1] = -1;
+
+  while ((c = getopt(argc, argv, "w:r:n:s:h")) != -1) {
+    switch (c) {
+    case 'w':
+      if (parse_test_mode(optarg, &mode) != 0) {
+        return -1;
+      }
+      modes.push_back(mode);
+      break;
+    case 'r':
+      rates = optarg;
+      break;
+    case 'n':
+      bench.count = atol(optarg);
+      break;
+    case 's':
+      bench.msg_size = std::max((size_t)atol(optarg), sizeof(struct wait_ping));
+      break;
+    case 'h':
+    default:
+      print_wait_usage();
+      return -1;
+    }
+  }
+
+  if (bench.count <= 0) {
+    print_wait_usage();
+    return -1;
+  }
+
+  if (modes.empty()) {
+    modes = {TEST_MODE_PROBE, TEST_MODE_WAIT, TEST_MODE_EVENTFD};
+  }
+
+  rates = strdup((rates != NULL) ? rates : WAIT_DEFAULT_RATES);
+  for (ucp_test_mode_t round_mode : modes) {
+    saveptr = NULL;
+    std::vector<char> list(rates, rates + strlen(rates) + 1);
+    for (rate_str = strtok_r(list.data(), ",", &saveptr); rate_str != NULL;
+         rate_str = strtok_r(NULL, ",", &saveptr)) {
+      struct wait_round round = {};
+      round.mode = round_mode;
+      round.rate = atol(rate_str);
+      if (round.rate <= 0) {
+        fprintf(stderr, "Wrong rate \"%s\"\n", rate_str);
+        free(rates);
+        return -1;
+      }
+      round.rtt_ns.reserve(bench.count);
+      round.wakeup_ns.reserve(bench.count);
+      bench.rounds.push_back(round);
+    }
+  }
+  free(rates);
+
+  ret = bench_init_side(&bench.pinger, "wait bench pinger",
+                        UCP_FEATURE_TAG | UCP_FEATURE_WAKEUP);
+  CHKERR_JUMP(ret != 0, "initialize pinger\n", err);
+
+  ret = bench_init_side(&bench.responder, "wait bench responder",
+                        UCP_FEATURE_TAG | UCP_FEATURE_WAKEUP);
+  CHKERR_JUMP(ret != 0, "initialize responder\n", err_pinger);
+
+  ret = -1;
+  status = bench_connect(&bench.pinger, &bench.responder, &bench.pinger.ep);
+  CHKERR_JUMP(status != UCS_OK, "connect pinger\n", err_responder);
+
+  status = bench_connect(&bench.responder, &bench.pinger,
+                         &bench.responder.ep);
+  CHKERR_JUMP(status != UCS_OK, "connect responder\n", err_pinger_ep);
+
+  CHKERR_JUMP(pthread_create(&responder_thread, NULL, wait_responder_thread,
+                             &bench) != 0,
+              "create responder thread\n", err_responder_ep);
+  if (pthread_create(&pinger_thread, NULL, wait_pinger_thread, &bench) != 0) {
+    fprintf(stderr, "Failed to create pinger thread\n");
+    /* Stop the responder waiting for pings, and stand in for the pinger at
+     * the barrier */
+    wait_stop(&bench, bench.responder.ucp_worker);
+    bench.barrier_count.fetch_add(1);
+    pthread_join(responder_thread, NULL);
+    ret = -1;
+    goto err_responder_ep;
+  }
+
+  pthread_join(pinger_thread, NULL);
+  pthread_join(responder_thread, NULL);
+  ret = (bench.ret[0] != 0) ? bench.ret[0] : bench.ret[1];
+
+  log_flush();
+  printf("\n%lu byte pings, %ld per round; latencies in us, CPU is the "
+         "responder's\n",
+         bench.msg_size, bench.count);
+  printf("%-8s %9s %10s %9s %9s %9s %9s %8s\n", "mode", "rate", "achieved",
+         "rtt p50", "rtt p99", "wake p50", "wake p99", "cpu");
+  for (struct wait_round &round : bench.rounds) {
+    print_round(&round);
+  }
+
+err_responder_ep:
+  ep_close(bench.responder.ucp_worker, bench.responder.ep,
+           UCP_EP_CLOSE_FLAG_FORCE);
+err_pinger_ep:
+  ep_close(bench.pinger.ucp_worker, bench.pinger.ep, UCP_EP_CLOSE_FLAG_FORCE);
+err_responder:
+  bench_cleanup_side(&bench.responder);
+err_pinger:
+  bench_cleanup_side(&bench.pinger);
+err:
+  return ret;
+}